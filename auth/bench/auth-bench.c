@@ -0,0 +1,645 @@
+/// @file auth-bench.c
+/// @brief Benchmark and load driver for the AutoHome Mosquitto Authorization Plugin
+/// 
+/// Part of AutoHome.
+/// 
+/// Loads the built plugin the same way the broker does, fills a temporary database with
+/// registered users and replays the broker workloads: connection storms through the
+/// username-password check and publish/subscribe traffic through the access control check,
+/// both with the legacy API (version 2) and the event-based API (version 5).
+/// Reports throughput and latency percentiles for each workload.
+/// 
+/// Usage: ah-auth-bench [-p plugin] [-u users] [-c connects] [-a checks] [-s seed] [-v] [key=value...]
+/// Every key=value pair is passed to the plugin as an auth_opt_key option.
+// 
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+#include <sqlite3.h>
+#include <mosquitto.h>
+#include <mosquitto_plugin.h>
+#include <sha2.h>
+
+#include "../src/mosquitto_v5.h"
+
+#ifndef AH_PLUGIN_PATH
+#define AH_PLUGIN_PATH "./libah-auth-plugin.so"
+#endif
+
+/// @brief Maximum number of options passed to the plugin
+#define MAX_OPTIONS 32
+
+/// @brief Superuser name given to the plugin
+#define BENCH_SUPERUSER "bench-master"
+
+/// @brief Guest secret given to the plugin
+#define BENCH_GUEST_SECRET "bench-guest"
+
+/// @brief Legacy plugin API entry points
+typedef struct LegacyAPI {
+	int (*init)(void**, struct mosquitto_auth_opt*, int);
+	int (*cleanup)(void*, struct mosquitto_auth_opt*, int);
+	int (*security_init)(void*, struct mosquitto_auth_opt*, int, bool);
+	int (*security_cleanup)(void*, struct mosquitto_auth_opt*, int, bool);
+	int (*unpwd_check)(void*, const char*, const char*);
+	int (*acl_check)(void*, const char*, const char*, const char*, int);
+} LegacyAPI;
+
+/// @brief Event-based plugin API entry points
+typedef struct EventAPI {
+	int (*init)(mosquitto_plugin_id_t*, void**, struct mosquitto_opt*, int);
+	int (*cleanup)(void*, struct mosquitto_opt*, int);
+} EventAPI;
+
+/// @brief Fake broker client, as seen by the event-based API
+struct mosquitto {
+	/// @brief Client identifier
+	const char* id;
+	
+	/// @brief Username
+	const char* username;
+};
+
+/// @brief Event callbacks registered by the plugin, indexed by event
+static MOSQ_FUNC_generic_callback callbacks[MOSQ_EVT_DISCONNECT + 1];
+
+/// @brief User data registered along with the callbacks, indexed by event
+static void* callbackdata[MOSQ_EVT_DISCONNECT + 1];
+
+/// @brief True to print the plugin log messages
+static bool verbose = false;
+
+void mosquitto_log_printf(int level, const char* fmt, ...)
+{
+	if (!verbose && level != MOSQ_LOG_ERR) {
+		return;
+	}
+	
+	va_list args;
+	
+	va_start(args, fmt);
+	fprintf(stderr, "plugin: ");
+	vfprintf(stderr, fmt, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+}
+
+int mosquitto_callback_register(mosquitto_plugin_id_t* identifier, int event, MOSQ_FUNC_generic_callback cb_func,
+                                const void* event_data, void* userdata)
+{
+	if (event < 0 || event > MOSQ_EVT_DISCONNECT) {
+		return MOSQ_ERR_NOT_SUPPORTED;
+	}
+	
+	callbacks[event]    = cb_func;
+	callbackdata[event] = userdata;
+	
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_callback_unregister(mosquitto_plugin_id_t* identifier, int event, MOSQ_FUNC_generic_callback cb_func,
+                                  const void* event_data)
+{
+	if (event < 0 || event > MOSQ_EVT_DISCONNECT) {
+		return MOSQ_ERR_NOT_SUPPORTED;
+	}
+	
+	callbacks[event] = NULL;
+	
+	return MOSQ_ERR_SUCCESS;
+}
+
+const char* mosquitto_client_id(const struct mosquitto* client)
+{
+	return client->id;
+}
+
+const char* mosquitto_client_username(const struct mosquitto* client)
+{
+	return client->username;
+}
+
+int mosquitto_broker_publish_copy(const char* clientid, const char* topic, int payloadlen, const void* payload,
+                                  int qos, bool retain, mosquitto_property* properties)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+/// @brief Current monotonic time, in nanoseconds
+static uint64_t now(void)
+{
+	struct timespec time;
+	
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	
+	return (uint64_t) time.tv_sec * 1000000000u + (uint64_t) time.tv_nsec;
+}
+
+/// @brief Next number of a xorshift64* pseudo-random sequence
+static uint64_t randomnext(uint64_t* state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	
+	return *state * 0x2545f4914f6cdd1dull;
+}
+
+/// @brief Order two latencies
+static int latencycmp(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+	
+	return (x > y) - (x < y);
+}
+
+/// @brief Print the throughput and latency percentiles of a workload
+/// 
+/// @param[in] name Workload name.
+/// @param[in,out] latencies Latency of every operation, in nanoseconds. Sorted on return.
+/// @param[in] count Number of operations.
+/// @param[in] elapsed Time taken by the whole workload, in nanoseconds.
+static void report(const char* name, uint64_t* latencies, size_t count, uint64_t elapsed)
+{
+	if (count == 0) {
+		return;
+	}
+	
+	qsort(latencies, count, sizeof (uint64_t), latencycmp);
+	
+	printf("%-22s %10zu ops %12.0f ops/s   p50 %8.2f us   p99 %8.2f us   max %9.2f us\n",
+	       name, count, count / (elapsed / 1e9), latencies[count / 2] / 1e3,
+	       latencies[count - 1 - count / 100] / 1e3, latencies[count - 1] / 1e3);
+}
+
+/// @brief Compute the base16 SHA-256 digest of salt + password, as stored by devcontrol
+static void hashpassword(const char* salt, const char* password, char* hash)
+{
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	sha256_ctx    hashctx;
+	
+	sha256_init(&hashctx);
+	sha256_update(&hashctx, (const unsigned char*) salt, strlen(salt));
+	sha256_update(&hashctx, (const unsigned char*) password, strlen(password));
+	sha256_final(&hashctx, digest);
+	
+	for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+		snprintf(&hash[2 * i], 3, "%02x", digest[i]);
+	}
+}
+
+/// @brief Create the database schema and register the benchmark users
+/// 
+/// User i is "dev<i>" with password "pass<i>".
+/// 
+/// @param[in] dbfile Database file.
+/// @param[in] users Number of users.
+/// @return True on success; false otherwise.
+static bool filldb(const char* dbfile, long users)
+{
+	sqlite3*      db;
+	sqlite3_stmt* profile = NULL;
+	sqlite3_stmt* auth    = NULL;
+	bool          ok      = false;
+	
+	if (sqlite3_open(dbfile, &db) != SQLITE_OK) {
+		sqlite3_close(db);
+		return false;
+	}
+	
+	const char* schema = "create table profile (username text not null primary key,"
+	                     "                      displayname text not null unique,"
+	                     "                      type text not null,"
+	                     "                      connected text not null,"
+	                     "                      status text not null);"
+	                     "create table auth (username text not null primary key references profile on delete cascade,"
+	                     "                   hash text not null,"
+	                     "                   salt text not null);"
+	                     "create table schedule (id integer not null primary key,"
+	                     "                       username text not null references profile on delete cascade,"
+	                     "                       command text not null,"
+	                     "                       fuzzy int not null,"
+	                     "                       recurrent int not null,"
+	                     "                       firedate int not null,"
+	                     "                       weekday int not null,"
+	                     "                       hours int not null,"
+	                     "                       minutes int not null);"
+	                     "begin;";
+	
+	if (sqlite3_exec(db, schema, NULL, NULL, NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v2(db, "insert into profile values (?, ?, 'sonoff', 'false', 'off');", -1, &profile, NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v2(db, "insert into auth values (?, ?, ?);", -1, &auth, NULL) != SQLITE_OK) {
+		goto done;
+	}
+	
+	for (long i = 0; i < users; i++) {
+		char username[32];
+		char display[32];
+		char password[32];
+		char salt[32];
+		char hash[2 * SHA256_DIGEST_SIZE + 1];
+		
+		snprintf(username, sizeof (username), "dev%ld", i);
+		snprintf(display,  sizeof (display),  "Device %ld", i);
+		snprintf(password, sizeof (password), "pass%ld", i);
+		snprintf(salt,     sizeof (salt),     "salt%08lx", (unsigned long) (i * 2654435761u));
+		
+		hashpassword(salt, password, hash);
+		
+		sqlite3_reset(profile);
+		sqlite3_bind_text(profile, 1, username, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_text(profile, 2, display,  -1, SQLITE_TRANSIENT);
+		
+		sqlite3_reset(auth);
+		sqlite3_bind_text(auth, 1, username, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_text(auth, 2, hash,     -1, SQLITE_TRANSIENT);
+		sqlite3_bind_text(auth, 3, salt,     -1, SQLITE_TRANSIENT);
+		
+		if (sqlite3_step(profile) != SQLITE_DONE || sqlite3_step(auth) != SQLITE_DONE) {
+			goto done;
+		}
+	}
+	
+	ok = (sqlite3_exec(db, "commit;", NULL, NULL, NULL) == SQLITE_OK);
+
+done:
+	sqlite3_finalize(profile);
+	sqlite3_finalize(auth);
+	sqlite3_close(db);
+	
+	return ok;
+}
+
+/// @brief Credentials presented by a simulated client
+typedef struct Login {
+	/// @brief Username (and client identifier)
+	char username[32];
+	
+	/// @brief Password
+	char password[32];
+} Login;
+
+/// @brief Generate the clients of a connection storm
+/// 
+/// Mostly registered devices with their right password (90%); the rest are devices
+/// with a wrong password (5%) and unpaired devices logging in as guests (5%).
+static void makelogins(Login* logins, long count, long users, uint64_t* seed)
+{
+	for (long i = 0; i < count; i++) {
+		uint64_t kind = randomnext(seed) % 100;
+		long     user = (long) (randomnext(seed) % (uint64_t) users);
+		
+		if (kind < 90) {
+			snprintf(logins[i].username, sizeof (logins[i].username), "dev%ld", user);
+			snprintf(logins[i].password, sizeof (logins[i].password), "pass%ld", user);
+		}
+		else if (kind < 95) {
+			snprintf(logins[i].username, sizeof (logins[i].username), "dev%ld", user);
+			snprintf(logins[i].password, sizeof (logins[i].password), "wrong%ld", user);
+		}
+		else {
+			snprintf(logins[i].username, sizeof (logins[i].username), "sonoff-%04x", (unsigned) (randomnext(seed) & 0xffff));
+			snprintf(logins[i].password, sizeof (logins[i].password), "%s", BENCH_GUEST_SECRET);
+		}
+	}
+}
+
+/// @brief Access control check issued by a simulated client
+typedef struct Access {
+	/// @brief Index of the client in the login array
+	long client;
+	
+	/// @brief Requested topic
+	char topic[96];
+	
+	/// @brief Requested access
+	int access;
+} Access;
+
+/// @brief Generate the traffic of the publish/subscribe workload
+/// 
+/// Clients mostly use their own topics (90%), with suffixes from the usual command topics
+/// up to long nested ones; the rest are attempts on other clients' topics.
+static void makeaccesses(Access* accesses, long count, const Login* logins, long clients, uint64_t* seed)
+{
+	static const char* suffixes[] = {"control", "status", "schedule", "askschedule", "meta/firmware/version"};
+	
+	for (long i = 0; i < count; i++) {
+		long        client = (long) (randomnext(seed) % (uint64_t) clients);
+		const char* owner  = logins[client].username;
+		char        other[32];
+		
+		if (randomnext(seed) % 100 >= 90) {
+			snprintf(other, sizeof (other), "dev%u", (unsigned) (randomnext(seed) % 100000));
+			owner = other;
+		}
+		
+		int suffix = (int) (randomnext(seed) % (sizeof (suffixes) / sizeof (suffixes[0]) + 1));
+		
+		if (suffix < sizeof (suffixes) / sizeof (suffixes[0])) {
+			snprintf(accesses[i].topic, sizeof (accesses[i].topic), "%s/%s", owner, suffixes[suffix]);
+		}
+		else {  // deep topic of random length
+			int length = snprintf(accesses[i].topic, sizeof (accesses[i].topic), "%s/", owner);
+			int extra  = 1 + (int) (randomnext(seed) % 64);
+			
+			for (int k = 0; k < extra && length < sizeof (accesses[i].topic) - 1; k++, length++) {
+				accesses[i].topic[length] = (k % 8 == 7) ? '/' : 'a' + (char) (randomnext(seed) % 26);
+			}
+			
+			accesses[i].topic[length] = 0;
+		}
+		
+		accesses[i].client = client;
+		accesses[i].access = (randomnext(seed) % 2 == 0) ? MOSQ_ACL_READ : MOSQ_ACL_WRITE;
+	}
+}
+
+/// @brief Run the legacy API workloads
+static void runlegacy(const LegacyAPI* api, void* context, const Login* logins, long connects,
+                      const Access* accesses, long checks, uint64_t* latencies)
+{
+	uint64_t start = now();
+	
+	for (long i = 0; i < connects; i++) {
+		uint64_t begin = now();
+		
+		api->unpwd_check(context, logins[i].username, logins[i].password);
+		latencies[i] = now() - begin;
+	}
+	
+	report("v2 connect storm", latencies, connects, now() - start);
+	
+	start = now();
+	
+	for (long i = 0; i < checks; i++) {
+		const Login* login = &logins[accesses[i].client];
+		uint64_t     begin = now();
+		
+		api->acl_check(context, login->username, login->username, accesses[i].topic, accesses[i].access);
+		latencies[i] = now() - begin;
+	}
+	
+	report("v2 acl checks", latencies, checks, now() - start);
+}
+
+/// @brief Run the event-based API workloads
+static void runevents(const Login* logins, long connects, const Access* accesses, long checks, uint64_t* latencies)
+{
+	struct mosquitto* clients = (struct mosquitto*) calloc(connects, sizeof (struct mosquitto));
+	
+	if (clients == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return;
+	}
+	
+	uint64_t start = now();
+	
+	for (long i = 0; i < connects; i++) {
+		struct mosquitto_evt_basic_auth event;
+		
+		memset(&event, 0, sizeof (event));
+		
+		clients[i].id       = logins[i].username;
+		clients[i].username = logins[i].username;
+		event.client        = &clients[i];
+		event.username      = (char*) logins[i].username;
+		event.password      = (char*) logins[i].password;
+		
+		uint64_t begin = now();
+		
+		callbacks[MOSQ_EVT_BASIC_AUTH](MOSQ_EVT_BASIC_AUTH, &event, callbackdata[MOSQ_EVT_BASIC_AUTH]);
+		latencies[i] = now() - begin;
+	}
+	
+	report("v5 connect storm", latencies, connects, now() - start);
+	
+	start = now();
+	
+	struct mosquitto_evt_acl_check event;
+	
+	memset(&event, 0, sizeof (event));  // once, like the legacy loop it only fills the request fields
+	
+	for (long i = 0; i < checks; i++) {
+		event.client = &clients[accesses[i].client];
+		event.topic  = accesses[i].topic;
+		event.access = accesses[i].access;
+		
+		uint64_t begin = now();
+		
+		callbacks[MOSQ_EVT_ACL_CHECK](MOSQ_EVT_ACL_CHECK, &event, callbackdata[MOSQ_EVT_ACL_CHECK]);
+		latencies[i] = now() - begin;
+	}
+	
+	report("v5 acl checks", latencies, checks, now() - start);
+	
+	if (callbacks[MOSQ_EVT_DISCONNECT] != NULL) {
+		for (long i = 0; i < connects; i++) {
+			struct mosquitto_evt_disconnect event;
+			
+			memset(&event, 0, sizeof (event));
+			event.client = &clients[i];
+			
+			callbacks[MOSQ_EVT_DISCONNECT](MOSQ_EVT_DISCONNECT, &event, callbackdata[MOSQ_EVT_DISCONNECT]);
+		}
+	}
+	
+	free(clients);
+}
+
+/// @brief Print the program usage
+static void usage(const char* program)
+{
+	fprintf(stderr, "Usage: %s [-p plugin] [-u users] [-c connects] [-a checks] [-s seed] [-v] [key=value...]\n"
+	                "  -p  plugin library (default: %s)\n"
+	                "  -u  registered users in the database (default: 1000)\n"
+	                "  -c  logins in the connection storms (default: 100000)\n"
+	                "  -a  access control checks (default: 1000000)\n"
+	                "  -s  random seed (default: 1)\n"
+	                "  -v  print plugin log messages\n"
+	                "  key=value pairs are passed to the plugin as auth_opt_key options\n", program, AH_PLUGIN_PATH);
+}
+
+int main(int argc, char** argv)
+{
+	const char*               plugin   = AH_PLUGIN_PATH;
+	long                      users    = 1000;
+	long                      connects = 100000;
+	long                      checks   = 1000000;
+	uint64_t                  seed     = 1;
+	struct mosquitto_auth_opt options[MAX_OPTIONS];
+	int                       count    = 0;
+	int                       option;
+	
+	while ((option = getopt(argc, argv, "p:u:c:a:s:vh")) != -1) {
+		switch (option) {
+			case 'p': plugin   = optarg;               break;
+			case 'u': users    = atol(optarg);         break;
+			case 'c': connects = atol(optarg);         break;
+			case 'a': checks   = atol(optarg);         break;
+			case 's': seed     = strtoull(optarg, NULL, 10); break;
+			case 'v': verbose  = true;                 break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	
+	if (users <= 0 || connects <= 0 || checks < 0 || seed == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	
+	char dbfile[] = "/tmp/ah-auth-bench-XXXXXX";
+	int  dbfd     = mkstemp(dbfile);
+	
+	if (dbfd < 0) {
+		perror("Can't create the temporary database");
+		return 1;
+	}
+	
+	close(dbfd);
+	
+	options[count++] = (struct mosquitto_auth_opt) {"db_file",      dbfile};
+	options[count++] = (struct mosquitto_auth_opt) {"superuser",    BENCH_SUPERUSER};
+	options[count++] = (struct mosquitto_auth_opt) {"guest_secret", BENCH_GUEST_SECRET};
+	
+	for (int i = optind; i < argc && count < MAX_OPTIONS; i++) {
+		char* separator = strchr(argv[i], '=');
+		
+		if (separator == NULL) {
+			usage(argv[0]);
+			remove(dbfile);
+			return 1;
+		}
+		
+		*separator       = 0;
+		options[count++] = (struct mosquitto_auth_opt) {argv[i], separator + 1};
+	}
+	
+	int       status    = 1;
+	void*     library   = NULL;
+	Login*    logins    = (Login*) malloc(connects * sizeof (Login));
+	Access*   accesses  = (Access*) malloc((checks > 0 ? checks : 1) * sizeof (Access));
+	uint64_t* latencies = (uint64_t*) malloc((connects > checks ? connects : checks) * sizeof (uint64_t));
+	
+	if (logins == NULL || accesses == NULL || latencies == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		goto done;
+	}
+	
+	if (!filldb(dbfile, users)) {
+		fprintf(stderr, "Can't fill the temporary database\n");
+		goto done;
+	}
+	
+	if ((library = dlopen(plugin, RTLD_NOW)) == NULL) {
+		fprintf(stderr, "Can't load the plugin: %s\n", dlerror());
+		goto done;
+	}
+	
+	makelogins(logins, connects, users, &seed);
+	makeaccesses(accesses, checks, logins, connects, &seed);
+	
+	printf("%ld users, %ld logins, %ld access checks, options:", users, connects, checks);
+	
+	for (int i = 3; i < count; i++) {
+		printf(" %s=%s", options[i].key, options[i].value);
+	}
+	
+	printf("\n");
+	
+	LegacyAPI legacy = {
+		dlsym(library, "mosquitto_auth_plugin_init"),
+		dlsym(library, "mosquitto_auth_plugin_cleanup"),
+		dlsym(library, "mosquitto_auth_security_init"),
+		dlsym(library, "mosquitto_auth_security_cleanup"),
+		dlsym(library, "mosquitto_auth_unpwd_check"),
+		dlsym(library, "mosquitto_auth_acl_check")
+	};
+	
+	if (legacy.init == NULL || legacy.cleanup == NULL || legacy.security_init == NULL ||
+	    legacy.security_cleanup == NULL || legacy.unpwd_check == NULL || legacy.acl_check == NULL) {
+		fprintf(stderr, "The plugin does not implement the legacy API\n");
+		goto done;
+	}
+	
+	void* context;
+	
+	if (legacy.init(&context, options, count) != 0 || legacy.security_init(context, options, count, false) != 0) {
+		fprintf(stderr, "Can't initialize the plugin\n");
+		goto done;
+	}
+	
+	runlegacy(&legacy, context, logins, connects, accesses, checks, latencies);
+	
+	legacy.security_cleanup(context, options, count, false);
+	legacy.cleanup(context, options, count);
+	
+	EventAPI events = {
+		dlsym(library, "mosquitto_plugin_init"),
+		dlsym(library, "mosquitto_plugin_cleanup")
+	};
+	
+	if (events.init != NULL && events.cleanup != NULL) {
+		// the option layouts are identical
+		if (events.init((mosquitto_plugin_id_t*) &events, &context, (struct mosquitto_opt*) options, count) != 0 ||
+		    callbacks[MOSQ_EVT_BASIC_AUTH] == NULL || callbacks[MOSQ_EVT_ACL_CHECK] == NULL) {
+			fprintf(stderr, "Can't initialize the plugin through the event-based API\n");
+			goto done;
+		}
+		
+		runevents(logins, connects, accesses, checks, latencies);
+		
+		events.cleanup(context, (struct mosquitto_opt*) options, count);
+	}
+	
+	status = 0;
+
+done:
+	if (library != NULL) {
+		dlclose(library);
+	}
+	
+	free(logins);
+	free(accesses);
+	free(latencies);
+	
+	remove(dbfile);
+	
+	return status;
+}
@@ -66,5 +66,6 @@ void sha256_update(sha256_ctx *ctx, const unsigned char *message,
 void sha256_final(sha256_ctx *ctx, unsigned char *digest);
 void sha256(const unsigned char *message, unsigned int len,
             unsigned char *digest);
+const char *sha256_implementation(void);
 
 #endif /* !SHA2_H */
@@ -36,6 +36,20 @@
 
 #include "sha2.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHA256_SHANI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/* the crypto intrinsics can only be enabled per function from GCC 8 on */
+#if defined(__GNUC__) && defined(__aarch64__) && defined(__linux__) \
+    && (defined(__ARM_FEATURE_CRYPTO) || defined(__clang__) || __GNUC__ >= 8)
+#define SHA256_ARMV8
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#endif
+
 #define UNPACK32(x, str)                      \
 {                                             \
     *((str) + 3) = (uint8_t) ((x)      );       \
@@ -82,8 +96,8 @@ uint32_t sha256_k[64] =
 
 /* SHA-256 functions */
 
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
+static void sha256_transf_generic(sha256_ctx *ctx, const unsigned char *message,
+                                  unsigned int block_nb)
 {
     uint32_t w[64];
     uint32_t wv[8];
@@ -128,6 +142,243 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
     }
 }
 
+#ifdef SHA256_SHANI
+
+/* Intel SHA extensions: the state is kept as the ABEF and CDGH halves
+   that sha256rnds2 expects, and every macro step covers four rounds */
+
+#define SHANI_ROUNDS(k, msg)                                       \
+{                                                                  \
+    tmp    = _mm_add_epi32(msg,                                    \
+                 _mm_loadu_si128((const __m128i *) &sha256_k[k])); \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, tmp);           \
+    tmp    = _mm_shuffle_epi32(tmp, 0x0e);                         \
+    state0 = _mm_sha256rnds2_epu32(state0, state1, tmp);           \
+}
+
+#define SHANI_SCR(m0, m1, m2, m3)                                  \
+{                                                                  \
+    m0 = _mm_sha256msg1_epu32(m0, m1);                             \
+    m0 = _mm_add_epi32(m0, _mm_alignr_epi8(m3, m2, 4));            \
+    m0 = _mm_sha256msg2_epu32(m0, m3);                             \
+}
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_transf_shani(sha256_ctx *ctx, const unsigned char *message,
+                                unsigned int block_nb)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                        0x0405060700010203ULL);
+    __m128i state0, state1, abef, cdgh, tmp;
+    __m128i m0, m1, m2, m3;
+    const unsigned char *sub_block;
+    int i;
+
+    int j;
+
+    tmp    = _mm_loadu_si128((const __m128i *) &ctx->h[0]);
+    state1 = _mm_loadu_si128((const __m128i *) &ctx->h[4]);
+
+    tmp    = _mm_shuffle_epi32(tmp, 0xb1);
+    state1 = _mm_shuffle_epi32(state1, 0x1b);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    for (i = 0; i < (int) block_nb; i++) {
+        sub_block = message + (i << 6);
+
+        abef = state0;
+        cdgh = state1;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (sub_block     )), mask);
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (sub_block + 16)), mask);
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (sub_block + 32)), mask);
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (sub_block + 48)), mask);
+
+        SHANI_ROUNDS( 0, m0);
+        SHANI_ROUNDS( 4, m1);
+        SHANI_ROUNDS( 8, m2);
+        SHANI_ROUNDS(12, m3);
+
+        for (j = 16; j < 64; j += 16) {
+            SHANI_SCR(m0, m1, m2, m3);
+            SHANI_ROUNDS(j     , m0);
+            SHANI_SCR(m1, m2, m3, m0);
+            SHANI_ROUNDS(j +  4, m1);
+            SHANI_SCR(m2, m3, m0, m1);
+            SHANI_ROUNDS(j +  8, m2);
+            SHANI_SCR(m3, m0, m1, m2);
+            SHANI_ROUNDS(j + 12, m3);
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp    = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+    _mm_storeu_si128((__m128i *) &ctx->h[0], state0);
+    _mm_storeu_si128((__m128i *) &ctx->h[4], state1);
+}
+
+static int sha256_supported_shani(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)
+        || !(ecx & (1 << 9)) || !(ecx & (1 << 19))) {   /* SSSE3, SSE4.1 */
+        return 0;
+    }
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return 0;
+    }
+
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+    return (ebx & (1 << 29)) != 0;                      /* SHA */
+}
+
+#endif /* SHA256_SHANI */
+
+#ifdef SHA256_ARMV8
+
+/* ARMv8 cryptography extensions: four rounds per macro step */
+
+#ifdef __clang__
+#define SHA256_ARMV8_TARGET __attribute__((target("crypto")))
+#else
+#define SHA256_ARMV8_TARGET __attribute__((target("+crypto")))
+#endif
+
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+
+#define ARMV8_ROUNDS(k, msg)                                       \
+{                                                                  \
+    tmp    = vaddq_u32(msg, vld1q_u32(&sha256_k[k]));              \
+    save   = state0;                                               \
+    state0 = vsha256hq_u32(state0, state1, tmp);                   \
+    state1 = vsha256h2q_u32(state1, save, tmp);                    \
+}
+
+#define ARMV8_SCR(m0, m1, m2, m3)                                  \
+{                                                                  \
+    m0 = vsha256su1q_u32(vsha256su0q_u32(m0, m1), m2, m3);         \
+}
+
+#define ARMV8_LOAD(str)                                            \
+    vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(str)))
+
+SHA256_ARMV8_TARGET
+static void sha256_transf_armv8(sha256_ctx *ctx, const unsigned char *message,
+                                unsigned int block_nb)
+{
+    uint32x4_t state0, state1, abcd, efgh, save, tmp;
+    uint32x4_t m0, m1, m2, m3;
+    const unsigned char *sub_block;
+    int i;
+
+    int j;
+
+    state0 = vld1q_u32(&ctx->h[0]);
+    state1 = vld1q_u32(&ctx->h[4]);
+
+    for (i = 0; i < (int) block_nb; i++) {
+        sub_block = message + (i << 6);
+
+        abcd = state0;
+        efgh = state1;
+
+        m0 = ARMV8_LOAD(sub_block     );
+        m1 = ARMV8_LOAD(sub_block + 16);
+        m2 = ARMV8_LOAD(sub_block + 32);
+        m3 = ARMV8_LOAD(sub_block + 48);
+
+        ARMV8_ROUNDS( 0, m0);
+        ARMV8_ROUNDS( 4, m1);
+        ARMV8_ROUNDS( 8, m2);
+        ARMV8_ROUNDS(12, m3);
+
+        for (j = 16; j < 64; j += 16) {
+            ARMV8_SCR(m0, m1, m2, m3);
+            ARMV8_ROUNDS(j     , m0);
+            ARMV8_SCR(m1, m2, m3, m0);
+            ARMV8_ROUNDS(j +  4, m1);
+            ARMV8_SCR(m2, m3, m0, m1);
+            ARMV8_ROUNDS(j +  8, m2);
+            ARMV8_SCR(m3, m0, m1, m2);
+            ARMV8_ROUNDS(j + 12, m3);
+        }
+
+        state0 = vaddq_u32(state0, abcd);
+        state1 = vaddq_u32(state1, efgh);
+    }
+
+    vst1q_u32(&ctx->h[0], state0);
+    vst1q_u32(&ctx->h[4], state1);
+}
+
+static int sha256_supported_armv8(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+}
+
+#endif /* SHA256_ARMV8 */
+
+/* Block transform selected on first use. The portable version is
+   the fallback when the CPU lacks the SHA-256 instructions */
+
+typedef void (*sha256_transf_fn)(sha256_ctx *ctx, const unsigned char *message,
+                                 unsigned int block_nb);
+
+static sha256_transf_fn sha256_transf_impl = NULL;
+static const char *sha256_impl_name = "generic";
+
+static void sha256_select(void)
+{
+    sha256_transf_fn impl = sha256_transf_generic;
+
+#ifdef SHA256_SHANI
+    if (sha256_supported_shani()) {
+        impl = sha256_transf_shani;
+        sha256_impl_name = "x86 SHA extensions";
+    }
+#endif
+
+#ifdef SHA256_ARMV8
+    if (sha256_supported_armv8()) {
+        impl = sha256_transf_armv8;
+        sha256_impl_name = "ARMv8 cryptography extensions";
+    }
+#endif
+
+    sha256_transf_impl = impl;
+}
+
+void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
+                   unsigned int block_nb)
+{
+    if (sha256_transf_impl == NULL) {
+        sha256_select();
+    }
+
+    sha256_transf_impl(ctx, message, block_nb);
+}
+
+const char *sha256_implementation(void)
+{
+    if (sha256_transf_impl == NULL) {
+        sha256_select();
+    }
+
+    return sha256_impl_name;
+}
+
 void sha256(const unsigned char *message, unsigned int len, unsigned char *digest)
 {
     sha256_ctx ctx;
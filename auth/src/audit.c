@@ -0,0 +1,320 @@
+/// @file audit.c
+/// @brief Asynchronous log of the authentication and access control decisions
+/// 
+/// Part of AutoHome.
+/// 
+/// The ring indices only grow; a record is at index % capacity. The producer publishes a record
+/// by releasing head after filling its slot, and the drainer frees slots by releasing tail once
+/// their batch is committed, so a failed batch keeps its records and is retried.
+// 
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "audit.h"
+
+/// @brief Copy a string into a fixed size buffer, truncating it if necessary
+static void copy_truncated(char* buffer, size_t size, const char* str)
+{
+	if (str == NULL) {
+		buffer[0] = 0;
+		return;
+	}
+	
+	size_t length = strlen(str);
+	
+	if (length >= size) {
+		length = size - 1;
+	}
+	
+	memcpy(buffer, str, length);
+	buffer[length] = 0;
+}
+
+/// @brief Current wall clock time, in milliseconds since the epoch
+static int64_t wallclock_ms(void)
+{
+	struct timespec now;
+	
+	clock_gettime(CLOCK_REALTIME, &now);
+	
+	return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/// @brief Insert a row in the authlog table
+/// 
+/// Empty strings are stored as nulls.
+static int insert_row(sqlite3_stmt* insert, int64_t time, const char* event, const char* result, const char* reason,
+                      const char* username, const char* clientid, const char* topic, int access)
+{
+	sqlite3_bind_int64(insert, 1, time);
+	sqlite3_bind_text(insert, 2, event, -1, SQLITE_STATIC);
+	sqlite3_bind_text(insert, 3, result, -1, SQLITE_STATIC);
+	sqlite3_bind_text(insert, 4, reason, -1, SQLITE_STATIC);
+	
+	if (username[0] != 0) {
+		sqlite3_bind_text(insert, 5, username, -1, SQLITE_STATIC);
+	}
+	
+	if (clientid[0] != 0) {
+		sqlite3_bind_text(insert, 6, clientid, -1, SQLITE_STATIC);
+	}
+	
+	if (topic[0] != 0) {
+		sqlite3_bind_text(insert, 7, topic, -1, SQLITE_STATIC);
+		sqlite3_bind_int(insert, 8, access);
+	}
+	
+	int retval = sqlite3_step(insert);
+	
+	sqlite3_reset(insert);
+	sqlite3_clear_bindings(insert);
+	
+	return (retval == SQLITE_DONE) ? SQLITE_OK : retval;
+}
+
+/// @brief Write every pending record (and the count of dropped ones) in a single transaction
+static int flush(AuditLog* log)
+{
+	size_t        tail    = atomic_load_explicit(&log->tail, memory_order_relaxed);
+	size_t        head    = atomic_load_explicit(&log->head, memory_order_acquire);
+	unsigned long dropped = atomic_exchange_explicit(&log->dropped, 0, memory_order_relaxed);
+	int           retval;
+	
+	if (head == tail && dropped == 0) {
+		return SQLITE_OK;
+	}
+	
+	if ((retval = sqlite3_exec(log->db, "begin immediate;", NULL, NULL, NULL)) != SQLITE_OK) {
+		atomic_fetch_add_explicit(&log->dropped, dropped, memory_order_relaxed);
+		return retval;
+	}
+	
+	for (size_t i = tail; i != head && retval == SQLITE_OK; i++) {
+		const AuditRecord* record = &log->records[i & (log->capacity - 1)];
+		
+		retval = insert_row(log->insert, record->time, record->event, record->result, record->reason,
+		                    record->username, record->clientid, record->topic, record->access);
+	}
+	
+	if (retval == SQLITE_OK && dropped > 0) {
+		char reason[64];
+		
+		snprintf(reason, sizeof (reason), "%lu records lost, audit buffer full", dropped);
+		retval = insert_row(log->insert, wallclock_ms(), "audit", "dropped", reason, "", "", "", 0);
+	}
+	
+	if (retval == SQLITE_OK && log->prune != NULL) {
+		retval = sqlite3_step(log->prune);
+		retval = (retval == SQLITE_DONE) ? SQLITE_OK : retval;
+		
+		sqlite3_reset(log->prune);
+	}
+	
+	if (retval == SQLITE_OK) {
+		retval = sqlite3_exec(log->db, "commit;", NULL, NULL, NULL);
+	}
+	
+	if (retval != SQLITE_OK) {
+		sqlite3_exec(log->db, "rollback;", NULL, NULL, NULL);
+		atomic_fetch_add_explicit(&log->dropped, dropped, memory_order_relaxed);
+		return retval;
+	}
+	
+	atomic_store_explicit(&log->tail, head, memory_order_release);
+	
+	return SQLITE_OK;
+}
+
+/// @brief Drainer thread body: write a batch every interval until stopped, then a last one
+static void* drain(void* arg)
+{
+	AuditLog* log = (AuditLog*) arg;
+	
+	pthread_mutex_lock(&log->lock);
+	
+	while (!log->stop) {
+		struct timespec deadline;
+		
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		
+		deadline.tv_sec  += log->interval / 1000;
+		deadline.tv_nsec += (log->interval % 1000) * 1000000;
+		
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec  += 1;
+			deadline.tv_nsec -= 1000000000;
+		}
+		
+		// wakes up on stop, timeout or spuriously; an early batch is harmless
+		pthread_cond_timedwait(&log->wake, &log->lock, &deadline);
+		pthread_mutex_unlock(&log->lock);
+		
+		flush(log);  // a failed batch stays in the ring, to be retried
+		
+		pthread_mutex_lock(&log->lock);
+	}
+	
+	pthread_mutex_unlock(&log->lock);
+	
+	flush(log);
+	
+	return NULL;
+}
+
+/// @brief Release the database objects and memory of a log whose drainer is not running
+static void free_log(AuditLog* log)
+{
+	sqlite3_finalize(log->insert);
+	sqlite3_finalize(log->prune);
+	sqlite3_close(log->db);
+	free(log->records);
+	free(log);
+}
+
+int audit_open(const char* dbfile, int busytimeout, size_t size, long interval, long maxrows, AuditLog** log)
+{
+	AuditLog* newlog = (AuditLog*) calloc(1, sizeof (AuditLog));
+	int       retval;
+	
+	*log = NULL;
+	
+	if (newlog == NULL) {
+		return SQLITE_NOMEM;
+	}
+	
+	newlog->capacity = 1;
+	
+	while (newlog->capacity < size) {
+		newlog->capacity <<= 1;
+	}
+	
+	newlog->interval = (interval > 0) ? interval : 1;
+	newlog->records  = (AuditRecord*) malloc(newlog->capacity * sizeof (AuditRecord));
+	
+	atomic_init(&newlog->head, 0);
+	atomic_init(&newlog->tail, 0);
+	atomic_init(&newlog->dropped, 0);
+	
+	if (newlog->records == NULL) {
+		free_log(newlog);
+		return SQLITE_NOMEM;
+	}
+	
+	if ((retval = sqlite3_open_v2(dbfile, &newlog->db, SQLITE_OPEN_READWRITE, NULL)) != SQLITE_OK ||
+	    (retval = sqlite3_busy_timeout(newlog->db, busytimeout)) != SQLITE_OK) {
+		free_log(newlog);
+		return retval;
+	}
+	
+	if ((retval = sqlite3_prepare_v2(newlog->db, "insert into authlog (time, event, result, reason, username, "
+	                                             "clientid, topic, access) values (?, ?, ?, ?, ?, ?, ?, ?);", -1,
+	                                 &newlog->insert, NULL)) != SQLITE_OK) {
+		free_log(newlog);
+		return retval;
+	}
+	
+	if (maxrows > 0) {
+		if ((retval = sqlite3_prepare_v2(newlog->db, "delete from authlog where id <= "
+		                                             "(select max(id) from authlog) - ?;", -1,
+		                                 &newlog->prune, NULL)) != SQLITE_OK) {
+			free_log(newlog);
+			return retval;
+		}
+		
+		sqlite3_bind_int64(newlog->prune, 1, maxrows);
+	}
+	
+	if (pthread_mutex_init(&newlog->lock, NULL) != 0) {
+		free_log(newlog);
+		return SQLITE_NOMEM;
+	}
+	
+	if (pthread_cond_init(&newlog->wake, NULL) != 0) {
+		pthread_mutex_destroy(&newlog->lock);
+		free_log(newlog);
+		return SQLITE_NOMEM;
+	}
+	
+	if (pthread_create(&newlog->thread, NULL, drain, newlog) != 0) {
+		pthread_cond_destroy(&newlog->wake);
+		pthread_mutex_destroy(&newlog->lock);
+		free_log(newlog);
+		return SQLITE_NOMEM;
+	}
+	
+	*log = newlog;
+	
+	return SQLITE_OK;
+}
+
+void audit_close(AuditLog* log)
+{
+	if (log == NULL) {
+		return;
+	}
+	
+	pthread_mutex_lock(&log->lock);
+	log->stop = true;
+	pthread_cond_signal(&log->wake);
+	pthread_mutex_unlock(&log->lock);
+	
+	pthread_join(log->thread, NULL);
+	
+	pthread_cond_destroy(&log->wake);
+	pthread_mutex_destroy(&log->lock);
+	free_log(log);
+}
+
+void audit_record(AuditLog* log, const char* event, const char* result, const char* reason,
+                  const char* username, const char* clientid, const char* topic, int access)
+{
+	size_t head = atomic_load_explicit(&log->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&log->tail, memory_order_acquire);
+	
+	if (head - tail >= log->capacity) {
+		atomic_fetch_add_explicit(&log->dropped, 1, memory_order_relaxed);
+		return;
+	}
+	
+	AuditRecord* record = &log->records[head & (log->capacity - 1)];
+	
+	record->time   = wallclock_ms();
+	record->event  = event;
+	record->result = result;
+	record->reason = reason;
+	record->access = access;
+	
+	copy_truncated(record->username, sizeof (record->username), username);
+	copy_truncated(record->clientid, sizeof (record->clientid), clientid);
+	copy_truncated(record->topic, sizeof (record->topic), topic);
+	
+	atomic_store_explicit(&log->head, head + 1, memory_order_release);
+}
@@ -0,0 +1,153 @@
+/// @file audit.h
+/// @brief Asynchronous log of the authentication and access control decisions
+/// 
+/// Part of AutoHome.
+/// 
+/// The broker thread only copies each decision into a bounded single-producer, single-consumer
+/// ring; a background thread periodically drains it into the authlog table, one transaction
+/// per batch. When the ring is full new records are dropped and counted instead, so the broker
+/// never waits for the database; the drainer logs how many were lost.
+// 
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef AUDIT_H
+#define AUDIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <sqlite3.h>
+
+/// @brief Maximum stored length of the usernames and client identifiers, including the terminator
+#define AUDIT_NAME_SIZE 64
+
+/// @brief Maximum stored length of the topics, including the terminator
+#define AUDIT_TOPIC_SIZE 192
+
+/// @brief Single decision
+typedef struct AuditRecord {
+	/// @brief Time of the decision, in milliseconds since the epoch
+	int64_t time;
+	
+	/// @brief Kind of decision, "auth" or "acl"; a static string
+	const char* event;
+	
+	/// @brief Outcome, e.g. "allowed"; a static string
+	const char* result;
+	
+	/// @brief Reason for the outcome, e.g. "wrong password"; a static string
+	const char* reason;
+	
+	/// @brief Access requested (MOSQ_ACL_*), for access control checks; zero otherwise
+	int access;
+	
+	/// @brief Username, truncated; may be empty
+	char username[AUDIT_NAME_SIZE];
+	
+	/// @brief Client identifier, truncated; may be empty
+	char clientid[AUDIT_NAME_SIZE];
+	
+	/// @brief Topic, truncated, for access control checks; empty otherwise
+	char topic[AUDIT_TOPIC_SIZE];
+} AuditRecord;
+
+/// @brief Audit log
+typedef struct AuditLog {
+	/// @brief Ring of pending records
+	AuditRecord* records;
+	
+	/// @brief Number of records in the ring; a power of two
+	size_t capacity;
+	
+	/// @brief Number of records ever added; only written by the broker thread
+	atomic_size_t head;
+	
+	/// @brief Number of records ever written to the database; only written by the drainer
+	atomic_size_t tail;
+	
+	/// @brief Records dropped because the ring was full, and not yet logged
+	atomic_ulong dropped;
+	
+	/// @brief Database connection, only used by the drainer
+	sqlite3* db;
+	
+	/// @brief Prepared statement to insert a record
+	sqlite3_stmt* insert;
+	
+	/// @brief Prepared statement to drop the oldest records; NULL if the table is unbounded
+	sqlite3_stmt* prune;
+	
+	/// @brief Time between batches, in milliseconds
+	long interval;
+	
+	/// @brief Drainer thread
+	pthread_t thread;
+	
+	/// @brief Protects stop; never taken by the broker thread
+	pthread_mutex_t lock;
+	
+	/// @brief Signaled to stop the drainer before the end of its interval
+	pthread_cond_t wake;
+	
+	/// @brief True once the drainer must write the last batch and exit
+	bool stop;
+} AuditLog;
+
+/// @brief Open the audit log and start its drainer
+/// 
+/// @param[in] dbfile Database file, which must have an authlog table.
+/// @param[in] busytimeout Time to wait for other connections to release their locks, in milliseconds.
+/// @param[in] size Minimum number of pending records (rounded up to a power of two).
+/// @param[in] interval Time between batches, in milliseconds.
+/// @param[in] maxrows Number of records kept in the table, dropping the oldest ones; zero if unbounded.
+/// @param[out] log Newly allocated audit log; NULL on error.
+/// @return SQL return code. SQLITE_OK, if everything executed correctly; SQLITE_NOMEM if
+///         the log could not be allocated or its thread started; another SQLite error code otherwise.
+int audit_open(const char* dbfile, int busytimeout, size_t size, long interval, long maxrows, AuditLog** log);
+
+/// @brief Write every pending record, stop the drainer and release every resource used by a log
+/// 
+/// @param[in] log Log to close. May be NULL.
+void audit_close(AuditLog* log);
+
+/// @brief Add a record to the log, or drop it if the ring is full
+/// 
+/// Never blocks. Must always be called from the same thread.
+/// 
+/// @param[in,out] log Log to modify.
+/// @param[in] event Kind of decision; a static string.
+/// @param[in] result Outcome; a static string.
+/// @param[in] reason Reason for the outcome; a static string.
+/// @param[in] username Username. May be NULL.
+/// @param[in] clientid Client identifier. May be NULL.
+/// @param[in] topic Topic. May be NULL.
+/// @param[in] access Access requested; zero if not an access control check.
+void audit_record(AuditLog* log, const char* event, const char* result, const char* reason,
+                  const char* username, const char* clientid, const char* topic, int access);
+
+#endif  // #ifndef AUDIT_H
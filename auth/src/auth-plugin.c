@@ -6,6 +6,11 @@
 /// Simple SQLite-based authorization system. Holds _username:salt:hash(salt, password)_ triplets
 /// in a database, and each user has access to the corresponding topics __username/\#__.
 /// One superuser may use any topic it wants.
+/// 
+/// Both the legacy authorization plugin API (version 2) and the event-based plugin API
+/// (version 5, Mosquitto 2.0 and newer) are exported; the broker picks the newest one it supports.
+/// With the event-based API, per-client authorization decisions are computed once on
+/// authentication instead of on every access control check.
 //
 // Copyright (c) 2017, Diego Guerrero
 // All rights reserved.
@@ -37,12 +42,24 @@
 #include <time.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <limits.h>
 
 #include <sqlite3.h>
 #include <mosquitto.h>
 #include <mosquitto_plugin.h>
 #include <sha2.h>
 
+#include "mosquitto_v5.h"
+#include "credentials.h"
+#include "credcache.h"
+#include "snapshot.h"
+#include "clients.h"
+#include "groups.h"
+#include "presence.h"
+#include "audit.h"
+#include "throttle.h"
+#include "metrics.h"
+
 /// @brief Plugin-specific API return codes
 enum return_codes
 {
@@ -52,9 +69,30 @@ enum return_codes
 	DB_FILE_CANTOPEN     = 3,
 	DB_FILE_CANTCLOSE    = 4,
 	DB_ERROR             = 5,
+	INVALID_OPTION       = 6,
+	NO_MEMORY            = 7,
+	CALLBACK_FAILED      = 8,
 	NOTREQUIRED          = 102
 };
 
+/// @brief Topic where the metrics are published on demand (plugin API version 5 only)
+/// 
+/// Only the superuser may read it; subscribing to it triggers a fresh report.
+#define METRICS_TOPIC "$SYS/broker/autohome/auth/metrics"
+
+/// @brief Prefix of the group topics, reserved for group/<name>/control
+/// 
+/// No device owns these topics, whatever its username; only the superuser may write to them.
+#define GROUP_TOPIC_PREFIX "group/"
+
+/// @brief Suffix of the group control topics
+#define GROUP_TOPIC_SUFFIX "/control"
+
+/// @brief Topic filter any device may subscribe to in order to receive the commands for its groups
+/// 
+/// Messages are only delivered from the groups the device is a member of.
+#define GROUP_TOPIC_FILTER "group/+/control"
+
 /// @brief Plugin global context
 ///
 /// Maintains information and references throughout the life of the plugin.
@@ -65,6 +103,58 @@ typedef struct Context {
 	/// @brief Prepared statement for password queries
 	sqlite3_stmt* passquery;
 	
+	/// @brief Prepared statement for TLS pre-shared key queries
+	/// 
+	/// NULL if the database has no psk table; no client can connect through TLS-PSK then.
+	sqlite3_stmt* pskquery;
+	
+	/// @brief Prepared statement to read the database version
+	/// 
+	/// The version changes every time another connection commits a transaction.
+	sqlite3_stmt* dataversionquery;
+	
+	/// @brief Prepared statement to read the credentials version counter
+	/// 
+	/// The counter is maintained by triggers on the auth table. NULL if the database
+	/// has no such counter; any change to the database will be considered a credentials change.
+	sqlite3_stmt* authversionquery;
+	
+	/// @brief Database version seen on the last credentials change check
+	sqlite3_int64 dataversion;
+	
+	/// @brief Credentials version seen on the last credentials change check
+	sqlite3_int64 authversion;
+	
+	/// @brief Cached credentials, filled on demand
+	/// 
+	/// Cleared whenever the auth table changes. Disabled (zero capacity) unless
+	/// an auth_opt_cache_size is given.
+	CredCache cache;
+	
+	/// @brief Usernames known not to be registered, filled on demand
+	/// 
+	/// Spares the database query for guests that log in repeatedly. Cleared with the
+	/// credential cache. Disabled (zero capacity) unless an auth_opt_negative_cache_size is given.
+	CredCache missing;
+	
+	/// @brief True if credentials are looked up in an eagerly loaded snapshot of the auth table
+	/// 
+	/// Set through the auth_opt_snapshot option. If enabled, the credential cache is not used.
+	bool usesnapshot;
+	
+	/// @brief Current snapshot of the auth table
+	/// 
+	/// Only used if usesnapshot is set. Rebuilt when the broker reloads its configuration
+	/// and whenever the auth table changes; a new snapshot replaces the old one only
+	/// once it has been completely loaded.
+	Snapshot* snapshot;
+	
+	/// @brief Current index of the device groups
+	/// 
+	/// Rebuilt along with the snapshot, whenever the device groups change. NULL if the database has
+	/// no devgroup table; no device is a member of any group then.
+	GroupIndex* groups;
+	
 	/// @brief Username of the superuser
 	/// 
 	/// This user has read and write access to any topic.
@@ -79,6 +169,49 @@ typedef struct Context {
 	/// from being connected). The security feature is only meant to deter simple
 	/// attacks; more complex situations should be dealt using an appropriate firewall.
 	char* guestsecret;
+	
+	/// @brief Rate limits for guest logins
+	/// 
+	/// Keeps a flood of unpaired devices from starving the paired ones. Disabled unless
+	/// an auth_opt_guest_rate or auth_opt_guest_user_rate is given.
+	Throttle throttle;
+	
+	/// @brief Hot path counters and latency histograms
+	Metrics metrics;
+	
+	/// @brief Time between periodic metrics reports, in nanoseconds; zero if disabled
+	uint64_t metricsinterval;
+	
+	/// @brief Plugin identifier given by the broker
+	/// 
+	/// Only set when the event-based plugin API is in use.
+	mosquitto_plugin_id_t* identifier;
+	
+	/// @brief Authorization state of every client authenticated through the event-based API
+	ClientTable clients;
+	
+	/// @brief Database connection used to write back the presence of the devices
+	/// 
+	/// Separate from the main connection, which may be read-only. NULL unless
+	/// an auth_opt_presence_interval is given and the event-based API is in use.
+	sqlite3* presencedb;
+	
+	/// @brief Prepared statement to update the presence of a device
+	sqlite3_stmt* presencequery;
+	
+	/// @brief Presence of every registered device authenticated through the event-based API
+	PresenceTable presence;
+	
+	/// @brief Minimum time between presence write-backs, in nanoseconds; zero if disabled
+	uint64_t presenceinterval;
+	
+	/// @brief Time of the last presence write-back, as returned by metrics_now()
+	uint64_t lastpresence;
+	
+	/// @brief Log of every authentication and every denied access control check
+	/// 
+	/// Written to the authlog table by a background thread. NULL unless auth_opt_audit is true.
+	AuditLog* audit;
 } Context;
 
 /// @brief Releases memory used by a context
@@ -86,6 +219,13 @@ typedef struct Context {
 ///          so they will not be released by this function
 void free_context(Context* context)
 {
+	credcache_free(&context->cache);
+	credcache_free(&context->missing);
+	throttle_free(&context->throttle);
+	snapshot_free(context->snapshot);
+	groups_free(context->groups);
+	clients_free(&context->clients);
+	presence_free(&context->presence);
 	free(context->superuser);
 	free(context->guestsecret);
 	free(context);
@@ -100,6 +240,45 @@ int mosquitto_auth_plugin_version(void)
 	return MOSQ_AUTH_PLUGIN_VERSION;
 }
 
+/// @brief Parse a boolean configuration option
+/// 
+/// @param[in] value Option value. Accepted values are "true" and "false".
+/// @param[out] result Parsed value.
+/// @return True if the value could be parsed; false otherwise.
+static bool parse_bool(const char* value, bool* result)
+{
+	if (strcmp(value, "true") == 0) {
+		*result = true;
+	}
+	else if (strcmp(value, "false") == 0) {
+		*result = false;
+	}
+	else {
+		return false;
+	}
+	
+	return true;
+}
+
+/// @brief Parse a non-negative integer configuration option
+/// 
+/// @param[in] value Option value, in decimal.
+/// @param[out] result Parsed value.
+/// @return True if the value could be parsed; false otherwise.
+static bool parse_nonnegative(const char* value, long* result)
+{
+	char* end;
+	long  parsed = strtol(value, &end, 10);
+	
+	if (*value == 0 || *end != 0 || parsed < 0) {
+		return false;
+	}
+	
+	*result = parsed;
+	
+	return true;
+}
+
 /// @brief Prepare, evaluate and destroy an SQL statement with no outputs.
 /// 
 /// Prepare a statement based on the given query, evaluate it and destroy the statement.
@@ -228,19 +407,123 @@ static int create_table(sqlite3* db, char* name, char* definition)
 	return NOTREQUIRED;
 }
 
-/// @brief Retrieve the corresponding password hash for a given user
+/// @brief Finalize every prepared statement held by a context
+/// 
+/// @param[in] context Plugin context.
+/// @return SQL return code. SQLITE_OK, if every statement was finalized correctly;
+///         the last SQLite error code otherwise.
+static int finalize_statements(Context* context)
+{
+	int retval = SQLITE_OK;
+	int status;
+	
+	// sqlite3_finalize is a harmless no-op on NULL statements
+	if ((status = sqlite3_finalize(context->passquery)) != SQLITE_OK) {
+		retval = status;
+	}
+	
+	if ((status = sqlite3_finalize(context->pskquery)) != SQLITE_OK) {
+		retval = status;
+	}
+	
+	if ((status = sqlite3_finalize(context->dataversionquery)) != SQLITE_OK) {
+		retval = status;
+	}
+	
+	if ((status = sqlite3_finalize(context->authversionquery)) != SQLITE_OK) {
+		retval = status;
+	}
+	
+	context->passquery        = NULL;
+	context->pskquery         = NULL;
+	context->dataversionquery = NULL;
+	context->authversionquery = NULL;
+	
+	return retval;
+}
+
+/// @brief Evaluate a prepared statement with a single integer output
+/// 
+/// The statement is reset before and after the evaluation, so it is left ready to be used again.
+/// 
+/// @param[in] statement Prepared statement. It must return at least one row.
+/// @param[out] result Queried result.
+/// @return SQL return code. SQLITE_OK, if everything executed correctly; an SQLite error code otherwise.
+static int step_single_int64(sqlite3_stmt* statement, sqlite3_int64* result)
+{
+	int retval;
+	
+	if ((retval = sqlite3_reset(statement)) != SQLITE_OK) {
+		return retval;
+	}
+	
+	if ((retval = sqlite3_step(statement)) != SQLITE_ROW) {
+		sqlite3_reset(statement);
+		return (retval == SQLITE_DONE) ? SQLITE_NOTFOUND : retval;
+	}
+	
+	*result = sqlite3_column_int64(statement, 0);
+	
+	return sqlite3_reset(statement);
+}
+
+/// @brief Check whether the stored credentials may have changed
+/// 
+/// Compare the database version against the one seen on the previous call; it changes
+/// whenever another connection (i.e. devcontrol) commits a transaction. Most of those transactions
+/// only update device profiles, so if the credentials version counter is available
+/// it is consulted to discard changes unrelated to the auth table.
+/// 
+/// @param[in,out] context Plugin context. Remembers the last seen versions.
+/// @param[out] changed True if the credentials may have changed since the last call.
+/// @return SQL return code. SQLITE_OK, if everything executed correctly; an SQLite error code otherwise.
+static int credentials_changed(Context* context, bool* changed)
+{
+	sqlite3_int64 version = 0;
+	int           retval;
+	
+	*changed = false;
+	
+	// the database version must be read first; otherwise a commit between both queries
+	// could be recorded as seen without having checked its credentials version
+	if ((retval = step_single_int64(context->dataversionquery, &version)) != SQLITE_OK) {
+		return retval;
+	}
+	
+	if (version == context->dataversion) {
+		return SQLITE_OK;
+	}
+	
+	context->dataversion = version;
+	
+	if (context->authversionquery == NULL) {
+		*changed = true;
+		return SQLITE_OK;
+	}
+	
+	if ((retval = step_single_int64(context->authversionquery, &version)) != SQLITE_OK) {
+		return retval;
+	}
+	
+	if (version != context->authversion) {
+		context->authversion = version;
+		*changed = true;
+	}
+	
+	return SQLITE_OK;
+}
+
+/// @brief Retrieve the stored credentials for a given user
 /// 
 /// Search the database for the given username and retrieve the corresponding password hash
-/// and salt. If the username is not registered, retrieve the empty string as password.
+/// and salt. A user with an empty password hash is considered not registered.
 /// 
-/// @param[in] pssquery Prepared statement for password extraction.
+/// @param[in] passquery Prepared statement for password extraction.
 /// @param[in] username Queried username.
-/// @param[out] hash Retrieved password hash.
-/// @param[in] hashlen Hash buffer size (including null terminator). It must be greater than zero.
-/// @param[out] salt Retrieved salt used to compute the hash.
-/// @param[in] saltlen Salt buffer size (including null terminator). It must be greater than zero.
+/// @param[out] credentials Retrieved credentials. Only set if the user is registered.
+/// @param[out] found True if the user is registered.
 /// @return SQL return code. SQLITE_OK, if everything executed correctly; an SQLite error code otherwise.
-static int retrieve_password(sqlite3_stmt* passquery, const char* username, char* hash, size_t hashlen, char* salt, size_t saltlen)
+static int retrieve_credentials(sqlite3_stmt* passquery, const char* username, Credentials* credentials, bool* found)
 {
 	int retval;
 	
@@ -255,19 +538,15 @@ static int retrieve_password(sqlite3_stmt* passquery, const char* username, char
 	retval = sqlite3_step(passquery);
 	
 	if (retval == SQLITE_DONE) {  // unrecognized user
-		hash[0] = 0;
-		salt[0] = 0;
+		*found = false;
 	}
 	else if (retval == SQLITE_ROW) {  // recognized user
-		const unsigned char* result = sqlite3_column_text(passquery, 0);
-		
-		strncpy(hash, (const char*) result, hashlen);
-		hash[hashlen - 1] = 0;
+		const char* hash = (const char*) sqlite3_column_text(passquery, 0);
+		const char* salt = (const char*) sqlite3_column_text(passquery, 1);
 		
-		result = sqlite3_column_text(passquery, 1);
+		*found = (hash != NULL && hash[0] != 0);
 		
-		strncpy(salt, (const char*) result, saltlen);
-		salt[saltlen - 1] = 0;
+		credentials_set(credentials, hash, salt);
 	}
 	else {
 		return retval;
@@ -280,225 +559,1200 @@ static int retrieve_password(sqlite3_stmt* passquery, const char* username, char
 	return SQLITE_OK;
 }
 
-/// @brief Plugin initialization routine
+/// @brief Retrieve the stored credentials for a given user, accounting for it in the metrics
 /// 
-/// Open a connection to the SQLite database.
+/// Same semantics as retrieve_credentials().
 /// 
-/// @param[out] user_data Initialized plugin context, available on subsequent calls to the API.
-/// @param[in] auth_opts Configuration options. Used to read the database file and the superuser name
-///                      (through the auth_opt_db_file and auth_opt_superuser variables in the
-///                      configuration file).
-/// @param[in] auth_opt_count Number of configuration options.
-/// @return Return code. On success, zero; otherwise, a number greater than zero.
-int mosquitto_auth_plugin_init(void **user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count)
+/// @param[in,out] context Plugin context.
+/// @param[in] username Queried username.
+/// @param[out] credentials Retrieved credentials. Only set if the user is registered.
+/// @param[out] found True if the user is registered.
+/// @return SQL return code. SQLITE_OK, if everything executed correctly; an SQLite error code otherwise.
+static int query_credentials(Context* context, const char* username, Credentials* credentials, bool* found)
 {
-	char*    dbfile  = NULL;
-	Context* context = (Context*) calloc(1, sizeof (Context));
-	*user_data       = context;
-	
-	for (int i = 0; i < auth_opt_count; i++) {
-		if (strcmp(auth_opts[i].key, "db_file") == 0) {
-			dbfile = auth_opts[i].value;
-		}
-		else if (strcmp(auth_opts[i].key, "superuser") == 0) {
-			int sulen          = strlen(auth_opts[i].value);
-			context->superuser = (char*) malloc((sulen + 1) * sizeof (char));
-			strncpy(context->superuser, auth_opts[i].value, sulen);
-			context->superuser[sulen] = 0;
-		}
-		else if (strcmp(auth_opts[i].key, "guest_secret") == 0) {
-			int passlen          = strlen(auth_opts[i].value);
-			context->guestsecret = (char*) malloc((passlen + 1) * sizeof (char));
-			strncpy(context->guestsecret, auth_opts[i].value, passlen);
-			context->guestsecret[passlen] = 0;
-		}
-	}
+	uint64_t start  = metrics_now();
+	int      retval = retrieve_credentials(context->passquery, username, credentials, found);
 	
-	if (sqlite3_initialize() != SQLITE_OK) {
-		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to initialize SQLite3.");
-		
-		free_context(context);
-		return FAILED_SQLITE;
-	}
+	histogram_record(&context->metrics.dblatency, start);
 	
-	if (dbfile == NULL) {
-		mosquitto_log_printf(MOSQ_LOG_ERR, "No SQLite database specified. Check your "
-		                                   "Mosquitto configuration file; it should "
-		                                   "include an appropriate auth_opt_db_file variable.");
-		
-		free_context(context);
-		return NO_DB_FILE_SPECIFIED;
-	}
+	context->metrics.cachemisses += 1;
+	context->metrics.dberrors    += (retval != SQLITE_OK);
 	
-	if (sqlite3_open(dbfile, &context->db) != SQLITE_OK) {
-		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to open SQLite database.");
-		
-		sqlite3_close(context->db);
-		free_context(context);
-		return DB_FILE_CANTOPEN;
-	}
+	return retval;
+}
+
+/// @brief Build a new snapshot of the auth table and swap it in place of the current one
+/// 
+/// If the new snapshot can't be built, the current one is kept.
+/// 
+/// @param[in,out] context Plugin context.
+/// @return SQL return code. SQLITE_OK, if everything executed correctly; an SQLite error code otherwise.
+static int reload_snapshot(Context* context)
+{
+	Snapshot* snapshot;
+	int       retval;
 	
-	if (sql_exec_void(context->db, "pragma foreign_keys = on;") != SQLITE_OK) {
-		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to enable foreign keys.");
-		
-		sqlite3_close(context->db);
-		free_context(context);
-		return DB_ERROR;
+	if ((retval = snapshot_load(context->db, &snapshot)) != SQLITE_OK) {
+		return retval;
 	}
 	
-	int profretvalue = create_table(context->db, "profile", "username text not null primary key,"
-	                                                        "displayname text not null unique,"
-	                                                        "type text not null,"
-	                                                        "connected text not null,"
-	                                                        "status text not null");
-	
-	int authretvalue = create_table(context->db, "auth", "username text not null primary key references profile on delete cascade,"
-	                                                     "hash text not null,"
-	                                                     "salt text not null");
+	// the broker calls the plugin from a single thread, so no lookup can see a half-swapped index
+	Snapshot* old     = context->snapshot;
+	context->snapshot = snapshot;
 	
-	int schedretvalue = create_table(context->db, "schedule", "id integer not null primary key,"
-	                                                          "username text not null references profile on delete cascade,"
-	                                                          "command text not null,"
-	                                                          "fuzzy int not null,"
-	                                                          "recurrent int not null,"
-	                                                          "firedate int not null,"
-	                                                          "weekday int not null,"
-	                                                          "hours int not null,"
-	                                                          "minutes int not null");
+	snapshot_free(old);
 	
-	bool error = (profretvalue  != SUCCESS && profretvalue  != NOTREQUIRED);
-	error     |= (authretvalue  != SUCCESS && authretvalue  != NOTREQUIRED);
-	error     |= (schedretvalue != SUCCESS && schedretvalue != NOTREQUIRED);
+	return SQLITE_OK;
+}
+
+/// @brief Build a new index of the device groups and swap it in place of the current one
+/// 
+/// If the new index can't be built, the current one is kept.
+/// 
+/// @param[in,out] context Plugin context.
+/// @return SQL return code. SQLITE_OK, if everything executed correctly; an SQLite error code otherwise.
+static int reload_groups(Context* context)
+{
+	GroupIndex* groups;
+	int         retval;
 	
-	if (!error) {
-		if (profretvalue == SUCCESS && authretvalue == SUCCESS && schedretvalue == SUCCESS) {
-			mosquitto_log_printf(MOSQ_LOG_NOTICE, "Uninitialized database. Creating from scratch.");
-		}
-		else if (profretvalue == NOTREQUIRED && authretvalue == NOTREQUIRED && schedretvalue == NOTREQUIRED) {
-			// database was already OK, nothing to log
-		}
-		else {
-			mosquitto_log_printf(MOSQ_LOG_NOTICE, "Incomplete database. Patching (but foreign keys may be wrong).");
-		}
-	}
-	else {  // SQL error
-		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create tables.");
-		
-		sqlite3_close(context->db);
-		free_context(context);
-		return DB_ERROR;
+	if ((retval = groups_load(context->db, &groups)) != SQLITE_OK) {
+		return retval;
 	}
 	
-	if (sqlite3_prepare_v2(context->db, "select hash, salt from auth where username=?;", -1, &context->passquery, NULL) != SQLITE_OK) {
-		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to compile password prepared statement.");
-		
-		sqlite3_finalize(context->passquery);
-		sqlite3_close(context->db);
-		free_context(context);
-		return DB_ERROR;
-	}
+	GroupIndex* old = context->groups;
+	context->groups = groups;
 	
-	mosquitto_log_printf(MOSQ_LOG_INFO, "AutoHome authorization plugin initialized successfully");
+	groups_free(old);
 	
-	return SUCCESS;
+	return SQLITE_OK;
 }
 
-/// @brief Plugin shut down routine
+/// @brief Bring every in-memory index up to date if the credentials or groups have changed
 /// 
-/// Close the connection to the SQLite database.
+/// Clear the credential caches and reload the group index and snapshot (if enabled).
+/// An index that fails to reload is kept, and the next call will try to reload it again;
+/// a stale snapshot must not be trusted, though.
 /// 
-/// @param[in] user_data Plugin context.
-/// @param[in] auth_opts Configuration options.
-/// @param[in] auth_opt_count Number of configuration options.
-/// @return Return code. On success, zero; otherwise, a number greater than zero.
-int mosquitto_auth_plugin_cleanup(void *user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count)
+/// @param[in,out] context Plugin context.
+/// @param[out] current True if the snapshot (if enabled) reflects the auth table.
+/// @return SQL return code. SQLITE_OK, if everything executed correctly; an SQLite error code otherwise.
+static int refresh_indices(Context* context, bool* current)
 {
-	Context* context = (Context*) user_data;
+	bool changed;
+	int  retval;
 	
-	if (sqlite3_finalize(context->passquery) != SQLITE_OK) {
-		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to finalize password prepared statement.");
-		
-		sqlite3_close(context->db);
-		free_context(context);
-		return DB_FILE_CANTCLOSE;
+	*current = true;
+	
+	if ((retval = credentials_changed(context, &changed)) != SQLITE_OK) {
+		*current = false;
+		return retval;
 	}
 	
-	if (sqlite3_close(context->db) != SQLITE_OK) {
-		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to close SQLite database.");
-		
-		free_context(context);
-		return DB_FILE_CANTCLOSE;
+	if (!changed) {
+		return SQLITE_OK;
 	}
 	
-	if (sqlite3_shutdown() != SQLITE_OK) {
-		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to shutdown SQLite3.");
+	// a missing user may have just been paired, so both caches go
+	credcache_clear(&context->cache);
+	credcache_clear(&context->missing);
+	
+	if (context->groups != NULL && reload_groups(context) != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to reload the device groups, keeping the previous ones.");
 		
-		free_context(context);
-		return FAILED_SQLITE;
+		context->dataversion = -1;  // force a reload attempt on the next lookup
+		context->authversion = -1;
 	}
 	
-	free_context(context);
-	
-	mosquitto_log_printf(MOSQ_LOG_INFO, "AutoHome authorization plugin shut down successfully");
+	if (context->usesnapshot && reload_snapshot(context) != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to reload the credentials snapshot, querying the database instead.");
+		
+		context->dataversion = -1;
+		context->authversion = -1;
+		
+		*current = false;
+	}
 	
-	return SUCCESS;
+	return SQLITE_OK;
 }
 
-/// @brief Security initialization routine
+/// @brief Retrieve the stored credentials for a given user, using the in-memory indices if possible
 /// 
-/// Additional initialization steps run after the plugin initialization.
-/// Unlike the plugin initialization, this functions will be called again
-/// every time the broker reloads its configuration while running.
-/// Does nothing.
+/// Same semantics as retrieve_credentials(). If the snapshot is enabled, the lookup is resolved
+/// without querying the auth table, reloading the snapshot first if the table has changed.
+/// Otherwise, registered users are cached on their first lookup, as are unregistered ones
+/// in the negative cache; both are cleared before the lookup if the auth table has changed.
 /// 
-/// @param[in] user_data Plugin context.
-/// @param[in] auth_opts Configuration options.
-/// @param[in] auth_opt_count Number of configuration options.
-/// @param[in] reload When the broker is asked to reload its configuration, it will run this
-///                   routine again, with this flag as true; otherwise (on startup) it will be false.
-/// @return Return code. On success, zero; otherwise, a number greater than zero.
-int mosquitto_auth_security_init(void *user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count, bool reload)
+/// @param[in] context Plugin context.
+/// @param[in] username Queried username.
+/// @param[out] credentials Retrieved credentials. Only set if the user is registered.
+/// @param[out] found True if the user is registered.
+/// @return SQL return code. SQLITE_OK, if everything executed correctly; an SQLite error code otherwise.
+static int lookup_credentials(Context* context, const char* username, Credentials* credentials, bool* found)
 {
-	return SUCCESS;
+	int retval;
+	
+	if (context->usesnapshot) {
+		bool current;
+		
+		if ((retval = refresh_indices(context, &current)) != SQLITE_OK) {
+			return retval;
+		}
+		
+		if (!current) {
+			return query_credentials(context, username, credentials, found);
+		}
+		
+		const SnapshotEntry* entry = snapshot_find(context->snapshot, username);
+		
+		*found = (entry != NULL);
+		
+		context->metrics.snapshothits += 1;
+		
+		if (*found) {
+			*credentials = entry->credentials;
+		}
+		
+		return SQLITE_OK;
+	}
+	
+	if (context->cache.capacity > 0 || context->missing.capacity > 0) {
+		bool current;
+		
+		if ((retval = refresh_indices(context, &current)) != SQLITE_OK) {
+			return retval;
+		}
+		
+		const CacheEntry* entry = credcache_find(&context->cache, username);
+		
+		if (entry != NULL) {
+			*credentials = entry->credentials;
+			*found       = true;
+			
+			context->metrics.cachehits += 1;
+			return SQLITE_OK;
+		}
+		
+		if (credcache_find(&context->missing, username) != NULL) {
+			*found = false;
+			
+			context->metrics.negativehits += 1;
+			return SQLITE_OK;
+		}
+	}
+	
+	if ((retval = query_credentials(context, username, credentials, found)) != SQLITE_OK) {
+		return retval;
+	}
+	
+	if (*found) {
+		credcache_insert(&context->cache, username, credentials);
+	}
+	else {
+		static const Credentials none;  // only the username matters in the negative cache
+		
+		credcache_insert(&context->missing, username, &none);
+	}
+	
+	return SQLITE_OK;
+}
+
+/// @brief Copy a pre-shared key into a broker buffer
+/// 
+/// @param[in] psk Stored key, in base16.
+/// @param[out] key Output buffer.
+/// @param[in] max_key_len Size of the output buffer.
+/// @return True if the key is valid and fits in the buffer; false otherwise.
+static bool copy_psk(const char* psk, char* key, int max_key_len)
+{
+	size_t psklen = strlen(psk);
+	
+	// the broker decodes the key itself, but a malformed one is better reported here
+	if (psklen == 0 || psklen % 2 != 0 || strspn(psk, "0123456789abcdefABCDEF") != psklen || max_key_len <= 0 ||
+	    psklen >= (size_t) max_key_len) {
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "Malformed or oversized pre-shared key in the database.");
+		return false;
+	}
+	
+	memcpy(key, psk, psklen + 1);
+	
+	return true;
+}
+
+/// @brief Retrieve the TLS pre-shared key of a given user, using the snapshot if possible
+/// 
+/// Keys are not cached: they are only needed once per TLS handshake, so without the snapshot
+/// the psk table is queried every time.
+/// 
+/// @param[in] context Plugin context.
+/// @param[in] identity Queried identity (username).
+/// @param[out] key Retrieved key, in base16. Only set if found.
+/// @param[in] max_key_len Size of the key buffer.
+/// @param[out] found True if the user has a valid key.
+/// @return SQL return code. SQLITE_OK, if everything executed correctly; an SQLite error code otherwise.
+static int lookup_psk(Context* context, const char* identity, char* key, int max_key_len, bool* found)
+{
+	int retval;
+	
+	*found = false;
+	
+	if (context->usesnapshot) {
+		bool current;
+		
+		if ((retval = refresh_indices(context, &current)) != SQLITE_OK) {
+			return retval;
+		}
+		
+		if (current) {
+			const SnapshotEntry* entry = snapshot_find(context->snapshot, identity);
+			
+			*found = (entry != NULL && entry->psk != NULL && copy_psk(entry->psk, key, max_key_len));
+			
+			return SQLITE_OK;
+		}
+	}
+	
+	if (context->pskquery == NULL) {
+		return SQLITE_OK;
+	}
+	
+	if ((retval = sqlite3_reset(context->pskquery)) != SQLITE_OK) {
+		return retval;
+	}
+	
+	if ((retval = sqlite3_bind_text(context->pskquery, 1, identity, -1, SQLITE_TRANSIENT)) != SQLITE_OK) {
+		return retval;
+	}
+	
+	retval = sqlite3_step(context->pskquery);
+	
+	if (retval == SQLITE_ROW) {
+		const char* psk = (const char*) sqlite3_column_text(context->pskquery, 0);
+		
+		*found = (psk != NULL && copy_psk(psk, key, max_key_len));
+	}
+	else if (retval != SQLITE_DONE) {
+		sqlite3_reset(context->pskquery);
+		return retval;
+	}
+	
+	return sqlite3_reset(context->pskquery);
+}
+
+/// @brief Triggers keeping the credentials version counter up to date
+/// 
+/// Any change to the auth, psk or devgroup tables, including cascaded deletions from the profile table,
+/// increments the counter, so cached credentials and groups can be invalidated precisely.
+static const char* authversion_triggers[] = {
+	"create trigger if not exists authversion_insert after insert on auth "
+	"begin update authversion set version = version + 1 where id = 0; end;",
+	"create trigger if not exists authversion_update after update on auth "
+	"begin update authversion set version = version + 1 where id = 0; end;",
+	"create trigger if not exists authversion_delete after delete on auth "
+	"begin update authversion set version = version + 1 where id = 0; end;",
+	"create trigger if not exists pskversion_insert after insert on psk "
+	"begin update authversion set version = version + 1 where id = 0; end;",
+	"create trigger if not exists pskversion_update after update on psk "
+	"begin update authversion set version = version + 1 where id = 0; end;",
+	"create trigger if not exists pskversion_delete after delete on psk "
+	"begin update authversion set version = version + 1 where id = 0; end;",
+	"create trigger if not exists groupversion_insert after insert on devgroup "
+	"begin update authversion set version = version + 1 where id = 0; end;",
+	"create trigger if not exists groupversion_update after update on devgroup "
+	"begin update authversion set version = version + 1 where id = 0; end;",
+	"create trigger if not exists groupversion_delete after delete on devgroup "
+	"begin update authversion set version = version + 1 where id = 0; end;"
+};
+
+/// @brief Create the database schema if not already there
+/// 
+/// Create the profile, auth and schedule tables shared with devcontrol, the TLS pre-shared
+/// key and device group tables and the credentials version counter along with its triggers.
+/// 
+/// @param[in] db Database handle. It must be writable.
+/// @return Return code. SUCCESS, if the schema is complete; DB_ERROR otherwise.
+static int create_schema(sqlite3* db)
+{
+	int profretvalue = create_table(db, "profile", "username text not null primary key,"
+	                                               "displayname text not null unique,"
+	                                               "type text not null,"
+	                                               "connected text not null,"
+	                                               "status text not null");
+	
+	int authretvalue = create_table(db, "auth", "username text not null primary key references profile on delete cascade,"
+	                                            "hash text not null,"
+	                                            "salt text not null");
+	
+	int schedretvalue = create_table(db, "schedule", "id integer not null primary key,"
+	                                                 "username text not null references profile on delete cascade,"
+	                                                 "command text not null,"
+	                                                 "fuzzy int not null,"
+	                                                 "recurrent int not null,"
+	                                                 "firedate int not null,"
+	                                                 "weekday int not null,"
+	                                                 "hours int not null,"
+	                                                 "minutes int not null");
+	
+	bool error = (profretvalue  != SUCCESS && profretvalue  != NOTREQUIRED);
+	error     |= (authretvalue  != SUCCESS && authretvalue  != NOTREQUIRED);
+	error     |= (schedretvalue != SUCCESS && schedretvalue != NOTREQUIRED);
+	
+	if (!error) {
+		if (profretvalue == SUCCESS && authretvalue == SUCCESS && schedretvalue == SUCCESS) {
+			mosquitto_log_printf(MOSQ_LOG_NOTICE, "Uninitialized database. Creating from scratch.");
+		}
+		else if (profretvalue == NOTREQUIRED && authretvalue == NOTREQUIRED && schedretvalue == NOTREQUIRED) {
+			// database was already OK, nothing to log
+		}
+		else {
+			mosquitto_log_printf(MOSQ_LOG_NOTICE, "Incomplete database. Patching (but foreign keys may be wrong).");
+		}
+	}
+	else {  // SQL error
+		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create tables.");
+		return DB_ERROR;
+	}
+	
+	// pre-shared keys are optional, every client can still authenticate with its password
+	int pskretvalue = create_table(db, "psk", "username text not null primary key references profile on delete cascade,"
+	                                          "key text not null");
+	
+	if (pskretvalue != SUCCESS && pskretvalue != NOTREQUIRED) {
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to create the pre-shared key table.");
+	}
+	
+	int groupretvalue = create_table(db, "devgroup", "name text not null,"
+	                                                 "username text not null references profile on delete cascade,"
+	                                                 "primary key (name, username)");
+	
+	if (groupretvalue != SUCCESS && groupretvalue != NOTREQUIRED) {
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to create the device group table.");
+	}
+	
+	// the audit log is only needed if auth_opt_audit is set, which reports its own error
+	int logretvalue = create_table(db, "authlog", "id integer not null primary key,"
+	                                              "time integer not null,"
+	                                              "event text not null,"
+	                                              "result text not null,"
+	                                              "reason text not null,"
+	                                              "username text,"
+	                                              "clientid text,"
+	                                              "topic text,"
+	                                              "access integer");
+	
+	if (logretvalue != SUCCESS && logretvalue != NOTREQUIRED) {
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to create the audit log table.");
+	}
+	
+	// the credentials version counter is not part of the main schema; it is a cache coherence
+	// helper, so failing to set it up only means every database change will clear the cache
+	int verretvalue = create_table(db, "authversion", "id integer not null primary key check (id = 0),"
+	                                                  "version integer not null");
+	
+	if (verretvalue == SUCCESS || verretvalue == NOTREQUIRED) {
+		bool vererror = (sql_exec_void(db, "insert or ignore into authversion values (0, 0);") != SQLITE_OK);
+		
+		for (int i = 0; i < sizeof (authversion_triggers) / sizeof (authversion_triggers[0]); i++) {
+			vererror |= (sql_exec_void(db, authversion_triggers[i]) != SQLITE_OK);
+		}
+		
+		if (vererror) {
+			mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to set up the credentials version triggers.");
+		}
+	}
+	
+	return SUCCESS;
+}
+
+/// @brief Journal modes accepted through the auth_opt_db_journal option
+static const char* journal_modes[] = {"delete", "truncate", "persist", "wal"};
+
+/// @brief Change the database journal mode
+/// 
+/// The mode is stored in the database file, so it applies to every connection (i.e. devcontrol's).
+/// 
+/// @param[in] db Database handle. It must be writable.
+/// @param[in] mode Journal mode. It must be one of journal_modes.
+/// @return SQL return code. SQLITE_OK, if the journal mode was changed; SQLITE_ERROR if
+///         SQLite kept the previous mode; another SQLite error code otherwise.
+static int set_journal_mode(sqlite3* db, const char* mode)
+{
+	sqlite3_stmt* statement;
+	char          query[64];
+	int           retval;
+	
+	snprintf(query, sizeof (query), "pragma journal_mode = %s;", mode);
+	
+	if ((retval = sqlite3_prepare_v2(db, query, -1, &statement, NULL)) != SQLITE_OK) {
+		sqlite3_finalize(statement);
+		return retval;
+	}
+	
+	if ((retval = sqlite3_step(statement)) != SQLITE_ROW) {
+		sqlite3_finalize(statement);
+		return retval;
+	}
+	
+	// the pragma reports the resulting mode, which is the old one if it could not be changed
+	const char* result = (const char*) sqlite3_column_text(statement, 0);
+	bool        same   = (result != NULL && strcmp(result, mode) == 0);
+	
+	if ((retval = sqlite3_finalize(statement)) != SQLITE_OK) {
+		return retval;
+	}
+	
+	return same ? SQLITE_OK : SQLITE_ERROR;
+}
+
+/// @brief Open the database connection used to write back the presence of the devices
+/// 
+/// @param[in,out] context Plugin context.
+/// @param[in] dbfile Database file.
+/// @param[in] busytimeout Time to wait for other connections to release their locks, in milliseconds.
+/// @return SQL return code. SQLITE_OK, if everything executed correctly; an SQLite error code otherwise.
+static int open_presence(Context* context, const char* dbfile, int busytimeout)
+{
+	int retval;
+	
+	if ((retval = sqlite3_open_v2(dbfile, &context->presencedb, SQLITE_OPEN_READWRITE, NULL)) != SQLITE_OK) {
+		return retval;
+	}
+	
+	if ((retval = sqlite3_busy_timeout(context->presencedb, busytimeout)) != SQLITE_OK) {
+		return retval;
+	}
+	
+	return sqlite3_prepare_v2(context->presencedb, "update profile set connected = ? where username = ?;", -1,
+	                          &context->presencequery, NULL);
+}
+
+/// @brief Close the database connection used to write back the presence of the devices
+/// 
+/// Harmless if it is not open.
+/// 
+/// @param[in,out] context Plugin context.
+static void close_presence(Context* context)
+{
+	sqlite3_finalize(context->presencequery);
+	sqlite3_close(context->presencedb);
+	
+	context->presencequery = NULL;
+	context->presencedb    = NULL;
+}
+
+/// @brief Write back every presence change in a single transaction
+/// 
+/// On failure, the changes are kept so the next write-back retries them.
+/// 
+/// @param[in,out] context Plugin context.
+/// @return SQL return code. SQLITE_OK, if everything executed correctly; an SQLite error code otherwise.
+static int flush_presence(Context* context)
+{
+	PresenceTable* table = &context->presence;
+	int            retval;
+	
+	if ((retval = sql_exec_void(context->presencedb, "begin immediate;")) != SQLITE_OK) {
+		return retval;
+	}
+	
+	for (size_t i = 0; i < table->capacity && retval == SQLITE_OK; i++) {
+		const PresenceEntry* entry = &table->entries[i];
+		
+		if (entry->username == NULL || !entry->dirty) {
+			continue;
+		}
+		
+		sqlite3_bind_int(context->presencequery, 1, entry->connections > 0);
+		sqlite3_bind_text(context->presencequery, 2, entry->username, -1, SQLITE_STATIC);
+		
+		retval = sqlite3_step(context->presencequery);
+		retval = (retval == SQLITE_DONE) ? SQLITE_OK : retval;
+		
+		sqlite3_reset(context->presencequery);
+		sqlite3_clear_bindings(context->presencequery);
+	}
+	
+	if (retval == SQLITE_OK) {
+		retval = sql_exec_void(context->presencedb, "commit;");
+	}
+	
+	if (retval != SQLITE_OK) {
+		sql_exec_void(context->presencedb, "rollback;");
+		return retval;
+	}
+	
+	presence_clean(table);
+	
+	return SQLITE_OK;
+}
+
+/// @brief Plugin initialization routine
+/// 
+/// Open a connection to the SQLite database.
+/// 
+/// @param[out] user_data Initialized plugin context, available on subsequent calls to the API.
+/// @param[in] auth_opts Configuration options. Used to read the database file, the superuser name,
+///                      the credential cache size and the snapshot mode (through the auth_opt_db_file,
+///                      auth_opt_superuser, auth_opt_cache_size and auth_opt_snapshot variables
+///                      in the configuration file), how to open the database (auth_opt_db_journal,
+///                      auth_opt_db_readonly, auth_opt_db_busy_timeout and auth_opt_db_mmap_size),
+///                      the negative cache size (auth_opt_negative_cache_size) and the guest login
+///                      limits (auth_opt_guest_rate, auth_opt_guest_burst, auth_opt_guest_user_rate
+///                      and auth_opt_guest_user_burst), the metrics report interval
+///                      (auth_opt_metrics_interval), the presence write-back interval
+///                      (auth_opt_presence_interval) and the audit log (auth_opt_audit,
+///                      auth_opt_audit_buffer_size, auth_opt_audit_interval and auth_opt_audit_max_rows).
+/// @param[in] auth_opt_count Number of configuration options.
+/// @return Return code. On success, zero; otherwise, a number greater than zero.
+int mosquitto_auth_plugin_init(void **user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count)
+{
+	char*       dbfile      = NULL;
+	const char* journal     = NULL;
+	bool        readonly    = false;
+	long        busytimeout = 0;
+	long        mmapsize    = -1;
+	long        cachesize   = 0;
+	long        missingsize = 0;
+	long        guestrate   = 0;
+	long        guestburst  = 0;
+	long        userrate    = 0;
+	long        userburst   = 0;
+	long        interval    = 0;
+	long        presence    = 0;
+	bool        audit       = false;
+	long        auditsize   = 1024;
+	long        auditperiod = 1000;
+	long        auditrows   = 0;
+	Context*    context     = (Context*) calloc(1, sizeof (Context));
+	*user_data              = context;
+	
+	for (int i = 0; i < auth_opt_count; i++) {
+		if (strcmp(auth_opts[i].key, "db_file") == 0) {
+			dbfile = auth_opts[i].value;
+		}
+		else if (strcmp(auth_opts[i].key, "superuser") == 0) {
+			int sulen          = strlen(auth_opts[i].value);
+			context->superuser = (char*) malloc((sulen + 1) * sizeof (char));
+			strncpy(context->superuser, auth_opts[i].value, sulen);
+			context->superuser[sulen] = 0;
+		}
+		else if (strcmp(auth_opts[i].key, "guest_secret") == 0) {
+			int passlen          = strlen(auth_opts[i].value);
+			context->guestsecret = (char*) malloc((passlen + 1) * sizeof (char));
+			strncpy(context->guestsecret, auth_opts[i].value, passlen);
+			context->guestsecret[passlen] = 0;
+		}
+		else if (strcmp(auth_opts[i].key, "db_journal") == 0) {
+			journal = NULL;
+			
+			for (int k = 0; k < sizeof (journal_modes) / sizeof (journal_modes[0]); k++) {
+				if (strcmp(auth_opts[i].value, journal_modes[k]) == 0) {
+					journal = journal_modes[k];
+				}
+			}
+			
+			if (journal == NULL) {
+				mosquitto_log_printf(MOSQ_LOG_ERR, "Invalid auth_opt_db_journal; it must be one of "
+				                                   "delete, truncate, persist or wal.");
+				
+				free_context(context);
+				return INVALID_OPTION;
+			}
+		}
+		else if (strcmp(auth_opts[i].key, "db_readonly") == 0) {
+			if (!parse_bool(auth_opts[i].value, &readonly)) {
+				mosquitto_log_printf(MOSQ_LOG_ERR, "Invalid auth_opt_db_readonly; it must be either true or false.");
+				
+				free_context(context);
+				return INVALID_OPTION;
+			}
+		}
+		else if (strcmp(auth_opts[i].key, "db_busy_timeout") == 0) {
+			if (!parse_nonnegative(auth_opts[i].value, &busytimeout) || busytimeout > INT_MAX) {
+				mosquitto_log_printf(MOSQ_LOG_ERR, "Invalid auth_opt_db_busy_timeout; it must be a non-negative "
+				                                   "integer (milliseconds).");
+				
+				free_context(context);
+				return INVALID_OPTION;
+			}
+		}
+		else if (strcmp(auth_opts[i].key, "db_mmap_size") == 0) {
+			if (!parse_nonnegative(auth_opts[i].value, &mmapsize)) {
+				mosquitto_log_printf(MOSQ_LOG_ERR, "Invalid auth_opt_db_mmap_size; it must be a non-negative "
+				                                   "integer (bytes).");
+				
+				free_context(context);
+				return INVALID_OPTION;
+			}
+		}
+		else if (strcmp(auth_opts[i].key, "cache_size") == 0) {
+			if (!parse_nonnegative(auth_opts[i].value, &cachesize)) {
+				mosquitto_log_printf(MOSQ_LOG_ERR, "Invalid auth_opt_cache_size; it must be a non-negative integer.");
+				
+				free_context(context);
+				return INVALID_OPTION;
+			}
+		}
+		else if (strcmp(auth_opts[i].key, "negative_cache_size") == 0) {
+			if (!parse_nonnegative(auth_opts[i].value, &missingsize)) {
+				mosquitto_log_printf(MOSQ_LOG_ERR, "Invalid auth_opt_negative_cache_size; it must be a non-negative integer.");
+				
+				free_context(context);
+				return INVALID_OPTION;
+			}
+		}
+		else if (strcmp(auth_opts[i].key, "guest_rate") == 0) {
+			if (!parse_nonnegative(auth_opts[i].value, &guestrate)) {
+				mosquitto_log_printf(MOSQ_LOG_ERR, "Invalid auth_opt_guest_rate; it must be a non-negative integer (logins per minute).");
+				
+				free_context(context);
+				return INVALID_OPTION;
+			}
+		}
+		else if (strcmp(auth_opts[i].key, "guest_burst") == 0) {
+			if (!parse_nonnegative(auth_opts[i].value, &guestburst)) {
+				mosquitto_log_printf(MOSQ_LOG_ERR, "Invalid auth_opt_guest_burst; it must be a non-negative integer.");
+				
+				free_context(context);
+				return INVALID_OPTION;
+			}
+		}
+		else if (strcmp(auth_opts[i].key, "guest_user_rate") == 0) {
+			if (!parse_nonnegative(auth_opts[i].value, &userrate)) {
+				mosquitto_log_printf(MOSQ_LOG_ERR, "Invalid auth_opt_guest_user_rate; it must be a non-negative integer (logins per minute).");
+				
+				free_context(context);
+				return INVALID_OPTION;
+			}
+		}
+		else if (strcmp(auth_opts[i].key, "guest_user_burst") == 0) {
+			if (!parse_nonnegative(auth_opts[i].value, &userburst)) {
+				mosquitto_log_printf(MOSQ_LOG_ERR, "Invalid auth_opt_guest_user_burst; it must be a non-negative integer.");
+				
+				free_context(context);
+				return INVALID_OPTION;
+			}
+		}
+		else if (strcmp(auth_opts[i].key, "metrics_interval") == 0) {
+			if (!parse_nonnegative(auth_opts[i].value, &interval)) {
+				mosquitto_log_printf(MOSQ_LOG_ERR, "Invalid auth_opt_metrics_interval; it must be a non-negative "
+				                                   "integer (seconds).");
+				
+				free_context(context);
+				return INVALID_OPTION;
+			}
+		}
+		else if (strcmp(auth_opts[i].key, "presence_interval") == 0) {
+			if (!parse_nonnegative(auth_opts[i].value, &presence)) {
+				mosquitto_log_printf(MOSQ_LOG_ERR, "Invalid auth_opt_presence_interval; it must be a non-negative "
+				                                   "integer (milliseconds).");
+				
+				free_context(context);
+				return INVALID_OPTION;
+			}
+		}
+		else if (strcmp(auth_opts[i].key, "audit") == 0) {
+			if (!parse_bool(auth_opts[i].value, &audit)) {
+				mosquitto_log_printf(MOSQ_LOG_ERR, "Invalid auth_opt_audit; it must be either true or false.");
+				
+				free_context(context);
+				return INVALID_OPTION;
+			}
+		}
+		else if (strcmp(auth_opts[i].key, "audit_buffer_size") == 0) {
+			if (!parse_nonnegative(auth_opts[i].value, &auditsize) || auditsize == 0) {
+				mosquitto_log_printf(MOSQ_LOG_ERR, "Invalid auth_opt_audit_buffer_size; it must be a positive integer.");
+				
+				free_context(context);
+				return INVALID_OPTION;
+			}
+		}
+		else if (strcmp(auth_opts[i].key, "audit_interval") == 0) {
+			if (!parse_nonnegative(auth_opts[i].value, &auditperiod) || auditperiod == 0) {
+				mosquitto_log_printf(MOSQ_LOG_ERR, "Invalid auth_opt_audit_interval; it must be a positive "
+				                                   "integer (milliseconds).");
+				
+				free_context(context);
+				return INVALID_OPTION;
+			}
+		}
+		else if (strcmp(auth_opts[i].key, "audit_max_rows") == 0) {
+			if (!parse_nonnegative(auth_opts[i].value, &auditrows)) {
+				mosquitto_log_printf(MOSQ_LOG_ERR, "Invalid auth_opt_audit_max_rows; it must be a non-negative integer.");
+				
+				free_context(context);
+				return INVALID_OPTION;
+			}
+		}
+		else if (strcmp(auth_opts[i].key, "snapshot") == 0) {
+			if (!parse_bool(auth_opts[i].value, &context->usesnapshot)) {
+				mosquitto_log_printf(MOSQ_LOG_ERR, "Invalid auth_opt_snapshot; it must be either true or false.");
+				
+				free_context(context);
+				return INVALID_OPTION;
+			}
+		}
+	}
+	
+	if (context->usesnapshot && (cachesize > 0 || missingsize > 0)) {
+		mosquitto_log_printf(MOSQ_LOG_NOTICE, "The credentials snapshot is enabled; ignoring auth_opt_cache_size "
+		                                      "and auth_opt_negative_cache_size.");
+		cachesize   = 0;
+		missingsize = 0;
+	}
+	
+	if (!credcache_init(&context->cache, cachesize) || !credcache_init(&context->missing, missingsize)) {
+		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate the credential cache.");
+		
+		free_context(context);
+		return NO_MEMORY;
+	}
+	
+	context->metricsinterval    = (uint64_t) interval * 1000000000u;
+	context->metrics.lastreport = metrics_now();
+	context->presenceinterval   = (uint64_t) presence * 1000000u;
+	context->lastpresence       = context->metrics.lastreport;
+	
+	if (!throttle_init(&context->throttle, guestrate, guestburst, userrate, userburst)) {
+		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate the guest login throttle.");
+		
+		free_context(context);
+		return NO_MEMORY;
+	}
+	
+	if (sqlite3_initialize() != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to initialize SQLite3.");
+		
+		free_context(context);
+		return FAILED_SQLITE;
+	}
+	
+	if (dbfile == NULL) {
+		mosquitto_log_printf(MOSQ_LOG_ERR, "No SQLite database specified. Check your "
+		                                   "Mosquitto configuration file; it should "
+		                                   "include an appropriate auth_opt_db_file variable.");
+		
+		free_context(context);
+		return NO_DB_FILE_SPECIFIED;
+	}
+	
+	int openflags = readonly ? SQLITE_OPEN_READONLY : (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+	
+	if (sqlite3_open_v2(dbfile, &context->db, openflags, NULL) != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to open SQLite database.");
+		
+		sqlite3_close(context->db);
+		free_context(context);
+		return DB_FILE_CANTOPEN;
+	}
+	
+	// wait for devcontrol to release its locks instead of failing right away;
+	// in WAL mode readers are never blocked by a writer, but recovery and checkpoints may briefly lock
+	if (sqlite3_busy_timeout(context->db, (int) busytimeout) != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to set the database busy timeout.");
+		
+		sqlite3_close(context->db);
+		free_context(context);
+		return DB_ERROR;
+	}
+	
+	if (journal != NULL) {
+		if (readonly) {
+			mosquitto_log_printf(MOSQ_LOG_WARNING, "The database is opened read-only; ignoring auth_opt_db_journal.");
+		}
+		else if (set_journal_mode(context->db, journal) != SQLITE_OK) {
+			mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to change the database journal mode.");
+		}
+	}
+	
+	if (mmapsize >= 0) {
+		char query[64];
+		
+		snprintf(query, sizeof (query), "pragma mmap_size = %ld;", mmapsize);
+		
+		if (sql_exec_void(context->db, query) != SQLITE_OK) {
+			mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to set the database memory map size.");
+		}
+	}
+	
+	if (sql_exec_void(context->db, "pragma foreign_keys = on;") != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to enable foreign keys.");
+		
+		sqlite3_close(context->db);
+		free_context(context);
+		return DB_ERROR;
+	}
+	
+	if (!readonly && create_schema(context->db) != SUCCESS) {
+		sqlite3_close(context->db);
+		free_context(context);
+		return DB_ERROR;
+	}
+	
+	if (sqlite3_prepare_v2(context->db, "select hash, salt from auth where username=?;", -1, &context->passquery, NULL) != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_ERR, readonly ? "Failed to compile password prepared statement; a read-only "
+		                                              "database must already contain the schema."
+		                                            : "Failed to compile password prepared statement.");
+		
+		finalize_statements(context);
+		sqlite3_close(context->db);
+		free_context(context);
+		return DB_ERROR;
+	}
+	
+	if (sqlite3_prepare_v2(context->db, "select psk.key from psk join auth using (username) "
+	                                    "where psk.username=? and auth.hash <> '';", -1, &context->pskquery, NULL) != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_NOTICE, "No pre-shared key table in the database; TLS-PSK logins will be refused.");
+		
+		sqlite3_finalize(context->pskquery);
+		context->pskquery = NULL;
+	}
+	
+	if (sqlite3_prepare_v2(context->db, "pragma data_version;", -1, &context->dataversionquery, NULL) != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to compile database version prepared statement.");
+		
+		finalize_statements(context);
+		sqlite3_close(context->db);
+		free_context(context);
+		return DB_ERROR;
+	}
+	
+	if (sqlite3_prepare_v2(context->db, "select version from authversion where id = 0;", -1, &context->authversionquery, NULL) != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "Credentials version counter not available; any database "
+		                                       "change will clear the credential cache.");
+		
+		sqlite3_finalize(context->authversionquery);
+		context->authversionquery = NULL;
+	}
+	
+	bool changed;
+	
+	context->dataversion = -1;
+	context->authversion = -1;
+	
+	if (credentials_changed(context, &changed) != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to read the database version.");
+		
+		finalize_statements(context);
+		sqlite3_close(context->db);
+		free_context(context);
+		return DB_ERROR;
+	}
+	
+	if (reload_groups(context) != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_NOTICE, "No device group table in the database; group topics are disabled.");
+	}
+	
+	if (context->usesnapshot && reload_snapshot(context) != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to load the credentials snapshot.");
+		
+		finalize_statements(context);
+		sqlite3_close(context->db);
+		free_context(context);
+		return DB_ERROR;
+	}
+	
+	// always read-write, even if the main connection is read-only
+	if (presence > 0 && open_presence(context, dbfile, (int) busytimeout) != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to open the presence database connection.");
+		
+		close_presence(context);
+		finalize_statements(context);
+		sqlite3_close(context->db);
+		free_context(context);
+		return DB_ERROR;
+	}
+	
+	if (audit && audit_open(dbfile, (int) busytimeout, (size_t) auditsize, auditperiod, auditrows, &context->audit) != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to start the audit log; the database must have an authlog table.");
+		
+		close_presence(context);
+		finalize_statements(context);
+		sqlite3_close(context->db);
+		free_context(context);
+		return DB_ERROR;
+	}
+	
+	mosquitto_log_printf(MOSQ_LOG_INFO, "SHA-256 implementation: %s.", sha256_implementation());
+	mosquitto_log_printf(MOSQ_LOG_INFO, "AutoHome authorization plugin initialized successfully");
+	
+	return SUCCESS;
+}
+
+/// @brief Plugin shut down routine
+/// 
+/// Close the connection to the SQLite database. If the presence of the devices is being
+/// written back, mark every device as disconnected first. The pending audit records are written
+/// before the audit log is closed.
+/// 
+/// @param[in] user_data Plugin context.
+/// @param[in] auth_opts Configuration options.
+/// @param[in] auth_opt_count Number of configuration options.
+/// @return Return code. On success, zero; otherwise, a number greater than zero.
+int mosquitto_auth_plugin_cleanup(void *user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count)
+{
+	Context* context = (Context*) user_data;
+	
+	audit_close(context->audit);
+	context->audit = NULL;
+	
+	if (context->presencedb != NULL) {
+		if (sql_exec_void(context->presencedb, "update profile set connected = 0;") != SQLITE_OK) {
+			mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to mark the devices as disconnected.");
+		}
+		
+		close_presence(context);
+	}
+	
+	if (finalize_statements(context) != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to finalize prepared statements.");
+		
+		sqlite3_close(context->db);
+		free_context(context);
+		return DB_FILE_CANTCLOSE;
+	}
+	
+	if (sqlite3_close(context->db) != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to close SQLite database.");
+		
+		free_context(context);
+		return DB_FILE_CANTCLOSE;
+	}
+	
+	if (sqlite3_shutdown() != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to shutdown SQLite3.");
+		
+		free_context(context);
+		return FAILED_SQLITE;
+	}
+	
+	free_context(context);
+	
+	mosquitto_log_printf(MOSQ_LOG_INFO, "AutoHome authorization plugin shut down successfully");
+	
+	return SUCCESS;
+}
+
+/// @brief Security initialization routine
+/// 
+/// Additional initialization steps run after the plugin initialization.
+/// Unlike the plugin initialization, this functions will be called again
+/// every time the broker reloads its configuration while running.
+/// On reload, build a fresh credentials snapshot (if enabled) and device group index; the current
+/// ones remain in use until the new ones are ready, and are kept if the reload fails.
+/// On startup, mark every device as disconnected if their presence is written back (no client
+/// has connected yet), or give up on the write-back if the legacy API is in use.
+/// 
+/// @param[in] user_data Plugin context.
+/// @param[in] auth_opts Configuration options.
+/// @param[in] auth_opt_count Number of configuration options.
+/// @param[in] reload When the broker is asked to reload its configuration, it will run this
+///                   routine again, with this flag as true; otherwise (on startup) it will be false.
+/// @return Return code. On success, zero; otherwise, a number greater than zero.
+int mosquitto_auth_security_init(void *user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count, bool reload)
+{
+	Context* context = (Context*) user_data;
+	
+	if (!reload && context->presencedb != NULL) {
+		if (context->identifier == NULL) {
+			mosquitto_log_printf(MOSQ_LOG_WARNING, "Presence tracking requires the event-based plugin API; "
+			                                       "ignoring auth_opt_presence_interval.");
+			close_presence(context);
+		}
+		else if (sql_exec_void(context->presencedb, "update profile set connected = 0;") != SQLITE_OK) {
+			mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to mark the devices as disconnected.");
+		}
+	}
+	
+	if (reload && context->groups != NULL && reload_groups(context) != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to reload the device groups, keeping the previous ones.");
+	}
+	
+	if (reload && context->usesnapshot) {
+		if (reload_snapshot(context) != SQLITE_OK) {
+			mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to reload the credentials snapshot, keeping the previous one.");
+		}
+		else {
+			mosquitto_log_printf(MOSQ_LOG_INFO, "Credentials snapshot reloaded (%lu users).",
+			                     (unsigned long) context->snapshot->count);
+		}
+	}
+	
+	return SUCCESS;
+}
+
+/// @brief Security shut down routine
+/// 
+/// Additional shut down steps run before the plugin shut down.
+/// Unlike the plugin shut down, this functions will be called again
+/// every time the broker reloads its configuration while running.
+/// Does nothing.
+/// 
+/// @param[in] user_data Plugin context.
+/// @param[in] auth_opts Configuration options.
+/// @param[in] auth_opt_count Number of configuration options.
+/// @param[in] reload When the broker is asked to reload its configuration, it will run this
+///                   routine again, with this flag as true; otherwise (on startup) it will be false.
+/// @return Return code. On success, zero; otherwise, a number greater than zero.
+int mosquitto_auth_security_cleanup(void *user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count, bool reload)
+{
+	return SUCCESS;
+}
+
+/// @brief Report the metrics through the broker log and, if possible, the metrics topic
+/// 
+/// @param[in] context Plugin context.
+static void report_metrics(Context* context)
+{
+	char report[1024];
+	int  length = metrics_format(&context->metrics, report, sizeof (report));
+	
+	if (length >= (int) sizeof (report)) {
+		length = sizeof (report) - 1;
+	}
+	
+	mosquitto_log_printf(MOSQ_LOG_INFO, "Auth metrics: %s", report);
+	
+	// only brokers with the event-based API let plugins publish; the message is queued,
+	// so this is safe from inside a callback. Retained, so it reaches the subscriber who asked
+	if (context->identifier != NULL && mosquitto_broker_publish_copy != NULL) {
+		mosquitto_broker_publish_copy(NULL, METRICS_TOPIC, length, report, 0, true, NULL);
+	}
+}
+
+/// @brief Report the metrics if the report interval has elapsed
+/// 
+/// Checked on every call to the plugin, so there are no reports while the broker is idle.
+/// 
+/// @param[in] context Plugin context.
+/// @param[in] now Current time, as returned by metrics_now().
+static void schedule_metrics(Context* context, uint64_t now)
+{
+	if (context->metricsinterval > 0 && now - context->metrics.lastreport >= context->metricsinterval) {
+		context->metrics.lastreport = now;
+		report_metrics(context);
+	}
+}
+
+/// @brief Write back the presence changes if the write-back interval has elapsed
+/// 
+/// Checked on every tick and connection event, so transitions close in time are batched together.
+/// 
+/// @param[in] context Plugin context.
+/// @param[in] now Current time, as returned by metrics_now().
+static void schedule_presence(Context* context, uint64_t now)
+{
+	if (context->presencedb == NULL || context->presence.dirty == 0 ||
+	    now - context->lastpresence < context->presenceinterval) {
+		return;
+	}
+	
+	context->lastpresence = now;
+	
+	if (flush_presence(context) != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to write back the device presence; retrying later.");
+	}
 }
 
-/// @brief Security shut down routine
+/// @brief Account for an access control check in the metrics
 /// 
-/// Additional shut down steps run before the plugin shut down.
-/// Unlike the plugin shut down, this functions will be called again
-/// every time the broker reloads its configuration while running.
-/// Does nothing.
+/// @param[in] context Plugin context.
+/// @param[in] result Check result.
+/// @param[in] start Time when the check started, as returned by metrics_now().
+static void record_acl(Context* context, int result, uint64_t start)
+{
+	uint64_t now = histogram_record(&context->metrics.acllatency, start);
+	
+	context->metrics.aclcalls   += 1;
+	context->metrics.aclallowed += (result == MOSQ_ERR_SUCCESS);
+	context->metrics.acldenied  += (result != MOSQ_ERR_SUCCESS);
+	
+	schedule_metrics(context, now);
+}
+
+/// @brief Add a denied access control check to the audit log, if enabled
 /// 
-/// @param[in] user_data Plugin context.
-/// @param[in] auth_opts Configuration options.
-/// @param[in] auth_opt_count Number of configuration options.
-/// @param[in] reload When the broker is asked to reload its configuration, it will run this
-///                   routine again, with this flag as true; otherwise (on startup) it will be false.
-/// @return Return code. On success, zero; otherwise, a number greater than zero.
-int mosquitto_auth_security_cleanup(void *user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count, bool reload)
+/// The reason is reconstructed from the request, which is cheaper than tracking it
+/// through every check for the (rare) denials.
+/// 
+/// @param[in] context Plugin context.
+/// @param[in] result Check result.
+/// @param[in] clientid Client's identifier. May be NULL.
+/// @param[in] username Client's username. May be NULL.
+/// @param[in] topic Requested topic.
+/// @param[in] access Requested access.
+static void audit_acl(Context* context, int result, const char* clientid, const char* username,
+                      const char* topic, int access)
 {
-	return SUCCESS;
+	if (context->audit == NULL || result == MOSQ_ERR_SUCCESS) {
+		return;
+	}
+	
+	const char* reason;
+	
+	if (result != MOSQ_ERR_ACL_DENIED) {
+		reason = "internal error";
+	}
+	else if (clientid == NULL || username == NULL) {
+		reason = "bad username";
+	}
+	else if (strcmp(clientid, username) != 0) {
+		reason = "client identifier mismatch";
+	}
+	else if (strncmp(topic, GROUP_TOPIC_PREFIX, sizeof (GROUP_TOPIC_PREFIX) - 1) == 0) {
+		reason = "group topic";
+	}
+	else {
+		reason = "foreign topic";
+	}
+	
+	audit_record(context->audit, "acl", (result == MOSQ_ERR_ACL_DENIED) ? "denied" : "error", reason,
+	             username, clientid, topic, access);
 }
 
-/// @brief Access control list check
+/// @brief Access control list check for the group topics
 /// 
-/// Check whether a user has permission to read or write to a topic.
-/// In this plugin, every user have read and write access to __username/\#__.
+/// Devices may only read the control topic of the groups they are members of, and
+/// subscribe to GROUP_TOPIC_FILTER to receive them all; they can never write to a group topic.
 /// 
-/// @param[in] user_data Plugin context.
-/// @param[in] clientid Client's unique identification string, used to route messages.
-///                     It must be the same as the username, to simplify authorization.
-/// @param[in] username Client's username, used to authenticate them and select
-///                     the topics it may be authorized to interact in.
-/// @param[in] topic Topic the user is trying to access.
-/// @param[in] access Type of acces the user is requesting: MOSQ_ACL_READ for reading,
-///                   MOSQ_ACL_WRITE for writing.
-/// @return Return code. MOSQ_ERR_SUCCESS on success, MOSQ_ERR_ACL_DENIED if access was
-///         not granted and MOSQ_ERR_ACL_UNKNOWN if an application-specific error occurred.
-int mosquitto_auth_acl_check(void *user_data, const char *clientid, const char *username, const char *topic, int access)
+/// @param[in] context Plugin context.
+/// @param[in] username Device username. It need not be null-terminated.
+/// @param[in] namelen Length of the username.
+/// @param[in] topic Requested topic. It must start with GROUP_TOPIC_PREFIX.
+/// @param[in] access Requested access.
+/// @return Return code. MOSQ_ERR_SUCCESS if access was granted, MOSQ_ERR_ACL_DENIED otherwise.
+static int check_group_acl(Context* context, const char* username, size_t namelen, const char* topic, int access)
 {
-	Context* context = (Context*) user_data;
+	if (access == MOSQ_ACL_WRITE) {
+		return MOSQ_ERR_ACL_DENIED;
+	}
+	
+	if ((access == MOSQ_ACL_SUBSCRIBE || access == MOSQ_ACL_UNSUBSCRIBE) && strcmp(topic, GROUP_TOPIC_FILTER) == 0) {
+		return MOSQ_ERR_SUCCESS;
+	}
+	
+	const char* group     = &topic[sizeof (GROUP_TOPIC_PREFIX) - 1];
+	const char* separator = strchr(group, '/');
+	
+	if (separator == NULL || separator == group || strcmp(separator, GROUP_TOPIC_SUFFIX) != 0 || context->groups == NULL) {
+		return MOSQ_ERR_ACL_DENIED;
+	}
 	
+	bool current;
+	
+	if (refresh_indices(context, &current) != SQLITE_OK) {  // stale groups are still better than none
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "Internal SQLite error, checking the device groups as last loaded.");
+	}
+	
+	return groups_member(context->groups, username, namelen, group, separator - group) ? MOSQ_ERR_SUCCESS
+	                                                                                    : MOSQ_ERR_ACL_DENIED;
+}
+
+/// @brief Access control list check, without metrics accounting
+/// 
+/// Same semantics as mosquitto_auth_acl_check().
+static int check_acl(Context* context, const char* clientid, const char* username, const char* topic, int access)
+{
 	if (clientid == NULL || username == NULL) {
 		mosquitto_log_printf(MOSQ_LOG_NOTICE, "Bad username");
 		return MOSQ_ERR_ACL_DENIED;
@@ -513,7 +1767,12 @@ int mosquitto_auth_acl_check(void *user_data, const char *clientid, const char *
 		return MOSQ_ERR_ACL_DENIED;
 	}
 	
-	size_t namelen  = strlen(username);
+	size_t namelen = strlen(username);
+	
+	if (strncmp(topic, GROUP_TOPIC_PREFIX, sizeof (GROUP_TOPIC_PREFIX) - 1) == 0) {
+		return check_group_acl(context, username, namelen, topic, access);
+	}
+	
 	size_t topiclen = strlen(topic);
 	
 	if (topiclen < namelen + 2) {  // at least 'username/x' long
@@ -535,12 +1794,128 @@ int mosquitto_auth_acl_check(void *user_data, const char *clientid, const char *
 	return MOSQ_ERR_SUCCESS;
 }
 
+/// @brief Access control list check
+/// 
+/// Check whether a user has permission to read or write to a topic.
+/// In this plugin, every user have read and write access to __username/\#__,
+/// and read access to __group/name/control__ for every group it is a member of.
+/// 
+/// @param[in] user_data Plugin context.
+/// @param[in] clientid Client's unique identification string, used to route messages.
+///                     It must be the same as the username, to simplify authorization.
+/// @param[in] username Client's username, used to authenticate them and select
+///                     the topics it may be authorized to interact in.
+/// @param[in] topic Topic the user is trying to access.
+/// @param[in] access Type of acces the user is requesting: MOSQ_ACL_READ for reading,
+///                   MOSQ_ACL_WRITE for writing.
+/// @return Return code. MOSQ_ERR_SUCCESS on success, MOSQ_ERR_ACL_DENIED if access was
+///         not granted and MOSQ_ERR_ACL_UNKNOWN if an application-specific error occurred.
+int mosquitto_auth_acl_check(void *user_data, const char *clientid, const char *username, const char *topic, int access)
+{
+	Context* context = (Context*) user_data;
+	uint64_t start   = metrics_now();
+	int      retval  = check_acl(context, clientid, username, topic, access);
+	
+	record_acl(context, retval, start);
+	audit_acl(context, retval, clientid, username, topic, access);
+	
+	return retval;
+}
+
+/// @brief Username-password check, without metrics accounting
+/// 
+/// Same semantics as mosquitto_auth_unpwd_check().
+/// 
+/// @param[out] registered True if the username is in the database; false for guests.
+/// @param[out] reason Reason for the result, for the audit log; a static string.
+static int check_unpwd(Context* context, const char* username, const char* password, bool* registered,
+                       const char** reason)
+{
+	Credentials credentials;
+	bool        found;
+	
+	*registered = false;
+	
+	if (username == NULL) {
+		*reason = "no username";
+		return MOSQ_ERR_AUTH;
+	}
+	
+	if (lookup_credentials(context, username, &credentials, &found)) {
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "Internal SQLite error, authentication cancelled.");
+		
+		*reason = "internal error";
+		return MOSQ_ERR_UNKNOWN;
+	}
+	
+	if (!found) {  // unrecognized user
+		if (throttle_enabled(&context->throttle)) {
+			bool waslimited = context->throttle.limited;
+			
+			if (!throttle_allow(&context->throttle, username)) {
+				if (!waslimited) {  // log once per burst of rejections
+					mosquitto_log_printf(MOSQ_LOG_NOTICE, "Guest login rate exceeded; rejecting guests.");
+				}
+				
+				context->metrics.throttled += 1;
+				
+				*reason = "guest rate exceeded";
+				return MOSQ_ERR_AUTH;
+			}
+		}
+		
+		bool match = ((context->guestsecret == NULL && password == NULL) ||
+		              (context->guestsecret != NULL && password != NULL && strcmp(context->guestsecret, password) == 0));
+		
+		*reason = match ? "guest" : "wrong guest secret";
+		return match ? MOSQ_ERR_SUCCESS : MOSQ_ERR_AUTH;
+	}
+	
+	*registered = true;
+	
+	bool match = credentials_match(&credentials, password);
+	
+	*reason = match ? "registered" : "wrong password";
+	return match ? MOSQ_ERR_SUCCESS : MOSQ_ERR_AUTH;
+}
+
+/// @brief Username-password check, with metrics accounting
+/// 
+/// Same semantics as mosquitto_auth_unpwd_check().
+/// 
+/// @param[in] clientid Client's identifier, for the audit log. May be NULL.
+/// @param[out] registered True if the username is in the database; false for guests.
+static int authenticate(Context* context, const char* clientid, const char* username, const char* password,
+                        bool* registered)
+{
+	const char* reason;
+	uint64_t    start  = metrics_now();
+	int         retval = check_unpwd(context, username, password, registered, &reason);
+	uint64_t    now    = histogram_record(&context->metrics.authlatency, start);
+	
+	if (context->audit != NULL) {
+		audit_record(context->audit, "auth", (retval == MOSQ_ERR_SUCCESS) ? "allowed" :
+		                                     (retval == MOSQ_ERR_AUTH)    ? "denied"  : "error",
+		             reason, username, clientid, NULL, 0);
+	}
+	
+	context->metrics.authcalls   += 1;
+	context->metrics.authallowed += (retval == MOSQ_ERR_SUCCESS);
+	context->metrics.authdenied  += (retval == MOSQ_ERR_AUTH);
+	context->metrics.autherrors  += (retval == MOSQ_ERR_UNKNOWN);
+	
+	schedule_metrics(context, now);
+	
+	return retval;
+}
+
 /// @brief Username-password check
 /// 
 /// Check whether the provided password is correct for the given username.
 /// If the username exists on the database, the password must match the stored one
 /// (for security, only a hash of the password is stored).
-/// If the username does not exist, the password must be empty.
+/// If the username does not exist, the password must be the guest secret (or empty if there is none),
+/// and the login must be within the guest rate limits.
 /// 
 /// @param[in] user_data Plugin context.
 /// @param[in] username Client's username, public and permanent identification.
@@ -549,63 +1924,342 @@ int mosquitto_auth_acl_check(void *user_data, const char *clientid, const char *
 ///         failed and MOSQ_ERR_UNKNOWN if an application-specific error ocurred.
 int mosquitto_auth_unpwd_check(void *user_data, const char *username, const char *password)
 {
-	Context* context = (Context*) user_data;
+	bool registered;
 	
-	char clienthash[65];
-	
-	char hash[65];
-	char salt[65];
+	return authenticate((Context*) user_data, NULL, username, password, &registered);
+}
+
+/// @brief PSK key retrieval routine
+/// 
+/// Retrieve the PSK secret key associated with the given client, stored by devcontrol
+/// in the psk table when the device was paired. Only called for listeners with a psk_hint,
+/// regardless of its value; those listeners should set use_identity_as_username, so the
+/// identity is then subject to the same access control as a username.
+/// Guests have no key, so they must connect through a certificate-based listener.
+/// 
+/// @param[in] user_data Plugin context.
+/// @param[in] hint Associated PSK hint.
+/// @param[in] identity Client's identity claim.
+/// @param[out] key Retrieved PSK key, in base16.
+/// @param[in] max_key_len Maximum size of the key.
+/// @return Return code. MOSQ_ERR_SUCCESS on success, MOSQ_ERR_AUTH if the identity has no key
+///         and MOSQ_ERR_UNKNOWN if an application-specific error ocurred.
+int mosquitto_auth_psk_key_get(void *user_data, const char *hint, const char *identity, char *key, int max_key_len)
+{
+	Context* context = (Context*) user_data;
+	bool     found;
 	
-	if (username == NULL) {
+	if (identity == NULL || key == NULL) {
 		return MOSQ_ERR_AUTH;
 	}
 	
-	if (retrieve_password(context->passquery, username, hash, 65, salt, 65)) {
-		mosquitto_log_printf(MOSQ_LOG_WARNING, "Internal SQLite error, authentication cancelled.");
+	if (lookup_psk(context, identity, key, max_key_len, &found) != SQLITE_OK) {
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "Internal SQLite error, pre-shared key retrieval cancelled.");
 		return MOSQ_ERR_UNKNOWN;
 	}
 	
-	if (strlen(hash) == 0) {  // unrecognized user
-		return ((context->guestsecret == NULL && password == NULL) ||
-		        (context->guestsecret != NULL && password != NULL && strcmp(context->guestsecret, password) == 0)) ?
-		            MOSQ_ERR_SUCCESS : MOSQ_ERR_AUTH;
+	return found ? MOSQ_ERR_SUCCESS : MOSQ_ERR_AUTH;
+}
+
+/// @brief Username-password check event (plugin API version 5)
+/// 
+/// Same check as mosquitto_auth_unpwd_check(). On success, the client's access control
+/// decisions that do not depend on the topic are computed and stored for its later checks,
+/// and a registered device logging in with its own ClientID is accounted as connected.
+/// 
+/// @param[in] event Event identifier, MOSQ_EVT_BASIC_AUTH.
+/// @param[in] event_data Event description, a struct mosquitto_evt_basic_auth.
+/// @param[in] user_data Plugin context.
+/// @return Return code. MOSQ_ERR_SUCCESS on success, MOSQ_ERR_AUTH if the authentication
+///         failed and MOSQ_ERR_UNKNOWN if an application-specific error ocurred.
+static int on_basic_auth(int event, void *event_data, void *user_data)
+{
+	Context*                         context = (Context*) user_data;
+	struct mosquitto_evt_basic_auth* data    = (struct mosquitto_evt_basic_auth*) event_data;
+	bool                             registered;
+	int                              retval;
+	
+	const char* clientid = mosquitto_client_id(data->client);
+	
+	if ((retval = authenticate(context, clientid, data->username, data->password, &registered)) != MOSQ_ERR_SUCCESS) {
+		return retval;
+	}
+	
+	bool superuser  = (context->superuser != NULL && strcmp(context->superuser, data->username) == 0);
+	bool authorized = (clientid != NULL && strcmp(clientid, data->username) == 0);
+	
+	if (!superuser && !authorized) {
+		mosquitto_log_printf(MOSQ_LOG_NOTICE, "Unauthorized access: ClientID != Username.");
 	}
 	
-	sha256_ctx hashctx;
+	const ClientInfo* previous = clients_find(&context->clients, data->client);
+	bool              present  = (context->presencedb != NULL && registered && authorized && !superuser);
 	
-	sha256_init(&hashctx);
-	sha256_update(&hashctx, (unsigned char*) salt, strlen(salt));
-	sha256_update(&hashctx, (unsigned char*) password, strlen(password));
-	sha256_final(&hashctx,  (unsigned char*) clienthash);
+	if (previous != NULL && previous->present) {  // authenticating again, the old connection is replaced
+		presence_disconnect(&context->presence, clients_prefix(previous), previous->prefixlen - 1);
+	}
 	
-	char digit[17] = "0123456789abcdef";
+	if (present && !presence_connect(&context->presence, data->username, strlen(data->username))) {
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to store the device presence.");
+		present = false;
+	}
 	
-	// encode as a human-readable base16 string
-	for (int i = 31, k = 63; i >= 0; i--, k -= 2) {
-		char byte = clienthash[i];
+	if (!clients_insert(&context->clients, data->client, data->username, superuser, authorized, present)) {
+		// not fatal, the access control check falls back to the stateless version
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to store the client authorization state.");
 		
-		clienthash[k]     = digit[byte        & 0x0f];
-		clienthash[k - 1] = digit[(byte >> 4) & 0x0f];
+		if (present) {  // without the state, the disconnection would go unnoticed
+			presence_disconnect(&context->presence, data->username, strlen(data->username));
+		}
+		
+		clients_remove(&context->clients, data->client);  // drop the stale state of the old connection
 	}
 	
-	clienthash[64] = 0;
+	schedule_presence(context, metrics_now());
 	
-	return (strcmp(clienthash, hash) == 0) ? MOSQ_ERR_SUCCESS : MOSQ_ERR_AUTH;
+	return MOSQ_ERR_SUCCESS;
 }
 
-/// @brief PSK key retrieval routine
+/// @brief Access control list check event (plugin API version 5)
 /// 
-/// Retrieve the PSK secret key associated with the given client.
-/// Not implemented.
+/// Same semantics as mosquitto_auth_acl_check(), using the state stored on authentication:
+/// for a regular user the check reduces to a single comparison against its topic prefix
+/// (or a group membership lookup, for the group topics).
+/// A superuser subscription to METRICS_TOPIC also publishes a fresh metrics report.
 /// 
+/// @param[in] event Event identifier, MOSQ_EVT_ACL_CHECK.
+/// @param[in] event_data Event description, a struct mosquitto_evt_acl_check.
+/// @param[in] user_data Plugin context.
+/// @return Return code. MOSQ_ERR_SUCCESS on success, MOSQ_ERR_ACL_DENIED if access was
+///         not granted and MOSQ_ERR_ACL_UNKNOWN if an application-specific error occurred.
+static int on_acl_check(int event, void *event_data, void *user_data)
+{
+	Context*                        context = (Context*) user_data;
+	struct mosquitto_evt_acl_check* data    = (struct mosquitto_evt_acl_check*) event_data;
+	uint64_t                        start   = metrics_now();
+	const ClientInfo*               info    = clients_find(&context->clients, data->client);
+	int                             retval;
+	
+	if (info == NULL) {  // authenticated before the state was stored, or storing it failed
+		retval = check_acl(context, mosquitto_client_id(data->client), mosquitto_client_username(data->client),
+		                   data->topic, data->access);
+	}
+	else if (info->superuser) {
+		if (data->access == MOSQ_ACL_SUBSCRIBE && strcmp(data->topic, METRICS_TOPIC) == 0) {
+			report_metrics(context);
+		}
+		
+		retval = MOSQ_ERR_SUCCESS;
+	}
+	else if (!info->authorized) {
+		retval = MOSQ_ERR_ACL_DENIED;
+	}
+	else if (data->topic[0] == GROUP_TOPIC_PREFIX[0] &&  // rules out most topics without a call
+	         strncmp(data->topic, GROUP_TOPIC_PREFIX, sizeof (GROUP_TOPIC_PREFIX) - 1) == 0) {
+		retval = check_group_acl(context, clients_prefix(info), info->prefixlen - 1, data->topic, data->access);
+	}
+	else {
+		// the topic must be at least 'username/x' long; checking that first (memchr stops
+		// at the terminator) keeps the comparison within both strings
+		bool match = (memchr(data->topic, 0, info->prefixlen + 1) == NULL &&
+		              memcmp(data->topic, clients_prefix(info), info->prefixlen) == 0);
+		
+		retval = match ? MOSQ_ERR_SUCCESS : MOSQ_ERR_ACL_DENIED;
+	}
+	
+	record_acl(context, retval, start);
+	
+	if (retval != MOSQ_ERR_SUCCESS && context->audit != NULL) {  // spare the client lookups otherwise
+		audit_acl(context, retval, mosquitto_client_id(data->client), mosquitto_client_username(data->client),
+		          data->topic, data->access);
+	}
+	
+	return retval;
+}
+
+/// @brief Client disconnection event (plugin API version 5)
+/// 
+/// Release the authorization state stored for the client and, if it is a registered device,
+/// account for its disconnection.
+/// 
+/// @param[in] event Event identifier, MOSQ_EVT_DISCONNECT.
+/// @param[in] event_data Event description, a struct mosquitto_evt_disconnect.
+/// @param[in] user_data Plugin context.
+/// @return Return code. Always MOSQ_ERR_SUCCESS.
+static int on_disconnect(int event, void *event_data, void *user_data)
+{
+	Context*                         context = (Context*) user_data;
+	struct mosquitto_evt_disconnect* data    = (struct mosquitto_evt_disconnect*) event_data;
+	const ClientInfo*                info    = clients_find(&context->clients, data->client);
+	
+	if (info != NULL && info->present) {
+		presence_disconnect(&context->presence, clients_prefix(info), info->prefixlen - 1);
+		schedule_presence(context, metrics_now());
+	}
+	
+	clients_remove(&context->clients, data->client);
+	
+	return MOSQ_ERR_SUCCESS;
+}
+
+/// @brief Periodic event (plugin API version 5)
+/// 
+/// Write back the presence changes once the write-back interval has elapsed,
+/// even if no other client connects or disconnects in the meantime.
+/// 
+/// @param[in] event Event identifier, MOSQ_EVT_TICK.
+/// @param[in] event_data Event description, a struct mosquitto_evt_tick.
+/// @param[in] user_data Plugin context.
+/// @return Return code. Always MOSQ_ERR_SUCCESS.
+static int on_tick(int event, void *event_data, void *user_data)
+{
+	schedule_presence((Context*) user_data, metrics_now());
+	
+	return MOSQ_ERR_SUCCESS;
+}
+
+/// @brief TLS pre-shared key retrieval event (plugin API version 5)
+/// 
+/// Same semantics as mosquitto_auth_psk_key_get(), except that unknown identities are deferred
+/// so the broker may still try its psk_file.
+/// 
+/// @param[in] event Event identifier, MOSQ_EVT_PSK_KEY.
+/// @param[in] event_data Event description, a struct mosquitto_evt_psk_key.
+/// @param[in] user_data Plugin context.
+/// @return Return code. MOSQ_ERR_SUCCESS on success, MOSQ_ERR_PLUGIN_DEFER if the identity
+///         has no key and MOSQ_ERR_UNKNOWN if an application-specific error ocurred.
+static int on_psk_key(int event, void *event_data, void *user_data)
+{
+	struct mosquitto_evt_psk_key* data = (struct mosquitto_evt_psk_key*) event_data;
+	
+	int retval = mosquitto_auth_psk_key_get(user_data, data->hint, data->identity, data->key, data->max_key_len);
+	
+	return (retval == MOSQ_ERR_AUTH) ? MOSQ_ERR_PLUGIN_DEFER : retval;
+}
+
+/// @brief Configuration reload event (plugin API version 5)
+/// 
+/// Equivalent to mosquitto_auth_security_init() with reload set to true.
+/// 
+/// @param[in] event Event identifier, MOSQ_EVT_RELOAD.
+/// @param[in] event_data Event description, a struct mosquitto_evt_reload.
 /// @param[in] user_data Plugin context.
-/// @param[in] hint Associated PSK hint.
-/// @param[in] identity Client's identity claim.
-/// @param[out] key Retrieved PSK key.
-/// @param[in] max_key_len Maximum size of the key.
 /// @return Return code. On success, zero; otherwise, a number greater than zero.
-///         If the function is not required, also a number greater than zero.
-int mosquitto_auth_psk_key_get(void *user_data, const char *hint, const char *identity, char *key, int max_key_len)
+static int on_reload(int event, void *event_data, void *user_data)
 {
-	return NOTREQUIRED;
+	struct mosquitto_evt_reload* data = (struct mosquitto_evt_reload*) event_data;
+	
+	return mosquitto_auth_security_init(user_data, (struct mosquitto_auth_opt*) data->options, data->option_count, true);
+}
+
+/// @brief Event callbacks registered with the event-based plugin API
+static const struct {
+	int                        event;
+	MOSQ_FUNC_generic_callback callback;
+} v5_callbacks[] = {
+	{MOSQ_EVT_BASIC_AUTH, on_basic_auth},
+	{MOSQ_EVT_ACL_CHECK,  on_acl_check},
+	{MOSQ_EVT_PSK_KEY,    on_psk_key},
+	{MOSQ_EVT_DISCONNECT, on_disconnect},
+	{MOSQ_EVT_RELOAD,     on_reload}
+};
+
+/// @brief Unregister every event callback
+/// 
+/// @param[in] context Plugin context.
+static void unregister_callbacks(Context* context)
+{
+	for (int i = 0; i < sizeof (v5_callbacks) / sizeof (v5_callbacks[0]); i++) {
+		mosquitto_callback_unregister(context->identifier, v5_callbacks[i].event, v5_callbacks[i].callback, NULL);
+	}
+	
+	mosquitto_callback_unregister(context->identifier, MOSQ_EVT_TICK, on_tick, NULL);  // harmless if not registered
+}
+
+/// @brief Plugin API version negotiation
+/// 
+/// Mosquitto 2.0 and newer call this function instead of mosquitto_auth_plugin_version(),
+/// with the list of API versions they support. The event-based API is preferred;
+/// otherwise the legacy authorization API is used.
+/// 
+/// @param[in] supported_version_count Number of supported versions.
+/// @param[in] supported_versions Plugin API versions supported by the broker.
+/// @return Selected API version, or -1 if none of the broker versions is supported.
+int mosquitto_plugin_version(int supported_version_count, const int *supported_versions)
+{
+	bool legacy = false;
+	
+	for (int i = 0; i < supported_version_count; i++) {
+		if (supported_versions[i] == MOSQ_PLUGIN_VERSION) {
+			return MOSQ_PLUGIN_VERSION;
+		}
+		
+		legacy |= (supported_versions[i] == MOSQ_AUTH_PLUGIN_VERSION);
+	}
+	
+	return legacy ? MOSQ_AUTH_PLUGIN_VERSION : -1;
+}
+
+/// @brief Plugin initialization routine (plugin API version 5)
+/// 
+/// Same initialization as mosquitto_auth_plugin_init() followed by mosquitto_auth_security_init(),
+/// then register the event callbacks. The periodic event is only registered to write back the
+/// presence of the devices; without it, the changes are written back on connection events.
+/// 
+/// @param[in] identifier Plugin identifier, required to register callbacks.
+/// @param[out] user_data Initialized plugin context, available on subsequent calls to the API.
+/// @param[in] opts Configuration options. Same options as in mosquitto_auth_plugin_init().
+/// @param[in] opt_count Number of configuration options.
+/// @return Return code. On success, zero; otherwise, a number greater than zero.
+int mosquitto_plugin_init(mosquitto_plugin_id_t *identifier, void **user_data, struct mosquitto_opt *opts, int opt_count)
+{
+	struct mosquitto_auth_opt* auth_opts = (struct mosquitto_auth_opt*) opts;  // same layout
+	int                        retval;
+	
+	if ((retval = mosquitto_auth_plugin_init(user_data, auth_opts, opt_count)) != SUCCESS) {
+		return retval;
+	}
+	
+	Context* context    = (Context*) *user_data;
+	context->identifier = identifier;
+	
+	mosquitto_auth_security_init(context, auth_opts, opt_count, false);
+	
+	for (int i = 0; i < sizeof (v5_callbacks) / sizeof (v5_callbacks[0]); i++) {
+		if (mosquitto_callback_register(identifier, v5_callbacks[i].event, v5_callbacks[i].callback, NULL, context) != MOSQ_ERR_SUCCESS) {
+			mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to register the plugin event callbacks.");
+			
+			unregister_callbacks(context);
+			mosquitto_auth_plugin_cleanup(context, auth_opts, opt_count);
+			return CALLBACK_FAILED;
+		}
+	}
+	
+	if (context->presencedb != NULL &&
+	    mosquitto_callback_register(identifier, MOSQ_EVT_TICK, on_tick, NULL, context) != MOSQ_ERR_SUCCESS) {
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "Periodic events not available; the device presence is only "
+		                                       "written back when a client connects or disconnects.");
+	}
+	
+	return SUCCESS;
+}
+
+/// @brief Plugin shut down routine (plugin API version 5)
+/// 
+/// Unregister the event callbacks, then shut down as in mosquitto_auth_security_cleanup()
+/// followed by mosquitto_auth_plugin_cleanup().
+/// 
+/// @param[in] user_data Plugin context.
+/// @param[in] opts Configuration options.
+/// @param[in] opt_count Number of configuration options.
+/// @return Return code. On success, zero; otherwise, a number greater than zero.
+int mosquitto_plugin_cleanup(void *user_data, struct mosquitto_opt *opts, int opt_count)
+{
+	struct mosquitto_auth_opt* auth_opts = (struct mosquitto_auth_opt*) opts;
+	Context*                   context   = (Context*) user_data;
+	
+	unregister_callbacks(context);
+	mosquitto_auth_security_cleanup(context, auth_opts, opt_count, false);
+	
+	return mosquitto_auth_plugin_cleanup(context, auth_opts, opt_count);
 }
@@ -0,0 +1,205 @@
+/// @file clients.c
+/// @brief Per-client authorization state
+/// 
+/// Part of AutoHome.
+/// 
+/// Linear probing table. Removals shift the following entries back into the freed slot,
+/// so no tombstones are needed and searches always stop at the first empty slot.
+// 
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "clients.h"
+
+/// @brief Initial number of slots
+#define CLIENTS_MIN_CAPACITY 64
+
+/// @brief Slot array alignment, so that no entry straddles two cache lines
+#define CLIENTS_ALIGNMENT 64
+
+/// @brief Home slot of a client handle
+static size_t home(const ClientTable* table, const void* client)
+{
+	// handles are heap pointers, so the low bits carry no information; the slot is taken
+	// from the top bits of the product, which spread handles allocated next to each other
+	uint64_t key = (uint64_t) (uintptr_t) client >> 4;
+	
+	return (size_t) ((key * 0x9e3779b97f4a7c15ull) >> (64 - __builtin_ctzll(table->capacity)));
+}
+
+/// @brief Search the slot holding a client, or the empty slot where it would be inserted
+static ClientInfo* probe(const ClientTable* table, const void* client)
+{
+	size_t mask = table->capacity - 1;
+	
+	for (size_t i = home(table, client); ; i = (i + 1) & mask) {
+		ClientInfo* entry = &table->entries[i];
+		
+		if (entry->client == NULL || entry->client == client) {
+			return entry;
+		}
+	}
+}
+
+/// @brief Double the table capacity, keeping every entry
+static bool grow(ClientTable* table)
+{
+	ClientTable bigger;
+	
+	bigger.capacity = (table->capacity > 0) ? 2 * table->capacity : CLIENTS_MIN_CAPACITY;
+	bigger.count    = table->count;
+	bigger.entries  = (ClientInfo*) aligned_alloc(CLIENTS_ALIGNMENT, bigger.capacity * sizeof (ClientInfo));
+	
+	if (bigger.entries == NULL) {
+		return false;
+	}
+	
+	memset(bigger.entries, 0, bigger.capacity * sizeof (ClientInfo));
+	
+	for (size_t i = 0; i < table->capacity; i++) {
+		if (table->entries[i].client != NULL) {
+			*probe(&bigger, table->entries[i].client) = table->entries[i];
+		}
+	}
+	
+	free(table->entries);
+	*table = bigger;
+	
+	return true;
+}
+
+/// @brief Release the heap copy of an entry's topic prefix, if it has one
+static void free_prefix(ClientInfo* entry)
+{
+	if (entry->client != NULL && entry->prefixlen > CLIENTS_PREFIX_SIZE) {
+		free(entry->longprefix);
+	}
+}
+
+void clients_free(ClientTable* table)
+{
+	for (size_t i = 0; i < table->capacity; i++) {
+		free_prefix(&table->entries[i]);
+	}
+	
+	free(table->entries);
+	
+	table->entries  = NULL;
+	table->capacity = 0;
+	table->count    = 0;
+}
+
+const ClientInfo* clients_find(const ClientTable* table, const void* client)
+{
+	if (table->capacity == 0 || client == NULL) {
+		return NULL;
+	}
+	
+	const ClientInfo* entry = probe(table, client);
+	
+	return (entry->client != NULL) ? entry : NULL;
+}
+
+bool clients_insert(ClientTable* table, const void* client, const char* username, bool superuser, bool authorized,
+                    bool present)
+{
+	if (client == NULL) {
+		return false;
+	}
+	
+	if (4 * (table->count + 1) > 3 * table->capacity && !grow(table)) {  // keep the load factor under 3/4
+		return false;
+	}
+	
+	size_t namelen   = strlen(username);
+	size_t prefixlen = namelen + 1;
+	char*  prefix    = NULL;
+	
+	if (prefixlen > CLIENTS_PREFIX_SIZE && (prefix = (char*) malloc(prefixlen * sizeof (char))) == NULL) {
+		return false;
+	}
+	
+	ClientInfo* entry = probe(table, client);
+	
+	if (entry->client == NULL) {
+		table->count += 1;
+	}
+	else {
+		free_prefix(entry);
+	}
+	
+	if (prefix == NULL) {
+		prefix = entry->shortprefix;
+	}
+	else {
+		entry->longprefix = prefix;
+	}
+	
+	memcpy(prefix, username, namelen);
+	prefix[namelen] = '/';
+	
+	entry->client     = client;
+	entry->prefixlen  = (uint32_t) prefixlen;
+	entry->superuser  = superuser;
+	entry->authorized = authorized;
+	entry->present    = present;
+	
+	return true;
+}
+
+void clients_remove(ClientTable* table, const void* client)
+{
+	if (table->capacity == 0 || client == NULL) {
+		return;
+	}
+	
+	size_t      mask  = table->capacity - 1;
+	ClientInfo* entry = probe(table, client);
+	
+	if (entry->client == NULL) {
+		return;
+	}
+	
+	free_prefix(entry);
+	table->count -= 1;
+	
+	// backward shift: move back every following entry that would be unreachable
+	// through the hole, i.e. whose home slot is not between the hole and itself
+	size_t hole = entry - table->entries;
+	
+	for (size_t i = (hole + 1) & mask; table->entries[i].client != NULL; i = (i + 1) & mask) {
+		size_t ideal = home(table, table->entries[i].client);
+		
+		if (((i - ideal) & mask) >= ((i - hole) & mask)) {
+			table->entries[hole] = table->entries[i];
+			hole                 = i;
+		}
+	}
+	
+	memset(&table->entries[hole], 0, sizeof (ClientInfo));
+}
@@ -0,0 +1,124 @@
+/// @file clients.h
+/// @brief Per-client authorization state
+/// 
+/// Part of AutoHome.
+/// 
+/// Hash table from broker client handles to the authorization decisions that can be computed
+/// once, when the client authenticates, instead of on every access control check.
+// 
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef CLIENTS_H
+#define CLIENTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/// @brief Room for the topic prefix stored inline in each entry
+/// 
+/// Chosen so that an entry takes half a cache line. Longer prefixes are stored on the heap.
+#define CLIENTS_PREFIX_SIZE 16
+
+/// @brief Authorization state of a connected client
+typedef struct ClientInfo {
+	/// @brief Broker client handle; NULL if the slot is empty
+	const void* client;
+	
+	union {
+		/// @brief Topic prefix the client has access to, "<username>/", not null-terminated
+		/// 
+		/// Stored inline when it fits, so the access control check does not follow another pointer.
+		char shortprefix[CLIENTS_PREFIX_SIZE];
+		
+		/// @brief Owned copy of the topic prefix, if it is longer than CLIENTS_PREFIX_SIZE
+		char* longprefix;
+	};
+	
+	/// @brief Length of the topic prefix
+	uint32_t prefixlen;
+	
+	/// @brief True if the client authenticated as the superuser
+	bool superuser;
+	
+	/// @brief True if the client identifier matches its username
+	/// 
+	/// Otherwise, the client is denied access to every topic (except if it is the superuser).
+	bool authorized;
+	
+	/// @brief True if the client is accounted for in the presence of its device
+	bool present;
+} ClientInfo;
+
+/// @brief Topic prefix of a client, wherever it is stored
+/// 
+/// @param[in] info Client state.
+/// @return The "<username>/" prefix, not null-terminated; its length is info->prefixlen.
+static inline const char* clients_prefix(const ClientInfo* info)
+{
+	return (info->prefixlen <= CLIENTS_PREFIX_SIZE) ? info->shortprefix : info->longprefix;
+}
+
+/// @brief Client table
+typedef struct ClientTable {
+	/// @brief Slot array
+	ClientInfo* entries;
+	
+	/// @brief Number of slots; zero or a power of two
+	size_t capacity;
+	
+	/// @brief Number of occupied slots
+	size_t count;
+} ClientTable;
+
+/// @brief Release every resource used by a table, leaving it empty
+void clients_free(ClientTable* table);
+
+/// @brief Search the table for the given client
+/// 
+/// @param[in] table Table to search.
+/// @param[in] client Broker client handle.
+/// @return The client state if found; NULL otherwise.
+const ClientInfo* clients_find(const ClientTable* table, const void* client);
+
+/// @brief Add or replace the state of a client
+/// 
+/// @param[in,out] table Table to modify.
+/// @param[in] client Broker client handle.
+/// @param[in] username Client's username, used to build its topic prefix.
+/// @param[in] superuser True if the client is the superuser.
+/// @param[in] authorized True if the client identifier matches its username.
+/// @param[in] present True if the client is accounted for in the presence of its device.
+/// @return True on success; false if memory could not be allocated.
+bool clients_insert(ClientTable* table, const void* client, const char* username, bool superuser, bool authorized,
+                    bool present);
+
+/// @brief Remove the state of a client, if present
+/// 
+/// @param[in,out] table Table to modify.
+/// @param[in] client Broker client handle.
+void clients_remove(ClientTable* table, const void* client);
+
+#endif  // #ifndef CLIENTS_H
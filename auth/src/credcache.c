@@ -0,0 +1,166 @@
+/// @file credcache.c
+/// @brief Bounded in-memory credential cache
+/// 
+/// Part of AutoHome.
+/// 
+/// Every username hashes to a home slot and may live in any of the following
+/// CREDCACHE_WINDOW slots. Entries are never removed individually (only the whole cache
+/// is cleared), so a search can stop at the first empty slot in the window.
+// 
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "credcache.h"
+
+/// @brief Number of consecutive slots a username may occupy
+#define CREDCACHE_WINDOW 8
+
+/// @brief FNV-1a hash of a null-terminated string
+static uint64_t strhash(const char* str)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	
+	for (const unsigned char* c = (const unsigned char*) str; *c != 0; c++) {
+		hash ^= *c;
+		hash *= 0x100000001b3ull;
+	}
+	
+	return hash;
+}
+
+bool credcache_init(CredCache* cache, size_t size)
+{
+	cache->entries  = NULL;
+	cache->capacity = 0;
+	
+	if (size == 0) {
+		return true;
+	}
+	
+	size_t capacity = CREDCACHE_WINDOW;
+	
+	while (capacity < size) {
+		capacity <<= 1;
+	}
+	
+	cache->entries = (CacheEntry*) calloc(capacity, sizeof (CacheEntry));
+	
+	if (cache->entries == NULL) {
+		return false;
+	}
+	
+	cache->capacity = capacity;
+	
+	return true;
+}
+
+void credcache_free(CredCache* cache)
+{
+	credcache_clear(cache);
+	
+	free(cache->entries);
+	
+	cache->entries  = NULL;
+	cache->capacity = 0;
+}
+
+void credcache_clear(CredCache* cache)
+{
+	for (size_t i = 0; i < cache->capacity; i++) {
+		free(cache->entries[i].username);
+		cache->entries[i].username = NULL;
+	}
+}
+
+const CacheEntry* credcache_find(const CredCache* cache, const char* username)
+{
+	if (cache->capacity == 0) {
+		return NULL;
+	}
+	
+	size_t mask = cache->capacity - 1;
+	size_t home = strhash(username) & mask;
+	
+	for (size_t k = 0; k < CREDCACHE_WINDOW; k++) {
+		const CacheEntry* entry = &cache->entries[(home + k) & mask];
+		
+		if (entry->username == NULL) {
+			return NULL;
+		}
+		
+		if (strcmp(entry->username, username) == 0) {
+			return entry;
+		}
+	}
+	
+	return NULL;
+}
+
+bool credcache_insert(CredCache* cache, const char* username, const Credentials* credentials)
+{
+	if (cache->capacity == 0) {
+		return false;
+	}
+	
+	uint64_t    hashcode = strhash(username);
+	size_t      mask     = cache->capacity - 1;
+	size_t      home     = hashcode & mask;
+	CacheEntry* target   = NULL;
+	
+	for (size_t k = 0; k < CREDCACHE_WINDOW; k++) {
+		CacheEntry* entry = &cache->entries[(home + k) & mask];
+		
+		if (entry->username == NULL || strcmp(entry->username, username) == 0) {
+			target = entry;
+			break;
+		}
+	}
+	
+	if (target == NULL) {  // the window is full, evict one of its entries; the upper bits
+		                   // of the hash are unrelated to the home slot, so they can pick the victim
+		target = &cache->entries[(home + (hashcode >> 32) % CREDCACHE_WINDOW) & mask];
+	}
+	
+	if (target->username == NULL || strcmp(target->username, username) != 0) {
+		size_t namelen = strlen(username);
+		char*  copy    = (char*) malloc((namelen + 1) * sizeof (char));
+		
+		if (copy == NULL) {
+			return false;
+		}
+		
+		memcpy(copy, username, namelen + 1);
+		
+		free(target->username);
+		target->username = copy;
+	}
+	
+	target->credentials = *credentials;
+	
+	return true;
+}
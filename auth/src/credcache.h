@@ -0,0 +1,91 @@
+/// @file credcache.h
+/// @brief Bounded in-memory credential cache
+/// 
+/// Part of AutoHome.
+/// 
+/// Open-addressing hash table mapping usernames to their stored _hash:salt_ pair.
+/// Entries are filled on demand and evicted in place when their probe window is full,
+/// so the memory footprint is fixed at initialization.
+// 
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef CREDCACHE_H
+#define CREDCACHE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "credentials.h"
+
+/// @brief Cached credentials for a single user
+typedef struct CacheEntry {
+	/// @brief Owned copy of the username; NULL if the slot is empty
+	char* username;
+	
+	/// @brief Stored credentials, already decoded
+	Credentials credentials;
+} CacheEntry;
+
+/// @brief Credential cache
+typedef struct CredCache {
+	/// @brief Slot array
+	CacheEntry* entries;
+	
+	/// @brief Number of slots; always a power of two (zero if the cache is disabled)
+	size_t capacity;
+} CredCache;
+
+/// @brief Initialize an empty cache
+/// 
+/// @param[out] cache Cache to initialize.
+/// @param[in] size Minimum number of entries the cache can hold. It will be rounded up to
+///                 a power of two. If zero, the cache is disabled and every search misses.
+/// @return True on success; false if the memory could not be allocated.
+bool credcache_init(CredCache* cache, size_t size);
+
+/// @brief Release every resource used by a cache
+void credcache_free(CredCache* cache);
+
+/// @brief Remove every entry from the cache, keeping its capacity
+void credcache_clear(CredCache* cache);
+
+/// @brief Search the cache for the given user
+/// 
+/// @param[in] cache Cache to search.
+/// @param[in] username Queried username.
+/// @return The matching entry if found; NULL otherwise.
+const CacheEntry* credcache_find(const CredCache* cache, const char* username);
+
+/// @brief Add or update the credentials for a user
+/// 
+/// If there is no room for the user, an older entry will be evicted.
+/// 
+/// @param[in,out] cache Cache to modify.
+/// @param[in] username Username.
+/// @param[in] credentials Stored credentials.
+/// @return True on success; false if the cache is disabled or memory could not be allocated.
+bool credcache_insert(CredCache* cache, const char* username, const Credentials* credentials);
+
+#endif  // #ifndef CREDCACHE_H
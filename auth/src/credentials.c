@@ -0,0 +1,98 @@
+/// @file credentials.c
+/// @brief Decoded user credentials and password verification
+/// 
+/// Part of AutoHome.
+// 
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <string.h>
+
+#include "credentials.h"
+
+/// @brief Value of a base16 digit; -1 if not a digit
+static int hexvalue(char digit)
+{
+	if (digit >= '0' && digit <= '9') {
+		return digit - '0';
+	}
+	else if (digit >= 'a' && digit <= 'f') {
+		return digit - 'a' + 10;
+	}
+	else if (digit >= 'A' && digit <= 'F') {
+		return digit - 'A' + 10;
+	}
+	
+	return -1;
+}
+
+void credentials_set(Credentials* credentials, const char* hash, const char* salt)
+{
+	credentials->valid = (hash != NULL && strlen(hash) == 2 * SHA256_DIGEST_SIZE);
+	
+	for (int i = 0; credentials->valid && i < SHA256_DIGEST_SIZE; i++) {
+		int high = hexvalue(hash[2 * i]);
+		int low  = hexvalue(hash[2 * i + 1]);
+		
+		credentials->valid   = (high >= 0 && low >= 0);
+		credentials->hash[i] = (unsigned char) ((high << 4) | low);
+	}
+	
+	if (!credentials->valid) {
+		memset(credentials->hash, 0, sizeof (credentials->hash));
+	}
+	
+	if (salt == NULL) {
+		credentials->salt[0] = 0;
+		return;
+	}
+	
+	strncpy(credentials->salt, salt, CREDENTIALS_SALT_SIZE);
+	credentials->salt[CREDENTIALS_SALT_SIZE - 1] = 0;
+}
+
+bool credentials_match(const Credentials* credentials, const char* password)
+{
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	sha256_ctx    hashctx;
+	
+	if (password == NULL) {  // registered users must always present a password
+		return false;
+	}
+	
+	sha256_init(&hashctx);
+	sha256_update(&hashctx, (const unsigned char*) credentials->salt, strlen(credentials->salt));
+	sha256_update(&hashctx, (const unsigned char*) password, strlen(password));
+	sha256_final(&hashctx, digest);
+	
+	// accumulate every difference instead of stopping at the first one; volatile
+	// keeps the compiler from turning the loop back into an early-exit comparison
+	volatile unsigned char diff = 0;
+	
+	for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+		diff |= digest[i] ^ credentials->hash[i];
+	}
+	
+	return credentials->valid && diff == 0;
+}
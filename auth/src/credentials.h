@@ -0,0 +1,74 @@
+/// @file credentials.h
+/// @brief Decoded user credentials and password verification
+/// 
+/// Part of AutoHome.
+/// 
+/// The database stores password hashes as base16 strings; they are decoded once, when read,
+/// so verifying a password only needs a digest computation and a binary comparison.
+// 
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef CREDENTIALS_H
+#define CREDENTIALS_H
+
+#include <stdbool.h>
+
+#include <sha2.h>
+
+/// @brief Maximum size of the stored salt string (including null terminator)
+#define CREDENTIALS_SALT_SIZE 65
+
+/// @brief Stored credentials for a single user
+typedef struct Credentials {
+	/// @brief Password hash, SHA-256(salt + password)
+	unsigned char hash[SHA256_DIGEST_SIZE];
+	
+	/// @brief True if the stored hash is a well-formed base16 digest
+	/// 
+	/// Otherwise, no password matches the credentials.
+	bool valid;
+	
+	/// @brief Salt used to compute the hash
+	char salt[CREDENTIALS_SALT_SIZE];
+} Credentials;
+
+/// @brief Fill a credentials record from its stored representation
+/// 
+/// @param[out] credentials Record to fill.
+/// @param[in] hash Stored password hash, as a base16 string. May be NULL.
+/// @param[in] salt Stored salt. May be NULL. It is truncated if too long.
+void credentials_set(Credentials* credentials, const char* hash, const char* salt);
+
+/// @brief Check a password against the stored credentials
+/// 
+/// The digests are compared in constant time, so the time taken does not reveal
+/// how much of the hash a guessed password got right.
+/// 
+/// @param[in] credentials Stored credentials.
+/// @param[in] password Password presented by the client. May be NULL.
+/// @return True if the password is correct; false otherwise (always if the password is NULL).
+bool credentials_match(const Credentials* credentials, const char* password);
+
+#endif  // #ifndef CREDENTIALS_H
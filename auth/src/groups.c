@@ -0,0 +1,231 @@
+/// @file groups.c
+/// @brief Immutable in-memory index of the device groups
+/// 
+/// Part of AutoHome.
+// 
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "groups.h"
+
+/// @brief Order two memberships by username, then group
+static int membercmp(const void* a, const void* b)
+{
+	const GroupMember* x = (const GroupMember*) a;
+	const GroupMember* y = (const GroupMember*) b;
+	int                diff = strcmp(x->username, y->username);
+	
+	return (diff != 0) ? diff : strcmp(x->group, y->group);
+}
+
+/// @brief Order a length-delimited name against a null-terminated one
+static int namecmp(const char* name, size_t namelen, const char* stored)
+{
+	int diff = strncmp(name, stored, namelen);
+	
+	if (diff != 0) {
+		return diff;
+	}
+	
+	// the common prefix is equal; the stored name is greater if it is longer
+	return (stored[namelen] != 0) ? -1 : 0;
+}
+
+/// @brief Make room for one more name in the index storage
+static bool reserve_names(GroupIndex* index, size_t* namescap, size_t needed)
+{
+	if (needed <= *namescap) {
+		return true;
+	}
+	
+	size_t newcap = (*namescap > 0) ? 2 * *namescap : 1024;
+	
+	while (newcap < needed) {
+		newcap *= 2;
+	}
+	
+	char* names = (char*) realloc(index->names, newcap * sizeof (char));
+	
+	if (names == NULL) {
+		return false;
+	}
+	
+	index->names = names;
+	*namescap    = newcap;
+	
+	return true;
+}
+
+/// @brief Read every row of the devgroup table into an index
+/// 
+/// The name storage may be reallocated while reading, so the name fields are left unset;
+/// instead, the offsets of every username and group name are returned separately.
+/// 
+/// @param[in] db Database handle.
+/// @param[in,out] index Empty index to fill.
+/// @param[out] offsets Newly allocated array with two offsets per entry: that of its username and
+///                     that of its group name. Must be freed by the caller, even on error.
+/// @return SQL return code.
+static int groups_read(sqlite3* db, GroupIndex* index, size_t** offsets)
+{
+	sqlite3_stmt* statement;
+	size_t        entrycap = 0;
+	size_t        namescap = 0;
+	size_t        namesize = 0;
+	int           retval;
+	
+	if ((retval = sqlite3_prepare_v2(db, "select username, name from devgroup;", -1, &statement, NULL)) != SQLITE_OK) {
+		sqlite3_finalize(statement);
+		return retval;
+	}
+	
+	while ((retval = sqlite3_step(statement)) == SQLITE_ROW) {
+		const unsigned char* username = sqlite3_column_text(statement, 0);
+		const unsigned char* group    = sqlite3_column_text(statement, 1);
+		
+		if (username == NULL || group == NULL) {
+			continue;
+		}
+		
+		size_t namelen  = strlen((const char*) username);
+		size_t grouplen = strlen((const char*) group);
+		
+		if (index->count == entrycap) {
+			size_t       newcap  = (entrycap > 0) ? 2 * entrycap : 64;
+			GroupMember* entries = (GroupMember*) realloc(index->entries, newcap * sizeof (GroupMember));
+			
+			if (entries == NULL) {
+				sqlite3_finalize(statement);
+				return SQLITE_NOMEM;
+			}
+			
+			index->entries = entries;
+			
+			size_t* newoffsets = (size_t*) realloc(*offsets, 2 * newcap * sizeof (size_t));
+			
+			if (newoffsets == NULL) {
+				sqlite3_finalize(statement);
+				return SQLITE_NOMEM;
+			}
+			
+			*offsets = newoffsets;
+			entrycap = newcap;
+		}
+		
+		if (!reserve_names(index, &namescap, namesize + namelen + grouplen + 2)) {
+			sqlite3_finalize(statement);
+			return SQLITE_NOMEM;
+		}
+		
+		memcpy(&index->names[namesize], username, namelen + 1);
+		memcpy(&index->names[namesize + namelen + 1], group, grouplen + 1);
+		
+		(*offsets)[2 * index->count]     = namesize;
+		(*offsets)[2 * index->count + 1] = namesize + namelen + 1;
+		namesize                        += namelen + grouplen + 2;
+		index->count                    += 1;
+	}
+	
+	if (retval != SQLITE_DONE) {
+		sqlite3_finalize(statement);
+		return retval;
+	}
+	
+	return sqlite3_finalize(statement);
+}
+
+int groups_load(sqlite3* db, GroupIndex** index)
+{
+	GroupIndex* result  = (GroupIndex*) calloc(1, sizeof (GroupIndex));
+	size_t*     offsets = NULL;
+	int         retval;
+	
+	*index = NULL;
+	
+	if (result == NULL) {
+		return SQLITE_NOMEM;
+	}
+	
+	if ((retval = groups_read(db, result, &offsets)) != SQLITE_OK) {
+		free(offsets);
+		groups_free(result);
+		return retval;
+	}
+	
+	for (size_t i = 0; i < result->count; i++) {
+		result->entries[i].username = &result->names[offsets[2 * i]];
+		result->entries[i].group    = &result->names[offsets[2 * i + 1]];
+	}
+	
+	free(offsets);
+	
+	if (result->count > 0) {  // an empty table leaves the entry array unallocated
+		qsort(result->entries, result->count, sizeof (GroupMember), membercmp);
+	}
+	
+	*index = result;
+	
+	return SQLITE_OK;
+}
+
+void groups_free(GroupIndex* index)
+{
+	if (index == NULL) {
+		return;
+	}
+	
+	free(index->entries);
+	free(index->names);
+	free(index);
+}
+
+bool groups_member(const GroupIndex* index, const char* username, size_t namelen, const char* group, size_t grouplen)
+{
+	size_t low  = 0;
+	size_t high = index->count;
+	
+	while (low < high) {
+		size_t mid  = low + (high - low) / 2;
+		int    diff = namecmp(username, namelen, index->entries[mid].username);
+		
+		if (diff == 0) {
+			diff = namecmp(group, grouplen, index->entries[mid].group);
+		}
+		
+		if (diff == 0) {
+			return true;
+		}
+		else if (diff < 0) {
+			high = mid;
+		}
+		else {
+			low = mid + 1;
+		}
+	}
+	
+	return false;
+}
@@ -0,0 +1,89 @@
+/// @file groups.h
+/// @brief Immutable in-memory index of the device groups
+/// 
+/// Part of AutoHome.
+/// 
+/// Devices in a group may read its control topic, group/<name>/control, so a single message
+/// reaches every member. The index holds every _username:group_ pair sorted by username,
+/// then group, so membership checks are a binary search over a contiguous array.
+/// Like snapshots, indices are never modified; a new one is loaded to reflect database changes.
+// 
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef GROUPS_H
+#define GROUPS_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <sqlite3.h>
+
+/// @brief Membership of a device in a group
+typedef struct GroupMember {
+	/// @brief Member username; points into the index name storage
+	const char* username;
+	
+	/// @brief Group name; points into the index name storage
+	const char* group;
+} GroupMember;
+
+/// @brief Index of the devgroup table
+typedef struct GroupIndex {
+	/// @brief Memberships sorted by username, then group
+	GroupMember* entries;
+	
+	/// @brief Number of memberships
+	size_t count;
+	
+	/// @brief Storage for every username and group name, one after another (null-terminated)
+	char* names;
+} GroupIndex;
+
+/// @brief Build a new index from the database
+/// 
+/// @param[in] db Database handle.
+/// @param[out] index Newly allocated index; NULL on error.
+/// @return SQL return code. SQLITE_OK, if everything executed correctly; SQLITE_NOMEM if
+///         the index could not be allocated; another SQLite error code otherwise.
+int groups_load(sqlite3* db, GroupIndex** index);
+
+/// @brief Release every resource used by an index
+/// 
+/// @param[in] index Index to release. May be NULL.
+void groups_free(GroupIndex* index);
+
+/// @brief Check whether a device belongs to a group
+/// 
+/// Neither name needs to be null-terminated, so they can point into a larger string (i.e. a topic).
+/// 
+/// @param[in] index Index to search.
+/// @param[in] username Device username.
+/// @param[in] namelen Length of the username.
+/// @param[in] group Group name.
+/// @param[in] grouplen Length of the group name.
+/// @return True if the device is a member of the group; false otherwise.
+bool groups_member(const GroupIndex* index, const char* username, size_t namelen, const char* group, size_t grouplen);
+
+#endif  // #ifndef GROUPS_H
@@ -0,0 +1,128 @@
+/// @file metrics.c
+/// @brief Plugin hot path counters and latency histograms
+/// 
+/// Part of AutoHome.
+// 
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "metrics.h"
+
+uint64_t metrics_now(void)
+{
+	struct timespec time;
+	
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	
+	return (uint64_t) time.tv_sec * 1000000000u + (uint64_t) time.tv_nsec;
+}
+
+uint64_t histogram_record(Histogram* histogram, uint64_t start)
+{
+	uint64_t end     = metrics_now();
+	uint64_t elapsed = end - start;
+	int      bucket  = 63 - __builtin_clzll(elapsed | 1);  // floor(log2(elapsed))
+	
+	if (bucket >= METRICS_BUCKETS) {
+		bucket = METRICS_BUCKETS - 1;
+	}
+	
+	histogram->buckets[bucket] += 1;
+	histogram->count           += 1;
+	histogram->total           += elapsed;
+	
+	if (elapsed > histogram->max) {
+		histogram->max = elapsed;
+	}
+	
+	return end;
+}
+
+/// @brief Upper bound of the given percentile, in microseconds
+/// 
+/// @param[in] histogram Histogram to query.
+/// @param[in] percent Percentile, in (0, 100].
+/// @return The end of the bucket holding the percentile, capped at the longest sample.
+static double percentile(const Histogram* histogram, double percent)
+{
+	uint64_t rank = (uint64_t) (histogram->count * percent / 100.0 + 0.5);
+	uint64_t seen = 0;
+	
+	if (rank == 0) {
+		rank = 1;
+	}
+	
+	for (int i = 0; i < METRICS_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		
+		if (seen >= rank) {
+			uint64_t end = (uint64_t) 2 << i;
+			
+			return ((end < histogram->max) ? end : histogram->max) / 1000.0;
+		}
+	}
+	
+	return histogram->max / 1000.0;
+}
+
+/// @brief Write the summary of a histogram
+static int format_histogram(const Histogram* histogram, char* buffer, size_t size)
+{
+	if (histogram->count == 0) {
+		return snprintf(buffer, size, "n=0");
+	}
+	
+	return snprintf(buffer, size, "n=%" PRIu64 " mean=%.1fus p50<=%.1fus p99<=%.1fus max=%.1fus",
+	                histogram->count, (double) histogram->total / histogram->count / 1000.0,
+	                percentile(histogram, 50), percentile(histogram, 99), histogram->max / 1000.0);
+}
+
+int metrics_format(const Metrics* metrics, char* buffer, size_t size)
+{
+	char auth[128];
+	char acl[128];
+	char db[128];
+	
+	format_histogram(&metrics->authlatency, auth, sizeof (auth));
+	format_histogram(&metrics->acllatency,  acl,  sizeof (acl));
+	format_histogram(&metrics->dblatency,   db,   sizeof (db));
+	
+	return snprintf(buffer, size,
+	                "auth: calls=%" PRIu64 " allowed=%" PRIu64 " denied=%" PRIu64 " errors=%" PRIu64
+	                " throttled=%" PRIu64 " [%s]; "
+	                "acl: calls=%" PRIu64 " allowed=%" PRIu64 " denied=%" PRIu64 " [%s]; "
+	                "lookups: cached=%" PRIu64 " negative=%" PRIu64 " snapshot=%" PRIu64 " queried=%" PRIu64
+	                " errors=%" PRIu64 " [%s]",
+	                metrics->authcalls, metrics->authallowed, metrics->authdenied, metrics->autherrors,
+	                metrics->throttled, auth,
+	                metrics->aclcalls, metrics->aclallowed, metrics->acldenied, acl,
+	                metrics->cachehits, metrics->negativehits, metrics->snapshothits, metrics->cachemisses,
+	                metrics->dberrors, db);
+}
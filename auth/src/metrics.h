@@ -0,0 +1,130 @@
+/// @file metrics.h
+/// @brief Plugin hot path counters and latency histograms
+/// 
+/// Part of AutoHome.
+/// 
+/// Latencies are kept in histograms with one bucket per power of two nanoseconds,
+/// so recording a sample is a couple of increments and percentiles can still be estimated
+/// (within a factor of two) when reporting.
+// 
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// @brief Number of histogram buckets; the last one also holds every longer sample (> 2 s)
+#define METRICS_BUCKETS 32
+
+/// @brief Latency histogram
+typedef struct Histogram {
+	/// @brief Number of samples in [2^i, 2^(i + 1)) nanoseconds, per bucket i
+	uint64_t buckets[METRICS_BUCKETS];
+	
+	/// @brief Number of samples
+	uint64_t count;
+	
+	/// @brief Sum of every sample, in nanoseconds
+	uint64_t total;
+	
+	/// @brief Longest sample, in nanoseconds
+	uint64_t max;
+} Histogram;
+
+/// @brief Plugin metrics
+typedef struct Metrics {
+	/// @brief Username-password checks
+	uint64_t authcalls;
+	
+	/// @brief Username-password checks that succeeded
+	uint64_t authallowed;
+	
+	/// @brief Username-password checks that failed
+	uint64_t authdenied;
+	
+	/// @brief Username-password checks cancelled by an SQLite error
+	uint64_t autherrors;
+	
+	/// @brief Guest logins rejected by the throttle
+	uint64_t throttled;
+	
+	/// @brief Access control checks
+	uint64_t aclcalls;
+	
+	/// @brief Access control checks that granted access
+	uint64_t aclallowed;
+	
+	/// @brief Access control checks that denied access
+	uint64_t acldenied;
+	
+	/// @brief Credentials found in the credential cache
+	uint64_t cachehits;
+	
+	/// @brief Usernames found in the negative cache
+	uint64_t negativehits;
+	
+	/// @brief Credentials looked up in the snapshot
+	uint64_t snapshothits;
+	
+	/// @brief Credential lookups that had to query the database
+	uint64_t cachemisses;
+	
+	/// @brief Password queries that failed with an SQLite error
+	uint64_t dberrors;
+	
+	/// @brief Latency of the username-password checks
+	Histogram authlatency;
+	
+	/// @brief Latency of the access control checks
+	Histogram acllatency;
+	
+	/// @brief Latency of the password queries
+	Histogram dblatency;
+	
+	/// @brief Time of the last periodic report, in nanoseconds
+	uint64_t lastreport;
+} Metrics;
+
+/// @brief Current monotonic time, in nanoseconds
+uint64_t metrics_now(void);
+
+/// @brief Add a sample to a histogram
+/// 
+/// @param[in,out] histogram Histogram to update.
+/// @param[in] start Time when the measured operation started, as returned by metrics_now().
+/// @return Current time, i.e. when the operation ended.
+uint64_t histogram_record(Histogram* histogram, uint64_t start);
+
+/// @brief Write a single-line, human-readable report of the metrics
+/// 
+/// @param[in] metrics Metrics to report.
+/// @param[out] buffer Output buffer. The report is truncated if it does not fit.
+/// @param[in] size Buffer size (including null terminator). It must be greater than zero.
+/// @return Length of the report, not counting truncation.
+int metrics_format(const Metrics* metrics, char* buffer, size_t size);
+
+#endif  // #ifndef METRICS_H
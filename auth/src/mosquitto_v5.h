@@ -0,0 +1,164 @@
+/// @file mosquitto_v5.h
+/// @brief Declarations for version 5 of the Mosquitto plugin API
+/// 
+/// Part of AutoHome.
+/// 
+/// Subset of mosquitto_plugin.h and mosquitto_broker.h from Mosquitto 2.0, binary compatible
+/// with the broker, for the events used by this plugin. The bundled headers predate the event
+/// API, so the plugin carries these declarations itself.
+/// 
+/// The broker functions are declared weak: the same library must still load in brokers that only
+/// provide the legacy authorization API, where they are never called (and resolve to NULL).
+// 
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef MOSQUITTO_V5_H
+#define MOSQUITTO_V5_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <mosquitto.h>
+
+/// @brief Plugin API version implemented through the event callbacks
+#define MOSQ_PLUGIN_VERSION 5
+
+#ifndef MOSQ_ACL_SUBSCRIBE
+#define MOSQ_ACL_SUBSCRIBE   0x04
+#define MOSQ_ACL_UNSUBSCRIBE 0x08
+#endif
+
+/// @brief Return code for a plugin that has no opinion on an event
+#define MOSQ_ERR_PLUGIN_DEFER 17
+
+/// @brief Opaque plugin identifier, handed to the plugin on initialization
+typedef struct mosquitto_plugin_id_t mosquitto_plugin_id_t;
+
+/// @brief Opaque MQTT v5 property list
+typedef struct mqtt5__property mosquitto_property;
+
+/// @brief Plugin configuration option (same layout as struct mosquitto_auth_opt)
+struct mosquitto_opt {
+	char* key;
+	char* value;
+};
+
+/// @brief Events a plugin may register a callback for
+enum mosquitto_plugin_event {
+	MOSQ_EVT_RELOAD             = 1,
+	MOSQ_EVT_ACL_CHECK          = 2,
+	MOSQ_EVT_BASIC_AUTH         = 3,
+	MOSQ_EVT_EXT_AUTH_START     = 4,
+	MOSQ_EVT_EXT_AUTH_CONTINUE  = 5,
+	MOSQ_EVT_CONTROL            = 6,
+	MOSQ_EVT_MESSAGE            = 7,
+	MOSQ_EVT_PSK_KEY            = 8,
+	MOSQ_EVT_TICK               = 9,
+	MOSQ_EVT_DISCONNECT         = 10
+};
+
+/// @brief MOSQ_EVT_RELOAD data
+struct mosquitto_evt_reload {
+	void*                 future;
+	struct mosquitto_opt* options;
+	int                   option_count;
+	void*                 future2[4];
+};
+
+/// @brief MOSQ_EVT_ACL_CHECK data
+struct mosquitto_evt_acl_check {
+	void*               future;
+	struct mosquitto*   client;
+	const char*         topic;
+	const void*         payload;
+	mosquitto_property* properties;
+	int                 access;
+	uint32_t            payloadlen;
+	uint8_t             qos;
+	bool                retain;
+	void*               future2[4];
+};
+
+/// @brief MOSQ_EVT_BASIC_AUTH data
+struct mosquitto_evt_basic_auth {
+	void*             future;
+	struct mosquitto* client;
+	char*             username;
+	char*             password;
+	void*             future2[4];
+};
+
+/// @brief MOSQ_EVT_PSK_KEY data
+struct mosquitto_evt_psk_key {
+	void*             future;
+	struct mosquitto* client;
+	const char*       hint;
+	const char*       identity;
+	char*             key;
+	int               max_key_len;
+	void*             future2[4];
+};
+
+/// @brief MOSQ_EVT_TICK data
+struct mosquitto_evt_tick {
+	void*  future;
+	long   now_ns;
+	long   next_ns;
+	time_t now_s;
+	time_t next_s;
+	void*  future2[4];
+};
+
+/// @brief MOSQ_EVT_DISCONNECT data
+struct mosquitto_evt_disconnect {
+	void*             future;
+	struct mosquitto* client;
+	int               reason;
+	void*             future2[4];
+};
+
+/// @brief Event callback signature
+typedef int (*MOSQ_FUNC_generic_callback)(int event, void* event_data, void* userdata);
+
+__attribute__((weak))
+int mosquitto_callback_register(mosquitto_plugin_id_t* identifier, int event, MOSQ_FUNC_generic_callback cb_func,
+                                const void* event_data, void* userdata);
+
+__attribute__((weak))
+int mosquitto_callback_unregister(mosquitto_plugin_id_t* identifier, int event, MOSQ_FUNC_generic_callback cb_func,
+                                  const void* event_data);
+
+__attribute__((weak))
+const char* mosquitto_client_id(const struct mosquitto* client);
+
+__attribute__((weak))
+const char* mosquitto_client_username(const struct mosquitto* client);
+
+__attribute__((weak))
+int mosquitto_broker_publish_copy(const char* clientid, const char* topic, int payloadlen, const void* payload,
+                                  int qos, bool retain, mosquitto_property* properties);
+
+#endif  // #ifndef MOSQUITTO_V5_H
@@ -0,0 +1,172 @@
+/// @file presence.c
+/// @brief Connection state of every registered device
+/// 
+/// Part of AutoHome.
+/// 
+/// Linear probing table that only grows, since the set of registered devices is small
+/// and stable; iterating over its slots is the way to find the changed entries.
+// 
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "presence.h"
+
+/// @brief Initial number of slots
+#define PRESENCE_MIN_CAPACITY 64
+
+/// @brief FNV-1a hash of a length-delimited string
+static uint64_t strhash(const char* str, size_t length)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (unsigned char) str[i];
+		hash *= 0x100000001b3ull;
+	}
+	
+	return hash;
+}
+
+/// @brief Search the slot holding a username, or the empty slot where it would be inserted
+static PresenceEntry* probe(const PresenceTable* table, const char* username, size_t namelen)
+{
+	size_t mask = table->capacity - 1;
+	
+	for (size_t i = strhash(username, namelen) & mask; ; i = (i + 1) & mask) {
+		PresenceEntry* entry = &table->entries[i];
+		
+		if (entry->username == NULL ||
+		    (strncmp(entry->username, username, namelen) == 0 && entry->username[namelen] == 0)) {
+			return entry;
+		}
+	}
+}
+
+/// @brief Double the table capacity, keeping every entry
+static bool grow(PresenceTable* table)
+{
+	PresenceTable bigger;
+	
+	bigger.capacity = (table->capacity > 0) ? 2 * table->capacity : PRESENCE_MIN_CAPACITY;
+	bigger.count    = table->count;
+	bigger.dirty    = table->dirty;
+	bigger.entries  = (PresenceEntry*) calloc(bigger.capacity, sizeof (PresenceEntry));
+	
+	if (bigger.entries == NULL) {
+		return false;
+	}
+	
+	for (size_t i = 0; i < table->capacity; i++) {
+		const char* username = table->entries[i].username;
+		
+		if (username != NULL) {
+			*probe(&bigger, username, strlen(username)) = table->entries[i];
+		}
+	}
+	
+	free(table->entries);
+	*table = bigger;
+	
+	return true;
+}
+
+/// @brief Flip the change mark of an entry, keeping the count of changed entries
+/// 
+/// A device that connects and disconnects between write-backs ends up unchanged.
+static void toggle(PresenceTable* table, PresenceEntry* entry)
+{
+	if ((entry->dirty = !entry->dirty)) {
+		table->dirty += 1;
+	}
+	else {
+		table->dirty -= 1;
+	}
+}
+
+void presence_free(PresenceTable* table)
+{
+	for (size_t i = 0; i < table->capacity; i++) {
+		free(table->entries[i].username);
+	}
+	
+	free(table->entries);
+	
+	table->entries  = NULL;
+	table->capacity = 0;
+	table->count    = 0;
+	table->dirty    = 0;
+}
+
+bool presence_connect(PresenceTable* table, const char* username, size_t namelen)
+{
+	if (2 * (table->count + 1) > table->capacity && !grow(table)) {  // keep the load factor under 1/2
+		return false;
+	}
+	
+	PresenceEntry* entry = probe(table, username, namelen);
+	
+	if (entry->username == NULL) {
+		if ((entry->username = (char*) malloc((namelen + 1) * sizeof (char))) == NULL) {
+			return false;
+		}
+		
+		memcpy(entry->username, username, namelen);
+		entry->username[namelen] = 0;
+		entry->connections       = 0;
+		entry->dirty             = false;
+		table->count            += 1;
+	}
+	
+	if (entry->connections++ == 0) {
+		toggle(table, entry);
+	}
+	
+	return true;
+}
+
+void presence_disconnect(PresenceTable* table, const char* username, size_t namelen)
+{
+	if (table->capacity == 0) {
+		return;
+	}
+	
+	PresenceEntry* entry = probe(table, username, namelen);
+	
+	if (entry->username != NULL && entry->connections > 0 && --entry->connections == 0) {
+		toggle(table, entry);
+	}
+}
+
+void presence_clean(PresenceTable* table)
+{
+	for (size_t i = 0; i < table->capacity; i++) {
+		table->entries[i].dirty = false;
+	}
+	
+	table->dirty = 0;
+}
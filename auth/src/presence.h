@@ -0,0 +1,94 @@
+/// @file presence.h
+/// @brief Connection state of every registered device
+/// 
+/// Part of AutoHome.
+/// 
+/// Hash table from usernames to their number of live connections. A device is connected
+/// while it has at least one; only the transitions from and to zero change its presence,
+/// so a client taking over the session of another one with the same identifier (which is
+/// disconnected after the new one has authenticated) leaves it connected.
+/// Changed entries are marked, so they can be written back to the database in batches.
+// 
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/// @brief Presence of a single device
+typedef struct PresenceEntry {
+	/// @brief Owned copy of the username; NULL if the slot is empty
+	char* username;
+	
+	/// @brief Number of live connections
+	unsigned int connections;
+	
+	/// @brief True if the presence changed since the last write-back
+	bool dirty;
+} PresenceEntry;
+
+/// @brief Presence table
+/// 
+/// Entries are never removed, devices are just marked as disconnected.
+typedef struct PresenceTable {
+	/// @brief Slot array
+	PresenceEntry* entries;
+	
+	/// @brief Number of slots; zero or a power of two
+	size_t capacity;
+	
+	/// @brief Number of occupied slots
+	size_t count;
+	
+	/// @brief Number of entries marked as changed
+	size_t dirty;
+} PresenceTable;
+
+/// @brief Release every resource used by a table, leaving it empty
+void presence_free(PresenceTable* table);
+
+/// @brief Account for a new connection of a device
+/// 
+/// @param[in,out] table Table to modify.
+/// @param[in] username Device username.
+/// @param[in] namelen Length of the username.
+/// @return True on success; false if memory could not be allocated.
+bool presence_connect(PresenceTable* table, const char* username, size_t namelen);
+
+/// @brief Account for a closed connection of a device
+/// 
+/// Unknown devices are ignored.
+/// 
+/// @param[in,out] table Table to modify.
+/// @param[in] username Device username.
+/// @param[in] namelen Length of the username.
+void presence_disconnect(PresenceTable* table, const char* username, size_t namelen);
+
+/// @brief Clear every change mark, once the changes have been written back
+void presence_clean(PresenceTable* table);
+
+#endif  // #ifndef PRESENCE_H
@@ -0,0 +1,220 @@
+/// @file snapshot.c
+/// @brief Immutable in-memory index of the auth table
+/// 
+/// Part of AutoHome.
+// 
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "snapshot.h"
+
+/// @brief Order two entries by username
+static int entrycmp(const void* a, const void* b)
+{
+	return strcmp(((const SnapshotEntry*) a)->username, ((const SnapshotEntry*) b)->username);
+}
+
+/// @brief Offset marking an entry without a pre-shared key
+#define NO_PSK SIZE_MAX
+
+/// @brief Read every row of the auth table into a snapshot
+/// 
+/// The name storage may be reallocated while reading, so the username and key fields are left unset;
+/// instead, the offsets of every username and key within the storage are returned separately.
+/// Pre-shared keys are read from the psk table; a database without it yields no keys.
+/// 
+/// @param[in] db Database handle.
+/// @param[in,out] snapshot Empty snapshot to fill.
+/// @param[out] offsets Newly allocated array with two offsets per entry: that of its username and
+///                     that of its key (NO_PSK if none). Must be freed by the caller, even on error.
+/// @return SQL return code.
+static int snapshot_read(sqlite3* db, Snapshot* snapshot, size_t** offsets)
+{
+	sqlite3_stmt* statement;
+	size_t        entrycap = 0;
+	size_t        namescap = 0;
+	size_t        namesize = 0;
+	int           retval;
+	
+	retval = sqlite3_prepare_v2(db, "select username, hash, salt, psk.key from auth left join psk using (username);",
+	                            -1, &statement, NULL);
+	
+	if (retval != SQLITE_OK) {  // databases set up before TLS-PSK support have no psk table
+		sqlite3_finalize(statement);
+		
+		if ((retval = sqlite3_prepare_v2(db, "select username, hash, salt, null from auth;", -1, &statement, NULL)) != SQLITE_OK) {
+			sqlite3_finalize(statement);
+			return retval;
+		}
+	}
+	
+	while ((retval = sqlite3_step(statement)) == SQLITE_ROW) {
+		const unsigned char* username = sqlite3_column_text(statement, 0);
+		const unsigned char* hash     = sqlite3_column_text(statement, 1);
+		const unsigned char* psk      = sqlite3_column_text(statement, 3);
+		
+		// an empty hash stands for an unregistered user, same as in the database lookup
+		if (username == NULL || hash == NULL || hash[0] == 0) {
+			continue;
+		}
+		
+		size_t namelen = strlen((const char*) username);
+		size_t psklen  = (psk != NULL) ? strlen((const char*) psk) + 1 : 0;
+		
+		if (snapshot->count == entrycap) {
+			size_t         newcap  = (entrycap > 0) ? 2 * entrycap : 64;
+			SnapshotEntry* entries = (SnapshotEntry*) realloc(snapshot->entries, newcap * sizeof (SnapshotEntry));
+			
+			if (entries == NULL) {
+				sqlite3_finalize(statement);
+				return SQLITE_NOMEM;
+			}
+			
+			snapshot->entries = entries;
+			
+			size_t* newoffsets = (size_t*) realloc(*offsets, 2 * newcap * sizeof (size_t));
+			
+			if (newoffsets == NULL) {
+				sqlite3_finalize(statement);
+				return SQLITE_NOMEM;
+			}
+			
+			*offsets = newoffsets;
+			entrycap = newcap;
+		}
+		
+		if (namesize + namelen + 1 + psklen > namescap) {
+			size_t newcap = (namescap > 0) ? 2 * namescap : 1024;
+			
+			while (newcap < namesize + namelen + 1 + psklen) {
+				newcap *= 2;
+			}
+			
+			char* names = (char*) realloc(snapshot->names, newcap * sizeof (char));
+			
+			if (names == NULL) {
+				sqlite3_finalize(statement);
+				return SQLITE_NOMEM;
+			}
+			
+			snapshot->names = names;
+			namescap        = newcap;
+		}
+		
+		SnapshotEntry* entry = &snapshot->entries[snapshot->count];
+		
+		memcpy(&snapshot->names[namesize], username, namelen + 1);
+		
+		(*offsets)[2 * snapshot->count]     = namesize;
+		(*offsets)[2 * snapshot->count + 1] = (psk != NULL) ? namesize + namelen + 1 : NO_PSK;
+		namesize                           += namelen + 1;
+		snapshot->count                    += 1;
+		
+		if (psk != NULL) {
+			memcpy(&snapshot->names[namesize], psk, psklen);
+			namesize += psklen;
+		}
+		
+		credentials_set(&entry->credentials, (const char*) hash, (const char*) sqlite3_column_text(statement, 2));
+	}
+	
+	if (retval != SQLITE_DONE) {
+		sqlite3_finalize(statement);
+		return retval;
+	}
+	
+	return sqlite3_finalize(statement);
+}
+
+int snapshot_load(sqlite3* db, Snapshot** snapshot)
+{
+	Snapshot* result  = (Snapshot*) calloc(1, sizeof (Snapshot));
+	size_t*   offsets = NULL;
+	int       retval;
+	
+	*snapshot = NULL;
+	
+	if (result == NULL) {
+		return SQLITE_NOMEM;
+	}
+	
+	if ((retval = snapshot_read(db, result, &offsets)) != SQLITE_OK) {
+		free(offsets);
+		snapshot_free(result);
+		return retval;
+	}
+	
+	for (size_t i = 0; i < result->count; i++) {
+		result->entries[i].username = &result->names[offsets[2 * i]];
+		result->entries[i].psk      = (offsets[2 * i + 1] != NO_PSK) ? &result->names[offsets[2 * i + 1]] : NULL;
+	}
+	
+	free(offsets);
+	
+	if (result->count > 0) {  // an empty table leaves the entry array unallocated
+		qsort(result->entries, result->count, sizeof (SnapshotEntry), entrycmp);
+	}
+	
+	*snapshot = result;
+	
+	return SQLITE_OK;
+}
+
+void snapshot_free(Snapshot* snapshot)
+{
+	if (snapshot == NULL) {
+		return;
+	}
+	
+	free(snapshot->entries);
+	free(snapshot->names);
+	free(snapshot);
+}
+
+const SnapshotEntry* snapshot_find(const Snapshot* snapshot, const char* username)
+{
+	size_t low  = 0;
+	size_t high = snapshot->count;
+	
+	while (low < high) {
+		size_t mid  = low + (high - low) / 2;
+		int    diff = strcmp(username, snapshot->entries[mid].username);
+		
+		if (diff == 0) {
+			return &snapshot->entries[mid];
+		}
+		else if (diff < 0) {
+			high = mid;
+		}
+		else {
+			low = mid + 1;
+		}
+	}
+	
+	return NULL;
+}
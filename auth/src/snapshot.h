@@ -0,0 +1,92 @@
+/// @file snapshot.h
+/// @brief Immutable in-memory index of the auth table
+/// 
+/// Part of AutoHome.
+/// 
+/// A snapshot holds every _username:salt:hash_ triplet (along with the user's TLS
+/// pre-shared key, if any) sorted by username, so lookups
+/// are a binary search over a contiguous array and never touch the database.
+/// Snapshots are never modified after being built; to reflect database changes a new one
+/// must be loaded and swapped in place of the old one.
+// 
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+
+#include <sqlite3.h>
+
+#include "credentials.h"
+
+/// @brief Credentials for a single user
+typedef struct SnapshotEntry {
+	/// @brief Username; points into the snapshot name storage
+	const char* username;
+	
+	/// @brief Stored credentials, already decoded
+	Credentials credentials;
+	
+	/// @brief TLS pre-shared key, in base16; points into the snapshot name storage. NULL if none
+	const char* psk;
+} SnapshotEntry;
+
+/// @brief Snapshot of the auth table
+typedef struct Snapshot {
+	/// @brief Entries sorted by username
+	SnapshotEntry* entries;
+	
+	/// @brief Number of entries
+	size_t count;
+	
+	/// @brief Storage for every username and pre-shared key, one after another (null-terminated)
+	char* names;
+} Snapshot;
+
+/// @brief Build a new snapshot from the database
+/// 
+/// The whole auth table is read inside a single read transaction,
+/// so the snapshot is consistent even if other connections are writing.
+/// 
+/// @param[in] db Database handle.
+/// @param[out] snapshot Newly allocated snapshot; NULL on error.
+/// @return SQL return code. SQLITE_OK, if everything executed correctly; SQLITE_NOMEM if
+///         the snapshot could not be allocated; another SQLite error code otherwise.
+int snapshot_load(sqlite3* db, Snapshot** snapshot);
+
+/// @brief Release every resource used by a snapshot
+/// 
+/// @param[in] snapshot Snapshot to release. May be NULL.
+void snapshot_free(Snapshot* snapshot);
+
+/// @brief Search the snapshot for the given user
+/// 
+/// @param[in] snapshot Snapshot to search.
+/// @param[in] username Queried username.
+/// @return The matching entry if found; NULL otherwise.
+const SnapshotEntry* snapshot_find(const Snapshot* snapshot, const char* username);
+
+#endif  // #ifndef SNAPSHOT_H
@@ -0,0 +1,158 @@
+/// @file throttle.c
+/// @brief Token bucket rate limiting of guest logins
+/// 
+/// Part of AutoHome.
+// 
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "throttle.h"
+
+/// @brief Number of per-username buckets
+#define THROTTLE_SLOTS 1024
+
+/// @brief FNV-1a hash of a null-terminated string, never zero
+static uint64_t strhash(const char* str)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	
+	for (const unsigned char* c = (const unsigned char*) str; *c != 0; c++) {
+		hash ^= *c;
+		hash *= 0x100000001b3ull;
+	}
+	
+	return (hash != 0) ? hash : 1;
+}
+
+/// @brief Current monotonic time, in seconds
+static double now(void)
+{
+	struct timespec time;
+	
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	
+	return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+/// @brief Refill a bucket up to the given time
+/// 
+/// @return True if the bucket holds at least one token.
+static bool refill(TokenBucket* bucket, double rate, double burst, double time)
+{
+	bucket->tokens += (time - bucket->last) * rate;
+	bucket->last    = time;
+	
+	if (bucket->tokens > burst) {
+		bucket->tokens = burst;
+	}
+	
+	return bucket->tokens >= 1.0;
+}
+
+bool throttle_init(Throttle* throttle, long rate, long burst, long userrate, long userburst)
+{
+	double time = now();
+	
+	throttle->rate      = rate / 60.0;
+	throttle->burst     = (burst > 0) ? burst : (rate > 0) ? rate : 1;
+	throttle->userrate  = userrate / 60.0;
+	throttle->userburst = (userburst > 0) ? userburst : (userrate > 0) ? userrate : 1;
+	throttle->slots     = NULL;
+	throttle->capacity  = 0;
+	throttle->limited   = false;
+	
+	throttle->global.tokens = throttle->burst;
+	throttle->global.last   = time;
+	
+	if (userrate > 0) {
+		throttle->slots = (ThrottleSlot*) calloc(THROTTLE_SLOTS, sizeof (ThrottleSlot));
+		
+		if (throttle->slots == NULL) {
+			return false;
+		}
+		
+		throttle->capacity = THROTTLE_SLOTS;
+	}
+	
+	return true;
+}
+
+void throttle_free(Throttle* throttle)
+{
+	free(throttle->slots);
+	
+	throttle->slots    = NULL;
+	throttle->capacity = 0;
+}
+
+bool throttle_enabled(const Throttle* throttle)
+{
+	return throttle->rate > 0 || throttle->capacity > 0;
+}
+
+bool throttle_allow(Throttle* throttle, const char* username)
+{
+	double        time  = now();
+	ThrottleSlot* slot  = NULL;
+	bool          allow = true;
+	
+	if (throttle->rate > 0) {
+		allow &= refill(&throttle->global, throttle->rate, throttle->burst, time);
+	}
+	
+	if (throttle->capacity > 0) {
+		uint64_t key = strhash(username);
+		
+		slot = &throttle->slots[key & (throttle->capacity - 1)];
+		
+		if (slot->key != key) {  // empty slot, or taken by another username: start afresh
+			slot->key           = key;
+			slot->bucket.tokens = throttle->userburst;
+			slot->bucket.last   = time;
+		}
+		
+		allow &= refill(&slot->bucket, throttle->userrate, throttle->userburst, time);
+	}
+	
+	throttle->limited = !allow;
+	
+	if (!allow) {
+		return false;
+	}
+	
+	if (throttle->rate > 0) {
+		throttle->global.tokens -= 1.0;
+	}
+	
+	if (slot != NULL) {
+		slot->bucket.tokens -= 1.0;
+	}
+	
+	return true;
+}
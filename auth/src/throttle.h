@@ -0,0 +1,114 @@
+/// @file throttle.h
+/// @brief Token bucket rate limiting of guest logins
+/// 
+/// Part of AutoHome.
+/// 
+/// Every guest login attempt takes a token from a global bucket and from a bucket of its own
+/// username; if either is empty, the attempt is rejected. Buckets refill continuously at
+/// a fixed rate up to their burst size. Per-username buckets live in a fixed-size table,
+/// so a flood of fresh usernames only recycles slots instead of growing memory.
+// 
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/// @brief Token bucket state
+typedef struct TokenBucket {
+	/// @brief Available tokens
+	double tokens;
+	
+	/// @brief Time of the last refill, in seconds
+	double last;
+} TokenBucket;
+
+/// @brief Per-username bucket slot
+typedef struct ThrottleSlot {
+	/// @brief Username hash; zero if the slot is empty
+	uint64_t key;
+	
+	/// @brief Bucket of the username
+	TokenBucket bucket;
+} ThrottleSlot;
+
+/// @brief Guest login throttle
+typedef struct Throttle {
+	/// @brief Global refill rate, in tokens per second; zero if the global limit is disabled
+	double rate;
+	
+	/// @brief Global bucket size
+	double burst;
+	
+	/// @brief Per-username refill rate, in tokens per second; zero if the per-username limit is disabled
+	double userrate;
+	
+	/// @brief Per-username bucket size
+	double userburst;
+	
+	/// @brief Global bucket
+	TokenBucket global;
+	
+	/// @brief Per-username buckets, indexed by username hash
+	ThrottleSlot* slots;
+	
+	/// @brief Number of per-username slots; zero or a power of two
+	size_t capacity;
+	
+	/// @brief True if the last attempt was rejected
+	bool limited;
+} Throttle;
+
+/// @brief Initialize a throttle with full buckets
+/// 
+/// @param[out] throttle Throttle to initialize.
+/// @param[in] rate Global limit, in logins per minute. Zero disables it.
+/// @param[in] burst Global bucket size. If zero, one minute worth of logins.
+/// @param[in] userrate Per-username limit, in logins per minute. Zero disables it.
+/// @param[in] userburst Per-username bucket size. If zero, one minute worth of logins.
+/// @return True on success; false if memory could not be allocated.
+bool throttle_init(Throttle* throttle, long rate, long burst, long userrate, long userburst);
+
+/// @brief Release every resource used by a throttle
+void throttle_free(Throttle* throttle);
+
+/// @brief Check whether the throttle is doing anything at all
+/// 
+/// @param[in] throttle Throttle to check.
+/// @return True if either limit is enabled.
+bool throttle_enabled(const Throttle* throttle);
+
+/// @brief Account for a login attempt
+/// 
+/// @param[in,out] throttle Throttle to update.
+/// @param[in] username Username of the attempt.
+/// @return True if the attempt is allowed; false if it exceeds one of the limits.
+///         Rejected attempts take no tokens.
+bool throttle_allow(Throttle* throttle, const char* username);
+
+#endif  // #ifndef THROTTLE_H
@@ -30,6 +30,61 @@
 """Schedule item definitions."""
 
 import shlex
+import struct
+
+# binary control protocol (see the firmware): a version byte followed by tag-length-value items
+BINARY_VERSION  = 2
+TAG_SWITCH      = 1
+TAG_ADD         = 2
+TAG_REMOVE      = 3
+TAG_CLEAR       = 4
+TAG_ASKSCHEDULE = 5
+TAG_CAPACITY    = 6
+TAG_VERSION     = 7
+TAG_SINCE       = 8
+
+# binary scheduled command: command, pad, fuzzy, recurrent, day mask, hours, minutes, pad, firedate
+_binaryformat = struct.Struct("<cx??BBBxQ")
+_commandcodes = {"off": b"0", "on": b"1"}
+_codecommands = {code: command for (command, code) in _commandcodes.items()}
+
+# day masks (bit 0 = Monday ... bit 6 = Sunday) with a single digit code
+_daycodes = {0x7f: 0, 0x1f: 8, 0x60: 9}
+
+def _daymask(weekday):
+	"""Day mask of a weekday descriptor: a single digit code 0-9, or several digits 1-7, one per day."""
+	
+	digits = str(weekday)
+	
+	if not digits.isdigit():
+		raise ValueError("Malformed weekday descriptor")
+	
+	if len(digits) == 1:
+		code = int(digits)
+		
+		for (mask, daycode) in _daycodes.items():
+			if code == daycode:
+				return mask
+		
+		return 1 << (code - 1)
+	
+	mask = 0
+	
+	for digit in digits:
+		if not "1" <= digit <= "7":
+			raise ValueError("Days in a weekday list must be between 1 and 7")
+		
+		mask |= 1 << (int(digit) - 1)
+	
+	return mask
+
+def _daycode(mask):
+	"""Canonical weekday descriptor of a day mask (the same one the devices report)."""
+	
+	if mask in _daycodes:
+		return _daycodes[mask]
+	
+	return int("".join(str(day + 1) for day in range(7) if mask & (1 << day)))
 
 # This class could very well be split in two: RecurrentEvent and NonRecurrentEvent, but the whole
 # thing is so simple (and both databases and the text device interface don't understand hierarchy
@@ -55,12 +110,12 @@ class Event(object):
 		self.fuzzy     = bool(fuzzy)
 		self.recurrent = bool(recurrent)
 		self.firedate  = int(firedate) if firedate is not None else 0
-		self.weekday   = int(weekday)  if weekday  is not None else 0
+		self.weekday   = _daycode(_daymask(weekday)) if weekday is not None else 0
 		self.hours     = int(hours)    if hours    is not None else 0
 		self.minutes   = int(minutes)  if minutes  is not None else 0
 		
 		if recurrent:
-			if not (0 <= self.weekday <= 9 and 0 <= self.hours <= 23 and 0 <= self.minutes <= 59):
+			if not (0 <= self.hours <= 23 and 0 <= self.minutes <= 59):
 				raise ValueError("Incorrect recurrent schedule specification")
 		else:
 			if self.firedate < 0:
@@ -87,10 +142,11 @@ class Event(object):
 		    the second char (x|z) indicates exact timer or fuzzy match (adds 16-minutes uniform noise)
 		    EpochTime is the number of seconds since 1 Jan 1970, 00:00:00
 		
-		For recurrent events, "recurrent (x|z)(0-9) Hour.Minutes Command", where
+		For recurrent events, "recurrent (x|z)(0-9)+ Hour.Minutes Command", where
 		    the second char (x|z) indicates exact timer or fuzzy match (adds 16-minutes uniform noise)
-		    the third char indicates a day of the week Mon-Sun (1-7), every day (0),
-		    every weekday Mon-Fri (8) or weekends Sat-Sun (9)
+		    the following digits indicate the days: a single one means a day of the week Mon-Sun (1-7),
+		    every day (0), every weekday Mon-Fri (8) or weekends Sat-Sun (9); several ones (1-7 only)
+		    mean every one of those days of the week, e.g. 135 for Mon, Wed and Fri
 		    Hour indicates the hour in 24-hour format using a leading zero if necessary
 		    Minutes indicates the minutes using a leading zero if necessary
 		"""
@@ -106,12 +162,12 @@ class Event(object):
 			firedate  = words[2]
 			
 		elif words[0] == "recurrent":
-			if len(words[1]) != 2:
+			if len(words[1]) < 2:
 				raise ValueError("Malformed fuzzy-weekday descriptor")
 			
 			recurrent = True
 			fuzzytext = words[1][0]
-			weekday   = words[1][1]
+			weekday   = words[1][1:]
 			timecomp  = words[2].split(".")
 			
 			if len(timecomp) != 2:
@@ -131,7 +187,7 @@ class Event(object):
 		
 		command = words[3]
 		
-		if recurrent:
+		if not recurrent:
 			return Event.create_once(command, fuzzy, firedate)
 		else:
 			return Event.create_recurrent(command, fuzzy, weekday, hours, minutes)
@@ -145,3 +201,98 @@ class Event(object):
 			                                                self.minutes, shlex.quote(self.command))
 		else:
 			return "timed {} {} {}".format(fztext, self.firedate, shlex.quote(self.command))
+	
+	def to_bytes(self):
+		"""Encode this event in the binary protocol scheduled command format."""
+		if self.command not in _commandcodes:
+			raise ValueError("Command '" + self.command + "' has no binary encoding")
+		
+		days = _daymask(self.weekday) if self.recurrent else 0
+		
+		return _binaryformat.pack(_commandcodes[self.command], self.fuzzy, self.recurrent,
+		                          days, self.hours, self.minutes, self.firedate)
+	
+	@staticmethod
+	def from_bytes(data):
+		"""Create a new event from its binary protocol encoding (see to_bytes)."""
+		try:
+			(code, fuzzy, recurrent, days, hours, minutes, firedate) = _binaryformat.unpack(data)
+		except struct.error:
+			raise ValueError("Incorrect binary event size")
+		
+		if code not in _codecommands:
+			raise ValueError("Unrecognized binary command")
+		
+		if recurrent:
+			if not 0 < days <= 0x7f:
+				raise ValueError("Incorrect binary day mask")
+			
+			return Event.create_recurrent(_codecommands[code], fuzzy, _daycode(days), hours, minutes)
+		else:
+			return Event.create_once(_codecommands[code], fuzzy, firedate)
+
+def encode_items(items):
+	"""Encode a list of (tag, value bytes) items as a binary protocol message."""
+	
+	message = bytearray([BINARY_VERSION])
+	
+	for (tag, value) in items:
+		if len(value) > 255:
+			raise ValueError("Binary item value too long")
+		
+		message += bytes([tag, len(value)]) + value
+	
+	return bytes(message)
+
+def decode_items(message):
+	"""Decode a binary protocol message into a list of (tag, value bytes) items."""
+	
+	if len(message) < 1 or message[0] != BINARY_VERSION:
+		raise ValueError("Unsupported binary protocol version")
+	
+	items = []
+	i     = 1
+	
+	while i < len(message):
+		if i + 2 > len(message) or i + 2 + message[i + 1] > len(message):
+			raise ValueError("Truncated binary item")
+		
+		items.append((message[i], bytes(message[i + 2:i + 2 + message[i + 1]])))
+		i += 2 + message[i + 1]
+	
+	return items
+
+def decode_schedule(message):
+	"""Decode a binary schedule reply coming from a device.
+	
+	Returns:
+		(events, capacity, count, version, since)
+		    events.   A list of event objects.
+		    capacity. The max number of scheduled events in the device.
+		    count.    The number of scheduled events in the device.
+		    version.  The device schedule version the reply corresponds to.
+		    since.    None if events is the whole schedule; otherwise, the schedule is the one
+		              at version since plus the events, the ones added after it.
+	"""
+	
+	events   = []
+	capacity = None
+	count    = None
+	version  = None
+	since    = None
+	
+	for (tag, value) in decode_items(message):
+		if tag == TAG_CAPACITY and len(value) == 2:
+			count    = value[0]
+			capacity = value[1]
+		elif tag == TAG_VERSION and len(value) == 4:
+			version = int.from_bytes(value, "little")
+		elif tag == TAG_SINCE and len(value) == 4:
+			since = int.from_bytes(value, "little")
+		elif tag == TAG_ADD:
+			events.append(Event.from_bytes(value))
+	
+	if capacity is None or version is None or (since is None and count != len(events)):
+		raise ValueError("Incomplete binary schedule")
+	
+	return (events, capacity, count, version, since)
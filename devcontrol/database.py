@@ -53,6 +53,12 @@ def setupdb(cursor):
 	MQTT credentials for every verified client. 'profile' maintains the identity
 	details of every device including its type, visible name, MQTT username,
 	connection status and sensor status. 'schedule' holds a list of scheduled events.
+	'psk' holds the TLS pre-shared key of every device that may connect through TLS-PSK.
+	'devgroup' lists the members of every device group, which may all be controlled at once.
+	'authlog' is written by the broker plugin with its authentication decisions, if audited.
+	'sensordata' keeps the windows of sensor samples published by the devices.
+	An additional 'authversion' counter is bumped by triggers on every change to 'auth', 'psk'
+	or 'devgroup'.
 	"""
 	
 	cursor.execute("select count(*) from sqlite_master where type='table' and name='profile';")
@@ -97,8 +103,74 @@ def setupdb(cursor):
 		               "  minutes int not null"
 		               ");")
 	
+	cursor.execute("create table if not exists psk ("
+	               "  username text not null primary key references profile on delete cascade,"
+	               "  key text not null"
+	               ");")
+	
+	cursor.execute("create table if not exists devgroup ("
+	               "  name text not null,"
+	               "  username text not null references profile on delete cascade,"
+	               "  primary key (name, username)"
+	               ");")
+	
+	# no foreign keys: guests and unknown clients are logged too, and records outlive devices
+	cursor.execute("create table if not exists authlog ("
+	               "  id integer not null primary key,"
+	               "  time integer not null,"
+	               "  event text not null,"
+	               "  result text not null,"
+	               "  reason text not null,"
+	               "  username text,"
+	               "  clientid text,"
+	               "  topic text,"
+	               "  access integer"
+	               ");")
+	
+	# time is the start of the window by the device clock, null if it was not synchronized yet
+	cursor.execute("create table if not exists sensordata ("
+	               "  id integer not null primary key,"
+	               "  username text not null references profile on delete cascade,"
+	               "  kind text not null,"
+	               "  time integer,"
+	               "  seconds integer not null,"
+	               "  count integer not null,"
+	               "  min integer not null,"
+	               "  max integer not null,"
+	               "  mean real not null"
+	               ");")
+	cursor.execute("create index if not exists sensordata_username on sensordata (username, id);")
+	
+	# credentials version counter, used by the broker plugin to invalidate its credential cache
+	cursor.execute("create table if not exists authversion ("
+	               "  id integer not null primary key check (id = 0),"
+	               "  version integer not null"
+	               ");")
+	cursor.execute("insert or ignore into authversion values (0, 0);")
+	
+	for event in ("insert", "update", "delete"):
+		cursor.execute("create trigger if not exists authversion_" + event + " after " + event + " on auth "
+		               "begin update authversion set version = version + 1 where id = 0; end;")
+		cursor.execute("create trigger if not exists pskversion_" + event + " after " + event + " on psk "
+		               "begin update authversion set version = version + 1 where id = 0; end;")
+		cursor.execute("create trigger if not exists groupversion_" + event + " after " + event + " on devgroup "
+		               "begin update authversion set version = version + 1 where id = 0; end;")
+	
 	cursor.execute("pragma foreign_keys = on;")
 
+def setjournalmode(cursor, mode):
+	"""Set the database journal mode.
+	
+	The mode is stored in the database file. In 'wal' mode the authorization plugin
+	reads never block on, nor fail because of, this service's writes. The mode can't be
+	changed inside a transaction, so this must run before any other modifying statement.
+	"""
+	
+	if mode not in ("delete", "truncate", "persist", "wal"):
+		raise ValueError("Invalid journal mode: " + mode)
+	
+	cursor.execute("pragma journal_mode = " + mode + ";")
+
 def setsuperuser(cursor, username, password):
 	"""Add (or update) the super user credentials to the authorization database."""
 	
@@ -203,6 +275,22 @@ def addprofile(cursor, id, displayname=None, stype="device", connected=True, sta
 	
 	return password
 
+def setpsk(cursor, id):
+	"""Generate a new TLS pre-shared key for a device.
+	
+	The key is stored in base16, the format the broker expects. Unlike the password,
+	the broker needs the key itself, so it can't be stored hashed.
+	
+	Returns:
+		Assigned key for this device.
+	"""
+	
+	key = binascii.hexlify(os.urandom(32)).decode()
+	
+	cursor.execute("insert or replace into psk (username, key) values (?, ?);", (id, key))
+	
+	return key
+
 def delprofile(cursor, displayname):
 	"""Remove the profile and credentials of a device from the database."""
 	
@@ -256,6 +344,26 @@ def clearschedule(cursor, username):
 	
 	cursor.execute("delete from schedule where username = ?", (username,))
 
+def addsensordata(cursor, username, kind, time, seconds, count, min, max, mean):
+	"""Add a window of sensor samples of a device to the database."""
+	
+	cursor.execute("insert into sensordata values (NULL, ?, ?, ?, ?, ?, ?, ?, ?);",
+	               (username, kind, time, seconds, count, min, max, mean))
+
+def devsensordata(cursor, displayname, limit=20):
+	"""Get the latest windows of sensor samples of a device, oldest first."""
+	
+	username = getusername(cursor, displayname)
+	
+	if username is None:
+		print("can't find user " + shlex.quote(str(displayname)), file=sys.stderr)
+		return []
+	
+	cursor.execute("select kind, time, seconds, count, min, max, mean from sensordata "
+	               "where username = ? order by id desc limit ?;", (username, limit))
+	
+	return cursor.fetchall()[::-1]
+
 def devlist(cursor):
 	"""Get a list of all known devices."""
 	
@@ -292,6 +400,36 @@ def _userlist0(cursor):
 		
 		info = cursor.fetchone()
 
+def addtogroup(cursor, group, username):
+	"""Add a device to a group, creating the group if necessary.
+	
+	Returns:
+		True if the device was added; False if it already was a member.
+	"""
+	
+	cursor.execute("insert or ignore into devgroup (name, username) values (?, ?);", (group, username))
+	
+	return cursor.rowcount > 0
+
+def delfromgroup(cursor, group, username):
+	"""Remove a device from a group; empty groups cease to exist.
+	
+	Returns:
+		True if the device was removed; False if it was not a member.
+	"""
+	
+	cursor.execute("delete from devgroup where name = ? and username = ?;", (group, username))
+	
+	return cursor.rowcount > 0
+
+def groupmembers(cursor, group):
+	"""Get the username, display name, type and status of every member of a group."""
+	
+	cursor.execute("select profile.username, displayname, type, status from devgroup "
+	               "join profile using (username) where name = ?;", (group,))
+	
+	return cursor.fetchall()
+
 def devinfo(cursor, displayname):
 	"""Get profile information about a specific device."""
 	
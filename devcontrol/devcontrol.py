@@ -166,6 +166,13 @@ def processline(userdata, line):
 		print(shlex.quote(("+" if connected else "-") + stype), end=" ")
 		print(shlex.quote(status))
 	
+	def group_handler(userdata, *args):
+		"""Transform the raw member list into a human readable list."""
+		for (username, displayname, stype, status) in database.groupmembers(userdata["cursor"], args[0]):
+			print(shlex.quote(displayname), end=" ")
+		
+		print()
+	
 	def schedule_handler(userdata, *args):
 		"""Transform the raw schedule list into a human readable list."""
 		for event in database.devschedule(userdata["cursor"], args[0]):
@@ -173,6 +180,13 @@ def processline(userdata, line):
 		
 		print("")
 	
+	def sensordata_handler(userdata, *args):
+		"""Transform the raw sensor windows into a human readable list."""
+		for (kind, time, seconds, count, low, high, mean) in database.devsensordata(userdata["cursor"], args[0]):
+			print(kind, "?" if time is None else time, seconds, count, low, high, "{:.2f}".format(mean))
+		
+		print("")
+	
 	# Command dictionary
 	
 	commands = {
@@ -195,6 +209,21 @@ def processline(userdata, line):
 		"askstatus": (1, device.askstatus),
 			# askstatus <displayname>
 			# ask the device for its current status
+		"checkupdates": (1, device.checkupdates),
+			# checkupdates <displayname>
+			# make the device check for firmware upgrades and WiFi access credentials updates right away
+		"asklog": (1, device.asklog),
+			# asklog <displayname>
+			# ask the device for the latest lines of its firmware log, which are printed when received
+		"askstats": (1, device.askstats),
+			# askstats <displayname>
+			# ask the device for its statistics (loop, message processing by kind of command and flash
+			# write times in us as count, average and max; free heap, RSSI, MQTT reconnections),
+			# printed when received
+		"sensorwindow": (2, device.sensorwindow),
+			# sensorwindow <displayname> <seconds>
+			# set the length of the windows the device aggregates its sensor samples in (1 to 86400 s);
+			# the device publishes one line per window on '<username>/sensor', kept for 'sensordata'
 		"cmd": (2, device.execute),
 			# cmd <displayname> <operation>
 			# send immediate command to device;
@@ -215,12 +244,28 @@ def processline(userdata, line):
 			# 'add' indicates to add the operation to the schedule, 'del' indicates to remove it from it;
 			# <weekday> must be a number between 0 and 9. Passing 0 signals the operation should execute
 			# every day; 1-7 signal it should be executed on Mon-Sun respectively; 8 signals Mon-Fri; and
-			# 9 signals Sat-Sun;
+			# 9 signals Sat-Sun; several digits 1-7 signal every one of those days, e.g. 135 for Mon-Wed-Fri;
 			# 'exact' sets the timer for the specific timestamp; 'fuzzy' adds a small amount of time noise;
 			# <operation> and <args> follow the same rules as the 'cmd' message
 		"clear": (1, device.clearschedule),
 			# clear <displayname>
 			# clear the schedule for a given device
+		"groupadd": (2, device.groupadd),
+			# groupadd <group> <displayname>
+			# add a device to a group, creating the group if it does not exist;
+			# group names can't contain '/', '+' or '#'
+		"groupdel": (2, device.groupdel),
+			# groupdel <group> <displayname>
+			# remove a device from a group; a group without devices ceases to exist
+		"groupcmd": (2, device.groupexecute),
+			# groupcmd <group> <operation>
+			# send immediate command to every device in a group with a single message;
+			# the operation must be valid for every device in the group, as in the 'cmd' message;
+			# otherwise, the command will not be sent to any of them
+		"group": (1, group_handler),
+			# group <group>
+			# retrieve the members of a group
+			# respond with a list of devices, using the format ('<displayname>' )*
 		"devlist": (0, devlist_handler),
 			# devlist
 			# retrieve verified device list
@@ -239,6 +284,13 @@ def processline(userdata, line):
 			# <connected><type> <status>
 			# where connected is formatted as + if the device is connected as - if it is not, e.g.
 			# '-sonoff on' indicates a disconnected sonoff device with a status of 'on'
+		"sensordata": (1, sensordata_handler),
+			# sensordata <displayname>
+			# retrieve the latest windows of sensor samples of a device
+			# respond with one window per line, oldest first, using the format
+			# <kind> <time> <seconds> <count> <min> <max> <mean>
+			# where time is the start of the window ('?' if the device clock was not synchronized yet);
+			# temperatures are in hundredths of a degree Celsius
 		"schedule": (1, schedule_handler)
 			# schedule <displayname>
 			# retrieve device schedule
@@ -273,7 +325,8 @@ def loop(mosquitto, configuration, db, cursor, guestlist, logger):
 	"""Main MQTT/REST API event loop."""
 	
 	userdata = {"done": False, "database": db, "cursor": cursor,
-	            "configuration": configuration, "client": None, "guestlist": guestlist}
+	            "configuration": configuration, "client": None, "guestlist": guestlist,
+	            "deviceschedules": {}}
 	client   = None
 	
 	try:
@@ -354,16 +407,22 @@ def main():
 	# the relative path is necessary for the mosquitto configuration file
 	# the join adds a trailing os-specific dir separator
 	configuration["relpath"] = os.path.join(os.path.relpath("./", scriptdir), "")
+	configuration.setdefault("devpresenceinterval", 0)
+	configuration.setdefault("devbinaryprotocol", False)
 	
 	with sqlite3.connect(configuration["devdbfile"]) as db:
 		cursor = db.cursor()
 		
 		try:
+			database.setjournalmode(cursor, configuration.get("devdbjournal", "delete"))
 			database.setupdb(cursor)
 			database.setsuperuser(cursor, configuration["superuser"], configuration["superpass"])
 		except KeyError:
 			print("Incomplete configuration file", file=sys.stderr)
 			return
+		except ValueError:
+			print("Invalid database journal mode in configuration file", file=sys.stderr)
+			return
 		except sqlite3.Error:
 			print("Can't set up the database and super user", file=sys.stderr)
 			return
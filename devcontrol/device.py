@@ -35,9 +35,39 @@ import shlex
 
 from sensors import sensors
 from Event import Event
+import Event as binary
 import database
 import mqtthandlers
 
+# maximum payload of a single schedule batch message;
+# the device drops any message bigger than its MQTT buffer
+_schedulebatchsize = 1024
+
+# longest sensor window the device accepts, in seconds (sensormaxwindow in the firmware)
+_maxsensorwindow = 24 * 60 * 60
+
+# switch commands with an encoding in the binary protocol
+_switchcodes = {"off": b"0", "on": b"1", "toggle": b"t"}
+
+def _binaryprotocol(userdata):
+	"""Whether the devices are sent the binary control messages instead of the text ones."""
+	
+	return userdata["configuration"].get("devbinaryprotocol", False)
+
+def _publishcontrol(userdata, username, text, items, qos=1):
+	"""Send a control message to a device, in the binary protocol if enabled and possible.
+	
+	The text message goes to the control topic; the (tag, value) items to the binary control topic.
+	If items is None, the text message is always used.
+	"""
+	
+	client = userdata["client"]
+	
+	if items is not None and _binaryprotocol(userdata):
+		client.publish(username + "/controlb", binary.encode_items(items), qos=qos)
+	else:
+		client.publish(username + "/control", text, qos=qos)
+
 def _validcommand(stype, command, status):
 	"""Check whether it is acceptable to send a given command
 	to a device of the given type and status.
@@ -99,17 +129,27 @@ def add(userdata, id, displayname=None, stype="device", status=""):
 	
 	password = database.addprofile(cursor, id, displayname, stype, True, status)
 	
-	db.commit()
-	
 	if password is None:
 		print("username already taken", file=sys.stderr)
 		return
 	
+	psk = database.setpsk(cursor, id)
+	
+	db.commit()
+	
 	guestlist.discard(id)
 	
+	# the key goes first: the credentials make the device reconnect right away;
+	# devices without TLS-PSK support ignore it
+	client.publish(id + "/lobby", "psk\n" + psk, qos=1)
 	client.publish(id + "/lobby", "auth\n" + id + "\n" + password, qos=1)
 	mqtthandlers.kickuser(configuration, id, password)
 
+def _validgroup(group):
+	"""Check whether a group name can be part of its control topic, 'group/<name>/control'."""
+	
+	return len(group) > 0 and not any(c in group for c in "/+#")
+
 def rename(userdata, displayname, newdisplayname):
 	"""Change the public display name of a device."""
 	
@@ -151,6 +191,78 @@ def delete(userdata, displayname):
 	
 	mqtthandlers.kickuser(configuration, username, configuration["devmqttpsk"])
 
+def groupadd(userdata, group, displayname):
+	"""Add a device to a group.
+	
+	Devices subscribe to every group control topic on connection; the broker
+	only delivers the messages from the groups they are members of.
+	"""
+	
+	cursor   = userdata["cursor"]
+	db       = userdata["database"]
+	username = database.getusername(cursor, displayname)
+	
+	if not _validgroup(group):
+		print("not a valid group name", file=sys.stderr)
+		return
+	
+	if username is None:
+		print("can't find user " + shlex.quote(str(displayname)), file=sys.stderr)
+		return
+	
+	if not database.addtogroup(cursor, group, username):
+		print("the device is already in the group", file=sys.stderr)
+		return
+	
+	db.commit()
+
+def groupdel(userdata, group, displayname):
+	"""Remove a device from a group."""
+	
+	cursor   = userdata["cursor"]
+	db       = userdata["database"]
+	username = database.getusername(cursor, displayname)
+	
+	if username is None:
+		print("can't find user " + shlex.quote(str(displayname)), file=sys.stderr)
+		return
+	
+	if not database.delfromgroup(cursor, group, username):
+		print("the device is not in the group", file=sys.stderr)
+		return
+	
+	db.commit()
+
+def groupexecute(userdata, group, command):
+	"""Send a signal to every device in a group to execute a command, with a single message.
+	
+	The command is first validated to check that every device can act on it, given its type;
+	if any device can't, none is sent the command.
+	"""
+	
+	cursor  = userdata["cursor"]
+	client  = userdata["client"]
+	members = database.groupmembers(cursor, group)
+	
+	if len(members) == 0:
+		print("can't find group " + shlex.quote(str(group)), file=sys.stderr)
+		return
+	
+	for (username, displayname, stype, status) in members:
+		if not _validcommand(stype, command, status):
+			print("invalid command " + str(command) + " for " + shlex.quote(str(displayname)) +
+			      " of type " + str(stype) + " and status " + str(status), file=sys.stderr)
+			return
+	
+	for (username, displayname, stype, status) in members:
+		newstatus = _statustransform(stype, command, status)
+		
+		if newstatus is not None:
+			database.setstatus(cursor, username, newstatus)
+	
+	# same delivery guarantees as a single device command
+	client.publish("group/" + group + "/control", command, qos=1)
+
 def sync(userdata, displayname):
 	"""Send a synchronization signal to a device to correct time drift."""
 	
@@ -162,10 +274,16 @@ def sync(userdata, displayname):
 		print("can't find user " + shlex.quote(str(displayname)), file=sys.stderr)
 		return
 	
-	t = int(time.time())
+	t = time.time()
 	t = t - time.timezone if not time.daylight else t - time.altzone
 	
-	client.publish(username + "/admin", "time " + str(t), qos=1)
+	client.publish(username + "/admin", "time {:.3f}".format(t), qos=1)
+	
+	# the device keeps the sensor window in RAM, so it's sent again whenever it (re)connects
+	window = userdata["configuration"].get("devsensorwindow", 0)
+	
+	if window > 0:
+		client.publish(username + "/admin", "sensorwindow " + str(window), qos=1)
 
 def ping(userdata, displayname):
 	"""Check that a device is responsive by sending a ping request."""
@@ -193,6 +311,99 @@ def askstatus(userdata, displayname):
 	
 	client.publish(username + "/admin", "askstatus", qos=0)
 
+def checkupdates(userdata, displayname):
+	"""Make the device check for firmware and access credentials updates."""
+	
+	cursor   = userdata["cursor"]
+	client   = userdata["client"]
+	username = database.getusername(cursor, displayname)
+	
+	if username is None:
+		print("can't find user " + shlex.quote(str(displayname)), file=sys.stderr)
+		return
+	
+	client.publish(username + "/admin", "checkupdates", qos=1)
+
+def asklog(userdata, displayname):
+	"""Ask the device for the contents of its log ring."""
+	
+	cursor   = userdata["cursor"]
+	client   = userdata["client"]
+	username = database.getusername(cursor, displayname)
+	
+	if username is None:
+		print("can't find user " + shlex.quote(str(displayname)), file=sys.stderr)
+		return
+	
+	client.publish(username + "/admin", "asklog", qos=0)
+
+def sensorwindow(userdata, displayname, seconds):
+	"""Set the length in seconds of the windows a device aggregates its sensor samples in."""
+	
+	cursor   = userdata["cursor"]
+	client   = userdata["client"]
+	username = database.getusername(cursor, displayname)
+	
+	if username is None:
+		print("can't find user " + shlex.quote(str(displayname)), file=sys.stderr)
+		return
+	
+	try:
+		seconds = int(seconds)
+	except ValueError:
+		seconds = 0
+	
+	if seconds < 1 or seconds > _maxsensorwindow:
+		print("the sensor window must be 1 to " + str(_maxsensorwindow) + " seconds", file=sys.stderr)
+		return
+	
+	client.publish(username + "/admin", "sensorwindow " + str(seconds), qos=1)
+
+def storesensordata(userdata, username, text):
+	"""Store the windows of sensor samples published by a device, one per line.
+	
+	Every line has the format '<kind> <date> <seconds> <count> <min> <max> <mean>', where date is the
+	start of the window in seconds since 1970 by the device clock (0 if it was not synchronized yet).
+	Malformed lines are skipped.
+	"""
+	
+	db     = userdata["database"]
+	cursor = userdata["cursor"]
+	
+	for line in text.splitlines():
+		fields = line.split()
+		
+		try:
+			if len(fields) != 7:
+				raise ValueError("expected 7 fields")
+			
+			kind          = fields[0]
+			date, seconds = int(fields[1]), int(fields[2])
+			count         = int(fields[3])
+			low, high     = int(fields[4]), int(fields[5])
+			mean          = float(fields[6])
+		except ValueError:
+			print("malformed sensor window: " + shlex.quote(line), file=sys.stderr)
+			continue
+		
+		database.addsensordata(cursor, username, kind, date if date > 0 else None, seconds,
+		                       count, low, high, mean)
+	
+	db.commit()
+
+def askstats(userdata, displayname):
+	"""Ask the device for its performance statistics."""
+	
+	cursor   = userdata["cursor"]
+	client   = userdata["client"]
+	username = database.getusername(cursor, displayname)
+	
+	if username is None:
+		print("can't find user " + shlex.quote(str(displayname)), file=sys.stderr)
+		return
+	
+	client.publish(username + "/admin", "askstats", qos=0)
+
 def execute(userdata, displayname, command):
 	"""Send a signal to a device to execute a command.
 	
@@ -231,7 +442,9 @@ def execute(userdata, displayname, command):
 	# the next call should be qos 2 because it is the only operation
 	# that may not be idempotent, but PubSubClient doesn't support it
 	# (and it's too heavyweight anyway)
-	client.publish(username + "/control", command, qos=1)
+	items = [(binary.TAG_SWITCH, _switchcodes[command])] if command in _switchcodes else None
+	
+	_publishcontrol(userdata, username, command, items)
 
 def schedule(userdata, displayname, event):
 	"""Add an operation to be performed represented in an event dictionary to a device's schedule."""
@@ -265,14 +478,7 @@ def schedule(userdata, displayname, event):
 		      " and status " + str(status), file=sys.stderr)
 		return
 		
-	eventstr = str(event)
-	
-	if event.recurrent:
-		eventstr = eventstr[:10] + "+" + eventstr[10:]
-	else:
-		eventstr = eventstr[:6] + "+" + eventstr[6:]
-	
-	client.publish(username + "/control", eventstr, qos=1)
+	_publishcontrol(userdata, username, _eventline(event, True), [(binary.TAG_ADD, event.to_bytes())])
 	database.addscheduled(cursor, username, event)
 
 def unschedule(userdata, displayname, event):
@@ -302,14 +508,7 @@ def unschedule(userdata, displayname, event):
 		      " and status " + str(status), file=sys.stderr)
 		return
 		
-	eventstr = str(event)
-	
-	if event.recurrent:
-		eventstr = eventstr[:10] + "-" + eventstr[10:]
-	else:
-		eventstr = eventstr[:6] + "-" + eventstr[6:]
-	
-	client.publish(username + "/control", eventstr, qos=1)
+	_publishcontrol(userdata, username, _eventline(event, False), [(binary.TAG_REMOVE, event.to_bytes())])
 	database.delscheduled(cursor, username, event)
 
 def clearschedule(userdata, displayname):
@@ -323,11 +522,14 @@ def clearschedule(userdata, displayname):
 		print("can't find user " + shlex.quote(str(displayname)), file=sys.stderr)
 		return
 	
-	client.publish(username + "/control", "clear", qos=1)
+	_publishcontrol(userdata, username, "clear", [(binary.TAG_CLEAR, b"")])
 	database.clearschedule(cursor, username)
 
 def askschedule(userdata, displayname):
-	"""Ask the device for its current schedule."""
+	"""Ask the device for its current schedule.
+	
+	If the device schedule was received before, only the changes since then are asked for.
+	"""
 	
 	cursor   = userdata["cursor"]
 	client   = userdata["client"]
@@ -337,14 +539,25 @@ def askschedule(userdata, displayname):
 		print("can't find user " + shlex.quote(str(displayname)), file=sys.stderr)
 		return
 	
-	client.publish(username + "/admin", "asksschedule", qos=0)
+	known = userdata["deviceschedules"].get(username)
+	
+	if _binaryprotocol(userdata):
+		since = known[0].to_bytes(4, "little") if known is not None else b""
+		_publishcontrol(userdata, username, None, [(binary.TAG_ASKSCHEDULE, since)], qos=0)
+	else:
+		since = " " + str(known[0]) if known is not None else ""
+		client.publish(username + "/admin", "askschedule" + since, qos=0)
 
 def schedule_makeconsistent(userdata, username, deviceschedule):
 	"""Check that the device internal schedule and the database schedule are the same.
 	If not, send the necessary messages to the device to fix its schedule (database supersedes).
+	
+	The device schedule may be either a text descriptor or a binary protocol reply (bytes).
+	Incremental replies are applied on top of the last device schedule received.
 	"""
 	
 	cursor      = userdata["cursor"]
+	known       = userdata["deviceschedules"]
 	displayname = database.getdisplayname(cursor, username)
 	
 	if displayname is None:
@@ -352,13 +565,29 @@ def schedule_makeconsistent(userdata, username, deviceschedule):
 		return
 	
 	dbschedule = database.devschedule(cursor, displayname)
-	parsed     = _parseschedule(deviceschedule)
+	parsed     = _parseschedule(deviceschedule)  if isinstance(deviceschedule, str) else \
+	             _decodeschedule(deviceschedule)
 	
 	if parsed is None:
 		print("invalid device schedule descriptor", file=sys.stderr)
 		return
 	
-	deviceschedule, capacity = parsed
+	deviceschedule, capacity, count, version, since = parsed
+	
+	if since is not None:
+		if username not in known or known[username][0] != since:
+			print("incremental device schedule from an unknown version", file=sys.stderr)
+			known.pop(username, None)
+			return
+		
+		deviceschedule = known[username][1] + deviceschedule
+	
+	if count != len(deviceschedule):
+		print("inconsistent device schedule descriptor", file=sys.stderr)
+		known.pop(username, None)
+		return
+	
+	known[username] = (version, deviceschedule)
 	
 	diffextra   = [event for event in deviceschedule if not event in dbschedule]
 	diffmissing = [event for event in dbschedule     if not event in deviceschedule]
@@ -368,48 +597,110 @@ def schedule_makeconsistent(userdata, username, deviceschedule):
 		"is bigger than the maximum schedule memory of the device (" + str(capacity) + ")")
 		return
 	
+	if not diffextra and not diffmissing:
+		return
+	
 	# note that extras must be removed before adding missing events
 	# otherwise we may exceed the maximum schedule size for the device
 	
-	for event in diffextra:
-		unschedule(userdata, displayname, event)
+	_uploadschedule(userdata, username, False, diffextra, diffmissing)
+
+def _eventline(event, add):
+	"""Represent an event as a device schedule line, marked for addition (add = True) or removal."""
+	
+	eventstr = str(event)
+	sign     = "+" if add else "-"
+	
+	if event.recurrent:
+		return eventstr[:10] + sign + eventstr[10:]
+	else:
+		return eventstr[:6] + sign + eventstr[6:]
+
+def _uploadschedule(userdata, username, replace, removals, additions):
+	"""Send a batch of schedule changes to a device, applied by the device in a single step.
+	
+	If replace is True, the additions become the whole device schedule (and there must be no removals);
+	otherwise the removals are removed from the device schedule, and then the additions added to it.
+	Batches bigger than the device's message buffer are split; the following messages always update
+	the schedule (so only the first one of a split replacement clears it).
+	"""
+	
+	client = userdata["client"]
+	
+	if _binaryprotocol(userdata):
+		items = (([(binary.TAG_CLEAR, b"")] if replace else []) +
+		         [(binary.TAG_REMOVE, event.to_bytes()) for event in removals] +
+		         [(binary.TAG_ADD,    event.to_bytes()) for event in additions])
+		
+		itemsize  = 2 + len(Event.create_once("on").to_bytes())
+		batchsize = max(1, (_schedulebatchsize - 1) // itemsize)
+		
+		for i in range(0, len(items), batchsize):
+			client.publish(username + "/controlb", binary.encode_items(items[i:i + batchsize]), qos=1)
+		
+		return
+	
+	lines = ([_eventline(event, False) for event in removals] +
+	         [_eventline(event, True)  for event in additions])
+	
+	header  = "schedule =" if replace else "schedule +"
+	message = header
+	
+	for line in lines:
+		if len(message) + 1 + len(line) > _schedulebatchsize and message != header:
+			client.publish(username + "/control", message, qos=1)
+			message = "schedule +"
+		
+		message += "\n" + line
+	
+	client.publish(username + "/control", message, qos=1)
+
+def _decodeschedule(message):
+	"""Decode a binary schedule reply (coming from the device); same result as _parseschedule."""
 	
-	for event in diffmissing:
-		schedule(userdata, displayname, event)
+	try:
+		return binary.decode_schedule(message)
+	except ValueError:
+		return None
 
 def _parseschedule(text):
 	"""Parse a schedule descriptor (coming from the device) into an appropriate list.
 	
+	The descriptor starts with a "schedule" line, or "schedule +<since>" for an incremental one,
+	followed by a "<count>/<capacity> <version>" line and one line per event.
+	
 	Returns:
-		(events, capacity) events.   A list of event object descriptors.
-		                   capacity. The max number of scheduled events in this device.
+		(events, capacity, count, version, since) as in Event.decode_schedule.
 	"""
 	
-	lines = text.split("\n")
+	lines = text.rstrip("\n").split("\n")
 	
-	if len(lines) < 1:
+	if len(lines) < 2:
 		return None
 	
-	header = lines[0].split("/")
+	first  = lines[0].split()
+	header = lines[1].replace(" ", "/").split("/")
 	
-	if len(header) != 2:
+	if len(first) not in (1, 2) or first[0] != "schedule" or len(header) != 3:
 		return None
 	
 	try:
-		nevents  = int(header[0])
+		since    = int(first[1][1:]) if len(first) == 2 and first[1].startswith("+") else None
+		count    = int(header[0])
 		capacity = int(header[1])
+		version  = int(header[2])
 	except ValueError:
 		return None
 	
-	if nevents != len(lines) - 1:
+	if len(first) == 2 and since is None:
 		return None
 	
 	events = []
 	
 	try:
-		for line in lines[1:]:
+		for line in lines[2:]:
 			events.append(Event.from_string(line))
 	except ValueError:
 		return None
 	
-	return (events, capacity)
+	return (events, capacity, count, version, since)
@@ -8,31 +8,77 @@ import flask
 import ssl
 import sys
 import json
+import os
+import time
+import gzip
+import shutil
+import zlib
 
 app           = flask.Flask(__name__)
 configuration = None
+staticdir     = os.path.join(app.root_path, "static")
 
 def check_authorization():
 	return flask.request.headers.get("Authorization") == configuration["devmqttpsk"]
 
+def compressed(filename):
+	"""Name of a gzip-compressed copy of a static file, compressed again whenever the file changes."""
+	
+	path   = os.path.join(staticdir, filename)
+	gzpath = path + ".gz"
+	
+	if not os.path.exists(gzpath) or os.path.getmtime(gzpath) < os.path.getmtime(path):
+		with open(path, "rb") as original, gzip.GzipFile(gzpath + ".tmp", "wb", 9, mtime=0) as compressedfile:
+			shutil.copyfileobj(original, compressedfile)
+		
+		os.replace(gzpath + ".tmp", gzpath)
+	
+	return filename + ".gz"
+
+def rolledout(mac, released):
+	"""Check if the rollout of a firmware released at the given time has reached a device.
+	
+	Each device gets a fixed slot from its MAC address, and the slots are reached uniformly
+	during the 'devfirmwarerollout' seconds after the release, so the fleet doesn't download
+	the image all at once.
+	"""
+	
+	rollout = configuration["devfirmwarerollout"]
+	
+	if rollout <= 0:
+		return True
+	
+	slot = (zlib.crc32(mac.encode("utf8")) % 1000) / 1000
+	
+	return slot < (time.time() - released) / rollout
+
 @app.route("/static/sonoff-firmware.bin", methods=["GET"])
 def sonoff_firmware():
 	
 	if not check_authorization():
 		flask.abort(404)
 	
+	# the version header is the running version, followed by the image formats the device accepts
 	try:
-		version = int(flask.request.headers.get("X-ESP8266-version"))
-	except:
-		version = sys.maxint
+		words   = flask.request.headers.get("X-ESP8266-version").split()
+		version = int(words[0])
+	except (AttributeError, IndexError, ValueError):
+		words   = []
+		version = sys.maxsize
 	
-	available = 1
+	available = configuration["devfirmwareversion"]
+	released  = os.path.getmtime(os.path.join(staticdir, "sonoff-firmware.bin"))
+	mac       = flask.request.headers.get("X-ESP8266-STA-MAC", "")
 	
-	if version < available:
-		return flask.send_from_directory("static/", "sonoff-firmware.bin")
-	else:
+	if version >= available or not rolledout(mac, released):
 		return ("", 304, {})
 	
+	if "gzip" in words[1:]:  # written to flash as it is, the bootloader inflates it when installing it
+		return flask.send_from_directory(staticdir, compressed("sonoff-firmware.bin"),
+		                                 mimetype="application/octet-stream")
+	else:
+		return flask.send_from_directory(staticdir, "sonoff-firmware.bin")
+	
 @app.route("/static/access", methods=["GET"])
 def access():
 	if not check_authorization():
@@ -41,6 +87,8 @@ def access():
 	return ("", 204, {"X-SSID": configuration["wifissid"], "X-PSK": configuration["wifipass"]})
 
 def main():
+	global configuration
+	
 	try:
 		with open("configuration.json") as configfile:
 			configuration = json.loads(configfile.read())
@@ -48,6 +96,9 @@ def main():
 		print("Can't open configuration file", file=sys.stderr)
 		return
 	
+	configuration.setdefault("devfirmwareversion", 1)
+	configuration.setdefault("devfirmwarerollout", 0)
+	
 	sslcontext = ssl.SSLContext(ssl.PROTOCOL_TLSv1_2)
 	sslcontext.load_cert_chain(configuration["certificate"], configuration["privatekey"])
 	
@@ -37,8 +37,16 @@ import paho.mqtt.client as mqtt
 import database
 import device
 
-_lobbyregex = re.compile(r"^([^/]+)/lobby$")
-_adminregex = re.compile(r"^([^/]+)/admin$")
+_lobbyregex  = re.compile(r"^([^/]+)/lobby$")
+_adminregex  = re.compile(r"^([^/]+)/admin$")
+_adminbregex = re.compile(r"^([^/]+)/adminb$")
+_statusregex = re.compile(r"^([^/]+)/status$")
+_sensorregex = re.compile(r"^([^/]+)/sensor$")
+
+def _brokerpresence(userdata):
+	"""Whether the broker authorization plugin keeps the device presence in the database."""
+	
+	return userdata["configuration"].get("devpresenceinterval", 0) > 0
 
 def onconnect(client, userdata, rc):
 	"""MQTT connect callback."""
@@ -48,13 +56,16 @@ def onconnect(client, userdata, rc):
 		cursor = userdata["cursor"]
 		
 		client.subscribe("#", qos=0)
-		users = database.userlist(cursor)
 		
-		for (username, _) in users:
-			database.setconnected(cursor, username, False)
-			client.publish(username + "/lobby", "ping")
-		
-		db.commit()
+		# the broker already knows who is connected, otherwise ask everyone
+		if not _brokerpresence(userdata):
+			users = database.userlist(cursor)
+			
+			for (username, _) in users:
+				database.setconnected(cursor, username, False)
+				client.publish(username + "/lobby", "ping")
+			
+			db.commit()
 	else:
 		userdata["done"] = True
 
@@ -74,6 +85,18 @@ def onmessage(client, userdata, message):
 	guestlist = userdata["guestlist"]
 	match     = _lobbyregex.match(message.topic)
 	
+	# binary protocol replies; only the schedule is sent this way
+	binmatch = _adminbregex.match(message.topic)
+	
+	if binmatch:
+		username = binmatch.group(1)
+		
+		if database.exists_username(cursor, username):
+			device.schedule_makeconsistent(userdata, username, bytes(message.payload))
+		
+		print(file=sys.stderr)
+		return
+	
 	try:
 		data = message.payload.decode("utf8")
 	except UnicodeDecodeError:
@@ -89,14 +112,18 @@ def onmessage(client, userdata, message):
 			
 			if data == "hello" or data == "here":
 				print("connected: " + shlex.quote(displayname))
-				database.setconnected(cursor, username, True)
+				
+				if not _brokerpresence(userdata):
+					database.setconnected(cursor, username, True)
 				
 				if data == "hello":
 					device.sync(userdata, displayname)
 				
 			elif data == "disconnected" or data == "abruptly disconnected":
 				print("disconnected: " + shlex.quote(displayname))
-				database.setconnected(cursor, username, False)
+				
+				if not _brokerpresence(userdata):
+					database.setconnected(cursor, username, False)
 			
 			db.commit()
 		else:
@@ -105,6 +132,25 @@ def onmessage(client, userdata, message):
 			elif data == "disconnected" or data == "abruptly disconnected":
 				guestlist.discard(username)
 	
+	# retained, so every device status arrives again when subscribing
+	match = _statusregex.match(message.topic)
+	
+	if match:
+		username = match.group(1)
+		
+		if database.exists_username(cursor, username) and data in ("on", "off"):
+			database.setstatus(cursor, username, data)
+			db.commit()
+	
+	# one line per window of sensor samples
+	match = _sensorregex.match(message.topic)
+	
+	if match:
+		username = match.group(1)
+		
+		if database.exists_username(cursor, username):
+			device.storesensordata(userdata, username, data)
+	
 	match = _adminregex.match(message.topic)
 	
 	if match:
@@ -115,7 +161,11 @@ def onmessage(client, userdata, message):
 				database.setstatus(cursor, username, data[7:])  # strip "status "
 				db.commit()
 			elif data.startswith("schedule"):
-				device.schedule_makeconsistent(userdata, username, data[9:])  # strip "schedule\n"
+				device.schedule_makeconsistent(userdata, username, data)
+			elif data.startswith("log\n"):
+				print("log " + shlex.quote(username) + ":\n" + data[4:], file=sys.stderr)
+			elif data.startswith("stats\n"):
+				print("stats " + shlex.quote(username) + ":\n" + data[6:], file=sys.stderr)
 	
 	print(file=sys.stderr)
 
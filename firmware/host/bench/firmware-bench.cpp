@@ -0,0 +1,367 @@
+// firmware-bench.cpp
+// Microbenchmarks of the firmware units
+// Part of AutoHome
+//
+// Runs the scheduler, the text protocol parser and the settings store of the firmware on the host,
+// with a full schedule of random commands: lines parsed, fire dates calculated, scheduler callbacks
+// and settings written to the emulated flash. Reports throughput and latency percentiles for each
+// workload, and the flash wear of the writes.
+//
+// Usage: ah-firmware-bench [-n commands] [-o operations] [-s seed]
+//
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <Arduino.h>
+
+#include <time.h>
+#include <unistd.h>
+
+extern "C" {
+#include <spi_flash.h>
+}
+
+#include "schedule.h"
+#include "textprotocol.h"
+#include "settings.h"
+#include "sensor.h"
+
+// current monotonic time, in nanoseconds
+static uint64_t now()
+{
+	timespec time;
+	
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	
+	return static_cast<uint64_t>(time.tv_sec) * 1000000000u + time.tv_nsec;
+}
+
+// next number of a xorshift64* pseudo-random sequence
+static uint64_t randomnext(uint64_t& state)
+{
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	
+	return state * 0x2545f4914f6cdd1dull;
+}
+
+// order two latencies
+static int latencycmp(const void* a, const void* b)
+{
+	uint64_t x = *static_cast<const uint64_t*>(a);
+	uint64_t y = *static_cast<const uint64_t*>(b);
+	
+	return (x > y) - (x < y);
+}
+
+// print the throughput and latency percentiles of a workload; sorts the latencies (in ns)
+static void report(const char* name, uint64_t* latencies, size_t count, uint64_t elapsed)
+{
+	if (count == 0) {
+		return;
+	}
+	
+	qsort(latencies, count, sizeof (uint64_t), latencycmp);
+	
+	printf("%-22s %10zu ops %12.0f ops/s   p50 %8.2f us   p99 %8.2f us   max %9.2f us\n",
+	       name, count, count / (elapsed / 1e9), latencies[count / 2] / 1e3,
+	       latencies[count - 1 - count / 100] / 1e3, latencies[count - 1] / 1e3);
+}
+
+// a random scheduled command; half of them recurrent, on random days
+static ScheduledCmd randomcommand(uint64_t& seed)
+{
+	ScheduledCmd cmd;
+	uint64_t     bits = randomnext(seed);
+	
+	cmd.command   = (bits & 1) ? '1' : '0';
+	cmd.fuzzy     = (bits >> 1) & 1;
+	cmd.recurrent = (bits >> 2) & 1;
+	
+	if (cmd.recurrent) {
+		cmd.days    = 1 + (bits >> 8) % everyday;
+		cmd.hours   = (bits >> 16) % 24;
+		cmd.minutes = (bits >> 24) % 60;
+	}
+	else {
+		cmd.firedate = (bits >> 32) % (20 * 365 * 24 * 60 * 60);  // some time in 20 years from scheduleepoch
+	}
+	
+	return cmd;
+}
+
+// parse control message schedule lines, the reply lines of random commands with an add/remove flag
+static void runparse(long operations, uint64_t& seed, uint64_t* latencies)
+{
+	const int lines  = 1024;
+	char      (*text)[schedlinesize + 1] = new char[lines][schedlinesize + 1];
+	int       length[lines];
+	
+	for (int k = 0; k < lines; k++) {
+		char reply[schedlinesize];
+		int  count  = formatscommand(reply, randomcommand(seed));
+		int  prefix = static_cast<const char*>(memchr(reply, ' ', count)) - reply + 1;
+		
+		memcpy(text[k], reply, prefix);
+		text[k][prefix] = (randomnext(seed) & 1) ? '+' : '-';
+		memcpy(&text[k][prefix + 1], &reply[prefix], count - prefix - 1);
+		length[k] = count;
+	}
+	
+	uint64_t start = now();
+	
+	for (long i = 0; i < operations; i++) {
+		ScheduledCmd cmd;
+		bool         add;
+		uint64_t     begin = now();
+		
+		if (!parsescommand(text[i % lines], length[i % lines], cmd, add)) {
+			fprintf(stderr, "Can't parse '%.*s'\n", length[i % lines], text[i % lines]);
+		}
+		
+		latencies[i] = now() - begin;
+	}
+	
+	report("parse schedule line", latencies, operations, now() - start);
+	
+	delete[] text;
+}
+
+// calculate fire dates: one command at a time from random dates, then the whole schedule at once
+static void runnextfire(long operations, uint64_t& seed, uint64_t* latencies)
+{
+	uint64_t start = now();
+	
+	for (long i = 0; i < operations; i++) {
+		const ScheduledCmd& cmd  = settings.schedule[i % settings.nscheduled];
+		uint64_t            date = scheduleepoch + randomnext(seed) % (20ull * 365 * 24 * 60 * 60);
+		uint64_t            begin = now();
+		
+		nextfire[i % settings.nscheduled] = nextfiredate(cmd, date);
+		latencies[i] = now() - begin;
+	}
+	
+	report("nextfiredate", latencies, operations, now() - start);
+	
+	long rounds = operations / settings.nscheduled + 1;
+	
+	start = now();
+	
+	for (long i = 0; i < rounds; i++) {
+		uint64_t date  = scheduleepoch + randomnext(seed) % (20ull * 365 * 24 * 60 * 60);
+		uint64_t begin = now();
+		
+		firedates(settings.schedule, settings.nscheduled, date);
+		latencies[i] = now() - begin;
+	}
+	
+	report("firedates (schedule)", latencies, rounds, now() - start);
+}
+
+// run the scheduler callback work from fire date to fire date: take the due commands out of the fire heap,
+// calculate the next fire date of the recurrent ones and put them back, and the timeout to the next one
+static void runcallbacks(long operations, uint64_t* latencies)
+{
+	ScheduledCmd schedule[maxnscheduled];
+	int          n = 0;
+	
+	for (int i = 0; i < settings.nscheduled; i++) {  // one-off commands would run out
+		if (settings.schedule[i].recurrent) {
+			schedule[n++] = settings.schedule[i];
+		}
+	}
+	
+	if (n == 0) {
+		return;
+	}
+	
+	uint64_t date = scheduleepoch;
+	
+	firedates(schedule, n, date);
+	
+	uint64_t start = now();
+	long     taken = 0;
+	
+	for (long i = 0; i < operations; i++) {
+		byte     due[maxnscheduled];
+		byte     command;
+		uint64_t begin = now();
+		
+		date = nextfire[fireheap[0]];
+		
+		int ndue = takedue(schedule, date, due, command);
+		
+		for (int k = 0; k < ndue; k++) {
+			nextfire[due[k]] = nextfiredate(schedule[due[k]], date);
+			heapinsert(due[k]);
+		}
+		
+		firetimeout(date * 1000);
+		latencies[i] = now() - begin;
+		taken       += ndue;
+	}
+	
+	report("scheduler callback", latencies, operations, now() - start);
+	printf("%-22s %10.2f commands/callback\n", "", static_cast<double>(taken) / operations);
+}
+
+// checksum the settings, as done for every write
+static void runchecksum(long operations, uint64_t* latencies)
+{
+	uint64_t start = now();
+	uint32_t total = 0;
+	
+	for (long i = 0; i < operations; i++) {
+		uint64_t begin = now();
+		
+		total        += settings_checksum(&settings);
+		latencies[i]  = now() - begin;
+	}
+	
+	report("settings checksum", latencies, operations, now() - start);
+	
+	if (total == 1) {  // keep the checksums from being optimized out
+		printf("\n");
+	}
+}
+
+// write settings changes to flash: a single command added or removed, then a whole new schedule
+static void runflush(long operations, uint64_t& seed, uint64_t* latencies)
+{
+	int changes[2] = { 1, maxnscheduled };
+	
+	for (int c = 0; c < 2; c++) {
+		uint32_t erases  = spi_flash_erases;
+		uint64_t written = spi_flash_written;
+		uint64_t start   = now();
+		
+		for (long i = 0; i < operations; i++) {
+			for (int k = 0; k < changes[c]; k++) {
+				settings.schedule[randomnext(seed) % settings.nscheduled] = randomcommand(seed);
+			}
+			
+			uint64_t begin = now();
+			
+			flush_settings();
+			latencies[i] = now() - begin;
+		}
+		
+		report((c == 0) ? "flush one command" : "flush schedule", latencies, operations, now() - start);
+		printf("%-22s %10.1f bytes/flush   %.4f erases/flush\n", "",
+		       static_cast<double>(spi_flash_written - written) / operations,
+		       static_cast<double>(spi_flash_erases - erases) / operations);
+	}
+}
+
+// aggregate the samples of a default window and format its line, as published
+static void runsensor(long operations, uint64_t& seed, uint64_t* latencies)
+{
+	char         line[windowlinesize];
+	SensorWindow window;
+	uint64_t     bytes = 0;
+	uint64_t     start = now();
+	
+	for (long i = 0; i < operations; i++) {
+		uint64_t begin = now();
+		
+		startwindow(window, 1500000000 + i * sensorwindow, sensorwindow);
+		
+		for (int k = 0; k < sensorwindow * 1000 / sensorperiod; k++) {
+			addsample(window, static_cast<int32_t>(randomnext(seed) % 4000) - 1000);
+		}
+		
+		bytes        += formatwindow(line, "temperature", window);
+		latencies[i]  = now() - begin;
+	}
+	
+	report("sensor window", latencies, operations, now() - start);
+	printf("%-22s %10.1f bytes/window\n", "", static_cast<double>(bytes) / operations);
+}
+
+// print the program usage
+static void usage(const char* program)
+{
+	fprintf(stderr, "Usage: %s [-n commands] [-o operations] [-s seed]\n"
+	                "  -n  scheduled commands (default: %d)\n"
+	                "  -o  operations of each workload (default: 100000)\n"
+	                "  -s  random seed (default: 1)\n", program, maxnscheduled);
+}
+
+int main(int argc, char** argv)
+{
+	long     commands   = maxnscheduled;
+	long     operations = 100000;
+	uint64_t seed       = 1;
+	int      option;
+	
+	while ((option = getopt(argc, argv, "n:o:s:h")) != -1) {
+		switch (option) {
+			case 'n': commands   = atol(optarg);                   break;
+			case 'o': operations = atol(optarg);                   break;
+			case 's': seed       = strtoull(optarg, nullptr, 10); break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	
+	if (commands < 1 || commands > maxnscheduled || operations < 1 || optind != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	
+	if (seed == 0) {  // xorshift never leaves 0
+		seed = 1;
+	}
+	
+	uint64_t* latencies = new uint64_t[operations];
+	
+	settings = Settings();
+	
+	for (long i = 0; i < commands; i++) {
+		settings.schedule[settings.nscheduled++] = randomcommand(seed);
+	}
+	
+	settings.checksum = settings_checksum(&settings);
+	compact_settings();
+	
+	runparse(operations, seed, latencies);
+	runnextfire(operations, seed, latencies);
+	runcallbacks(operations, latencies);
+	runchecksum(operations, latencies);
+	runflush(operations, seed, latencies);
+	runsensor(operations, seed, latencies);
+	
+	bool clean = load_settings();
+	
+	if (!clean || settings.checksum != settings_checksum(&settings)) {
+		fprintf(stderr, "The settings read back from flash are not the ones written\n");
+		return 1;
+	}
+	
+	delete[] latencies;
+	
+	return 0;
+}
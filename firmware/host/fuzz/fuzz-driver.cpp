@@ -0,0 +1,180 @@
+// fuzz-driver.cpp
+// Stand-in for the libFuzzer driver, for compilers without it
+// Part of AutoHome
+//
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Runs the harness on every file given, then on random mutations of built-in seed lines,
+// so the parser can still be fuzzed under the sanitizers when built with gcc.
+//
+// Usage: ah-parser-fuzz [-n runs] [-s seed] [file...]
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+const int maxinput = 64;  // longest mutated input
+
+const char* const seeds[] = {
+	"timed +x 1633436220 on",
+	"timed -z 1483228800 off",
+	"timed +z  4294967295   on",
+	"recurrent +x6 16.51 off",
+	"recurrent -z135 07.05 on",
+	"recurrent +x0 00.00 on",
+	"recurrent +z1234567 23.59 off",
+	"timed",
+	"recurrent",
+};
+
+// bytes the parser gives meaning to, so the mutations reach its deeper states more often
+const char tokens[] = "0123456789 \t\n.+-xzonf";
+
+// next number of a xorshift64* pseudo-random sequence
+static uint64_t randomnext(uint64_t& state)
+{
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	
+	return state * 0x2545f4914f6cdd1dull;
+}
+
+// apply a few random edits (replace, insert, delete or truncate) to an input
+// return its new size
+static size_t mutate(uint8_t* data, size_t size, uint64_t& state)
+{
+	int edits = 1 + randomnext(state) % 4;
+	
+	for (int e = 0; e < edits; e++) {
+		size_t  at   = (size > 0) ? randomnext(state) % size : 0;
+		uint8_t byte = (randomnext(state) % 4 == 0) ? randomnext(state) : tokens[randomnext(state) % (sizeof (tokens) - 1)];
+		
+		switch (randomnext(state) % 4) {
+			case 0:
+				if (size > 0) {
+					data[at] = byte;
+				}
+				break;
+			
+			case 1:
+				if (size < maxinput) {
+					memmove(&data[at + 1], &data[at], size - at);
+					data[at] = byte;
+					size    += 1;
+				}
+				break;
+			
+			case 2:
+				if (size > 0) {
+					memmove(&data[at], &data[at + 1], size - at - 1);
+					size -= 1;
+				}
+				break;
+			
+			default:
+				size = at;
+				break;
+		}
+	}
+	
+	return size;
+}
+
+// run the harness on the contents of a file
+// return false if it can't be read
+static bool runfile(const char* path)
+{
+	FILE* file = fopen(path, "rb");
+	
+	if (file == nullptr) {
+		return false;
+	}
+	
+	uint8_t data[4096];
+	size_t  size = fread(data, 1, sizeof (data), file);
+	
+	fclose(file);
+	LLVMFuzzerTestOneInput(data, size);
+	
+	return true;
+}
+
+// print the program usage
+static void usage(const char* program)
+{
+	fprintf(stderr, "Usage: %s [-n runs] [-s seed] [file...]\n"
+	                "  -n  mutated inputs to run (default: 1000000)\n"
+	                "  -s  random seed (default: 1)\n"
+	                "  files are run as they are, before the mutations\n", program);
+}
+
+int main(int argc, char** argv)
+{
+	long     runs  = 1000000;
+	uint64_t state = 1;
+	int      option;
+	
+	while ((option = getopt(argc, argv, "n:s:h")) != -1) {
+		switch (option) {
+			case 'n': runs  = atol(optarg);                   break;
+			case 's': state = strtoull(optarg, nullptr, 10); break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	
+	if (state == 0) {  // xorshift never leaves 0
+		state = 1;
+	}
+	
+	for (int i = optind; i < argc; i++) {
+		if (!runfile(argv[i])) {
+			fprintf(stderr, "Can't read %s\n", argv[i]);
+			return 1;
+		}
+	}
+	
+	const int nseeds = sizeof (seeds) / sizeof (seeds[0]);
+	
+	for (long r = 0; r < runs; r++) {
+		uint8_t data[maxinput];
+		size_t  size = strlen(seeds[r % nseeds]);
+		
+		memcpy(data, seeds[r % nseeds], size);
+		size = mutate(data, size, state);
+		
+		LLVMFuzzerTestOneInput(data, size);
+	}
+	
+	printf("%ld inputs run\n", runs + argc - optind);
+	
+	return 0;
+}
@@ -0,0 +1,82 @@
+// parser-fuzz.cpp
+// libFuzzer harness of the text protocol schedule line parser
+// Part of AutoHome
+//
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <Arduino.h>
+
+#include <stdio.h>
+
+#include "schedule.h"
+#include "textprotocol.h"
+
+// report a line the parser got wrong and stop, so the fuzzer keeps it
+static void fail(const char* problem, const char* line, size_t size)
+{
+	fprintf(stderr, "%s: '%.*s'\n", problem, static_cast<int>(size), line);
+	abort();
+}
+
+// parse the input as a schedule line of a control message; one that parses must describe
+// a valid command, and its schedule reply line must read back as the same command
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	// a copy of exactly the input, like the MQTT payload, so the sanitizers catch any read past it
+	char*        line = new char[size];
+	ScheduledCmd cmd;
+	bool         add;
+	
+	memcpy(line, data, size);
+	
+	if (parsescommand(line, size, cmd, add)) {
+		if ((cmd.command != '0' && cmd.command != '1') || (cmd.recurrent && (cmd.days == 0 || cmd.hours > 23 || cmd.minutes > 59))) {
+			fail("Invalid command parsed", line, size);
+		}
+		
+		nextfiredate(cmd, scheduleepoch + cmd.firedate);
+		
+		// the reply line has no add/remove flag, it goes before the fuzzy one
+		char         reply[schedlinesize];
+		char         again[schedlinesize + 1];
+		int          length = formatscommand(reply, cmd);
+		const char*  space  = static_cast<const char*>(memchr(reply, ' ', length));
+		int          prefix = space - reply + 1;
+		ScheduledCmd readback;
+		bool         readadd;
+		
+		memcpy(again, reply, prefix);
+		again[prefix] = '+';
+		memcpy(&again[prefix + 1], &reply[prefix], length - prefix - 1);  // without the \n
+		
+		if (!parsescommand(again, length, readback, readadd) || scommandcmp(cmd, readback) != 0) {
+			fail("Reply line read back as another command", again, length);
+		}
+	}
+	
+	delete[] line;
+	
+	return 0;
+}
@@ -0,0 +1,205 @@
+// shim.cpp
+// Host shims of the Arduino core and ESP8266 SDK functions used by the firmware units
+// Part of AutoHome
+//
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <Arduino.h>
+
+#include <stdarg.h>
+#include <time.h>
+
+extern "C" {
+#include <spi_flash.h>
+}
+
+#include "log.h"
+
+// Clock
+// ------------------------------------------------------------------------------
+
+// monotonic time since the first call, in microseconds
+static uint64_t elapsedus()
+{
+	static timespec start;
+	static bool     started = false;
+	timespec        time;
+	
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	
+	if (!started) {
+		start   = time;
+		started = true;
+	}
+	
+	return (time.tv_sec - start.tv_sec) * 1000000ull + time.tv_nsec / 1000 - start.tv_nsec / 1000;
+}
+
+unsigned long millis()
+{
+	return static_cast<uint32_t>(elapsedus() / 1000);
+}
+
+unsigned long micros()
+{
+	return static_cast<uint32_t>(elapsedus());
+}
+
+// Random numbers
+// ------------------------------------------------------------------------------
+
+static uint64_t randomstate = 1;
+
+long random(long howbig)
+{
+	if (howbig <= 0) {
+		return 0;
+	}
+	
+	randomstate ^= randomstate >> 12;  // xorshift64*
+	randomstate ^= randomstate << 25;
+	randomstate ^= randomstate >> 27;
+	
+	return (randomstate * 0x2545f4914f6cdd1dull >> 33) % howbig;
+}
+
+long random(long howsmall, long howbig)
+{
+	if (howsmall >= howbig) {
+		return howsmall;
+	}
+	
+	return howsmall + random(howbig - howsmall);
+}
+
+void noInterrupts()
+{
+}
+
+void interrupts()
+{
+}
+
+// Flash
+// ------------------------------------------------------------------------------
+
+const int flashsectors = 4;  // enough for the settings sector, wherever _SPIFFS_end puts it
+
+static uint8_t flash[flashsectors * SPI_FLASH_SEC_SIZE];
+static bool    flashready = false;
+
+uint32_t spi_flash_erases  = 0;
+uint64_t spi_flash_written = 0;
+int64_t  spi_flash_cutafter = -1;
+
+extern "C" {
+uint32_t _SPIFFS_end = 0;
+}
+
+// byte of the emulated flash at an address; a new flash comes erased
+static uint8_t& flashbyte(uint32_t address)
+{
+	if (!flashready) {
+		memset(flash, 0xff, sizeof (flash));
+		flashready = true;
+	}
+	
+	return flash[address % sizeof (flash)];
+}
+
+SpiFlashOpResult spi_flash_erase_sector(uint16_t sec)
+{
+	if (spi_flash_cutafter == 0) {
+		return SPI_FLASH_RESULT_OK;
+	}
+	
+	for (uint32_t i = 0; i < SPI_FLASH_SEC_SIZE; i++) {
+		flashbyte(sec * SPI_FLASH_SEC_SIZE + i) = 0xff;
+	}
+	
+	spi_flash_erases += 1;
+	
+	return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_write(uint32_t des_addr, uint32_t* src_addr, uint32_t size)
+{
+	const uint8_t* src = reinterpret_cast<const uint8_t*>(src_addr);
+	
+	if (des_addr % 4 != 0 || size % 4 != 0) {  // the SDK only writes whole words
+		return SPI_FLASH_RESULT_ERR;
+	}
+	
+	for (uint32_t i = 0; i < size && spi_flash_cutafter != 0; i++) {
+		flashbyte(des_addr + i) &= src[i];
+		
+		if (spi_flash_cutafter > 0) {
+			spi_flash_cutafter -= 1;
+		}
+	}
+	
+	spi_flash_written += size;
+	
+	return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_read(uint32_t src_addr, uint32_t* des_addr, uint32_t size)
+{
+	uint8_t* des = reinterpret_cast<uint8_t*>(des_addr);
+	
+	if (src_addr % 4 != 0 || size % 4 != 0) {
+		return SPI_FLASH_RESULT_ERR;
+	}
+	
+	for (uint32_t i = 0; i < size; i++) {
+		des[i] = flashbyte(src_addr + i);
+	}
+	
+	return SPI_FLASH_RESULT_OK;
+}
+
+// Log
+// ------------------------------------------------------------------------------
+
+// the lines are always formatted, so their arguments are checked as on the device,
+// but only printed (to stderr) if AH_FIRMWARE_LOG is set in the environment
+void logprintf(const char* format, ...)
+{
+	static int verbose = -1;
+	char       line[128];
+	va_list    args;
+	
+	if (verbose < 0) {
+		verbose = getenv("AH_FIRMWARE_LOG") != nullptr;
+	}
+	
+	va_start(args, format);
+	vsnprintf(line, sizeof (line), format, args);
+	va_end(args);
+	
+	if (verbose) {
+		fputs(line, stderr);
+	}
+}
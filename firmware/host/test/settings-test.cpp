@@ -0,0 +1,215 @@
+// settings-test.cpp
+// Power loss tests of the settings journal
+// Part of AutoHome
+//
+// Runs the scheduler, the text protocol parser and the settings store of the firmware on the host,
+// with a full schedule of random commands: lines parsed, fire dates calculated, scheduler callbacks
+// and settings written to the emulated flash. Reports throughput and latency percentiles for each
+// workload, and the flash wear of the writes.
+//
+// Usage: ah-firmware-bench [-n commands] [-o operations] [-s seed]
+//
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <Arduino.h>
+
+extern "C" {
+#include <spi_flash.h>
+}
+
+#include "settings.h"
+
+// Every test writes a change to the settings store, cutting the power after each possible number of bytes,
+// then boots like the sketch does: the settings read back must be either the old or the new ones as a whole,
+// and a store left with a damaged tail must take further changes once compacted
+
+typedef uint8_t SettingsImage[sizeof (Settings)];
+
+static int failures = 0;
+
+// report a failed check
+static void fail(const char* test, int64_t cut, const char* what)
+{
+	fprintf(stderr, "%s, power cut after %lld bytes: %s\n", test, static_cast<long long>(cut), what);
+	failures += 1;
+}
+
+// set the global settings to a stored image, fixing their checksum
+static void setimage(SettingsImage& image, const Settings& source)
+{
+	settings          = source;
+	settings.checksum = settings_checksum(&settings);
+	memcpy(image, &settings, sizeof (Settings));
+}
+
+// true if the global settings are the given image
+static bool isimage(const SettingsImage& image)
+{
+	return memcmp(&settings, image, sizeof (Settings)) == 0;
+}
+
+// write the base settings on an erased sector, followed by 'history' committed changes in the journal
+static void writebase(const Settings& base, int history)
+{
+	spi_flash_cutafter = -1;
+	
+	settings          = base;
+	settings.checksum = settings_checksum(&settings);
+	compact_settings();
+	
+	for (int i = 0; i < history; i++) {
+		settings.schedule[i].hours = (settings.schedule[i].hours + 1) % 24;
+		flush_settings();
+	}
+}
+
+// load the settings as the sketch does on boot, compacting the store if the journal has a damaged tail
+// return what load_settings() returned
+static bool boot()
+{
+	strcpy(settings.ssid, "stale");  // something load_settings() must overwrite
+	
+	bool clean = load_settings();
+	
+	if (!clean && settings.checksum == settings_checksum(&settings)) {
+		compact_settings();
+	}
+	
+	return clean;
+}
+
+// cut the power at every byte of the flush of 'change' on top of 'base' and its history
+static void runpowercut(const char* test, const Settings& base, const Settings& change, int history)
+{
+	SettingsImage oldimage;
+	SettingsImage newimage;
+	SettingsImage nextimage;
+	
+	writebase(base, history);
+	memcpy(oldimage, &settings, sizeof (Settings));
+	
+	Settings changed = change;
+	
+	for (int i = 0; i < history; i++) {
+		changed.schedule[i].hours = settings.schedule[i].hours;
+	}
+	
+	setimage(newimage, changed);
+	
+	uint64_t written = spi_flash_written;
+	
+	flush_settings();
+	
+	int64_t size = spi_flash_written - written;  // bytes written by the whole change
+	
+	Settings next = changed;  // a further change, written after the boot
+	strcpy(next.mqtt_pass, "after the power cut");
+	setimage(nextimage, next);
+	
+	for (int64_t cut = 0; cut <= size; cut++) {
+		writebase(base, history);
+		memcpy(&settings, newimage, sizeof (Settings));
+		
+		spi_flash_cutafter = cut;
+		flush_settings();
+		spi_flash_cutafter = -1;
+		
+		bool clean = boot();
+		bool isnew = isimage(newimage);
+		
+		// the padding of the last record is not covered by its checksum, so the change is finished
+		// once the bytes before it are written
+		if (!isnew && !isimage(oldimage)) {
+			fail(test, cut, "the settings are neither the old nor the new ones");
+			continue;
+		}
+		
+		if ((cut >= size && !isnew) || (cut < size - 3 && isnew)) {
+			fail(test, cut, isnew ? "an unfinished change was replayed" : "a finished change was lost");
+		}
+		
+		if (clean != (cut == 0 || isnew)) {
+			fail(test, cut, clean ? "the torn change was not reported" : "a finished change was reported as torn");
+		}
+		
+		if (!load_settings()) {
+			fail(test, cut, "the journal still has a damaged tail after booting");
+		}
+		
+		memcpy(&settings, nextimage, sizeof (Settings));
+		flush_settings();
+		
+		if (!boot() || !isimage(nextimage)) {
+			fail(test, cut, "a change written after the boot was not read back");
+		}
+	}
+	
+	printf("%-34s %4lld cuts\n", test, static_cast<long long>(size + 1));
+}
+
+int main()
+{
+	Settings base;
+	
+	strcpy(base.mqtt_user, "sonoff-1234");
+	strcpy(base.mqtt_pass, "secret");
+	
+	for (int i = 0; i < maxnscheduled / 2; i++) {
+		ScheduledCmd& cmd = base.schedule[base.nscheduled++];
+		
+		cmd.command   = '0' + i % 2;
+		cmd.recurrent = true;
+		cmd.days      = everyday;
+		cmd.hours     = i % 24;
+		cmd.minutes   = (i * 7) % 60;
+	}
+	
+	// the fields set below are far enough apart to be written as separate records, so a cut between
+	// them leaves finished records that must be discarded for lack of the commit flag
+	Settings change = base;
+	
+	strcpy(change.mqtt_user, "renamed");
+	change.schedule[0].minutes                 = 59;
+	change.schedule[base.nscheduled].command   = '1';
+	change.schedule[base.nscheduled].firedate  = 12345678;
+	change.nscheduled                         += 1;
+	change.schedule[maxnscheduled - 1].command = '0';
+	
+	runpowercut("change on an empty journal", base, change, 0);
+	runpowercut("change after three others", base, change, 3);
+	
+	Settings single = base;  // a change written as a single record
+	
+	single.schedule[1].hours = 23;
+	
+	runpowercut("single record change", base, single, 0);
+	
+	if (failures > 0) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	
+	return 0;
+}
@@ -33,20 +33,107 @@
 #define DEFAULT_WIFI_SSID "default-ssid"
 #define DEFAULT_WIFI_PASS "default-pass"
 
+// Set to 1 to connect to the MQTT broker through TLS-PSK once paired, using the key received
+// along with the MQTT credentials, which skips the certificate exchange and verification of a full
+// TLS handshake; guests still connect through the certificate-based listener.
+// Requires a WiFiClientSecure providing setPreSharedKey() (the stock ESP8266 core one does not).
+// Enabling it changes the layout of the settings stored in EEPROM, which are reset once.
+#define MQTT_USE_PSK 0
+
+// Set to 1 to resume TLS sessions: the MQTT and HTTPS clients offer the session of their last handshake
+// (kept in RTC memory, so it also survives restarts), letting the servers skip the key exchange.
+// Requires the BearSSL WiFiClientSecure (providing setSession() and setFingerprint()) and the
+// ESPhttpUpdate and HTTPClient calls taking a client.
+#define TLS_SESSION_RESUME 0
+
+// Set to 1 to keep the MQTT session of a paired device across reconnections: it connects without the
+// clean session flag and subscribes to its admin and control topics with QoS 1, so the broker queues the
+// commands sent while it is offline (for as long as persistent_client_expiration) and delivers them on
+// reconnection. Those reconnections say "here" instead of "hello", since nothing needs to be resent.
+// Requires a PubSubClient whose connect() takes the clean session flag (2.7 or later).
+#define MQTT_PERSISTENT_SESSION 0
+
+// Set to 1 to let the whole chip light-sleep while the main loop idles, instead of only the radio (modem
+// sleep). Both keep the connection to the access point, waking up for every DTIM beacon, so the MQTT
+// keepalive and the scheduler ticker are served at most a beacon interval late (usually 100 to 300 ms).
+// The button interrupt can't wake the chip from light sleep, so presses also wait for the next beacon.
+#define LIGHT_SLEEP 0
+
+// Set to 1 to accept gzip-compressed firmware images from the update server, which are written to the
+// OTA partition as they are downloaded and inflated by the bootloader when it installs them.
+// Requires ESP8266 core 2.7 or later (its eboot inflates gzip images).
+#define OTA_GZIP 0
+
+// Set to 1 to boot fast after a restart: the access point (BSSID and channel) and the master host address of
+// the last boot are cached in the settings, so the device connects to them right away instead of scanning for
+// the network and looking the master up through mDNS (falling back to that if they can't be reached).
+#define FAST_BOOT 1
+
+// Sensor attached to the free GPIO14 pin, sampled every 'sensorperiod' ms: SENSOR_PULSES counts the pulses
+// (falling edges) of a meter output between samples, SENSOR_LEVEL reads the pin level (0 or 1, so the mean is
+// the fraction of the time it was high) and SENSOR_DS18B20 reads a DS18B20 thermometer, in hundredths of a
+// degree Celsius. The samples are aggregated into windows (whose length can be set with 'sensorwindow' on
+// the admin topic), each published as a line of '<username>/sensor'. SENSOR_NONE leaves the pin alone.
+// SENSOR_DS18B20 requires the OneWire and DallasTemperature libraries.
+#define SENSOR_NONE    0
+#define SENSOR_PULSES  1
+#define SENSOR_LEVEL   2
+#define SENSOR_DS18B20 3
+#define SENSOR_KIND SENSOR_NONE
+
+// Log verbosity of the firmware: LOG_ERROR only keeps failures, LOG_INFO adds the main events and
+// LOG_DEBUG traces the scheduler and every received message. Calls above the level are compiled out,
+// so LOG_NONE removes logging from the build entirely.
+#define LOG_NONE  0
+#define LOG_ERROR 1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+#define LOG_LEVEL LOG_INFO
+
+// Size in bytes of the RAM ring the log is written to (a power of two); the ring is sent to the serial
+// port from the main loop without blocking, and its contents can be fetched with 'asklog' on the admin
+// topic. Set to 0 to write the log straight to the serial port instead, waiting for it to be sent.
+#define LOG_RINGSIZE 2048
+
 // Hard-coded settings
 const int  version           = 1;  // firmware version
 const char masterhost   [20] = "autohome.local";
 const int  masterporthttps   = 443;
 const int  masterportmqtt    = 8883;
+const int  masterportmqttpsk = 8884;  // TLS-PSK listener, only used if MQTT_USE_PSK is set
 const char firmwareuri  [44] = "/static/sonoff-firmware.bin";
 const char accessuri    [28] = "/static/access";
 const char authorization[32] = "guest-secret";
 const char fingerprint  [60] = "11 22 33 44 55 66 77 88 99 00 AA SS CC DD EE FF 11 22 33 44";
 const char mqtt_prefix  [10] = "sonoff-";
 const int  mqtt_maxattempts  = 24;  // after this many attempts to reconnect, reset device
+const int  mqtt_backoffmin   = 1000;  // ms of the window the first reconnection attempt happens in, at random;
+                                      // the window doubles with every failed attempt
+const int  mqtt_backoffmax   = 5 * 60 * 1000;  // ms of the largest reconnection window
+const int  mqtt_timeout      = 5000;  // ms to wait for the broker while connecting
 const int  maxcfgstrsize     = 44;  // max string length for usernames and passwords considering
                                     // the null terminator; should be a multiple of 4
-const int  maxnscheduled     = 32;  // max number of scheduled commands (trying to add another one
-                                    // will silently fail); should be a multiple of 4
+const int  maxpsksize        = 68;  // max length of a base16 pre-shared key (32 bytes) considering
+                                    // the null terminator; should be a multiple of 4
+const int  maxnscheduled     = 128;  // max number of scheduled commands (trying to add another one
+                                     // will fail); should be a multiple of 4 and at most 256
+const int  settingsdelay     = 2000;  // ms to wait for further schedule changes before writing
+                                      // them all to flash at once
+const int  fastbootattempts  = 3;  // failed MQTT connections after a fast boot before falling back
+                                   // to a full boot
+const int  updatesperiod     = 24 * 60 * 60 * 1000;  // ms between periodic checks for firmware and
+                                                   // access credentials updates
+const int  buttondebounce    = 30;  // ms to ignore the button for after it changes, while it bounces
+const int  statusdelay       = 500;  // ms to wait for further relay changes before publishing
+                                     // the status once they settle
+const int  clockmaxdrift     = 20000;  // max drift of the device clock in parts per million; larger
+                                       // differences at a synchronization are taken as clock changes
+const int  clockmininterval  = 60 * 60 * 1000;  // min ms between two synchronizations for their
+                                                // difference to measure the drift of the device clock
+const int  sensorperiod      = 1000;  // ms between two samples of the sensor
+const int  sensorwindow      = 60;  // s of samples aggregated into a window, until set otherwise
+const int  sensormaxwindow   = 24 * 60 * 60;  // s of the longest window that can be set
+const int  sensorqueuesize   = 8;  // windows kept while they can't be published; the oldest one is
+                                   // dropped when another one doesn't fit
 
 #endif  // #ifndef CONFIG_H
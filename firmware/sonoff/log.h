@@ -0,0 +1,56 @@
+// log.h
+// Leveled logging
+// Part of AutoHome
+//
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef LOG_H
+#define LOG_H
+
+#include "config.h"
+
+// printf-like logging at each level (see config.h); calls above LOG_LEVEL are compiled out,
+// arguments included; logprintf is implemented by the sketch
+#if LOG_LEVEL >= LOG_ERROR
+#define log_error(...) logprintf(__VA_ARGS__)
+#else
+#define log_error(...) ((void) 0)
+#endif
+
+#if LOG_LEVEL >= LOG_INFO
+#define log_info(...) logprintf(__VA_ARGS__)
+#else
+#define log_info(...) ((void) 0)
+#endif
+
+#if LOG_LEVEL >= LOG_DEBUG
+#define log_debug(...) logprintf(__VA_ARGS__)
+#else
+#define log_debug(...) ((void) 0)
+#endif
+
+void logprintf(const char* format, ...);
+
+#endif  // #ifndef LOG_H
@@ -0,0 +1,385 @@
+// schedule.cpp
+// Scheduled commands, their fire dates and the fire heap
+// Part of AutoHome
+//
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "schedule.h"
+#include "log.h"
+
+#include <limits.h>
+
+uint64_t nextfire[maxnscheduled];
+byte     fireheap[maxnscheduled];
+byte     heappos [maxnscheduled];
+int      heapsize = 0;
+
+uint64_t readull(const char* str, const char** stop)
+{
+	uint64_t    value = 0;
+	const char* c;
+	
+	for (c = str; *c != 0; c++) {
+		int digit = *c - '0';
+		
+		if (digit < 0 || 9 < digit) {
+			break;
+		}
+		
+		uint64_t maxacceptable = (ULONG_LONG_MAX - digit) / 10;
+		
+		if (value > maxacceptable) {
+			break;
+		}
+		
+		value *= 10;
+		value += digit;
+	}
+	
+	if (stop != nullptr) {
+		*stop = c;
+	}
+	
+	return value;
+}
+
+int writeull(char* dst, uint64_t value)
+{
+	char* c = dst;
+	
+	do {
+		*c     = value % 10 + '0';
+		value /= 10;
+		
+		c += 1;
+	} while (value > 0);
+	
+	int len = c - dst;
+	
+	c -= 1;  // the digits were written backwards, reverse them
+	
+	while (dst < c) {
+		char tmp = *dst;
+		*dst     = *c;
+		*c       = tmp;
+		
+		dst += 1;
+		c   -= 1;
+	}
+	
+	return len;
+}
+
+byte weekday(uint64_t time)
+{
+	// Jan 01 1970 (time == 0) was a Thursday, i.e. weekday(0) = 4
+	// every unix day is exactly 60 * 60 * 24 = 86400 seconds (leap seconds are discarded)
+	return ((time / 86400 + 3) % 7) + 1;
+}
+
+int midnightseconds(uint64_t time)
+{
+	return time % 86400;
+}
+
+int hours(uint64_t time)
+{
+	return (time % 86400) / 3600;
+}
+
+int minutes(uint64_t time)
+{
+	return (time % 3600) / 60;
+}
+
+int seconds(uint64_t time)
+{
+	return time % 60;
+}
+
+int scommandcmp(const ScheduledCmd& a, const ScheduledCmd& b)
+{
+	int diff = 0;
+	
+	if (a.firedate != b.firedate) {
+		return (a.firedate < b.firedate) ? -1 : 1;
+	}
+	
+	return ((diff = a.days      - b.days)      != 0) ? diff :
+	       ((diff = a.hours     - b.hours)     != 0) ? diff :
+	       ((diff = a.minutes   - b.minutes)   != 0) ? diff :
+	       ((diff = a.command   - b.command)   != 0) ? diff :
+	       ((diff = a.recurrent - b.recurrent) != 0) ? diff :
+	       (        a.fuzzy     - b.fuzzy);
+}
+
+int findscommand(const ScheduledCmd& needle, ScheduledCmd* haystack, int hsize)
+{
+	log_debug("finding command\r\n");
+	log_debug("needle: cmd: %c; fuzzy: %d; recurrent: %d, firedate: %d\r\n", needle.command, needle.fuzzy, needle.recurrent, (int) needle.firedate);
+	
+	for (int i = 0; i < hsize; i++) {
+		if (scommandcmp(needle, haystack[i]) == 0) {
+			log_debug("found it\r\n");
+			return i;
+		}
+	}
+	
+	return -1;
+}
+
+// swap two positions of the fire heap
+static void heapswap(int a, int b)
+{
+	byte tmp    = fireheap[a];
+	fireheap[a] = fireheap[b];
+	fireheap[b] = tmp;
+	
+	heappos[fireheap[a]] = a;
+	heappos[fireheap[b]] = b;
+}
+
+// move the fire heap entry at position p up until its parent fires earlier
+static void heapsiftup(int p)
+{
+	while (p > 0) {
+		int parent = (p - 1) / 2;
+		
+		if (nextfire[fireheap[parent]] <= nextfire[fireheap[p]]) {
+			break;
+		}
+		
+		heapswap(p, parent);
+		p = parent;
+	}
+}
+
+// move the fire heap entry at position p down until its children fire later
+static void heapsiftdown(int p)
+{
+	while (true) {
+		int left  = 2 * p + 1;
+		int right = left + 1;
+		int first = p;
+		
+		if (left < heapsize && nextfire[fireheap[left]] < nextfire[fireheap[first]]) {
+			first = left;
+		}
+		
+		if (right < heapsize && nextfire[fireheap[right]] < nextfire[fireheap[first]]) {
+			first = right;
+		}
+		
+		if (first == p) {
+			break;
+		}
+		
+		heapswap(p, first);
+		p = first;
+	}
+}
+
+void heapinsert(int i)
+{
+	fireheap[heapsize] = i;
+	heappos[i]         = heapsize;
+	
+	heapsiftup(heapsize++);
+}
+
+void heapdelete(int i)
+{
+	int p = heappos[i];
+	
+	if (p != --heapsize) {
+		fireheap[p]          = fireheap[heapsize];
+		heappos[fireheap[p]] = p;
+		
+		heapsiftdown(p);
+		heapsiftup(p);
+	}
+}
+
+void heapmove(int from, int to)
+{
+	fireheap[heappos[from]] = to;
+	heappos[to]             = heappos[from];
+}
+
+void heapbuild(int n)
+{
+	heapsize = n;
+	
+	for (int i = 0; i < heapsize; i++) {
+		fireheap[i] = i;
+		heappos [i] = i;
+	}
+	
+	for (int p = heapsize / 2 - 1; p >= 0; p--) {
+		heapsiftdown(p);
+	}
+}
+
+byte daycodemask(byte code)
+{
+	return (code == 0) ? everyday :
+	       (code == 8) ? weekdays :
+	       (code == 9) ? weekend  :
+	                     1 << (code - 1);
+}
+
+int writedays(char* dst, byte days)
+{
+	if (days == everyday || days == weekdays || days == weekend) {
+		*dst = (days == everyday) ? '0' : (days == weekdays) ? '8' : '9';
+		return 1;
+	}
+	
+	int count = 0;
+	
+	for (int d = 0; d < 7; d++) {
+		if (days & (1 << d)) {
+			dst[count++] = '1' + d;
+		}
+	}
+	
+	return count;
+}
+
+uint64_t nextfiredate(const ScheduledCmd& command, uint64_t now)
+{
+	uint64_t next;
+	
+	if (!command.recurrent) {
+		next = scheduleepoch + command.firedate;
+	}
+	else {
+		uint32_t secs     = midnightseconds(now);
+		uint64_t midnight = now - secs;
+		uint32_t today    = weekday(now) - 1;  // 0 = Monday, like the day mask bits
+		uint32_t schsecs  = 60 * (command.minutes + 60 * command.hours);  // schedule seconds since midnight
+		
+		// at an earlier time it must start counting from tomorrow;
+		// the equality forbids setting a recurrent firedate for right now (only for next week)
+		// to avoid re-raising an event multiple times when rescheduling after the event handler;
+		// in practice nobody should rely on a 1-second-precision based decision anyway
+		uint32_t first = (schsecs <= secs) ? 1 : 0;
+		
+		// rotate the mask so bit 0 is the first candidate day;
+		// the lowest set bit is then the number of days to wait from it
+		uint32_t shift   = (today + first) % 7;
+		uint32_t rotated = ((command.days >> shift) | (command.days << (7 - shift))) & everyday;
+		
+		if (rotated == 0) {  // no days, never
+			return ULONG_LONG_MAX;
+		}
+		
+		next = midnight + (first + __builtin_ctz(rotated)) * 24 * 60 * 60 + schsecs;
+	}
+	
+	if (command.fuzzy) {  // add noise
+		const int halfnoise = 8 * 60;  // noise will be +-8 mins, i.e. a total spread of 16 minutes
+		int lowbound  = (next > halfnoise)                  ? 0 : halfnoise - next;
+		int highbound = (next < ULONG_LONG_MAX - halfnoise) ? 2 * halfnoise : ULONG_LONG_MAX + halfnoise - next;
+		
+		next += random(lowbound, highbound) - halfnoise;
+	}
+	
+	return next;
+}
+
+void firedates(const ScheduledCmd* schedule, int n, uint64_t now)
+{
+	for (int i = 0; i < n; i++) {
+		nextfire[i] = nextfiredate(schedule[i], now);
+	}
+	
+	heapbuild(n);
+}
+
+int takedue(const ScheduledCmd* schedule, uint64_t now, byte* due, byte& command)
+{
+	// if more than one command must be executed, only execute the last one
+	// NOTE this relies on the particular commands of the switch, 'on' and 'off',
+	//      which are absorbent, i.e. the result of applying a sequence of commands
+	//      (instantaneously) is the same as applying the last one
+	uint64_t lastexectime = 0;
+	int      ndue         = 0;
+	
+	command = 0;
+	
+	// the heap top is the soonest command, so only the commands to run now are visited
+	while (heapsize > 0 && nextfire[fireheap[0]] <= now + 5) {
+		int      i        = fireheap[0];
+		uint64_t exectime = nextfire[i];
+		
+		log_debug("checking nextfire[%d]: %d\r\n", i, (int) exectime);
+		
+		heapdelete(i);
+		due[ndue++] = i;
+		
+		if ((!schedule[i].fuzzy && exectime  < now - 5) ||       // too old
+		    ( schedule[i].fuzzy && exectime  < now - 8 * 60)) {  // fuzzy gets 8 minutes of grace
+			// do not include in execution
+			log_debug("too old, discard\r\n");
+		}
+		else {
+			log_debug("candidate to execute\r\n");
+			if (exectime > lastexectime) {
+				log_debug("latest so far\r\n");
+				lastexectime = exectime;
+				command      = schedule[i].command;
+			}
+		}
+	}
+	
+	for (int k = 1; k < ndue; k++) {
+		for (int j = k; j > 0 && due[j - 1] < due[j]; j--) {
+			byte tmp   = due[j];
+			due[j]     = due[j - 1];
+			due[j - 1] = tmp;
+		}
+	}
+	
+	return ndue;
+}
+
+uint32_t firetimeout(uint64_t nowms)
+{
+	uint64_t now  = nowms / 1000;
+	uint64_t next = nextfire[fireheap[0]];
+	
+	next = (next > now) ? next : now;  // limit to the present or future, not the past;
+	                                   // if there's a command in the past, the callback will be called immediately
+	
+	uint64_t diff = next - now;
+	
+	diff = (diff < UINT32_MAX / 1000) ? diff : UINT32_MAX / 1000;  // if it is too far into the future (ticker uses 32 bits
+	                                                               // for the timestamp), just set the callback as far
+	                                                               // as possible; the callback will do nothing but set
+	                                                               // the next callback until diff is small enough
+	
+	return (diff > 0) ? 1000 * diff - nowms % 1000 : 0;  // to the millisecond the command's second starts
+}
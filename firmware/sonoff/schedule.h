@@ -0,0 +1,148 @@
+// schedule.h
+// Scheduled commands, their fire dates and the fire heap
+// Part of AutoHome
+//
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <Arduino.h>
+
+#include "config.h"
+
+const uint64_t scheduleepoch = 1483228800;  // 1 Jan 2017, 00:00:00; one-off command dates are stored relative to it
+
+// Command description to be run at a later time, packed in 8 bytes
+typedef struct ScheduledCmd
+{
+	uint32_t firedate;       // one-off command date, in seconds since scheduleepoch
+	char     command;        // '0': turn off, '1': turn on
+	byte     days      : 7;  // days of the week a recurrent command triggers on, bit 0 = Monday, ..., bit 6 = Sunday
+	byte     fuzzy     : 1;  // if true, execute the command at a random time in a 16 minute window around the set time
+	byte     hours     : 5;  // trigger at this hour
+	byte     recurrent : 1;  // trigger this command recurrently every week
+	byte     reserved1 : 2;
+	byte     minutes   : 6;  // and this minutes
+	byte     reserved2 : 2;
+	
+	ScheduledCmd()
+	: firedate(0), command('0'), days(0), fuzzy(0), hours(0), recurrent(0), reserved1(0),
+	  minutes(0), reserved2(0) {}
+} ScheduledCmd;
+
+const byte everyday = 0x7f;  // day masks with a single digit code in the text protocol (0, 8 and 9)
+const byte weekdays = 0x1f;
+const byte weekend  = 0x60;
+
+static_assert(sizeof (ScheduledCmd) == 8, "ScheduledCmd must stay packed in 8 bytes");
+static_assert(maxnscheduled <= 256, "the fire heap indexes the schedule with bytes");
+
+// Time of the next time the corresponding command will be executed;
+// separated from ScheduledCmd because this changes constantly and
+// so it's better to keep it out of EEPROM (to reduce the number of
+// consistency checks and writes to flash memory)
+extern uint64_t nextfire[maxnscheduled];
+
+// Binary min-heap of schedule indices ordered by nextfire, so the soonest command is always at the top
+extern byte fireheap[maxnscheduled];  // schedule indices, in heap order
+extern byte heappos [maxnscheduled];  // position in fireheap of every schedule index
+extern int  heapsize;
+
+// read an unsigned 64 bit integer from a string, similar to strtoull,
+// which is not implemented in the SDK or the libraries, raising a linker error
+uint64_t readull(const char* str, const char** stop);
+
+// write an unsigned 64 bit integer to a string
+// return the number of bytes written
+// no boundaries checks so make sure you have enough room (20 bytes in the worst case)
+int writeull(char* dst, uint64_t value);
+
+// day of the week where 1 = Monday ... 7 = Sunday
+byte weekday(uint64_t time);
+
+// seconds since the previous midnight
+int midnightseconds(uint64_t time);
+
+// hours since the previous midnight
+int hours(uint64_t time);
+
+// minutes since the previous hour
+int minutes(uint64_t time);
+
+// seconds since the previous minute
+int seconds(uint64_t time);
+
+// compare two ScheduledCmd
+// return value == 0 if equal, value < 0 if a < b, value > 0 if a > b
+// order defined by (firedate, days, hour, minutes, command, recurrent, fuzzy)
+int scommandcmp(const ScheduledCmd& a, const ScheduledCmd& b);
+
+// linear search on the haystack
+// return the index of the matched command or -1 if it was not found
+// avoid sort + binary search as it implies unnecessary writes to EEPROM
+// and given the small schedule size and the sparsity of update events it is not worth it
+int findscommand(const ScheduledCmd& needle, ScheduledCmd* haystack, int hsize);
+
+// add the scheduled command at index i to the fire heap
+void heapinsert(int i);
+
+// take the scheduled command at index i out of the fire heap
+void heapdelete(int i);
+
+// reflect in the fire heap that the scheduled command at index 'from' moved to index 'to'
+void heapmove(int from, int to);
+
+// rebuild the fire heap with every scheduled command, n being their number
+void heapbuild(int n);
+
+// day mask of a single digit day code: 1-7 for Mon-Sun, 0 for every day,
+// 8 for every weekday Mon-Fri and 9 for every weekend Sat-Sun
+byte daycodemask(byte code);
+
+// write the text descriptor of a day mask: its single digit code if it has one,
+// otherwise the digit of every day (1-7 for Mon-Sun) in order; no null terminator
+// return the number of bytes written (at most 7)
+int writedays(char* dst, byte days);
+
+// calculate the date a command fires next as seen from 'now', including the fuzzy noise
+uint64_t nextfiredate(const ScheduledCmd& command, uint64_t now);
+
+// calculate the fire date of each of the first n scheduled commands as seen from 'now',
+// and rebuild the fire heap with them
+void firedates(const ScheduledCmd* schedule, int n, uint64_t now);
+
+// take out of the fire heap every command due at 'now', i.e. firing within 5 seconds of it, and write
+// their indices to 'due' from the highest down, so dropping them in that order never moves a command
+// that is still to be handled; set 'command' to that of the latest one not too old, the only one to run,
+// or 0 if none
+// return the number of commands taken
+int takedue(const ScheduledCmd* schedule, uint64_t now, byte* due, byte& command);
+
+// time in ms from 'nowms' (ms since 1970) to the start of the second the soonest command fires at,
+// 0 if it is due already; the fire heap must not be empty
+uint32_t firetimeout(uint64_t nowms);
+
+#endif  // #ifndef SCHEDULE_H
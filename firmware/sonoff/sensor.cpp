@@ -0,0 +1,71 @@
+// sensor.cpp
+// Sensor sample windows
+// Part of AutoHome
+//
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "sensor.h"
+#include "schedule.h"
+
+#include <stdio.h>
+
+void startwindow(SensorWindow& window, uint64_t date, uint32_t seconds)
+{
+	window.date    = date;
+	window.seconds = seconds;
+	window.count   = 0;
+	window.min     = INT32_MAX;
+	window.max     = INT32_MIN;
+	window.sum     = 0;
+}
+
+void addsample(SensorWindow& window, int32_t value)
+{
+	window.count += 1;
+	window.sum   += value;
+	window.min    = (value < window.min) ? value : window.min;
+	window.max    = (value > window.max) ? value : window.max;
+}
+
+int formatwindow(char* buffer, const char* kind, const SensorWindow& window)
+{
+	// the mean is kept in hundredths, rounded half away from zero; it is within the sample range,
+	// so its whole part fits in 32 bits
+	int64_t  scaled = 100 * window.sum;
+	int64_t  half   = (scaled < 0) ? -static_cast<int64_t>(window.count / 2) : window.count / 2;
+	int64_t  mean   = (scaled + half) / window.count;
+	uint32_t whole  = static_cast<uint32_t>(((mean < 0) ? -mean : mean) / 100);
+	uint32_t cents  = static_cast<uint32_t>(((mean < 0) ? -mean : mean) % 100);
+	char     date[21];
+	
+	date[writeull(date, window.date)] = 0;
+	
+	int count = snprintf(buffer, windowlinesize, "%s %s %u %u %d %d %s%u.%02u\n", kind, date,
+	                     static_cast<unsigned>(window.seconds), static_cast<unsigned>(window.count),
+	                     static_cast<int>(window.min), static_cast<int>(window.max), (mean < 0) ? "-" : "",
+	                     static_cast<unsigned>(whole), static_cast<unsigned>(cents));
+	
+	return (count < windowlinesize - 1) ? count : windowlinesize - 1;
+}
@@ -0,0 +1,59 @@
+// sensor.h
+// Sensor sample windows
+// Part of AutoHome
+//
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef SENSOR_H
+#define SENSOR_H
+
+#include <Arduino.h>
+
+const int windowlinesize = 96;  // longest window line and \0, "temperature 18446744073709551615 4294967295 4294967295
+                                // -2147483648 -2147483648 -2147483648.00\n" (a single line)
+
+// Aggregate of the samples of a sensor over a window of time
+typedef struct SensorWindow
+{
+	uint64_t date;     // start of the window, in seconds since 1970 by the device clock; 0 if it was not set
+	uint32_t seconds;  // length of the window
+	uint32_t count;    // number of samples
+	int32_t  min;      // smallest sample
+	int32_t  max;      // largest sample
+	int64_t  sum;      // sum of the samples, for their mean
+} SensorWindow;
+
+// start an empty window
+void startwindow(SensorWindow& window, uint64_t date, uint32_t seconds);
+
+// add a sample to a window
+void addsample(SensorWindow& window, int32_t value);
+
+// write the '<kind> <date> <seconds> <count> <min> <max> <mean>' line of a window, \n included,
+// with the mean rounded to two decimals, to buffer (windowlinesize bytes); the window can't be empty
+// return its length
+int formatwindow(char* buffer, const char* kind, const SensorWindow& window);
+
+#endif  // #ifndef SENSOR_H
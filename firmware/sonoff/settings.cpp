@@ -0,0 +1,345 @@
+// settings.cpp
+// Settings and their flash store
+// Part of AutoHome
+//
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "settings.h"
+#include "stats.h"
+#include "log.h"
+
+#include <string.h>
+#include <limits.h>
+
+extern "C" {
+#include <spi_flash.h>
+}
+
+uint32_t crc32(void* data, int size)
+{
+	uint32_t checksum = 0xffffffff;
+	uint8_t* begin    = static_cast<uint8_t*>(data);
+	uint8_t* end      = begin + size;
+	
+	for (uint8_t* i = begin; i < end; i++) {
+		for (uint32_t k = 0x80; k > 0; k >>= 1) {
+			bool bit = checksum & 0x80000000;
+			
+			checksum <<= 1;
+			bit       ^= (*i & k);
+			
+			if (bit) {
+				checksum ^= 0x04c11db7;
+			}
+		}
+	}
+	
+	return checksum;
+}
+
+uint32_t settings_checksum(Settings* settings)
+{
+	uint32_t old_checksum = settings->checksum;
+	settings->checksum    = 0;
+	
+	uint32_t checksum = crc32(settings, sizeof (Settings));
+	
+	settings->checksum = old_checksum;
+	
+	return checksum;
+}
+
+// The settings live in the flash sector reserved for the EEPROM library, as a full copy
+// of the Settings struct followed by a journal with the changes made since it was written.
+// Flash bits can be cleared without erasing the sector, so a change only appends small records
+// with the modified bytes; the sector is only erased to compact the journal into a new full copy
+// once it is full. A sector written by the EEPROM library is a valid store with an empty journal.
+
+extern "C" uint32_t _SPIFFS_end;  // the EEPROM sector follows the SPIFFS area
+
+// Journal record header, followed by 'length' bytes of the Settings struct starting at 'offset',
+// padded to a multiple of 4 bytes. Every change is written as one or more records, the last one
+// flagged with journal_commit; the records of an unfinished change are discarded on replay.
+// An erased header (every bit set) marks the end of the journal
+typedef struct JournalRecord
+{
+	uint16_t offset;
+	uint16_t length;    // number of bytes, possibly with the journal_commit flag
+	uint32_t checksum;  // crc32 checksum of the whole record
+} JournalRecord;
+
+const uint16_t journal_commit = 0x8000;
+const uint32_t journal_start  = (sizeof (Settings) + 3) & ~3;
+
+Settings      settings;
+Settings      stored_settings;           // settings as last written to flash, to find what changed
+uint32_t      journal_end;               // offset in the sector of the first free journal byte
+bool          settings_pending = false;  // true if the settings changed but were not written yet
+unsigned long settings_changed;          // timestamp of the first change not written yet
+uint32_t      journal_buffer[(sizeof (JournalRecord) + sizeof (Settings) + 3) / 4];  // record being read or written
+
+// flash address of the settings sector
+static uint32_t settings_address()
+{
+	uint32_t end = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(&_SPIFFS_end));
+	
+	return ((end - 0x40200000) / SPI_FLASH_SEC_SIZE) * SPI_FLASH_SEC_SIZE;
+}
+
+// calculate the checksum for the record in the journal buffer removing the effect
+// of the checksum field itself
+static uint32_t journal_checksum()
+{
+	JournalRecord* record       = reinterpret_cast<JournalRecord*>(journal_buffer);
+	uint32_t       old_checksum = record->checksum;
+	record->checksum            = 0;
+	
+	uint32_t checksum = crc32(record, sizeof (JournalRecord) + (record->length & ~journal_commit));
+	
+	record->checksum = old_checksum;
+	
+	return checksum;
+}
+
+void compact_settings()
+{
+	log_info("Compacting the settings journal\r\n");
+	
+	noInterrupts();
+	spi_flash_erase_sector(settings_address() / SPI_FLASH_SEC_SIZE);
+	spi_flash_write(settings_address(), reinterpret_cast<uint32_t*>(&settings), journal_start);
+	interrupts();
+	
+	journal_end     = journal_start;
+	stored_settings = settings;
+}
+
+// append a record with the given bytes of the settings to the journal
+// if they don't fit, do nothing and return false
+static bool append_record(uint32_t offset, uint32_t length, bool commit)
+{
+	JournalRecord* record = reinterpret_cast<JournalRecord*>(journal_buffer);
+	uint32_t       size   = (sizeof (JournalRecord) + length + 3) & ~3;
+	
+	if (journal_end + size > SPI_FLASH_SEC_SIZE) {
+		return false;
+	}
+	
+	record->offset = offset;
+	record->length = length | (commit ? journal_commit : 0);
+	memcpy(&record[1], reinterpret_cast<uint8_t*>(&settings) + offset, length);
+	record->checksum = journal_checksum();
+	
+	noInterrupts();
+	spi_flash_write(settings_address() + journal_end, journal_buffer, size);
+	interrupts();
+	
+	journal_end += size;
+	
+	return true;
+}
+
+const uint32_t no_change = sizeof (Settings);  // end sentinel of next_change
+
+// find the next range of bytes of the settings that differ from the stored ones, starting at 'from'
+// ranges closer than a record header are merged, since a separate record would take more space
+// return the start of the range and set 'end' past its last byte, or return no_change if there are no changes
+static uint32_t next_change(uint32_t from, uint32_t* end)
+{
+	const uint8_t* current = reinterpret_cast<const uint8_t*>(&settings);
+	const uint8_t* stored  = reinterpret_cast<const uint8_t*>(&stored_settings);
+	uint32_t       start   = from;
+	
+	while (start < sizeof (Settings) && current[start] == stored[start]) {
+		start++;
+	}
+	
+	if (start >= sizeof (Settings)) {
+		return no_change;
+	}
+	
+	uint32_t last = start;
+	
+	for (uint32_t i = start + 1; i < sizeof (Settings) && i - last <= sizeof (JournalRecord); i++) {
+		if (current[i] != stored[i]) {
+			last = i;
+		}
+	}
+	
+	*end = last + 1;
+	
+	return start;
+}
+
+void flush_settings()
+{
+	uint32_t flushstart = micros();
+	
+	settings.checksum = settings_checksum(&settings);
+	settings_pending  = false;
+	
+#if DEBUG_SETTINGS
+	log_debug("new settings\r\n");
+	dump_settings();
+#endif
+	
+	uint32_t end;
+	uint32_t start = next_change(0, &end);
+	
+	while (start != no_change) {
+		uint32_t nextend;
+		uint32_t next = next_change(end, &nextend);
+		
+		if (!append_record(start, end - start, next == no_change)) {  // journal full
+			compact_settings();
+			addtiming(stats.flush, flushstart);
+			return;
+		}
+		
+		start = next;
+		end   = nextend;
+	}
+	
+	stored_settings = settings;
+	
+	addtiming(stats.flush, flushstart);
+}
+
+void save_settings()
+{
+	if (!settings_pending) {
+		settings_pending = true;
+		settings_changed = millis();
+	}
+}
+
+// read a settings image of the given size whose journal starts at 'start', replaying the journal
+// into 'current' and leaving in 'finished' the image after the last finished change
+// return false if the journal ends with a damaged or unfinished record (e.g. after a power loss)
+static bool replay_settings(uint8_t* current, uint8_t* finished, uint32_t size, uint32_t start)
+{
+	JournalRecord* record    = reinterpret_cast<JournalRecord*>(journal_buffer);
+	bool           clean     = true;
+	bool           committed = true;  // false while replaying the records of a change
+	
+	spi_flash_read(settings_address(), reinterpret_cast<uint32_t*>(current), start);
+	
+	memcpy(finished, current, size);
+	journal_end = start;
+	
+	while (journal_end + sizeof (JournalRecord) <= SPI_FLASH_SEC_SIZE) {
+		spi_flash_read(settings_address() + journal_end, journal_buffer, sizeof (JournalRecord));
+		
+		if (record->offset == 0xffff && record->length == 0xffff && record->checksum == 0xffffffff) {
+			break;
+		}
+		
+		uint32_t length = record->length & ~journal_commit;
+		uint32_t stored = (sizeof (JournalRecord) + length + 3) & ~3;
+		
+		if (record->offset + length > size || journal_end + stored > SPI_FLASH_SEC_SIZE) {
+			clean = false;
+			break;
+		}
+		
+		spi_flash_read(settings_address() + journal_end + sizeof (JournalRecord),
+		               &journal_buffer[sizeof (JournalRecord) / 4], stored - sizeof (JournalRecord));
+		
+		if (journal_checksum() != record->checksum) {
+			clean = false;
+			break;
+		}
+		
+		memcpy(current + record->offset, &record[1], length);
+		journal_end += stored;
+		committed    = (record->length & journal_commit);
+		
+		if (committed) {
+			memcpy(finished, current, size);
+		}
+	}
+	
+	return clean && committed;  // records of an unfinished change must not be followed by another one
+}
+
+bool load_settings()
+{
+	bool clean = replay_settings(reinterpret_cast<uint8_t*>(&settings), reinterpret_cast<uint8_t*>(&stored_settings),
+	                             sizeof (Settings), journal_start);
+	
+	settings = stored_settings;
+	
+	return clean;
+}
+
+bool load_legacy_settings()
+{
+	LegacySettings legacy;
+	
+	replay_settings(reinterpret_cast<uint8_t*>(&settings), reinterpret_cast<uint8_t*>(&stored_settings),
+	                sizeof (LegacySettings), (sizeof (LegacySettings) + 3) & ~3);
+	memcpy(&legacy, &stored_settings, sizeof (LegacySettings));
+	
+	uint32_t checksum = legacy.checksum;
+	legacy.checksum   = 0;
+	
+	if (crc32(&legacy, sizeof (LegacySettings)) != checksum || legacy.nscheduled > legacynscheduled) {
+		return false;
+	}
+	
+	settings = Settings();
+	
+	memcpy(settings.ssid,      legacy.ssid,      maxcfgstrsize);
+	memcpy(settings.password,  legacy.password,  maxcfgstrsize);
+	memcpy(settings.mqtt_user, legacy.mqtt_user, maxcfgstrsize);
+	memcpy(settings.mqtt_pass, legacy.mqtt_pass, maxcfgstrsize);
+#if MQTT_USE_PSK
+	memcpy(settings.mqtt_psk,  legacy.mqtt_psk,  maxpsksize);
+#endif
+	
+	for (int i = 0; i < legacy.nscheduled && settings.nscheduled < maxnscheduled; i++) {
+		const LegacyCmd& old = legacy.schedule[i];
+		ScheduledCmd     cmd;
+		
+		if ((!old.recurrent && (old.firedate < scheduleepoch || old.firedate - scheduleepoch > UINT32_MAX)) ||
+		    ( old.recurrent && old.weekday > 9)) {
+			continue;
+		}
+		
+		cmd.command   = old.command;
+		cmd.fuzzy     = old.fuzzy;
+		cmd.recurrent = old.recurrent;
+		cmd.days      = old.recurrent ? daycodemask(old.weekday) : 0;
+		cmd.hours     = old.recurrent ? old.hours   : 0;
+		cmd.minutes   = old.recurrent ? old.minutes : 0;
+		cmd.firedate  = old.recurrent ? 0 : old.firedate - scheduleepoch;
+		
+		settings.schedule[settings.nscheduled++] = cmd;
+	}
+	
+	settings.checksum = settings_checksum(&settings);
+	
+	return true;
+}
@@ -0,0 +1,127 @@
+// settings.h
+// Settings and their flash store
+// Part of AutoHome
+//
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <Arduino.h>
+
+#include "config.h"
+#include "schedule.h"
+
+#define DEBUG_SETTINGS (LOG_LEVEL >= LOG_DEBUG)
+
+// Network details learned on the last boot, to skip the WiFi scan and the master host lookup on the next one
+typedef struct BootCache
+{
+	uint8_t  bssid[6] = {};  // access point the device last connected to
+	uint8_t  channel  = 0;   // and its WiFi channel; 0 if nothing is cached
+	uint8_t  reserved = 0;
+	uint32_t masterip = 0;   // address of the master host last found through mDNS; 0 if unknown
+} BootCache;
+
+// Non-volatile settings saved in the EEPROM portion of the flash memory (see settings.cpp)
+typedef struct Settings
+{
+	uint32_t     checksum                 = 0;  // crc32 checksum
+	char         ssid     [maxcfgstrsize] = DEFAULT_WIFI_SSID;
+	char         password [maxcfgstrsize] = DEFAULT_WIFI_PASS;
+	char         mqtt_user[maxcfgstrsize] = "";
+	char         mqtt_pass[maxcfgstrsize] = "";
+	int          nscheduled               = 0;  // number of active scheduled commands
+	ScheduledCmd schedule[maxnscheduled];       // scheduled commands
+#if MQTT_USE_PSK
+	char         mqtt_psk[maxpsksize]     = "";  // base16 TLS pre-shared key
+#endif
+	BootCache    bootcache;                     // network details for a fast boot
+} Settings;
+
+// Settings as laid out before the schedule was packed, only read to convert them
+typedef struct LegacyCmd
+{
+	char     command;
+	byte     reserved1;
+	bool     fuzzy;
+	bool     recurrent;
+	byte     weekday;
+	byte     hours;
+	byte     minutes;
+	byte     reserved2;
+	uint64_t firedate;
+} LegacyCmd;
+
+const int legacynscheduled = 32;
+
+typedef struct LegacySettings
+{
+	uint32_t  checksum;
+	char      ssid     [maxcfgstrsize];
+	char      password [maxcfgstrsize];
+	char      mqtt_user[maxcfgstrsize];
+	char      mqtt_pass[maxcfgstrsize];
+	int       nscheduled;
+	LegacyCmd schedule[legacynscheduled];
+#if MQTT_USE_PSK
+	char      mqtt_psk[maxpsksize];
+#endif
+} LegacySettings;
+
+extern Settings      settings;
+extern bool          settings_pending;  // true if the settings changed but were not written yet
+extern unsigned long settings_changed;  // timestamp of the first change not written yet
+
+// calculate crc32 checksum (to validate hardware integrity, do not use for security)
+uint32_t crc32(void* data, int size);
+
+// calculate the checksum for a given settings struct removing the effect
+// of the checksum field itself to avoid a cyclic dependence
+uint32_t settings_checksum(Settings* settings);
+
+// write a full copy of the settings on a freshly erased sector, emptying the journal
+void compact_settings();
+
+// write the settings changes to flash right away
+void flush_settings();
+
+// schedule the settings changes to be written once no other change follows for a while,
+// so a burst of changes (e.g. a whole schedule) is written at once
+void save_settings();
+
+// read the settings, replaying the journal
+// return false if the journal ends with a damaged or unfinished record (e.g. after a power loss)
+bool load_settings();
+
+// read the settings stored with the legacy layout, converting them to the current one
+// (the store must be compacted afterwards); one-off commands out of the packed date range are dropped
+// return false if the stored settings are not valid legacy settings
+bool load_legacy_settings();
+
+// print a detailed description of the global settings; implemented by the sketch
+void dump_settings();
+
+#endif  // #ifndef SETTINGS_H
@@ -29,10 +29,10 @@
 #include <ESP8266WiFi.h>
 
 #include <stdlib.h>
+#include <stdarg.h>
 #include <ctype.h>
 #include <limits.h>
 
-#include <EEPROM.h>
 #include <Ticker.h>
 #include <ESP8266mDNS.h>
 #include <ESP8266httpUpdate.h>
@@ -42,8 +42,18 @@
 #include <lwip/dns.h>
 
 #include "config.h"
+#include "log.h"
+#include "schedule.h"
+#include "textprotocol.h"
+#include "stats.h"
+#include "settings.h"
+#include "sensor.h"
 
-#define DEBUG_SETTINGS 1
+// after config.h, which selects the sensor
+#if SENSOR_KIND == SENSOR_DS18B20
+#include <OneWire.h>
+#include <DallasTemperature.h>
+#endif
 
 #define BTN_PRESSED    LOW
 #define BTN_NOTPRESSED HIGH
@@ -57,33 +67,14 @@ const int relaypin  = 12;
 const int ledpin    = 13;
 const int freepin   = 14;
 
-// Command description to be run at a later time
-typedef struct ScheduledCmd
-{
-	char     command   = '0';    // '0': turn off, '1': turn on
-	byte     reserved1 = 0;
-	bool     fuzzy     = false;  // if true, execute the command at a random time in a 16 minute window around the set time
-	bool     recurrent = false;  // trigger this command recurrently every week
-	byte     weekday   = 0;      // 1-7: trigger on Mon, ..., Sun; 0: every day; 8: every weekday Mon-Fri, 9: every weekend Sat-Sun
-	byte     hours     = 0;      // trigger at this hour
-	byte     minutes   = 0;      // and this minutes
-	byte     reserved2 = 0;
-	uint64_t firedate  = 0;      // one-off command date
-} ScheduledCmd;
-
-// Non-volatile settings saved in the EEPROM portion of the flash memory
-typedef struct Settings
-{
-	uint32_t     checksum                 = 0;  // crc32 checksum
-	char         ssid     [maxcfgstrsize] = DEFAULT_WIFI_SSID;
-	char         password [maxcfgstrsize] = DEFAULT_WIFI_PASS;
-	char         mqtt_user[maxcfgstrsize] = "";
-	char         mqtt_pass[maxcfgstrsize] = "";
-	int          nscheduled               = 0;  // number of active scheduled commands
-	ScheduledCmd schedule[maxnscheduled];       // scheduled commands
-} Settings;
-
-Settings         settings;
+// Pending schedule reply
+typedef struct ScheduleReport
+{
+	bool     pending;      // true if the reply should be sent
+	bool     incremental;  // true if only the commands added since version 'since' were asked for
+	uint32_t since;
+} ScheduleReport;
+
 IPAddress        masterip;
 WiFiClientSecure wifi;
 PubSubClient     mqtt(wifi, fingerprint);
@@ -91,12 +82,17 @@ uint32_t         lastmillis;
 uint64_t         curdate;  // number of seconds since 1970 (reset after around 5 * 10^11 years)
                            // do not assume date always increases, it will be constantly
                            // corrected by timestamps from the server
+uint64_t         curdatems;       // number of milliseconds since 1970; curdate is its whole seconds
+int32_t          clockdrift;      // measured drift of millis(), in parts per million (positive if fast)
+int64_t          clockcarry;      // drift correction rounded off in the last update, in millionths of ms
+uint64_t         clocksincesync;  // ms counted by millis() since the last synchronization
+bool             clocksynced;     // true if the clock was synchronized since the boot
 
-// Time of the next time the corresponding command will be executed;
-// separated from ScheduledCmd because this changes constantly and
-// so it's better to keep it out of EEPROM (to reduce the number of
-// consistency checks and writes to flash memory)
-uint64_t nextfire[maxnscheduled];
+// Schedule versions, so a schedule reply can carry only the commands added since a version the server
+// already knows; kept in RAM, every schedule change takes the next version (wrapping around)
+uint32_t scheduleversion;              // version of the current schedule
+uint32_t removalversion;               // version of the last change that removed a command
+uint32_t entryversion[maxnscheduled];  // version that added each scheduled command
 
 // Auxiliar functions
 // ------------------------------------------------------------------------------
@@ -107,46 +103,11 @@ int min(int a, int b)
 	return (a < b) ? a : b;
 }
 
-// calculate crc32 checksum (to validate hardware integrity, do not use for security)
-uint32_t crc32(void* data, int size)
-{
-	uint32_t checksum = 0xffffffff;
-	uint8_t* begin    = static_cast<uint8_t*>(data);
-	uint8_t* end      = begin + size;
-	
-	for (uint8_t* i = begin; i < end; i++) {
-		for (uint32_t k = 0x80; k > 0; k >>= 1) {
-			bool bit = checksum & 0x80000000;
-			
-			checksum <<= 1;
-			bit       ^= (*i & k);
-			
-			if (bit) {
-				checksum ^= 0x04c11db7;
-			}
-		}
-	}
-	
-	return checksum;
-}
-
-// calculate the checksum for a given settings struct removing the effect
-// of the checksum field itself to avoid a cyclic dependence
-uint32_t settings_checksum(Settings* settings)
-{
-	uint32_t old_checksum = settings->checksum;
-	settings->checksum    = 0;
-	
-	uint32_t checksum = crc32(settings, sizeof (Settings));
-	
-	settings->checksum = old_checksum;
-	
-	return checksum;
-}
-
 // print a detailed description of the global settings
 void dump_settings()
 {
+	logflush();  // the dump is too big for the log ring, so it goes straight to the serial port
+	
 	int i;
 	Serial.printf("dumping settings (size = %d):\r\n", sizeof(settings));
 	Serial.println();
@@ -180,110 +141,95 @@ void dump_settings()
 	}
 }
 
-// write settings to EEPROM
-void flush_settings()
-{
-	settings.checksum = settings_checksum(&settings);
-	
-#if DEBUG_SETTINGS
-	Serial.println("new settings");
-	dump_settings();
-#endif
-	
-	EEPROM.begin(sizeof (Settings));
-	EEPROM.put(0, settings);
-	EEPROM.end();
-}
+// Log
+// ------------------------------------------------------------------------------
+// With a ring (LOG_RINGSIZE > 0) the log calls only copy the formatted line to RAM and send to the
+// serial port what fits in its FIFO right away; the rest is sent from the main loop, never blocking
+
+const int loglinesize = 128;  // longest formatted log line, longer ones are truncated
 
-// read an unsigned 64 bit integer from a string, similar to strtoull,
-// which is not implemented in the SDK or the libraries, raising a linker error
-uint64_t readull(const char* str, const char** stop)
+#if LOG_RINGSIZE > 0
+static_assert((LOG_RINGSIZE & (LOG_RINGSIZE - 1)) == 0, "LOG_RINGSIZE must be a power of two");
+
+char     logring[LOG_RINGSIZE];  // last LOG_RINGSIZE bytes of the log
+uint32_t loghead   = 0;          // number of bytes ever written to the log
+uint32_t logserial = 0;          // number of bytes of the log already sent to the serial port
+
+// send to the serial port as much of the pending log as it can take without blocking
+void logdrain()
 {
-	uint64_t    value = 0;
-	const char* c;
-	
-	for (c = str; *c != 0; c++) {
-		int digit = *c - '0';
-		
-		if (digit < 0 || 9 < digit) {
-			break;
-		}
+	while (loghead != logserial) {
+		int start = logserial % LOG_RINGSIZE;
+		int count = min(min(loghead - logserial, LOG_RINGSIZE - start), Serial.availableForWrite());
 		
-		uint64_t maxacceptable = (ULONG_LONG_MAX - digit) / 10;
-		
-		if (value > maxacceptable) {
+		if (count <= 0) {
 			break;
 		}
 		
-		value *= 10;
-		value += digit;
-	}
-	
-	if (stop != nullptr) {
-		*stop = c;
+		logserial += Serial.write(reinterpret_cast<const uint8_t*>(&logring[start]), count);
 	}
-	
-	return value;
 }
 
-// write an unsigned 64 bit integer to a string
-// return the number of bytes written
-// no boundaries checks so make sure you have enough room (20 bytes in the worst case)
-int writeull(char* dst, uint64_t value)
+// add to the log ring, overwriting the oldest bytes if it's full
+void logwrite(const char* data, int length)
 {
-	char* c = dst;
-	
-	while (value > 0) {
-		*c     = value % 10 + '0';
-		value /= 10;
-		
-		c += 1;
+	for (int k = 0; k < length; k++) {
+		logring[(loghead + k) % LOG_RINGSIZE] = data[k];
 	}
 	
-	int len = c - dst;
+	loghead += length;
 	
-	while (dst < c) {
-		char tmp = *dst;
-		*dst     = *c;
-		*c       = tmp;
-		
-		dst += 1;
-		c   -= 1;
+	if (loghead - logserial > LOG_RINGSIZE) {  // the serial port lost the overwritten bytes
+		logserial = loghead - LOG_RINGSIZE;
 	}
 	
-	return len;
-}
-
-// day of the week where 1 = Monday ... 7 = Sunday
-byte weekday(uint64_t time)
-{
-	// Jan 01 1970 (time == 0) was a Thursday, i.e. weekday(0) = 4
-	// every unix day is exactly 60 * 60 * 24 = 86400 seconds (leap seconds are discarded)
-	return ((time / 86400 + 3) % 7) + 1;
-}
-
-// seconds since the previous midnight
-int midnightseconds(uint64_t time)
-{
-	return time % 86400;
-}
-
-// hours since the previous midnight
-int hours(uint64_t time)
-{
-	return (time % 86400) / 3600;
+	logdrain();
 }
+#else
+void logdrain() {}
+#endif
 
-// minutes since the previous hour
-int minutes(uint64_t time)
+// write the pending log to the serial port, blocking until it is sent
+void logflush()
 {
-	return (time % 3600) / 60;
+#if LOG_RINGSIZE > 0
+	while (loghead != logserial) {
+		int start = logserial % LOG_RINGSIZE;
+		int count = min(loghead - logserial, LOG_RINGSIZE - start);
+		
+		logserial += Serial.write(reinterpret_cast<const uint8_t*>(&logring[start]), count);
+	}
+#endif
+	
+	Serial.flush();
 }
 
-// seconds since the previous minute
-int seconds(uint64_t time)
+// format a log line and add it to the log (use the log_* macros instead)
+void logprintf(const char* format, ...)
 {
-	return time % 60;
+	char    line[loglinesize];
+	va_list args;
+	
+	va_start(args, format);
+	int count = vsnprintf(line, loglinesize, format, args);
+	va_end(args);
+	
+	if (count < 0) {
+		return;
+	}
+	
+	if (count >= loglinesize) {  // keep the line end of truncated lines
+		count = loglinesize - 1;
+		
+		line[count - 2] = '\r';
+		line[count - 1] = '\n';
+	}
+	
+#if LOG_RINGSIZE > 0
+	logwrite(line, count);
+#else
+	Serial.write(reinterpret_cast<const uint8_t*>(line), count);
+#endif
 }
 
 // LED interface
@@ -350,26 +296,31 @@ void stopledblink()
 // and keeping it pressed for 10 seconds
 void restart()
 {
-	Serial.print("Restarting");
+	if (settings_pending) {
+		flush_settings();
+	}
+	
+	log_info("Restarting");
 	
 	digitalWrite(ledpin, LED_ON);  delay(150);
 	digitalWrite(ledpin, LED_OFF); delay(150);
 	digitalWrite(ledpin, LED_ON);  delay(200);
 	digitalWrite(ledpin, LED_OFF); delay(300);
 	
-	Serial.print(".");
+	log_info(".");
 	
 	digitalWrite(ledpin, LED_ON);  delay(800);
 	digitalWrite(ledpin, LED_OFF); delay(600);
 	
-	Serial.print(".");
+	log_info(".");
 	
 	digitalWrite(ledpin, LED_ON);  delay(300);
 	digitalWrite(ledpin, LED_OFF); delay(150);
 	digitalWrite(ledpin, LED_ON);  delay(150);
 	digitalWrite(ledpin, LED_OFF); delay(200);
 	
-	Serial.println(".");
+	log_info(".\r\n");
+	logflush();
 	
 	if (digitalRead(buttonpin) == BTN_PRESSED) {
 		delay(4000);
@@ -392,64 +343,72 @@ void restart()
 // resets configuration to its factory settings
 void resetconfig()
 {
-	Serial.println("Resetting configuration");
+	log_info("Resetting configuration\r\n");
 	WiFi.disconnect();
 	
-	Settings settings = Settings();
+	settings = Settings();
 	flush_settings();
 }
 
 // Scheduler
 // ------------------------------------------------------------------------------
 
-Ticker      sticker;
-const char* report_status;  // if not null, indicates a status response should be sent and
-                            // the status line corresponds to this string
+Ticker        sticker;
+const char*   report_status;       // if not null, indicates a status response should be sent and
+                                   // the status line corresponds to this string
+unsigned long report_statussince;  // timestamp for the first relay change not published yet
+bool          report_statusasked;  // true if the server asked for the status, answered right away
 
-// update the value of curdate;
-// should be called at least every 49 days (otherwise it would skip an millis() overflow)
-void updatetime()
+// record the relay status to be published, once the changes settle (see the main loop)
+void reportstatus()
 {
-	uint32_t mil = millis();                                   // note that just using date += (millis() - lastmillis) / 1000
-	curdate     += (mil - 1000 * (lastmillis / 1000)) / 1000;  // would lose accuracy due to roundoff errors, so we first round lastmillis
-	lastmillis   = mil;                                        // to the second, i.e. add the same amount of milliseconds that were
-	                                                           // rounded off in the previous iteration
+	if (report_status == nullptr) {
+		report_statussince = millis();
+	}
 	
-	Serial.printf("now: %d\r\n", (int) curdate);
+	report_status = (digitalRead(relaypin) == RELAY_ON) ? "on" : "off";
 }
 
-// compare two ScheduledCmd
-// return value == 0 if equal, value < 0 if a < b, value > 0 if a > b
-// order defined by (day, hour, minutes, command, recurrent, fuzzy)
-int scommandcmp(const ScheduledCmd& a, const ScheduledCmd& b)
+// update the value of curdate, correcting the drift of millis() measured between synchronizations;
+// should be called at least every 49 days (otherwise it would skip an millis() overflow)
+void updatetime()
 {
-	int diff = 0;
+	uint32_t mil     = millis();
+	uint32_t elapsed = mil - lastmillis;
+	int64_t  drift   = static_cast<int64_t>(elapsed) * clockdrift + clockcarry;  // in millionths of ms
+	
+	curdatems      += elapsed - drift / 1000000;  // the remainder is carried to the next update,
+	clockcarry      = drift % 1000000;            // so the correction doesn't lose accuracy to roundoff
+	clocksincesync += elapsed;
+	curdate         = curdatems / 1000;
+	lastmillis      = mil;
 	
-	return ((diff = a.weekday   - b.weekday)   != 0) ? diff :
-	       ((diff = a.hours     - b.hours)     != 0) ? diff :
-	       ((diff = a.minutes   - b.minutes)   != 0) ? diff :
-	       ((diff = a.command   - b.command)   != 0) ? diff :
-	       ((diff = a.recurrent - b.recurrent) != 0) ? diff :
-	       (        a.fuzzy     - b.fuzzy);
+	log_debug("now: %d\r\n", (int) curdate);
 }
 
-// linear search on the haystack
-// return the index of the matched command or -1 if it was not found
-// avoid sort + binary search as it implies unnecessary writes to EEPROM
-// and given the small schedule size and the sparsity of update events it is not worth it
-int findscommand(const ScheduledCmd& needle, ScheduledCmd* haystack, int hsize)
+// start a new schedule version space, every scheduled command belonging to its first version;
+// random, so the versions the server remembers from before a restart aren't mistaken for current ones
+void startversions()
 {
-	Serial.println("finding command");
-	Serial.printf("needle: cmd: %c; fuzzy: %d; recurrent: %d, firedate: %d\r\n", needle.command, needle.fuzzy, needle.recurrent, (int) needle.firedate);
+	scheduleversion = RANDOM_REG32;
+	removalversion  = scheduleversion;
 	
-	for (int i = 0; i < hsize; i++) {
-		if (scommandcmp(needle, haystack[i]) == 0) {
-			Serial.println("found it");
-			return i;
-		}
+	for (int k = 0; k < settings.nscheduled; k++) {
+		entryversion[k] = scheduleversion;
 	}
-	
-	return -1;
+}
+
+// return true if the schedule can be described as additions to the given version, i.e.
+// if the version is not newer than the current one and no command was removed after it
+bool knownversion(uint32_t since)
+{
+	return scheduleversion - since <= scheduleversion - removalversion;
+}
+
+// return true if the scheduled command at index k was added after the given (known) version
+bool addedsince(int k, uint32_t since)
+{
+	return scheduleversion - entryversion[k] < scheduleversion - since;
 }
 
 // add a new scheduled command
@@ -457,10 +416,11 @@ int findscommand(const ScheduledCmd& needle, ScheduledCmd* haystack, int hsize)
 // or if no there is no more room in the scheduler array, do nothing and return false
 bool schedulecommand(const ScheduledCmd& command)
 {
-	Serial.println("scheduling command");
-	Serial.printf("command: cmd: %c; fuzzy: %d; recurrent: %d, firedate: %d\r\n", command.command, command.fuzzy, command.recurrent, (int) command.firedate);
+	log_debug("scheduling command\r\n");
+	log_debug("command: cmd: %c; fuzzy: %d; recurrent: %d, firedate: %d\r\n", command.command, command.fuzzy, command.recurrent, (int) command.firedate);
 	
 	if (settings.nscheduled >= maxnscheduled) {
+		log_error("Schedule full, dropping the command\r\n");
 		return false;
 	}
 	
@@ -471,10 +431,12 @@ bool schedulecommand(const ScheduledCmd& command)
 	}
 	
 	settings.schedule[settings.nscheduled] = command;
-	calculatenextfire(settings.nscheduled++);
+	entryversion     [settings.nscheduled] = ++scheduleversion;
+	calculatenextfire(settings.nscheduled);
+	heapinsert(settings.nscheduled++);
 	updatescallback();
 	
-	flush_settings();
+	save_settings();
 	
 	return true;
 }
@@ -483,8 +445,8 @@ bool schedulecommand(const ScheduledCmd& command)
 // if it was not found, do nothing and return false
 bool unschedulecommand(const ScheduledCmd& command)
 {
-	Serial.println("unscheduling command");
-	Serial.printf("command: cmd: %c; fuzzy: %d; recurrent: %d, firedate: %d\r\n", command.command, command.fuzzy, command.recurrent, (int) command.firedate);
+	log_debug("unscheduling command\r\n");
+	log_debug("command: cmd: %c; fuzzy: %d; recurrent: %d, firedate: %d\r\n", command.command, command.fuzzy, command.recurrent, (int) command.firedate);
 	
 	int index = findscommand(command, settings.schedule, settings.nscheduled);
 	
@@ -492,116 +454,130 @@ bool unschedulecommand(const ScheduledCmd& command)
 		return false;
 	}
 	
-	settings.schedule[index] = settings.schedule[settings.nscheduled];
-	nextfire         [index] = nextfire         [settings.nscheduled--];
+	heapdelete(index);
+	dropscommand(index);
 	
-	flush_settings();
+	save_settings();
 	
 	return true;
 }
 
-// calculate the nextfire property for every scheduled command
-void calculatenextfire()
+// remove the scheduled command at index i, which must be out of the fire heap
+void dropscommand(int i)
 {
-	Serial.printf("recalculating all firedates (n = %d)\r\n", settings.nscheduled);
+	settings.nscheduled--;  // move the last command to the freed slot
+	removalversion = ++scheduleversion;
 	
-	for (int i = 0; i < settings.nscheduled; i++) {
-		calculatenextfire(i);
+	if (i != settings.nscheduled) {
+		settings.schedule[i] = settings.schedule[settings.nscheduled];
+		nextfire         [i] = nextfire         [settings.nscheduled];
+		entryversion     [i] = entryversion     [settings.nscheduled];
+		
+		heapmove(settings.nscheduled, i);
 	}
 }
 
+// calculate the nextfire property for every scheduled command, reading the clock only once
+void calculatenextfire()
+{
+	log_debug("recalculating all firedates (n = %d)\r\n", settings.nscheduled);
+	
+	updatetime();
+	firedates(settings.schedule, settings.nscheduled, curdate);
+}
+
 // calculate the nextfire property for the scheduled command at index i
+// the fire heap must be updated afterwards
 // if the index is out-of-bounds, do nothing and return false
 bool calculatenextfire(int i)
 {
-	Serial.printf("recalculating firedate for schedule[%d]\r\n", i);
-	Serial.printf("schedule[%d]: cmd: %c; fuzzy: %d; recurrent: %d, firedate: %d\r\n", i,
-	              settings.schedule[i].command, settings.schedule[i].fuzzy,
-	              settings.schedule[i].recurrent, (int) settings.schedule[i].firedate);
-	
 	if (i < 0 || i >= maxnscheduled) {
 		return false;
 	}
 	
-	if (!settings.schedule[i].recurrent) {
-		nextfire[i] = settings.schedule[i].firedate;
-	}
-	else {
-		updatetime();
-		
-		uint32_t wday     = weekday(curdate) % 7;
-		uint32_t secs     = midnightseconds(curdate);
-		uint64_t midnight = curdate - secs;
-		
-		uint32_t schwday = settings.schedule[i].weekday;  // schedule weekday and seconds since midnight
-		uint32_t schsecs = 60 *(settings.schedule[i].minutes + 60 * settings.schedule[i].hours);
-		
-		if (schsecs <= secs) {           // at an earlier time (so it must start counting from tomorrow)
-			midnight += 24 * 60 * 60;    // the equality forbids setting a recurrent firedate for right now (only for next week)
-			wday      = (wday + 1) % 7;  // to avoid re-raising an event multiple times when rescheduling after the event handler;
-		}                                // in practice nobody should rely on a 1-second-precision based decision anyway
-		
-		// note that at least one of the possible weekdays must satisfy the conditional
-		for (int k = 0; k < 7; k++) {
-			if (schwday == 0 ||                 // the schedule is every day, so today too
-			    schwday == wday ||              // the schedule is for today, (note the differences between 0-index and 1-index
-			    (schwday == 7 && wday == 0) ||  // and also between starting in Sunday and Monday)
-			    (schwday == 8 && 1 <= wday && wday <= 5) ||    // the schedule is for weekday and today is a weekday
-			    (schwday == 9 && (wday == 0 || wday == 6))) {  // the schedule is for weekend and today is a weekend
-				
-				nextfire[i] = midnight + schsecs;
-				Serial.printf("found match: %d, %d; new firedate: %d\r\n", k, wday, (int) nextfire[i]);
-				break;
-			}
-			
-			midnight += 24 * 60 * 60;
-			wday      = (wday + 1) % 7;
-		}
-	}
+	log_debug("recalculating firedate for schedule[%d]\r\n", i);
+	log_debug("schedule[%d]: cmd: %c; fuzzy: %d; recurrent: %d, days: %02x, firedate: %d\r\n", i,
+	              settings.schedule[i].command, settings.schedule[i].fuzzy, settings.schedule[i].recurrent,
+	              settings.schedule[i].days, (int) settings.schedule[i].firedate);
 	
-	if (settings.schedule[i].fuzzy) {  // add noise
-		const int halfnoise = 8 * 60;  // noise will be +-8 mins, i.e. a total spread of 16 minutes
-		int lowbound  = (nextfire[i] > halfnoise)                  ? 0 : halfnoise - nextfire[i];
-		int highbound = (nextfire[i] < ULONG_LONG_MAX - halfnoise) ? 2 * halfnoise : ULONG_LONG_MAX + halfnoise - nextfire[i];
-		
-		nextfire[i] += random(lowbound, highbound) - halfnoise;
-		
-		Serial.printf("fuzzy; lowbound: %d; highbound: %d; new firedate: %d\r\n", lowbound - halfnoise, highbound - halfnoise, (int) nextfire[i]);
-	}
+	updatetime();
+	nextfire[i] = nextfiredate(settings.schedule[i], curdate);
+	
+	log_debug("new firedate: %d\r\n", (int) nextfire[i]);
 	
 	return true;
 }
 
 // update callback timeout according to the soonest fire
+// nothing is armed before the clock is set: until then the fire dates are meaningless, and
+// commands arriving early (e.g. queued for the session while offline) would be dropped as too old
 void updatescallback()
 {
-	Serial.println("recalculating callback timeout");
-	if (settings.nscheduled == 0) {
+	log_debug("recalculating callback timeout\r\n");
+	if (heapsize == 0 || !clocksynced) {
 		sticker.once_ms((uint32_t) ULONG_MAX, scallback);  // even if there are no events, calling the callback will
 		return;                                            // force a time update, so we don't miss a millis() overflow
 	}
 	
 	updatetime();
-	uint64_t next = ULONG_LONG_MAX;
 	
-	for (int i = 0; i < settings.nscheduled; i++) {
-		next = (nextfire[i] < next) ? nextfire[i] : next;
-	}
+	uint32_t timeout = firetimeout(curdatems);
+	
+	log_debug("new timeout: %d ms\r\n", (int) timeout);
 	
-	next = (next > curdate) ? next : curdate;  // limit to the present or future, not the past;
-	                                           // if there's a command in the past, the callback will be called immediately
+	sticker.detach();
+	sticker.once_ms(timeout, scallback);
+}
+
+// set the clock to a timestamp from the server, in milliseconds since 1970
+// the difference with the device clock since the previous synchronization measures its drift,
+// and only the fire dates that may move are recalculated
+void synctime(uint64_t timems)
+{
+	updatetime();
 	
-	uint64_t diff = next - curdate;
+	uint64_t olddate = curdate;
+	int64_t  error   = static_cast<int64_t>(curdatems - timems);  // > 0 if the device clock is ahead
 	
-	diff = (diff < ULONG_MAX / 1000) ? diff : ULONG_MAX / 1000;  // if it is too far into the future (ticker uses 32 bits
-	                                                             // for the timestamp), just set the callback as far
-	                                                             // as possible; the callback will do nothing but set
-	                                                             // the next callback until diff is small enough
+	if (clocksynced) {
+		if (clocksincesync >= static_cast<uint64_t>(clockmininterval)) {
+			int64_t residual = error * 1000000 / static_cast<int64_t>(clocksincesync);  // ppm left after the correction
+			
+			if (residual > -clockmaxdrift && residual < clockmaxdrift) {  // otherwise, the server clock changed (e.g. DST)
+				int64_t drift = clockdrift + residual;
+				
+				clockdrift = (drift > clockmaxdrift) ? clockmaxdrift : (drift < -clockmaxdrift) ? -clockmaxdrift : drift;
+			}
+		}
+		
+		int64_t moved = (error < INT_MIN) ? INT_MAX : (error > INT_MAX) ? INT_MIN : -error;
+		
+		log_info("Clock moved %d ms, drift: %d ppm\r\n", static_cast<int>(moved), static_cast<int>(clockdrift));
+	}
 	
-	Serial.printf("new timeout: %d\r\n", (int) diff);
+	curdatems      = timems;
+	curdate        = timems / 1000;
+	clockcarry     = 0;
+	clocksincesync = 0;
 	
-	sticker.detach();
-	sticker.once_ms((uint32_t) (1000 * diff), scallback);
+	if (!clocksynced) {  // the fire dates were calculated from an unknown time
+		log_info("Clock set\r\n");
+		
+		clocksynced = true;
+		calculatenextfire();
+	}
+	else if (curdate + 5 < olddate) {  // back beyond the scheduler's grace: a recurrent command may now fire earlier
+		for (int i = 0; i < settings.nscheduled; i++) {
+			if (settings.schedule[i].recurrent) {
+				nextfire[i] = nextfiredate(settings.schedule[i], curdate);
+			}
+		}
+		
+		heapbuild(settings.nscheduled);
+	}
+	// forward, the fire dates are still the next ones; those left behind are run or discarded by the callback
+	
+	updatescallback();
 }
 
 // scheduler callback, usually called when there is a scheduled command to be run
@@ -610,82 +586,318 @@ void updatescallback()
 // if an old command (> 5 sec) is found, ignore it, it's too late now
 void scallback()
 {
-	// if more than one command must be executed, only execute the last one
-	// NOTE this relies on the particular commands of the switch, 'on' and 'off',
-	//      which are absorbent, i.e. the result of applying a sequence of commands
-	//      (instantaneously) is the same as applying the last one
-	uint64_t lastexectime = 0;
-	byte     lastexeccmd  = 0;
+	byte due[maxnscheduled];  // commands taken out of the fire heap
+	byte lastexeccmd;
 	
 	updatetime();
 	
-	Serial.printf("checking for actions to be performed, date: %d; n = %d\r\n", (int) curdate, settings.nscheduled);
+	if (!clocksynced) {  // synctime calculates the fire dates and rearms the callback
+		updatescallback();
+		return;
+	}
 	
-	for (int i = 0; i < settings.nscheduled; i++) {
-		uint64_t exectime = nextfire[i];
-		
-		Serial.printf("checking nextfire[%d]: %d\r\n", i, (int) exectime);
-		
-		if (exectime > curdate + 5) {  // not yet
-			Serial.println("  in the future, skip");
-			continue;
-		}
-		
-		if ((!settings.schedule[i].fuzzy && exectime  < curdate - 5) ||       // too old
-		    ( settings.schedule[i].fuzzy && exectime  < curdate - 8 * 60)) {  // fuzzy gets 8 minutes of grace
-			// do not include in execution
-			Serial.println("too old, discard");
-		}
-		else {
-			Serial.println("candidate to execute");
-			if (exectime > lastexectime) {
-				Serial.println("latest so far");
-				lastexectime = exectime;
-				lastexeccmd  = settings.schedule[i].command;
-			}
-		}
+	log_debug("checking for actions to be performed, date: %d; n = %d\r\n", (int) curdate, settings.nscheduled);
+	
+	int ndue = takedue(settings.schedule, curdate, due, lastexeccmd);
+	
+	// due from the highest index down, so moving the last command
+	// to a freed slot never moves a command that is still to be reset
+	for (int k = 0; k < ndue; k++) {
+		int i = due[k];
 		
-		// reset
 		if (settings.schedule[i].recurrent) {
-			Serial.println("recurrent: resetting the firedate");
+			log_debug("recurrent: resetting the firedate\r\n");
 			calculatenextfire(i);
+			heapinsert(i);
 		}
 		else {
-			Serial.println("one-off: kill it");
-			unschedulecommand(settings.schedule[i--]);
+			log_debug("one-off: kill it\r\n");
+			dropscommand(i);
+			save_settings();
 		}
 	}
 	
 	
 	if (lastexeccmd == '0') {
-		Serial.println("relay -> off");
-		report_status = "off";
+		log_info("relay -> off\r\n");
 		digitalWrite(relaypin, RELAY_OFF);
+		reportstatus();
 	}
 	else if (lastexeccmd == '1') {
-		Serial.println("relay -> on");
-		report_status = "on";
+		log_info("relay -> on\r\n");
 		digitalWrite(relaypin, RELAY_ON);
+		reportstatus();
 	}
 	
 	updatescallback();
 }
 
+// Sensor
+// ------------------------------------------------------------------------------
+// The sensor on freepin (see SENSOR_KIND) is sampled from the main loop every 'sensorperiod' ms,
+// and the samples are aggregated into windows; finished windows wait in a queue until they are
+// published, all at once, on '<username>/sensor'
+
+#if SENSOR_KIND == SENSOR_PULSES
+const char sensorkind[] = "pulses";
+#elif SENSOR_KIND == SENSOR_LEVEL
+const char sensorkind[] = "level";
+#elif SENSOR_KIND == SENSOR_DS18B20
+const char sensorkind[] = "temperature";
+
+OneWire           onewire(freepin);
+DallasTemperature thermometer(&onewire);
+#endif
+
+Ticker            sensorticker;
+volatile bool     sensor_due;                     // true if a sample should be taken, set by the ticker
+uint32_t          sensor_window;                  // s of the windows
+uint32_t          sensor_windowstart;             // timestamp for the start of the current window
+SensorWindow      sensor_current;                 // window being aggregated
+SensorWindow      sensor_queue[sensorqueuesize];  // finished windows not published yet, oldest first
+int               sensor_queued;                  // number of windows in the queue
+uint32_t          sensor_failures;                // samples that could not be read in the current window
+volatile uint32_t sensor_pulses;                  // pulses counted by the interrupt (SENSOR_PULSES)
+uint32_t          sensor_lastpulses;              // value of sensor_pulses at the last sample
+
+// pulse interrupt, on the falling edge (SENSOR_PULSES)
+void ICACHE_RAM_ATTR sensorpulse()
+{
+	sensor_pulses += 1;
+}
+
+// sensor ticker callback; the sample itself is taken from the main loop
+void sensortick()
+{
+	sensor_due = true;
+}
+
+// set up the sensor pin and start the first window, if there is a sensor
+void sensorsetup()
+{
+	sensor_window = sensorwindow;
+	sensor_queued = 0;
+	
+#if SENSOR_KIND != SENSOR_NONE
+#if SENSOR_KIND == SENSOR_PULSES
+	pinMode(freepin, INPUT_PULLUP);
+	attachInterrupt(digitalPinToInterrupt(freepin), sensorpulse, FALLING);
+#elif SENSOR_KIND == SENSOR_LEVEL
+	pinMode(freepin, INPUT);
+#elif SENSOR_KIND == SENSOR_DS18B20
+	thermometer.begin();
+	thermometer.setWaitForConversion(false);  // the conversion runs between two samples
+	thermometer.requestTemperatures();
+#endif
+	
+	sensor_windowstart = millis();
+	startwindow(sensor_current, 0, sensor_window);
+	sensorticker.attach_ms(sensorperiod, sensortick);
+#endif
+}
+
+// read the sensor
+// return false if it could not be read
+bool readsensor(int32_t& value)
+{
+#if SENSOR_KIND == SENSOR_PULSES
+	noInterrupts();
+	uint32_t pulses = sensor_pulses;
+	interrupts();
+	
+	value             = pulses - sensor_lastpulses;
+	sensor_lastpulses = pulses;
+	
+	return true;
+#elif SENSOR_KIND == SENSOR_LEVEL
+	value = digitalRead(freepin);
+	
+	return true;
+#elif SENSOR_KIND == SENSOR_DS18B20
+	float celsius = thermometer.getTempCByIndex(0);
+	
+	thermometer.requestTemperatures();  // for the next sample
+	
+	if (celsius == DEVICE_DISCONNECTED_C) {
+		return false;
+	}
+	
+	value = lroundf(celsius * 100);
+	
+	return true;
+#else
+	value = 0;
+	
+	return false;
+#endif
+}
+
+// finish the current window, queueing it unless it is empty, and start the next one
+void closewindow(uint32_t seconds)
+{
+	if (sensor_failures > 0) {
+		log_error("Can't read the sensor: %u samples lost\r\n", static_cast<unsigned>(sensor_failures));
+	}
+	
+	if (sensor_current.count > 0) {
+		if (sensor_queued == sensorqueuesize) {  // drop the oldest window
+			log_error("Sensor queue full, dropping a window\r\n");
+			
+			memmove(&sensor_queue[0], &sensor_queue[1], (sensorqueuesize - 1) * sizeof (SensorWindow));
+			sensor_queued -= 1;
+		}
+		
+		sensor_queue[sensor_queued++] = sensor_current;
+	}
+	
+	updatetime();
+	
+	sensor_failures    = 0;
+	sensor_windowstart = millis();
+	startwindow(sensor_current, clocksynced ? curdate : 0, seconds);
+}
+
+// take a sample, closing the window when it's over
+void sensorsample()
+{
+	int32_t value;
+	
+	if (readsensor(value)) {
+		addsample(sensor_current, value);
+	}
+	else {
+		sensor_failures += 1;
+	}
+	
+	if (millis() - sensor_windowstart >= 1000 * sensor_window) {
+		closewindow(sensor_window);
+	}
+}
+
+// set the length of the windows, closing the current one unless the length doesn't change
+// (the server sends it again on every hello)
+void setsensorwindow(uint32_t seconds)
+{
+	if (seconds == sensor_window) {
+		return;
+	}
+	
+	sensor_window = seconds;
+	
+#if SENSOR_KIND != SENSOR_NONE
+	closewindow(seconds);
+#endif
+}
+
+// TLS sessions
+// ------------------------------------------------------------------------------
+// With TLS_SESSION_RESUME, the clients keep the session of their last handshake with each server and
+// offer it on the next connection, so the server can resume it with an abbreviated handshake.
+// The sessions and the handshake counters are kept in RTC memory, which survives restart()
+// (but not a power loss)
+
+#if TLS_SESSION_RESUME
+typedef BearSSL::Session TlsSession;
+#else
+typedef struct TlsSession {} TlsSession;  // nothing to keep
+#endif
+
+typedef struct RtcState
+{
+	uint32_t   checksum    = 0;  // crc32 checksum of the rest of the struct
+	uint32_t   tls_full    = 0;  // number of full TLS handshakes
+	uint32_t   tls_resumed = 0;  // number of abbreviated TLS handshakes, resuming a session
+	TlsSession mqttsession;      // last session with the MQTT broker
+	TlsSession httpssession;     // last session with the HTTPS server
+} RtcState;
+
+const int rtcstateblock = 32;  // the first 128 bytes of the RTC user memory are reserved for OTA updates
+
+static_assert(sizeof (RtcState) % 4 == 0, "the RTC memory is read and written in 4 byte blocks");
+static_assert(4 * rtcstateblock + sizeof (RtcState) <= 512, "RtcState must fit in the RTC user memory");
+
+RtcState rtcstate;
+
+// checksum of the RTC state, removing the effect of the checksum field itself
+uint32_t rtcstate_checksum()
+{
+	return crc32(reinterpret_cast<uint8_t*>(&rtcstate) + sizeof (uint32_t), sizeof (RtcState) - sizeof (uint32_t));
+}
+
+// read the RTC state left by the previous run, or start a new one if there is none (e.g. after a power loss)
+void load_rtcstate()
+{
+	if (!ESP.rtcUserMemoryRead(rtcstateblock, reinterpret_cast<uint32_t*>(&rtcstate), sizeof (RtcState)) ||
+	    rtcstate.checksum != rtcstate_checksum()) {
+		rtcstate = RtcState();
+	}
+}
+
+// write the RTC state, for the next run after a restart
+void save_rtcstate()
+{
+	rtcstate.checksum = rtcstate_checksum();
+	
+	ESP.rtcUserMemoryWrite(rtcstateblock, reinterpret_cast<uint32_t*>(&rtcstate), sizeof (RtcState));
+}
+
+// count a TLS handshake made with the given session, which held 'offered' before connecting;
+// a server resuming a session keeps its ID, while a full handshake replaces it
+void counthandshake(const TlsSession& offered, const TlsSession& session)
+{
+	static const TlsSession none = TlsSession();
+	
+	bool resumed = TLS_SESSION_RESUME && memcmp(&offered, &none, sizeof (TlsSession)) != 0 &&
+	                                     memcmp(&offered, &session, sizeof (TlsSession)) == 0;
+	
+	if (resumed) {
+		rtcstate.tls_resumed += 1;
+	}
+	else {
+		rtcstate.tls_full += 1;
+	}
+	
+	save_rtcstate();
+	
+	log_info("TLS handshake %s (%u full, %u resumed so far)\r\n", resumed ? "resumed" : "full",
+	         static_cast<unsigned int>(rtcstate.tls_full), static_cast<unsigned int>(rtcstate.tls_resumed));
+}
+
 // MQTT
 // ------------------------------------------------------------------------------
 
-char  lobbytopic  [maxcfgstrsize + 10];  // cached lobby topic   "<username>/lobby"
-char  controltopic[maxcfgstrsize + 10];  // cached control topic "<username>/topic"
-char  admintopic  [maxcfgstrsize + 10];  // cached admin topic   "<username>/admin"
+char  lobbytopic   [maxcfgstrsize + 10];  // cached lobby topic          "<username>/lobby"
+char  controltopic [maxcfgstrsize + 10];  // cached control topic        "<username>/topic"
+char  admintopic   [maxcfgstrsize + 10];  // cached admin topic          "<username>/admin"
+char  controlbtopic[maxcfgstrsize + 10];  // cached binary control topic "<username>/controlb"
+char  adminbtopic  [maxcfgstrsize + 10];  // cached binary admin topic   "<username>/adminb"
+char  statustopic  [maxcfgstrsize + 10];  // cached status topic         "<username>/status"
+char  sensortopic  [maxcfgstrsize + 10];  // cached sensor topic         "<username>/sensor"
+const char grouptopic[] = "group/+/control";  // control topics of the groups the device is in;
+                                               // the broker only delivers those of its own groups
+const char* published_status;            // status retained on the status topic, null if not published
+                                         // since connecting
 bool  mqtt_hascreds;                     // true if the device remembers a user and password for MQTT
-bool  should_reconnect;                  // true if enough time has pass to reconnect to the MQTT broker
+bool  mqtt_saidhello;                    // true if the device said hello since it got its credentials
 bool  should_ping;                       // true if the mqtt client should pingback as soon as possible
-char* report_schedule;                   // prepared message detailing the device's schedule
+
+// MQTT connection states, stepped from the main loop (see mqtt_step)
+const byte mqtt_waiting     = 0;  // disconnected, waiting for the time of the next connection attempt
+const byte mqtt_subscribing = 1;  // connected, subscribing to the device topics
+const byte mqtt_up          = 2;  // connected and subscribed
+
+byte          mqtt_state;        // connection state
+int           mqtt_substep;      // next subscription step while subscribing
+int           mqtt_attempts;     // number of consecutive failed connection attempts so far
+unsigned long mqtt_nextattempt;  // timestamp for the next connection attempt while waiting
+
+ScheduleReport report_schedule;     // text reply, on '<username>/admin'
+ScheduleReport report_binschedule;  // binary reply, on '<username>/adminb'
 
 // connect to the MQTT server
 bool mqtt_connect()
 {
-	Serial.println("Connecting to MQTT broker");
+	log_info("Connecting to MQTT broker\r\n");
 	
 	bool connected = false;
 	
@@ -695,70 +907,241 @@ bool mqtt_connect()
 	strncpy(&lobbytopic[usernamelen], "/lobby", 6);              // it will usually pop a notification to the
 	lobbytopic[maxcfgstrsize + 9] = 0;                           // user, who must approve the new device
 	
+#if MQTT_USE_PSK
+	// paired devices with a key skip the certificate handshake; the broker takes the identity as username
+	bool usepsk = mqtt_hascreds && strlen(settings.mqtt_psk) > 0;
+	
+	if (usepsk) {
+		wifi.setPreSharedKey(settings.mqtt_user, settings.mqtt_psk);
+	}
+	else {
+		wifi.setPreSharedKey(nullptr, nullptr);
+	}
+	
+	mqtt.setServer(masterhost, usepsk ? masterportmqttpsk : masterportmqtt);
+#endif
+	
+	TlsSession offered = rtcstate.mqttsession;
+	
 	if (mqtt_hascreds) {
-		Serial.printf("Found credentials, connecting as %s\r\n", settings.mqtt_user);
+		log_info("Found credentials, connecting as %s\r\n", settings.mqtt_user);
+#if MQTT_PERSISTENT_SESSION
+		connected = mqtt.connect(settings.mqtt_user, settings.mqtt_user, settings.mqtt_pass,
+		                         lobbytopic, 1, 0, "abruptly disconnected", false);
+#else
 		connected = mqtt.connect(settings.mqtt_user, settings.mqtt_user, settings.mqtt_pass,
 		                         lobbytopic, 1, 0, "abruptly disconnected");
+#endif
 	}
 	else {  // use guest secret key to prove network access authorization
-		Serial.printf("Credentials not found, connecting as %s using the guest secret\r\n", settings.mqtt_user);
+		log_info("Credentials not found, connecting as %s using the guest secret\r\n", settings.mqtt_user);
 		connected = mqtt.connect(settings.mqtt_user, settings.mqtt_user, authorization,
 		                         lobbytopic, 1, 0, "abruptly disconnected");
 	}
 	
+	if (connected) {
+		counthandshake(offered, rtcstate.mqttsession);
+	}
+	
 	// authentication and authorization
 	
 	if (!connected) {
 		int state = mqtt.state();
 		
-		Serial.println("Can't connect to MQTT server");
+		log_error("Can't connect to MQTT server\r\n");
 		
 		if (state == MQTT_CONNECT_BAD_CLIENT_ID ||
 		    state == MQTT_CONNECT_BAD_CREDENTIALS ||
 		    state == MQTT_CONNECT_UNAUTHORIZED) {
 			if (mqtt_hascreds) {  // faulty credentials, try to enter as a guest next time
 				mqtt_hascreds      = false;
+#if MQTT_USE_PSK
+				settings.mqtt_psk[0] = 0;
+#endif
 				(mqtt_prefix + String(static_cast<unsigned long>(random(INT_MIN, INT_MAX)), HEX)).toCharArray(settings.mqtt_user, maxcfgstrsize);
 				
-				Serial.println("Faulty MQTT credentials, resetting");
+				log_error("Faulty MQTT credentials, resetting\r\n");
 			}
 		}
 		else if (state == MQTT_TLS_BAD_SERVER_CREDENTIALS) {
-			Serial.println("Incorrect MQTT server fingerprint, resetting");
+			log_error("Incorrect MQTT server fingerprint, resetting\r\n");
 		}
-		
-		return false;
+#if MQTT_USE_PSK
+		else if (usepsk && state == MQTT_CONNECT_FAILED) {  // the key may have been revoked
+			settings.mqtt_psk[0] = 0;
+			
+			log_error("TLS-PSK handshake failed, falling back to certificates\r\n");
+		}
+#endif
+		
+		return false;
 	}
 	
-	// subscriptions
-	
-	Serial.println("Subscribing to channels");
+	// topics, subscribed to from the following steps (see mqtt_subscribestep)
 	
 	if (mqtt_hascreds) {
 		strncpy(admintopic, settings.mqtt_user, maxcfgstrsize);
 		strncpy(&admintopic[usernamelen], "/admin", 6);
 		admintopic[maxcfgstrsize + 9] = 0;
 		
-		mqtt.subscribe(admintopic);
-		
 		strncpy(controltopic, settings.mqtt_user, maxcfgstrsize);
 		strncpy(&controltopic[usernamelen], "/control", 8);
 		controltopic[maxcfgstrsize + 9] = 0;
 		
-		mqtt.subscribe(controltopic);
+		strncpy(controlbtopic, settings.mqtt_user, maxcfgstrsize);
+		strncpy(&controlbtopic[usernamelen], "/controlb", 9);
+		controlbtopic[maxcfgstrsize + 9] = 0;
 		
-		mqtt.publish(lobbytopic, "hello");
+		strncpy(adminbtopic, settings.mqtt_user, maxcfgstrsize);
+		strncpy(&adminbtopic[usernamelen], "/adminb", 7);
+		adminbtopic[maxcfgstrsize + 9] = 0;
+		
+		strncpy(statustopic, settings.mqtt_user, maxcfgstrsize);
+		strncpy(&statustopic[usernamelen], "/status", 7);
+		statustopic[maxcfgstrsize + 9] = 0;
 		
-		Serial.println("Subscribed to admin and control");
+		strncpy(sensortopic, settings.mqtt_user, maxcfgstrsize);
+		strncpy(&sensortopic[usernamelen], "/sensor", 7);
+		sensortopic[maxcfgstrsize + 9] = 0;
+	}
+	
+	return true;
+}
+
+// take the next step of the subscriptions after connecting, one topic per step
+// the device says hello once subscribed to its topics, so the server's answers are not missed
+// return true once every subscription is done
+// 
+// the subscriptions are repeated even when the broker kept the session, because the client doesn't
+// report it; they are idempotent, and they restore the topics if the broker lost its sessions
+bool mqtt_subscribestep()
+{
+	const char* topics[] = {lobbytopic, admintopic, controltopic, controlbtopic, grouptopic};
+	int         ntopics  = mqtt_hascreds ? 5 : 1;  // guests only wait in the lobby
+#if MQTT_PERSISTENT_SESSION
+	const byte  qos[]    = {0, 1, 1, 1, 1};        // queue commands while the device is offline
+#else
+	const byte  qos[]    = {0, 0, 0, 0, 0};
+#endif
+	
+	if (mqtt_substep == 0) {
+		log_info("Subscribing to channels\r\n");
 	}
 	
-	mqtt.subscribe(lobbytopic);
+	mqtt.subscribe(topics[mqtt_substep], qos[mqtt_substep]);
+	mqtt_substep += 1;
 	
-	Serial.println("Subscribed to lobby");
+	if (mqtt_substep < ntopics) {
+		return false;
+	}
+	
+	if (mqtt_hascreds) {
+#if MQTT_PERSISTENT_SESSION
+		// the queued commands need no resync, and the clock is still right since the first hello
+		mqtt.publish(lobbytopic, mqtt_saidhello ? "here" : "hello");
+#else
+		mqtt.publish(lobbytopic, "hello");
+#endif
+		mqtt_saidhello = true;
+		
+		published_status = nullptr;  // the relay may have changed while offline
+		reportstatus();
+		
+		log_info("Subscribed to lobby, admin, control and groups\r\n");
+	}
+	else {
+		log_info("Subscribed to lobby\r\n");
+	}
 	
 	return true;
 }
 
+// schedule the next connection attempt at a random time within a window that doubles with every failed
+// attempt (up to a maximum), so a fleet of devices that lost the broker at once spreads its reconnections
+void mqtt_backoff()
+{
+	unsigned long window = mqtt_backoffmin;
+	
+	for (int k = 0; k < mqtt_attempts && window < mqtt_backoffmax; k++) {
+		window *= 2;
+	}
+	
+	window = (window < mqtt_backoffmax) ? window : mqtt_backoffmax;
+	
+	long wait = random(0, window);
+	
+	mqtt_state       = mqtt_waiting;
+	mqtt_nextattempt = millis() + wait;
+	
+	log_info("Next MQTT connection attempt in %ld ms\r\n", wait);
+}
+
+// close the MQTT connection on purpose, so it's not counted as lost (see the statistics);
+// the next step connects again right away
+void mqtt_close()
+{
+	mqtt.disconnect();
+	
+	mqtt_state       = mqtt_waiting;
+	mqtt_nextattempt = millis();
+}
+
+// take the next step of the MQTT connection state machine; each step blocks only for as long
+// as the client library does (the TLS handshake and CONNECT, bounded by the client timeout)
+void mqtt_step()
+{
+	unsigned long now = millis();
+	
+	if (mqtt.connected()) {
+		if (mqtt_state == mqtt_subscribing && mqtt_subscribestep()) {
+			mqtt_state = mqtt_up;
+		}
+		
+		return;
+	}
+	
+	if (mqtt_state != mqtt_waiting) {  // the connection was just lost
+		log_error("Disconnected from MQTT broker\r\n");
+		stats.disconnects += 1;
+		stats.lastreason   = mqtt.state();
+		mqtt_backoff();
+		return;
+	}
+	
+	if (static_cast<long>(now - mqtt_nextattempt) < 0) {
+		return;
+	}
+	
+	if (mqtt_connect()) {
+		log_info("Successfully connected to MQTT broker\r\n");
+		should_askpass     = true;
+		mqtt_attempts      = 0;
+		mqtt_everconnected = true;
+		mqtt_state         = mqtt_subscribing;
+		mqtt_substep       = 0;
+		return;
+	}
+	
+	log_error("Failed to connect to MQTT broker\r\n");
+	stats.connectfails += 1;
+	stats.lastreason    = mqtt.state();
+	mqtt_attempts += 1;
+	
+	if (fastbooted && !mqtt_everconnected && mqtt_attempts >= fastbootattempts) {
+		log_error("Can't reach the cached master host, restarting with a full boot\r\n");
+		settings.bootcache = BootCache();
+		save_settings();
+		restart();
+	}
+	
+	if (mqtt_attempts > mqtt_maxattempts) {  // something has gone wrong!
+		log_error("Too many failed MQTT connections, restarting\r\n");
+		restart();                           // start again from a clean state
+	}
+	
+	mqtt_backoff();
+}
+
 // ask the server for a username and a password
 // the server will in turn ask the final user through a notification
 // whether to accept the new device into his network
@@ -768,55 +1151,618 @@ void askcredentials()
 	mqtt.publish(lobbytopic, message);
 }
 
-// read one char and compare to two acceptable options (mapped to true and false)
-// set an output argument to the appropriate value
-// if the char does not correspond to neither option, return false
-bool readbool(char c, char truevalue, char falsevalue, bool& output)
+// switch the relay as requested by a control message ('on', 'off' or 'toggle');
+// return false if the message is not a switch command
+bool switchrelay(const char* data, unsigned int length)
 {
-	if (c == truevalue) {
-		output = true;
+	if (length == 2 && strncmp("on", data, 2) == 0) {
+		log_info("relay -> on\r\n");
+		digitalWrite(relaypin, RELAY_ON);
+	}
+	else if (length == 3 && strncmp("off", data, 3) == 0) {
+		log_info("relay -> off\r\n");
+		digitalWrite(relaypin, RELAY_OFF);
 	}
-	else if (c == falsevalue) {
-		output = false;
+	else if (length == 6 && strncmp("toggle", data, 6) == 0) {
+		log_info("relay -> toggle (%s)\r\n", !digitalRead(relaypin) ? "on" : "off");
+		digitalWrite(relaypin, !digitalRead(relaypin));
 	}
 	else {
 		return false;
 	}
 	
+	reportstatus();
+	
 	return true;
 }
 
-// process received message from the MQTT network
-void mqtt_receive(char* topic, byte* payload, unsigned int length)
+ScheduledCmd staged_schedule[maxnscheduled];  // schedule under construction while applying a batch
+uint32_t     staged_versions[maxnscheduled];  // version of each staged command
+
+// apply a batch of schedule changes in a single step
+// format: the header line 'schedule (=|+)', followed by one line per event in the 'timed' or 'recurrent'
+// control message format; '=' replaces the whole schedule with the listed events (which must all be
+// additions), '+' adds and removes the listed events from the current schedule
+// the batch is applied atomically: if any line is malformed, or the resulting schedule does not fit,
+// nothing changes and false is returned; otherwise the fire dates are recalculated, the callback set
+// and the settings written only once for the whole batch
+bool uploadschedule(const char* data, unsigned int length)
 {
-	char*        data        = reinterpret_cast<char*>(payload);
-	unsigned int usernamelen = strlen(settings.mqtt_user);
+	bool         replace = false;
+	int          nstaged = 0;
+	unsigned int i       = 8;
 	
-	Serial.println("Processing message:");
+	log_debug("Schedule batch\r\n");
 	
-	for (unsigned int i = 0; i < length; i++) {
-		Serial.print(data[i]);
+	while (i < length && data[i] != '\n' && std::isspace(data[i])) {
+		i += 1;
 	}
 	
-	Serial.println();
+	if (i >= length || !readbool(data[i], '=', '+', replace)) {
+		log_error("'Schedule' packet: Incorrect format at %d: expected [=+], found %c\r\n", i, data[i]);
+		return false;
+	}
+	
+	i += 1;
+	
+	while (i < length && data[i] != '\n' && std::isspace(data[i])) {
+		i += 1;
+	}
+	
+	if (i < length && data[i] != '\n') {
+		log_error("'Schedule' packet: Incorrect format at %d: expected newline, found %c\r\n", i, data[i]);
+		return false;
+	}
+	
+	if (!replace) {
+		memcpy(staged_schedule, settings.schedule, settings.nscheduled * sizeof (ScheduledCmd));
+		nstaged = settings.nscheduled;
+	}
+	
+	while (i < length) {  // i points to the newline before the next line
+		unsigned int start = i + 1;
+		unsigned int end   = start;
+		
+		while (end < length && data[end] != '\n') {
+			end += 1;
+		}
+		
+		i = end;
+		
+		while (end > start && std::isspace(data[end - 1])) {  // allow trailing whitespace and CRLF line ends
+			end -= 1;
+		}
+		
+		if (end == start) {  // skip empty lines
+			continue;
+		}
+		
+		ScheduledCmd newcmd;
+		bool         add;
+		
+		if (!parsescommand(&data[start], end - start, newcmd, add)) {
+			log_error("'Schedule' packet: can't read the event at %d\r\n", start);
+			return false;
+		}
+		
+		if (replace && !add) {
+			log_error("'Schedule' packet: Incorrect format at %d: can't remove events in a replacement\r\n", start);
+			return false;
+		}
+		
+		int index = findscommand(newcmd, staged_schedule, nstaged);
+		
+		if (add && index < 0) {
+			if (nstaged >= maxnscheduled) {
+				log_error("'Schedule' packet: too many events\r\n");
+				return false;
+			}
+			
+			staged_schedule[nstaged++] = newcmd;
+		}
+		else if (!add && index >= 0) {
+			staged_schedule[index] = staged_schedule[--nstaged];
+		}
+	}
+	
+	applyschedule(nstaged);
+	
+	return true;
+}
+
+// replace the schedule with the first nstaged commands of the staged schedule,
+// recalculating the fire dates, setting the callback and writing the settings once
+void applyschedule(int nstaged)
+{
+	log_info("Applying the schedule batch (n = %d)\r\n", nstaged);
+	
+	uint32_t batchversion = scheduleversion + 1;
+	int      kept         = 0;
+	
+	for (int k = 0; k < nstaged; k++) {  // commands already in the schedule keep their version
+		staged_versions[k] = batchversion;
+		
+		for (int j = 0; j < settings.nscheduled; j++) {
+			if (scommandcmp(staged_schedule[k], settings.schedule[j]) == 0) {
+				staged_versions[k] = entryversion[j];
+				kept              += 1;
+				break;
+			}
+		}
+	}
+	
+	if (kept < settings.nscheduled) {
+		removalversion = batchversion;
+	}
+	
+	if (kept < settings.nscheduled || kept < nstaged) {
+		scheduleversion = batchversion;
+	}
+	
+	memcpy(settings.schedule, staged_schedule, nstaged * sizeof (ScheduledCmd));
+	memcpy(entryversion,      staged_versions, nstaged * sizeof (uint32_t));
+	settings.nscheduled = nstaged;
+	
+	calculatenextfire();
+	updatescallback();
+	flush_settings();
+}
+
+// Binary control protocol
+// ------------------------------------------------------------------------------
+// Compact alternative to the text control messages, received on '<username>/controlb':
+// a version byte followed by a sequence of items, each one a tag byte, a length byte and
+// 'length' bytes of value; items with unknown tags are skipped
+// 
+// A scheduled command is encoded in 16 bytes: command ('0' or '1'), 0, fuzzy (0/1), recurrent (0/1),
+// days, hours, minutes, 0, and the firedate in seconds since 1970 as a little endian unsigned
+// 64 bit integer (zero for recurrent commands); the days are the day mask of ScheduledCmd
+// (version 1 messages carry a single digit day code instead, as the text protocol)
+// 
+// The schedule items of a message (clear, add, remove) are applied as a single batch, in order,
+// and only if every item is well-formed and the result fits in the schedule;
+// the schedule reply is published on '<username>/adminb' as a capacity item
+// (nscheduled and maxnscheduled, one byte each), a version item and one add item per command
+// 
+// An askschedule item may carry a schedule version (4 bytes, little endian) to ask only for the
+// commands added since then; if the device can describe the changes that way, the reply carries
+// a since item with that version and only those add items, otherwise it is a full reply
+
+const byte bin_version     = 2;
+const byte tag_switch      = 1;   // value: '0' turn off, '1' turn on, 't' toggle
+const byte tag_add         = 2;   // value: scheduled command to add
+const byte tag_remove      = 3;   // value: scheduled command to remove
+const byte tag_clear       = 4;   // no value: remove every scheduled command
+const byte tag_askschedule = 5;   // no value: send the schedule; or a version: send the changes since then
+const byte tag_capacity    = 6;   // value: number of scheduled commands and maximum number, one byte each
+const byte tag_version     = 7;   // value: schedule version the reply brings the server up to
+const byte tag_since       = 8;   // value: schedule version an incremental reply starts from
+const int  bin_scmdsize    = 16;  // size of an encoded scheduled command
+
+// decode a scheduled command from its binary encoding, for the given protocol version
+// return false if any field is out of range
+bool decodescommand(const byte* value, byte version, ScheduledCmd& cmd)
+{
+	uint64_t firedate = 0;
+	
+	for (int k = 7; k >= 0; k--) {
+		firedate = (firedate << 8) | value[8 + k];
+	}
+	
+	if ((value[0] != '0' && value[0] != '1') || value[2] > 1 || value[3] > 1) {
+		return false;
+	}
+	
+	// keep the unused fields zeroed, otherwise a command won't match its copies
+	byte days = (version == 1 && value[4] <= 9) ? daycodemask(value[4]) : (version == 1) ? 0 : value[4];
+	
+	if (value[3] && (days == 0 || days > everyday || value[5] > 23 || value[6] > 59 || firedate != 0)) {
+		return false;
+	}
+	
+	if (!value[3] && (value[4] != 0 || value[5] != 0 || value[6] != 0 ||
+	                  firedate < scheduleepoch || firedate - scheduleepoch > UINT32_MAX)) {
+		return false;
+	}
+	
+	cmd.command   = value[0];
+	cmd.fuzzy     = value[2];
+	cmd.recurrent = value[3];
+	cmd.days      = value[3] ? days : 0;
+	cmd.hours     = value[5];
+	cmd.minutes   = value[6];
+	cmd.firedate  = value[3] ? 0 : firedate - scheduleepoch;
+	
+	return true;
+}
+
+// encode a scheduled command into its binary encoding (bin_scmdsize bytes)
+void encodescommand(const ScheduledCmd& cmd, byte* value)
+{
+	value[0] = cmd.command;
+	value[1] = 0;
+	value[2] = cmd.fuzzy;
+	value[3] = cmd.recurrent;
+	value[4] = cmd.days;
+	value[5] = cmd.hours;
+	value[6] = cmd.minutes;
+	value[7] = 0;
+	
+	uint64_t firedate = cmd.recurrent ? 0 : scheduleepoch + cmd.firedate;
+	
+	for (int k = 0; k < 8; k++) {
+		value[8 + k] = (firedate >> (8 * k)) & 0xff;
+	}
+}
+
+// write a little endian unsigned 32 bit integer
+void encodeversion(uint32_t version, byte* value)
+{
+	for (int k = 0; k < 4; k++) {
+		value[k] = (version >> (8 * k)) & 0xff;
+	}
+}
+
+// write the binary schedule reply to the pending MQTT publication, item by item, if send is true
+// return its length (whether sent or not)
+unsigned int streambinschedule(bool incremental, uint32_t since, bool send)
+{
+	byte         item[2 + bin_scmdsize];
+	unsigned int size = 0;
+	
+	item[0] = bin_version;
+	size   += send ? mqtt.write(item, 1) : 1;
+	
+	item[0] = tag_capacity;
+	item[1] = 2;
+	item[2] = settings.nscheduled;
+	item[3] = maxnscheduled;
+	size   += send ? mqtt.write(item, 4) : 4;
+	
+	item[0] = tag_version;
+	item[1] = 4;
+	encodeversion(scheduleversion, &item[2]);
+	size   += send ? mqtt.write(item, 6) : 6;
+	
+	if (incremental) {
+		item[0] = tag_since;
+		item[1] = 4;
+		encodeversion(since, &item[2]);
+		size   += send ? mqtt.write(item, 6) : 6;
+	}
+	
+	for (int k = 0; k < settings.nscheduled; k++) {
+		if (incremental && !addedsince(k, since)) {
+			continue;
+		}
+		
+		item[0] = tag_add;
+		item[1] = bin_scmdsize;
+		encodescommand(settings.schedule[k], &item[2]);
+		size   += send ? mqtt.write(item, 2 + bin_scmdsize) : 2 + bin_scmdsize;
+	}
+	
+	return size;
+}
+
+// publish the binary schedule reply, streamed so it needs no buffer for the whole message
+// return false if it could not be sent
+bool publishbinschedule(const ScheduleReport& report)
+{
+	bool         incremental = report.incremental && knownversion(report.since);
+	unsigned int size        = streambinschedule(incremental, report.since, false);
+	
+	if (!mqtt.beginPublish(adminbtopic, size, false)) {
+		return false;
+	}
+	
+	streambinschedule(incremental, report.since, true);
+	
+	return mqtt.endPublish();
+}
+
+// process a binary control message
+// the whole message is validated before acting on any of its items
+// return false if the message is malformed, in which case nothing is done
+bool binary_receive(const byte* data, unsigned int length)
+{
+	if (length < 1 || (data[0] != 1 && data[0] != bin_version)) {
+		log_error("Binary packet: unsupported version\r\n");
+		return false;
+	}
+	
+	char           relaycmd = 0;      // last switch command in the message
+	bool           modified = false;  // true if the message changes the schedule
+	ScheduleReport ask      = {};
+	int            nstaged  = settings.nscheduled;
+	unsigned int   i        = 1;
+	
+	memcpy(staged_schedule, settings.schedule, settings.nscheduled * sizeof (ScheduledCmd));
+	
+	while (i < length) {
+		if (i + 2 > length || i + 2 + data[i + 1] > length) {
+			log_error("Binary packet: truncated item at %d\r\n", i);
+			return false;
+		}
+		
+		byte         tag   = data[i];
+		byte         len   = data[i + 1];
+		const byte*  value = &data[i + 2];
+		ScheduledCmd cmd;
+		
+		i += 2 + len;
+		
+		if (tag == tag_switch) {
+			if (len != 1 || (value[0] != '0' && value[0] != '1' && value[0] != 't')) {
+				log_error("Binary packet: incorrect switch command\r\n");
+				return false;
+			}
+			
+			relaycmd = value[0];
+		}
+		else if (tag == tag_add || tag == tag_remove) {
+			if (len != bin_scmdsize || !decodescommand(value, data[0], cmd)) {
+				log_error("Binary packet: incorrect scheduled command\r\n");
+				return false;
+			}
+			
+			int index = findscommand(cmd, staged_schedule, nstaged);
+			
+			if (tag == tag_add && index < 0) {
+				if (nstaged >= maxnscheduled) {
+					log_error("Binary packet: too many events\r\n");
+					return false;
+				}
+				
+				staged_schedule[nstaged++] = cmd;
+			}
+			else if (tag == tag_remove && index >= 0) {
+				staged_schedule[index] = staged_schedule[--nstaged];
+			}
+			
+			modified = true;
+		}
+		else if (tag == tag_clear) {
+			nstaged  = 0;
+			modified = true;
+		}
+		else if (tag == tag_askschedule) {
+			if (len != 0 && len != 4) {
+				log_error("Binary packet: incorrect schedule version\r\n");
+				return false;
+			}
+			
+			ask.pending     = true;
+			ask.incremental = (len == 4);
+			ask.since       = 0;
+			
+			for (int k = len - 1; k >= 0; k--) {
+				ask.since = (ask.since << 8) | value[k];
+			}
+		}
+		else {
+			log_error("Binary packet: skipping unknown item %d\r\n", tag);
+		}
+	}
+	
+	if (relaycmd != 0) {
+		switchrelay((relaycmd == '1') ? "on" : (relaycmd == '0') ? "off" : "toggle",
+		            (relaycmd == '1') ? 2    : (relaycmd == '0') ? 3     : 6);
+	}
+	
+	if (modified) {
+		applyschedule(nstaged);
+	}
+	
+	if (ask.pending) {
+		report_binschedule = ask;
+	}
+	
+	return true;
+}
+
+// write the text schedule reply to the pending MQTT publication, line by line, if send is true
+// return its length (whether sent or not)
+unsigned int streamschedule(bool incremental, uint32_t since, bool send)
+{
+	char         line[schedlinesize];
+	unsigned int size = 0;
+	int          count;
+	
+	if (incremental) {
+		count = snprintf(line, schedlinesize, "schedule +%u\n", static_cast<unsigned int>(since));
+	}
+	else {
+		count = snprintf(line, schedlinesize, "schedule\n");
+	}
+	
+	size += send ? mqtt.write(reinterpret_cast<const uint8_t*>(line), count) : count;
+	
+	count = snprintf(line, schedlinesize, "%d/%d %u\n", settings.nscheduled, maxnscheduled,
+	                 static_cast<unsigned int>(scheduleversion));
+	size += send ? mqtt.write(reinterpret_cast<const uint8_t*>(line), count) : count;
+	
+	for (int k = 0; k < settings.nscheduled; k++) {
+		if (incremental && !addedsince(k, since)) {
+			continue;
+		}
+		
+		count = formatscommand(line, settings.schedule[k]);
+		size += send ? mqtt.write(reinterpret_cast<const uint8_t*>(line), count) : count;
+	}
+	
+	return size;
+}
+
+// publish the text schedule reply, streamed one line at a time so it needs no buffer for the whole
+// message and fits any schedule size
+// format: 'schedule' (or 'schedule +<Version>' for an incremental reply) '\n'
+//         '<nscheduled>/<maxnscheduled> <CurrentVersion>' '\n'
+//         and one line per scheduled command (only those added since Version if incremental),
+//         in the 'timed' or 'recurrent' control message format and ending in '\n'
+// an incremental reply is only sent if no command was removed since the asked version,
+// otherwise it falls back to the full schedule
+// return false if it could not be sent
+bool publishschedule(const ScheduleReport& report)
+{
+	bool         incremental = report.incremental && knownversion(report.since);
+	unsigned int size        = streamschedule(incremental, report.since, false);
+	
+	if (!mqtt.beginPublish(admintopic, size, false)) {
+		return false;
+	}
+	
+	streamschedule(incremental, report.since, true);
+	
+	return mqtt.endPublish();
+}
+
+bool report_log;    // true if the log ring should be sent
+bool report_stats;  // true if the statistics should be sent
+
+// publish the log ring contents, oldest first, after a 'log' line
+// return false if it could not be sent
+bool publishlog()
+{
+#if LOG_RINGSIZE > 0
+	const char line[] = "log\n";
+	uint32_t   count  = (loghead < LOG_RINGSIZE) ? loghead : LOG_RINGSIZE;
+	int        start  = (loghead - count) % LOG_RINGSIZE;
+	int        split  = min(count, LOG_RINGSIZE - start);
+	
+	if (!mqtt.beginPublish(admintopic, 4 + count, false)) {
+		return false;
+	}
+	
+	mqtt.write(reinterpret_cast<const uint8_t*>(line), 4);
+	mqtt.write(reinterpret_cast<const uint8_t*>(&logring[start]), split);
+	mqtt.write(reinterpret_cast<const uint8_t*>(&logring[0]), count - split);
+	
+	return mqtt.endPublish();
+#else
+	return mqtt.publish(admintopic, "log\n");
+#endif
+}
+
+// publish the statistics, after a 'stats' line
+// return false if they could not be sent
+bool publishstats()
+{
+	const char* names[nstatskinds] = {"switch", "scommand", "upload", "binary", "time", "askschedule",
+	                                  "admin", "lobby", "other"};
+	char        buffer[768];  // fits the longest values of every line
+	int         len  = 0;
+	int         size = sizeof buffer;
+	
+	updateuptime();
+	
+	len += snprintf(&buffer[len], size - len, "stats\nuptime %u\nheap %u %u\nrssi %d\n",
+	                static_cast<unsigned>(stats.uptime / 1000), static_cast<unsigned>(ESP.getFreeHeap()),
+	                static_cast<unsigned>(ESP.getMaxFreeBlockSize()), static_cast<int>(WiFi.RSSI()));
+	len += formattiming(&buffer[len], size - len, "loop", stats.loop);
+	
+	for (int k = 0; k < nstatskinds; k++) {
+		len += formattiming(&buffer[len], size - len, names[k], stats.receive[k]);
+	}
+	
+	len += formattiming(&buffer[len], size - len, "flush", stats.flush);
+	len += snprintf(&buffer[len], size - len, "mqtt %u %u %d\ntls %u %u\n",
+	                static_cast<unsigned>(stats.disconnects), static_cast<unsigned>(stats.connectfails),
+	                stats.lastreason, static_cast<unsigned>(rtcstate.tls_full), static_cast<unsigned>(rtcstate.tls_resumed));
+	
+	return mqtt.beginPublish(admintopic, len, false) &&
+	       mqtt.write(reinterpret_cast<const uint8_t*>(buffer), len) == static_cast<size_t>(len) &&
+	       mqtt.endPublish();
+}
+
+// write the queued sensor windows to the pending MQTT publication, one line each, if send is true
+// return their length (whether sent or not)
+unsigned int streamsensor(bool send)
+{
+#if SENSOR_KIND != SENSOR_NONE
+	char         line[windowlinesize];
+	unsigned int size = 0;
+	
+	for (int k = 0; k < sensor_queued; k++) {
+		int count = formatwindow(line, sensorkind, sensor_queue[k]);
+		size += send ? mqtt.write(reinterpret_cast<const uint8_t*>(line), count) : count;
+	}
+	
+	return size;
+#else
+	return 0;
+#endif
+}
+
+// publish the queued sensor windows as a single message, oldest first
+// format: one line per window, '<kind> <Date> <Seconds> <Count> <Min> <Max> <Mean>' '\n';
+// Date is the start of the window in seconds since 1970 (0 if the clock was not synchronized yet)
+// and the mean has two decimals
+// return false if they could not be sent
+bool publishsensor()
+{
+	unsigned int size = streamsensor(false);
+	
+	if (!mqtt.beginPublish(sensortopic, size, false)) {
+		return false;
+	}
+	
+	streamsensor(true);
+	
+	return mqtt.endPublish();
+}
+
+// process a received message, timed by the kind of command it carried (see stats_kind)
+void mqtt_receive(char* topic, byte* payload, unsigned int length)
+{
+	uint32_t start = micros();
+	
+	stats_kind = stats_other;  // until mqtt_process recognizes the command
+	
+	mqtt_process(topic, payload, length);
+	addtiming(stats.receive[stats_kind], start);
+}
+
+// process received message from the MQTT network
+void mqtt_process(char* topic, byte* payload, unsigned int length)
+{
+	char*        data        = reinterpret_cast<char*>(payload);
+	unsigned int usernamelen = strlen(settings.mqtt_user);
+	
+	log_debug("Processing message:\r\n%.*s\r\n", static_cast<int>(length), data);
 	
 	int tlen = strlen(topic);
 	
+	// topic == group/<name>/control; only switch commands are sent to groups
+	if (tlen > 14 && strncmp("group/", topic, 6) == 0 && strcmp("/control", &topic[tlen - 8]) == 0) {
+		if (mqtt_hascreds) {
+			log_debug("Group control message...\r\n");
+			
+			stats_kind = stats_switch;
+			
+			if (!switchrelay(data, length)) {
+				log_error("Unsupported group command\r\n");
+			}
+		}
+		
+		return;
+	}
+	
 	if (tlen <= usernamelen + 2) {  // too short, it has to be at least '<username>/x' long
-		Serial.printf("Received message from incorrect topic: %s\r\n", topic);
+		log_error("Received message from incorrect topic: %s\r\n", topic);
 		return;
 	}
 	
 	unsigned int i;
 	for (i = 0; i < usernamelen; i++) {  // incorrect prefix, should be '<username>/'
 		if (topic[i] != settings.mqtt_user[i]) {
-			Serial.printf("Received message from incorrect topic: %s\r\n", topic);
+			log_error("Received message from incorrect topic: %s\r\n", topic);
 			return;
 		}
 	}
 	
 	if (topic[i] != '/') {
-		Serial.printf("Received message from incorrect topic: %s\r\n", topic);
+		log_error("Received message from incorrect topic: %s\r\n", topic);
 		return;
 	}
 	
@@ -825,136 +1771,30 @@ void mqtt_receive(char* topic, byte* payload, unsigned int length)
 	
 	if (mqtt_hascreds) {
 		if (clen == 7 && strncmp("control", channel, 7) == 0) {  // topic == <username>/control
-			Serial.println("Control message...");
+			log_debug("Control message...\r\n");
 			
-			if (length == 2 && strncmp("on", data, 2) == 0) {
-				Serial.println("relay -> on");
-				digitalWrite(relaypin, RELAY_ON);
-			}
-			else if (length == 3 && strncmp("off", data, 3) == 0) {
-				Serial.println("relay -> off");
-				digitalWrite(relaypin, RELAY_OFF);
-			}
-			else if (length == 6 && strncmp("toggle", data, 6) == 0) {
-				Serial.print("relay -> toggle (");
-				Serial.print(!digitalRead(relaypin) ? "on" : "off");
-				Serial.println(")");
-				digitalWrite(relaypin, !digitalRead(relaypin));
+			if (switchrelay(data, length)) {  // relay already switched
+				stats_kind = stats_switch;
 			}
 			else if (length == 5 && strncmp("clear", data, 5) == 0) {
-				Serial.println("Clearing the schedule");
+				log_info("Clearing the schedule\r\n");
 				
+				stats_kind          = stats_scommand;
 				settings.nscheduled = 0;
-				flush_settings();
+				removalversion      = ++scheduleversion;
+				heapbuild(settings.nscheduled);
+				save_settings();
 			}
 			else if (length > 5 && strncmp("timed", data, 5) == 0) {  // set new pre-programmed switch
-				// format timed (-|+)(x|z) EpochTime Command
-				// the first char (-|+) indicates if the timer must be added (+) or removed (-)
-				// the second char (x|z) indicates exact timer or fuzzy match (adds 16-minutes uniform noise)
-				// EpochTime is the number of seconds since 1 Jan 1970, 00:00:00
-				// The last argument indicates turning off or on (using the same semantics as the on and off commands)
-				// e.g. '+z 1633436220 on' means 'turn the switch on around Oct 5 2021, 09:17:00 (+- 8 minutes)'
-				
-				bool          add   = true;
-				bool          fuzzy = false;
-				unsigned int  i     = 5;
-				
-				Serial.println("One-off event");
-				
-				if (i >= length || !std::isspace(data[i])) {
-					Serial.printf("'Timed' packet: Incorrect format at %d: expected whitespace, found %c\r\n", i, data[i]);
-					return;
-				}
-				
-				while (i < length && std::isspace(data[i])) {
-					i += 1;
-				}
-				
-				if (i >= length || !readbool(data[i], '+', '-', add)) {
-					Serial.printf("'Timed' packet: Incorrect format at %d: expected [-+], found %c\r\n", i, data[i]);
-					return;
-				}
-				
-				i += 1;
-				
-				if (i >= length || !readbool(data[i], 'z', 'x', fuzzy)) {
-					Serial.printf("'Timed' packet: Incorrect format at %d: expected [zx], found %c\r\n", i, data[i]);
-					return;
-				}
-				
-				i += 1;
-				
-				if (i >= length || !std::isspace(data[i])) {
-					Serial.printf("'Timed' packet: Incorrect format at %d: expected whitespace, found %c\r\n", i, data[i]);
-					return;
-				}
-				
-				char buffer[16];  // hopefully we have moved on from relying on C overflowable arrays
-				                  // by the time this buffer can't hold the corresponding EpochTime
-				
-				while (i < length && std::isspace(data[i])) {
-					i += 1;
-				}
-				
-				int timelen = length - i;
-				
-				if (timelen > 15) {
-					Serial.println("'Timed' packet: time string too long");
-					return;
-				}
-				
-				unsigned int k;
-				for (k = 0; i < length && k < 15; k++, i++) {
-					if (std::isspace(data[i])) {
-						break;
-					}
-					
-					buffer[k] = data[i];
-				}
-				
-				buffer[k] = 0;
-				
-				const char*  readend;
-				uint64_t     time = readull(buffer, &readend);
 				ScheduledCmd newcmd;
+				bool         add;
 				
-				if (*readend != 0) {
-					Serial.println("'Timed' packet: can't read timestamp");
-					return;
-				}
+				stats_kind = stats_scommand;
 				
-				if (i >= length || !std::isspace(data[i])) {
-					Serial.printf("'Timed' packet: Incorrect format at %d: expected whitespace, found %c\r\n", i, data[i]);
+				if (!parsetimed(data, length, newcmd, add)) {
 					return;
 				}
 				
-				while (i < length && std::isspace(data[i])) {
-					i += 1;
-				}
-				
-				int remaining = length - i;
-				
-				if (remaining == 2 && strncmp("on", &data[i], 2) == 0) {
-					newcmd.command = '1';
-				}
-				else if (remaining == 3 && strncmp("off", &data[i], 3) == 0) {
-					newcmd.command = '0';
-				}
-				else {
-					Serial.printf("'Timed' packet: Incorrect format at %d: expected [(on)(off)], found '", i);
-					
-					for (int k = 0; k < remaining; k++) {
-						Serial.printf("%c", data[i + k]);
-					}
-					
-					Serial.println("'");
-					return;
-				}
-				
-				newcmd.fuzzy     = fuzzy;
-				newcmd.recurrent = false;
-				newcmd.firedate  = time;
-				
 				if (add) {
 					schedulecommand(newcmd);
 				}
@@ -963,101 +1803,68 @@ void mqtt_receive(char* topic, byte* payload, unsigned int length)
 				}
 			}
 			else if (length > 9 && strncmp("recurrent", data, 9) == 0) {  // set new recurrent pre-programmed switch
-				// format: recurrent (-|+)(x|z)(0-9) Hours.Minutes Command
-				// the first char (-|+) indicates if the timer must be added (+) or removed (-)
-				// the second char (x|z) indicates exact timer or fuzzy match (adds 16-minutes uniform noise)
-				// the third char indicates a day of the week Mon-Sun (1-7), every day (0),
-				// every weekday Mon-Fri (8) or weekends Sat-Sun (9)
-				// Hour indicates the hour in 24-hour format using a leading zero if necessary
-				// Minutes indicates the minutes using a leading zero if necessary
-				// The last argument indicates turning off or on (using the same semantics as the on and off commands)
-				// e.g. '+x6 16.51 off' means 'turn the switch off every Saturday at 16:51'
-				
-				bool          add     = true;
-				bool          fuzzy   = false;
-				byte          weekday = 0;
-				byte          hours   = 0;
-				byte          minutes = 0;
-				unsigned int  i       = 9;
-				
-				Serial.println("Recurrent event");
-				
-				if (i >= length || !std::isspace(data[i])) {
-					Serial.printf("'Recurrent' packet: Incorrect format at %d: expected whitespace, found %c\r\n", i, data[i]);
-					return;
-				}
-				
-				while (i < length && std::isspace(data[i])) {
-					i += 1;
-				}
-				
-				if (i >= length || !readbool(data[i], '+', '-', add)) {
-					Serial.printf("'Recurrent' packet: Incorrect format at %d: expected [-+], found %c\r\n", i, data[i]);
-					return;
-				}
+				ScheduledCmd newcmd;
+				bool         add;
 				
-				i += 1;
+				stats_kind = stats_scommand;
 				
-				if (i >= length || !readbool(data[i], 'z', 'x', fuzzy)) {
-					Serial.printf("'Recurrent' packet: Incorrect format at %d: expected [zx], found %c\r\n", i, data[i]);
+				if (!parserecurrent(data, length, newcmd, add)) {
 					return;
 				}
 				
-				i += 1;
-				
-				if (i < length && '0' <= data[i] && data[i] <= '9') {
-					weekday = payload[i] - '0';
-					i += 1;
+				if (add) {
+					schedulecommand(newcmd);
 				}
 				else {
-					Serial.printf("'Recurrent' packet: Incorrect format at %d: expected digit, found %c\r\n", i, data[i]);
-					return;
-				}
-				
-				if (i >= length || !std::isspace(data[i])) {
-					Serial.printf("'Recurrent' packet: Incorrect format at %d: expected whitespace, found %c\r\n", i, data[i]);
-					return;
-				}
-				
-				while (i < length && std::isspace(data[i])) {
-					i += 1;
+					unschedulecommand(newcmd);
 				}
+			}
+			else if (length > 8 && strncmp("schedule", data, 8) == 0) {  // batch of schedule changes
+				stats_kind = stats_upload;
+				uploadschedule(data, length);
+			}
+		}
+		else if (clen == 8 && strncmp("controlb", channel, 8) == 0) {  // topic == <username>/controlb
+			log_debug("Binary control message...\r\n");
+			
+			stats_kind = stats_binary;
+			binary_receive(payload, length);
+		}
+		else if (clen == 5 && strncmp("admin", channel, 5) == 0) {  // topic == <username>/admin
+			log_debug("Admin message...\r\n");
+			
+			stats_kind = stats_admin;  // unless it's one of the requests timed on their own
+			
+			if (length == 9 && strncmp("askstatus", data, 9) == 0) {
+				log_info("Retrieving status\r\n");
 				
-				if (i + 1 < length &&
-				    '0' <= data[i]     && data[i]     <= '9' &&
-				    '0' <= data[i + 1] && data[i + 1] <= '9') {
-					
-					hours = 10 * (data[i] - '0') + (data[i + 1] - '0');
-					i += 2;
-				}
-				else {
-					Serial.printf("'Recurrent' packet: Incorrect format at %d: expected hours, found %c%c\r\n", i, data[i], data[i + 1]);
-					return;
-				}
+				report_statusasked = true;
+				reportstatus();
+			}
+			else if (length == 12 && strncmp("checkupdates", data, 12) == 0) {
+				log_info("Checking for updates\r\n");
 				
-				if (data[i] != '.') {
-					Serial.printf("'Recurrent' packet: Incorrect format at %d: expected '.', found %c\r\n", i, data[i]);
-					return;
-				}
+				should_checkupdates = true;  // from the main loop, outside of the MQTT client
+			}
+			else if (length == 8 && strncmp("askstats", data, 8) == 0) {
+				log_info("Retrieving statistics\r\n");
 				
-				i += 1;
+				report_stats = true;
+			}
+			else if (length == 6 && strncmp("asklog", data, 6) == 0) {
+				log_info("Retrieving log\r\n");
 				
-				if (i + 1 < length &&
-				    '0' <= data[i]     && data[i]     <= '9' &&
-				    '0' <= data[i + 1] && data[i + 1] <= '9') {
-					
-					minutes = 10 * (data[i] - '0') + (data[i + 1] - '0');
-					i += 2;
-				}
-				else {
-					Serial.printf("'Recurrent' packet: Incorrect format at %d: expected minutes, found %c%c\r\n", i, data[i], data[i + 1]);
-					return;
-				}
+				report_log = true;
+			}
+			else if (length > 12 && strncmp("sensorwindow", data, 12) == 0) {
+				// format: sensorwindow Seconds
+				// the current window is closed and the following ones last Seconds
 				
-				ScheduledCmd newcmd;
+				char         buffer[24];
+				unsigned int i = 12;
 				
-				if (i >= length || !std::isspace(data[i])) {
-					Serial.printf("'Recurrent' packet: Incorrect format at %d: expected whitespace, found %c\r\n", i, data[i]);
+				if (!std::isspace(data[i])) {
+					log_error("'Sensorwindow' packet: Incorrect format at %d: expected whitespace, found %c\r\n", i, data[i]);
 					return;
 				}
 				
@@ -1065,115 +1872,78 @@ void mqtt_receive(char* topic, byte* payload, unsigned int length)
 					i += 1;
 				}
 				
-				int remaining = length - i;
+				int numlen = length - i;
 				
-				if (remaining == 2 && strncmp("on", &data[i], 2) == 0) {
-					newcmd.command = '1';
-				}
-				else if (remaining == 3 && strncmp("off", &data[i], 3) == 0) {
-					newcmd.command = '0';
-				}
-				else {
-					Serial.printf("'Recurrent' packet: Incorrect format at %d: expected [(on)(off)], found '", i);
-					
-					for (int k = 0; k < remaining; k++) {
-						Serial.printf("%c", data[i + k]);
-					}
-					
-					Serial.println("'");
+				if (numlen > 23) {
+					log_error("'Sensorwindow' packet: window too long\r\n");
 					return;
 				}
 				
-				newcmd.fuzzy     = fuzzy;
-				newcmd.recurrent = true;
-				newcmd.weekday   = weekday;
-				newcmd.hours     = hours;
-				newcmd.minutes   = minutes;
+				strncpy(buffer, &data[i], numlen);
+				buffer[numlen] = 0;
 				
-				if (add) {
-					schedulecommand(newcmd);
-				}
-				else {
-					unschedulecommand(newcmd);
+				const char* readend;
+				uint64_t    seconds = readull(buffer, &readend);
+				
+				if (readend == buffer || *readend != 0 || seconds < 1 || seconds > sensormaxwindow) {
+					log_error("'Sensorwindow' packet: expected a window of 1 to %d seconds\r\n", sensormaxwindow);
+					return;
 				}
-			}
-		}
-		else if (clen == 5 && strncmp("admin", channel, 5) == 0) {  // topic == <username>/admin
-			Serial.println("Admin message...");
-			
-			if (length == 9 && strncmp("askstatus", data, 9) == 0) {
-				Serial.println("Retrieving status");
 				
-				report_status = (digitalRead(relaypin)) ? "on" : "off";
+				log_info("Setting the sensor window to %u s\r\n", static_cast<unsigned>(seconds));
+				
+				setsensorwindow(seconds);
 			}
-			else if (length == 11 && strncmp("askschedule", data, 11) == 0) {
-				Serial.println("Retrieving schedule");
+			else if (length >= 11 && strncmp("askschedule", data, 11) == 0) {
+				// format: askschedule [Version]
+				// with a version, only ask for the commands added since then (see publishschedule)
 				
-				// header: "schedule\n" "nscheduled/maxnscheduled\n" (9 + 2 * len(str(int)) + 2 bytes)
-				// longest recurrent line: "recurrent x9 23.59 off" (22 bytes)
-				// longest timed line:     "timed x 18446744073709551615 off" (32 bytes)
-				// i.e. worst case: header + nscheduled * (32 + 1) [the extra 1 is for \n]
-				// 
-				// assuming a max of 9999999999 scheduled events, i.e. len(str(int)) = 10 (highly unlikely),
-				// this gives 33 * (nscheduled + 1) bytes for the whole message so, 1KiB + 32B
-				// will be enough for 32 events
+				ScheduleReport ask  = {};
+				unsigned int   i    = 11;
+				const char*    stop = nullptr;
 				
-				if (report_schedule != nullptr) {
-					free(report_schedule);
-				}
+				log_info("Retrieving schedule\r\n");
 				
-				report_schedule = static_cast<char*>(malloc(33 * (settings.nscheduled + 1) * sizeof (char)));
-				int i           = 0;
-				int count       = snprintf(&report_schedule[i], 32, "schedule\n%d/%d\n",  // not 33 to leave room for \0 at the end
-				                           settings.nscheduled, maxnscheduled);
+				stats_kind = stats_askschedule;
 				
-				i += min(32, count);
+				while (i < length && std::isspace(data[i])) {
+					i += 1;
+				}
 				
-				for (int k = 0; k < settings.nscheduled; k++) {
-					ScheduledCmd event = settings.schedule[k];
+				if (i < length) {
+					uint64_t since = readull(&data[i], &stop);
 					
-					char        fuzzy   = (event.fuzzy) ? 'z' : 'x';
-					const char* command = (event.command == '1') ? "on" :
-					                      (event.command == 't') ? "toggle" :
-					                                               "off";
-					
-					if (event.recurrent) {
-						count = snprintf(&report_schedule[i], 33, "recurrent %c%c %02d.%02d %s\n",
-						                 fuzzy, event.weekday, event.hours, event.minutes, command);
-						i    += min(33, count);
-					}
-					else {
-						count = snprintf(&report_schedule[i], 8, "timed %c ", fuzzy);
-						i    += min(8, count);
-						
-						count = writeull(&report_schedule[i], event.firedate);
-						i    += count;
-						
-						int remaining = 33 - 8 - count;
-						
-						count = snprintf(&report_schedule[i], remaining, " %s\n", command);
-						i    += min(remaining, count);
+					if (stop == &data[i] || stop != &data[length] || since > UINT32_MAX) {
+						log_error("'Askschedule' packet: Incorrect format at %d: expected version\r\n", i);
+						return;
 					}
+					
+					ask.incremental = true;
+					ask.since       = since;
 				}
 				
-				report_schedule[i] = 0;
+				ask.pending     = true;
+				report_schedule = ask;
 			}
 			else if (length > 4 && strncmp("time", data, 4) == 0) {  // time synchronization
-				// low-precision, just to keep the device time from drifting away through the year
-				// the server should send this as soon as the device is connected and once a day
-				// format: time EpochTime
-				// EpochTime is the number of seconds since 1 Jan 1970, 00:00:00
-				// e.g. time 1437495683 means 'set your clock to July 21 2015, 13:21:23'
-				
-				char buffer[16];  // hopefully we have moved on from relying on C overflowable arrays
+				// the server should send this as soon as the device is connected and once a day,
+				// which also lets the device measure and correct the drift of its clock
+				// format: time EpochTime[.Fraction]
+				// EpochTime is the number of seconds since 1 Jan 1970, 00:00:00, and Fraction its decimals
+				// (only milliseconds are kept)
+				// e.g. time 1437495683.25 means 'set your clock to July 21 2015, 13:21:23.250'
+				
+				char buffer[24];  // hopefully we have moved on from relying on C overflowable arrays
 				                  // by the time this buffer can't hold the corresponding EpochTime
 				
 				unsigned int i = 4;
 				
-				Serial.println("Synchronizing");
+				log_info("Synchronizing\r\n");
+				
+				stats_kind = stats_time;
 				
 				if (i >= length || !std::isspace(data[i])) {
-					Serial.printf("'Time' packet: Incorrect format at %d: expected whitespace, found %c\r\n", i, data[i]);
+					log_error("'Time' packet: Incorrect format at %d: expected whitespace, found %c\r\n", i, data[i]);
 					return;
 				}
 				
@@ -1183,8 +1953,8 @@ void mqtt_receive(char* topic, byte* payload, unsigned int length)
 				
 				int timelen = length - i;
 				
-				if (timelen > 15) {
-					Serial.println("'Time' packet: time string too long");
+				if (timelen > 23) {
+					log_error("'Time' packet: time string too long\r\n");
 					return;
 				}
 				
@@ -1193,43 +1963,65 @@ void mqtt_receive(char* topic, byte* payload, unsigned int length)
 				
 				const char* readend;
 				uint64_t    time = readull(buffer, &readend);
+				uint64_t    ms   = 1000 * time;
+				
+				if (*readend == '.') {
+					int scale = 100;
+					
+					for (readend += 1; std::isdigit(*readend); readend++) {
+						ms    += scale * (*readend - '0');
+						scale /= 10;
+					}
+				}
 				
 				if (*readend != 0) {  // readend will point to the string null terminator if the string was parsed completely
-					Serial.println("'Time' packet: can't read timestamp");
+					log_error("'Time' packet: can't read timestamp\r\n");
 					return;
 				}
 				
-				curdate    = time;
-				lastmillis = millis();
-				
-				calculatenextfire();
-				updatescallback();
+				synctime(ms);
 			}
 		}
 	}
 	
 	if (clen == 5 && strncmp("lobby", channel, 5) == 0) {
+		stats_kind = stats_lobby;
+		
 		if (length == 4 && strncmp("ping", data, 4) == 0) {
-			Serial.println("Pinging back");
+			log_info("Pinging back\r\n");
 			should_ping = true;
 		}
+#if MQTT_USE_PSK
+		else if (length > 4 && strncmp("psk\n", data, 4) == 0) {
+			// sent right before the credentials, which are the ones flushed to EEPROM
+			if (length - 4 > maxpsksize - 1) {
+				log_error("Received MQTT pre-shared key is too long\r\n");
+				return;
+			}
+			
+			strncpy(settings.mqtt_psk, &data[4], length - 4);
+			settings.mqtt_psk[length - 4] = 0;
+			
+			log_info("Received MQTT pre-shared key\r\n");
+		}
+#endif
 		else if (length > 5 && strncmp("auth\n", data, 5) == 0) {
 			// the payload consists of three lines: 'auth', user and password
 			unsigned int i = 5;
 			
-			Serial.println("Parsing credentials");
+			log_info("Parsing credentials\r\n");
 			
 			for (; i < length; i++) {
 				if (payload[i] == '\n') {
 					int userlen = i - 5;
 					int passlen = length - i - 1;
 					if (userlen > maxcfgstrsize - 1) {
-						Serial.println("Received MQTT username is too long");
+						log_error("Received MQTT username is too long\r\n");
 						return;
 					}
 					
 					if (passlen > maxcfgstrsize - 1) {
-						Serial.println("Received MQTT password is too long");
+						log_error("Received MQTT password is too long\r\n");
 						return;
 					}
 					
@@ -1241,9 +2033,10 @@ void mqtt_receive(char* topic, byte* payload, unsigned int length)
 					
 					flush_settings();
 					
-					mqtt_hascreds    = true;
-					should_reconnect = true;
-					mqtt.disconnect();
+					mqtt_hascreds  = true;
+					mqtt_saidhello = false;
+					mqtt_attempts  = 0;
+					mqtt_close();  // reconnect with the credentials
 				}
 			}
 		}
@@ -1253,225 +2046,399 @@ void mqtt_receive(char* topic, byte* payload, unsigned int length)
 // Main functions
 // ------------------------------------------------------------------------------
 
-bool          buttonprev;          // button state in the previous loop iteration
-unsigned long buttonstart;         // timestamp for the start of a button press
-unsigned long mqtt_lastreconnect;  // timestamp for the last time a MQTT reconnection was attempted
+volatile bool          buttonpressed;  // debounced button state, kept by the button interrupt
+volatile unsigned long buttonstart;    // timestamp for the start of the last button press
+volatile unsigned long buttonedge;     // timestamp for the last debounced button change
+volatile bool          buttontoggled;  // true if the button toggled the relay since the last loop iteration
+
 unsigned long mqtt_lastaskpass;    // timestamp for the last time the client asked for credentials
-int           mqtt_attempts;       // number of consecutive reconnection attempts so far
 bool          should_askpass;      // true if enough time has pass to ask for credentials again
+bool          should_checkupdates; // true if the firmware and access credentials updates should be checked
+unsigned long lastcheckupdates;    // timestamp for the last time the updates were checked
+bool          fastbooted;          // true if the device booted with the cached network details
+bool          mqtt_everconnected;  // true if the MQTT client connected at least once since the boot
 
-// set up all resources
-void setup()
+// button interrupt, on both edges: debounce the button and toggle the relay as soon as it is released,
+// so the press-to-relay latency doesn't depend on the main loop
+// also called from the main loop (with interrupts disabled), to catch a change ignored while bouncing
+void ICACHE_RAM_ATTR buttonchange()
 {
-	// general settings
-	
-	Serial.begin(115200);
-	pinMode(ledpin, OUTPUT);
-	
-	delay(2000);
-	
-	Serial.println();
-	Serial.println("Starting Sonoff wireless switch");
-	ledblink(1);
-	
-	pinMode(buttonpin, INPUT);
-	buttonprev = (digitalRead(buttonpin) == BTN_PRESSED);
-	
-	digitalWrite(relaypin, digitalRead(relaypin));  // <-- this  may seem to do nothing, but it changes the internal buffer
-	pinMode(relaypin, OUTPUT);                      // so this OUTPUT mode change does not force an unnecessary relay switch
-	                                                // (i.e. reset should not turn the lights off!)
-	
-	// read wifi settings and set it up
+	bool          pressed = (digitalRead(buttonpin) == BTN_PRESSED);
+	unsigned long now     = millis();
 	
-	EEPROM.begin(sizeof (Settings));
-	EEPROM.get(0, settings);
+	if (pressed == buttonpressed || now - buttonedge < buttondebounce) {
+		return;
+	}
 	
-	uint32_t checksum = settings_checksum(&settings);
+	buttonpressed = pressed;
+	buttonedge    = now;
 	
-	if (settings.checksum != checksum) {
-		Serial.println("Incorrect settings checksum, using default values");
-		Serial.printf("checksum was %d (%x) but %d (%x) was expected\r\n", settings.checksum, settings.checksum, checksum, checksum);
-		Serial.printf("username was %s\r\n", settings.mqtt_user);
-		
-#if DEBUG_SETTINGS
-		Serial.println("old settings");
-		dump_settings();
-#endif
-		
-		settings = Settings();
-		settings.checksum = settings_checksum(&settings);
-		EEPROM.put(0, settings);
+	if (pressed) {  // OnButtonDown
+		buttonstart = now;
+	}
+	else if (now - buttonstart > 200) {  // OnButtonUp, 0.2 seconds: toggle relay
+		digitalWrite(relaypin, !digitalRead(relaypin));
+		buttontoggled = true;
+	}
+}
 
-#if DEBUG_SETTINGS
-		Serial.println("new settings");
-		dump_settings();
-#endif
+// wait for the WiFi connection, at most 'tries' times 400 ms
+// return true if connected
+bool waitwifi(int tries)
+{
+	for (int i = 0; WiFi.status() != WL_CONNECTED && i < tries; i++) {
+		delay(400);
+		log_info(".");
 	}
 	
-	EEPROM.end();
-	
-	randomSeed(RANDOM_REG32 ^ micros());  // RANDOM_REG32 uses an internal (undocumented) hardware-based PRNG
-	delay(random(0, 2000));  // random delay to reduce congestion if multiple devices are turned on at the same time
-	
-	Serial.print("Connecting to WiFi");
-	
-	WiFi.mode(WIFI_STA);
-	WiFi.begin(settings.ssid, settings.password);
+	log_info("\r\n");
 	
-	for (int i = 0; WiFi.status() != WL_CONNECTED && i < 60; i++) {  // max wait time: 24 secs
-		delay(400);
-		Serial.print(".");
-	}
+	return WiFi.status() == WL_CONNECTED;
+}
+
+// remember the access point the device is connected to and the master address for the next boot
+// (only written to flash if they changed)
+void updatebootcache()
+{
+	BootCache cache;
 	
-	Serial.println("");
+	memcpy(cache.bssid, WiFi.BSSID(), sizeof (cache.bssid));
+	cache.channel  = WiFi.channel();
+	cache.masterip = static_cast<uint32_t>(masterip);
 	
-	if (WiFi.status() != WL_CONNECTED) {
-		Serial.println("WiFi connection failed");
-		restart();
+	if (memcmp(&cache, &settings.bootcache, sizeof (BootCache)) != 0) {
+		settings.bootcache = cache;
+		save_settings();
 	}
+}
+
+// check for firmware upgrades and WiFi access credentials updates on the master host
+// the MQTT connection is closed first, so only one TLS connection is open at a time
+void checkupdates()
+{
+	lastcheckupdates    = millis();
+	should_checkupdates = false;
 	
-	randomSeed(RANDOM_REG32 ^ micros());  // repeat the seed after connecting to WiFi for a better source of entropy:
-	delay(random(0, 2000));               // the microseconds the connection took (RANDOM_REG_32 seems to be legitimately
-	                                      // random at all times, but it is undocumented, so let's not assume anything)
+	mqtt_close();
 	
-	// connect with server
+#if TLS_SESSION_RESUME
+	WiFiClientSecure https;  // both requests share the HTTPS server session
 	
-	Serial.println("Getting Server IP");
+	https.setFingerprint(fingerprint);
+	https.setSession(&rtcstate.httpssession);
+#endif
 	
-	if (!MDNS.begin("")) {
-		Serial.println("Cannot start mDNS");
-		restart();
-	}
+	// firmware OTA update
 	
-	masterip      = MDNS.queryHost(masterhost);
-	ip_addr_t mip = {masterip};
+	log_info("Checking for firmware upgrade candidates\r\n");
 	
-	dns_local_addhost(masterhost, &mip);
+#if OTA_GZIP
+	String     current = String(version) + " gzip";  // followed by the image formats the device accepts
+#else
+	String     current = String(version);
+#endif
+	TlsSession offered = rtcstate.httpssession;
+#if TLS_SESSION_RESUME
+	int retvalue = ESPhttpUpdate.update(https, masterhost, masterporthttps, firmwareuri, current);
+#else
+	int retvalue = ESPhttpUpdate.update(masterhost, masterporthttps, firmwareuri, current, fingerprint);
+#endif
 	
-	if (masterip == IPAddress()) {
-		Serial.println("Server host not found in mDNS");
-		restart();
+	if (retvalue >= 0) {
+		counthandshake(offered, rtcstate.httpssession);
 	}
 	
-	Serial.print("Server found at ");
-	Serial.println(masterip.toString());
-	
-	// firmware OTA update
-	
-	Serial.println("Checking for firmware upgrade candidates");
-	
-	int retvalue = ESPhttpUpdate.update(masterhost, masterporthttps, firmwareuri, String(version), fingerprint);
 	if (retvalue == HTTP_CODE_OK) {
-		Serial.println("Found OTA firmware. Upgrading...");
+		log_info("Found OTA firmware. Upgrading...\r\n");
 		restart();
 	}
 	if (retvalue < 0) {
-		Serial.println("Can't read OTA firmware, continuing");
+		log_error("Can't read OTA firmware, continuing\r\n");
 	}
 	else if (retvalue == HTTP_CODE_NOT_MODIFIED) {
-		Serial.println("Found OTA firmware. Not a new version, skipping");
+		log_info("Found OTA firmware. Not a new version, skipping\r\n");
 	}
 	else {
-		Serial.println("No upgrades found");
+		log_info("No upgrades found\r\n");
 	}
 	
 	// WiFi reconfiguration
 	
 	HTTPClient client;
 	
-	Serial.println("Checking for access credentials updates");
+	log_info("Checking for access credentials updates\r\n");
+	
+	offered = rtcstate.httpssession;
+#if TLS_SESSION_RESUME
+	bool begun = client.begin(https, masterhost, masterporthttps, accessuri, true);
+#else
+	bool begun = client.begin(masterhost, masterporthttps, accessuri, fingerprint);
+#endif
+	int  code  = begun ? client.GET() : -1;
+	
+	if (code >= 0) {
+		counthandshake(offered, rtcstate.httpssession);
+	}
 	
-	if (client.begin(masterhost, masterporthttps, accessuri, fingerprint) && client.GET() == HTTP_CODE_NO_CONTENT) {
+	if (code == HTTP_CODE_NO_CONTENT) {
 		String candidatessid = client.header("X-SSID");
 		String candidatepass = client.header("X-PSK");
 		
 		if (candidatessid != settings.ssid || candidatepass != settings.password) {
 			if (candidatessid.length() > maxcfgstrsize - 1) {
-				Serial.println("Read WiFi SSID too long");
+				log_error("Read WiFi SSID too long\r\n");
 				restart();
 			}
 			
 			if (candidatepass.length() > maxcfgstrsize - 1) {
-				Serial.println("Read WiFi password too long");
+				log_error("Read WiFi password too long\r\n");
 				restart();
 			}
 			
 			candidatessid.toCharArray(settings.ssid, maxcfgstrsize);
 			candidatepass.toCharArray(settings.password, maxcfgstrsize);
 			
+			settings.bootcache = BootCache();  // the new network may use other access points
+			
 			flush_settings();
 			
-			Serial.println("Access credentials updated");
+			log_info("Access credentials updated\r\n");
+		}
+		else {
+			log_info("Found access credentials. Not modified, continuing\r\n");
+		}
+	}
+	else {
+		log_error("Can't read access updates, continuing\r\n");
+	}
+	
+	client.end();
+}
+
+// set up all resources
+void setup()
+{
+	// general settings
+	
+	Serial.begin(115200);
+	pinMode(ledpin, OUTPUT);
+	
+	load_rtcstate();
+	
+#if LOG_LEVEL >= LOG_DEBUG
+	delay(2000);  // give the serial monitor some time to attach
+#endif
+	
+	log_info("\r\nStarting Sonoff wireless switch\r\n");
+	ledblink(1);
+	
+	pinMode(buttonpin, INPUT);
+	
+	digitalWrite(relaypin, digitalRead(relaypin));  // <-- this  may seem to do nothing, but it changes the internal buffer
+	pinMode(relaypin, OUTPUT);                      // so this OUTPUT mode change does not force an unnecessary relay switch
+	                                                // (i.e. reset should not turn the lights off!)
+	
+	// read wifi settings and set it up
+	
+	bool     clean    = load_settings();
+	uint32_t checksum = settings_checksum(&settings);
+	
+	if (settings.checksum != checksum) {
+		log_error("Incorrect settings checksum\r\n");
+		log_error("checksum was %d (%x) but %d (%x) was expected\r\n", settings.checksum, settings.checksum, checksum, checksum);
+		log_error("username was %s\r\n", settings.mqtt_user);
+		
+#if DEBUG_SETTINGS
+		log_debug("old settings\r\n");
+		dump_settings();
+#endif
+		
+		if (load_legacy_settings()) {
+			log_info("Converting the settings from the legacy layout\r\n");
 		}
 		else {
-			Serial.println("Found access credentials. Not modified, continuing");
+			log_info("Using default values\r\n");
+			
+			settings = Settings();
+			settings.checksum = settings_checksum(&settings);
+		}
+		
+		compact_settings();
+
+#if DEBUG_SETTINGS
+		log_debug("new settings\r\n");
+		dump_settings();
+#endif
+	}
+	else if (!clean) {  // appending after a damaged record would corrupt the next one
+		log_info("Discarding an unfinished settings change\r\n");
+		compact_settings();
+	}
+	
+	heapbuild(settings.nscheduled);  // the fire dates are calculated and the callback armed once the clock is set
+	startversions();
+	
+	// connect to the WiFi network; a fast boot connects straight to the cached access point and master host
+	// address, and falls back to a full boot (scanning for the network and looking up the master) if that fails
+	
+	fastbooted = FAST_BOOT && settings.bootcache.channel != 0 && settings.bootcache.masterip != 0;
+	
+	randomSeed(RANDOM_REG32 ^ micros());  // RANDOM_REG32 uses an internal (undocumented) hardware-based PRNG
+	delay(random(0, fastbooted ? 250 : 2000));  // random delay to reduce congestion if multiple devices are turned
+	                                            // on at the same time (shorter on a fast boot, to be responsive soon)
+	
+	log_info("Connecting to WiFi");
+	
+	WiFi.mode(WIFI_STA);
+	WiFi.setSleepMode(LIGHT_SLEEP ? WIFI_LIGHT_SLEEP : WIFI_MODEM_SLEEP);  // sleep between beacons when idle
+	
+	if (fastbooted) {
+		WiFi.begin(settings.ssid, settings.password, settings.bootcache.channel, settings.bootcache.bssid);
+		
+		if (!waitwifi(10)) {  // max wait time: 4 secs
+			log_error("Cached access point not available, scanning\r\n");
+			
+			fastbooted = false;
+			WiFi.disconnect();
+		}
+	}
+	
+	if (!fastbooted) {
+		WiFi.begin(settings.ssid, settings.password);
+		
+		if (!waitwifi(60)) {  // max wait time: 24 secs
+			log_error("WiFi connection failed\r\n");
+			restart();
 		}
+		
+		randomSeed(RANDOM_REG32 ^ micros());  // repeat the seed after connecting to WiFi for a better source of entropy:
+		delay(random(0, 2000));               // the microseconds the connection took (RANDOM_REG_32 seems to be legitimately
+		                                      // random at all times, but it is undocumented, so let's not assume anything)
+	}
+	
+	// connect with server
+	
+	if (fastbooted) {
+		masterip = IPAddress(settings.bootcache.masterip);
 	}
 	else {
-		Serial.println("Can't read access updates, continuing");
+		log_info("Getting Server IP\r\n");
+		
+		if (!MDNS.begin("")) {
+			log_error("Cannot start mDNS\r\n");
+			restart();
+		}
+		
+		masterip = MDNS.queryHost(masterhost);
+		
+		if (masterip == IPAddress()) {
+			log_error("Server host not found in mDNS\r\n");
+			restart();
+		}
 	}
 	
+	ip_addr_t mip = {masterip};
+	
+	dns_local_addhost(masterhost, &mip);
+	
+	log_info("Server found at %s\r\n", masterip.toString().c_str());
+	
+	updatebootcache();
+	
+	// firmware OTA update and WiFi reconfiguration are checked from the main loop, once connected
+	
 	// MQTT configuration
 	
-	Serial.println("Configuring MQTT client");
+	log_info("Configuring MQTT client\r\n");
 	
-	mqtt_hascreds = (strlen(settings.mqtt_user) > 0 && strlen(settings.mqtt_pass) > 0);
+	mqtt_hascreds  = (strlen(settings.mqtt_user) > 0 && strlen(settings.mqtt_pass) > 0);
+	mqtt_saidhello = false;
 	
 	if (!mqtt_hascreds) {
 		(mqtt_prefix + String(static_cast<unsigned long>(random(INT_MIN, INT_MAX)), HEX)).toCharArray(settings.mqtt_user, maxcfgstrsize);
 	}
 	
-	Serial.print("MQTT username: ");
-	Serial.println(settings.mqtt_user);
+	log_info("MQTT username: %s\r\n", settings.mqtt_user);
 	
 	int now = millis();
 	
+	mqtt_state         = mqtt_waiting;
 	mqtt_attempts      = 0;
-	mqtt_lastreconnect = now;
+	mqtt_nextattempt   = now;
 	mqtt_lastaskpass   = now;
 	should_askpass     = true;
-	should_reconnect   = true;
 	should_ping        = false;
 	report_status      = nullptr;
-	report_schedule    = nullptr;
+	report_statusasked = false;
+	published_status   = nullptr;
+	report_schedule    = {};
+	report_binschedule = {};
+	report_log         = false;
+	report_stats       = false;
+	
+	should_checkupdates = false;
+	lastcheckupdates    = now;
+	mqtt_everconnected  = false;
+	
+	sensorsetup();
 	
 	mqtt.setServer(masterhost, masterportmqtt);
 	mqtt.setCallback(mqtt_receive);
+	wifi.setTimeout(mqtt_timeout);  // bounds how long a connection attempt blocks the main loop
 	
-	Serial.println("Sonoff setup completed");
-	Serial.println("------------------------");
-	Serial.println();
-	Serial.println();
+#if TLS_SESSION_RESUME
+	wifi.setSession(&rtcstate.mqttsession);
+#endif
+	
+	log_info("Sonoff setup completed\r\n");
+	log_info("------------------------\r\n");
+	log_info("\r\n\r\n");
 	ledblink(2);
 	
-	buttonstart = millis();  // if the user hasn't lifted the button since the program started,
-	                         // start counting the button press from here, the end of the setup
+	buttonpressed = (digitalRead(buttonpin) == BTN_PRESSED);
+	buttonstart   = millis();     // if the user hasn't lifted the button since the program started,
+	buttonedge    = buttonstart;  // start counting the button press from here, the end of the setup
+	
+	attachInterrupt(digitalPinToInterrupt(buttonpin), buttonchange, CHANGE);
 }
 
 // main loop
 void loop()
 {
-	// read user input (button)
-	bool          buttonstate = (digitalRead(buttonpin) == BTN_PRESSED);
-	unsigned long now         = millis();
+	uint32_t loopstart = micros();
 	
-	if (!buttonprev && buttonstate) {  // OnButtonDown
-		buttonstart = now;
+	// sensor, sampled when its ticker says so
+	if (sensor_due) {
+		sensor_due = false;
+		sensorsample();
 	}
-	else if (buttonstate) { // && buttonprev (implicit); OnButtonPressed
-		if (now - buttonstart > 5000) {  // 5 seconds: restart
-			Serial.println("Button pressed for 5 seconds, restarting");
-			restart();
-		}
+	
+	// user input (button), handled by its interrupt
+	noInterrupts();
+	buttonchange();
+	
+	bool          pressed  = buttonpressed;
+	bool          toggled  = buttontoggled;
+	unsigned long pressdur = millis() - buttonstart;
+	
+	buttontoggled = false;
+	interrupts();
+	
+	unsigned long now = millis();
+	
+	if (toggled) {
+		log_info("relay -> toggle (%s)\r\n", digitalRead(relaypin) ? "on" : "off");
+		reportstatus();
 	}
-	else if (buttonprev) {  // && !buttonstate (implicit): OnButtonUp
-		if (now - buttonstart > 200) {  // 0.2 seconds: toggle relay
-			Serial.print("relay -> toggle (");
-			Serial.print(!digitalRead(relaypin) ? "on" : "off");
-			Serial.println(")");
-			report_status = (!digitalRead(relaypin)) ? "on" : "off";
-			digitalWrite(relaypin, !digitalRead(relaypin));
-		}
+	
+	if (pressed && pressdur > 5000) {  // 5 seconds: restart
+		log_info("Button pressed for 5 seconds, restarting\r\n");
+		restart();
+	}
+	
+	// settings
+	if (settings_pending && now - settings_changed >= settingsdelay) {
+		flush_settings();
 	}
 	
 	// MQTT
@@ -1483,29 +2450,74 @@ void loop()
 			mqtt.publish(lobbytopic, "here");
 		}
 		
-		if (report_status != nullptr) {
-			char message[12];  // max len = 10 -> "status off"
-			int  slen = strlen(report_status);
+		// the status is retained on the status topic, so the server knows it without asking;
+		// bursts of relay changes are published once they settle, and only if the status changed
+		if (report_status != nullptr && mqtt_hascreds && mqtt_state == mqtt_up &&
+		    (report_statusasked || millis() - report_statussince >= statusdelay)) {
+			if (report_statusasked) {  // answer on the admin topic too
+				char message[12];  // max len = 10 -> "status off"
+				
+				strncpy(message, "status ", 7);
+				strncpy(&message[7], report_status, 12 - 7);
+				message[11] = 0;
+				
+				mqtt.publish(admintopic, message);
+			}
+			
+			if (published_status == nullptr || strcmp(report_status, published_status) != 0) {
+				mqtt.publish(statustopic, report_status, true);
+				published_status = report_status;
+			}
+			
+			report_status      = nullptr;
+			report_statusasked = false;
+		}
+		
+		if (report_schedule.pending) {
+			if (!publishschedule(report_schedule)) {
+				log_error("Can't publish the schedule\r\n");
+			}
 			
-			strncpy(message, "status ", 7);
-			strncpy(&message[7], report_status, 12 - 7);
-			message[11] = 0;
+			report_schedule.pending = false;
+		}
+		
+		if (report_stats) {
+			if (!publishstats()) {
+				log_error("Can't publish the statistics\r\n");
+			}
 			
-			mqtt.publish(admintopic, message);
+			report_stats = false;
+		}
+		
+		if (report_log) {
+			if (!publishlog()) {
+				log_error("Can't publish the log\r\n");
+			}
 			
-			report_status = nullptr;
+			report_log = false;
 		}
 		
-		if (report_schedule != nullptr) {
-			mqtt.publish(admintopic, report_schedule);
+		if (report_binschedule.pending) {
+			if (!publishbinschedule(report_binschedule)) {
+				log_error("Can't publish the binary schedule\r\n");
+			}
 			
-			free(report_schedule);
-			report_schedule = nullptr;
+			report_binschedule.pending = false;
+		}
+		
+		// the windows stay queued while they can't be sent
+		if (sensor_queued > 0 && mqtt_hascreds && mqtt_state == mqtt_up) {
+			if (publishsensor()) {
+				sensor_queued = 0;
+			}
+			else {
+				log_error("Can't publish the sensor windows\r\n");
+			}
 		}
 		
 		if (!mqtt_hascreds && should_askpass) {
 			should_askpass = false;
-			Serial.println("Asking for credentials");
+			log_info("Asking for credentials\r\n");
 			mqtt_lastaskpass = now;
 			askcredentials();
 		}
@@ -1514,31 +2526,24 @@ void loop()
 			should_askpass = true;
 		}
 	}
-	else {
-		if (should_reconnect) {
-			mqtt_lastreconnect = now;
-			should_reconnect   = false;
-			
-			if (mqtt_connect()) {
-				Serial.println("Successfully connected to MQTT broker");
-				should_askpass = true;
-				mqtt_attempts  = 0;
-			}
-			else {
-				Serial.println("Failed to connect to MQTT broker");
-				mqtt_attempts += 1;
-				
-				if (mqtt_attempts > mqtt_maxattempts) {  // something has gone wrong!
-					Serial.println("Too many failed MQTT connections, restarting");
-					restart();                           // start again from a clean state
-				}
-			}
-		}
-		
-		if (now - mqtt_lastreconnect > 5000) {  // reconnect to MQTT every 5 seconds
-			should_reconnect = true;
-		}
+	
+	mqtt_step();
+	
+	// firmware and access credentials updates
+	if (now - lastcheckupdates > updatesperiod) {
+		should_checkupdates = true;
 	}
 	
+	if (should_checkupdates) {
+		checkupdates();
+	}
+	
+	// log
+	logdrain();
+	
+	// statistics
+	updateuptime();
+	addtiming(stats.loop, loopstart);
+	
 	delay(250);
 }
@@ -0,0 +1,59 @@
+// stats.cpp
+// Device statistics
+// Part of AutoHome
+//
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "stats.h"
+
+#include <stdio.h>
+
+Stats stats;
+int   stats_kind;
+
+void addtiming(TimingStats& timing, uint32_t start)
+{
+	uint32_t us = micros() - start;
+	
+	timing.count += 1;
+	timing.total += us;
+	timing.max    = (us > timing.max) ? us : timing.max;
+}
+
+void updateuptime()
+{
+	uint32_t mil = millis();
+	
+	stats.uptime    += mil - stats.lastmillis;
+	stats.lastmillis = mil;
+}
+
+int formattiming(char* buffer, int size, const char* name, const TimingStats& timing)
+{
+	uint32_t average = (timing.count > 0) ? timing.total / timing.count : 0;
+	
+	return snprintf(buffer, size, "%s %u %u %u\n", name, static_cast<unsigned>(timing.count),
+	                static_cast<unsigned>(average), static_cast<unsigned>(timing.max));
+}
@@ -0,0 +1,80 @@
+// stats.h
+// Device statistics
+// Part of AutoHome
+//
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <Arduino.h>
+
+// Kinds of received messages, by the command they carry, timed separately (parsing and applying it)
+const int stats_switch      = 0;  // relay switch, on the control topic or a group one
+const int stats_scommand    = 1;  // single schedule change: timed, recurrent or clear
+const int stats_upload      = 2;  // schedule batch
+const int stats_binary      = 3;  // binary control message
+const int stats_time        = 4;  // time synchronization
+const int stats_askschedule = 5;  // schedule request (the reply is sent from the main loop)
+const int stats_admin       = 6;  // any other admin request
+const int stats_lobby       = 7;  // lobby message: ping, credentials or pre-shared key
+const int stats_other       = 8;  // unrecognized or misaddressed message
+const int nstatskinds       = 9;
+
+// Timing of a kind of work
+typedef struct TimingStats
+{
+	uint32_t count;  // number of times it was done
+	uint32_t max;    // longest time it took, in microseconds
+	uint64_t total;  // total time it took, in microseconds
+} TimingStats;
+
+// Device statistics since the boot, sent for 'askstats'
+typedef struct Stats
+{
+	TimingStats loop;                  // main loop iterations, without the idle delay
+	TimingStats receive[nstatskinds];  // processing of the received messages, by kind of command
+	TimingStats flush;                 // settings writes to flash
+	uint64_t    uptime;                // ms since the boot
+	uint32_t    lastmillis;            // millis() when the uptime was last updated
+	uint32_t    disconnects;           // MQTT connections lost
+	uint32_t    connectfails;          // failed MQTT connection attempts
+	int         lastreason;            // MQTT client state after the last lost connection or failed attempt
+} Stats;
+
+extern Stats stats;
+extern int   stats_kind;  // kind of the message being processed, set as it is recognized
+
+// add the time a piece of work took since 'start', as returned by micros()
+void addtiming(TimingStats& timing, uint32_t start);
+
+// update the uptime; should be called at least every 49 days (otherwise it would skip an millis() overflow)
+void updateuptime();
+
+// write a 'name count average max' line for a timing
+// return the number of characters written, as snprintf
+int formattiming(char* buffer, int size, const char* name, const TimingStats& timing);
+
+#endif  // #ifndef STATS_H
@@ -0,0 +1,350 @@
+// textprotocol.cpp
+// Text control protocol schedule lines
+// Part of AutoHome
+//
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "textprotocol.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <cctype>
+#include <limits.h>
+
+// the char at position i of a line, or \0 past its end (for the error messages)
+static char charat(const char* data, unsigned int length, unsigned int i)
+{
+	return (i < length) ? data[i] : 0;
+}
+
+bool readbool(char c, char truevalue, char falsevalue, bool& output)
+{
+	if (c == truevalue) {
+		output = true;
+	}
+	else if (c == falsevalue) {
+		output = false;
+	}
+	else {
+		return false;
+	}
+	
+	return true;
+}
+
+bool parsetimed(const char* data, unsigned int length, ScheduledCmd& newcmd, bool& add)
+{
+	// format timed (-|+)(x|z) EpochTime Command
+	// the first char (-|+) indicates if the timer must be added (+) or removed (-)
+	// the second char (x|z) indicates exact timer or fuzzy match (adds 16-minutes uniform noise)
+	// EpochTime is the number of seconds since 1 Jan 1970, 00:00:00
+	// The last argument indicates turning off or on (using the same semantics as the on and off commands)
+	// e.g. '+z 1633436220 on' means 'turn the switch on around Oct 5 2021, 09:17:00 (+- 8 minutes)'
+	
+	bool          fuzzy = false;
+	unsigned int  i     = 5;
+	
+	log_debug("One-off event\r\n");
+	
+	if (i >= length || !std::isspace(data[i])) {
+		log_error("'Timed' packet: Incorrect format at %d: expected whitespace, found %c\r\n", i, charat(data, length, i));
+		return false;
+	}
+	
+	while (i < length && std::isspace(data[i])) {
+		i += 1;
+	}
+	
+	if (i >= length || !readbool(data[i], '+', '-', add)) {
+		log_error("'Timed' packet: Incorrect format at %d: expected [-+], found %c\r\n", i, charat(data, length, i));
+		return false;
+	}
+	
+	i += 1;
+	
+	if (i >= length || !readbool(data[i], 'z', 'x', fuzzy)) {
+		log_error("'Timed' packet: Incorrect format at %d: expected [zx], found %c\r\n", i, charat(data, length, i));
+		return false;
+	}
+	
+	i += 1;
+	
+	if (i >= length || !std::isspace(data[i])) {
+		log_error("'Timed' packet: Incorrect format at %d: expected whitespace, found %c\r\n", i, charat(data, length, i));
+		return false;
+	}
+	
+	char buffer[16];  // hopefully we have moved on from relying on C overflowable arrays
+	                  // by the time this buffer can't hold the corresponding EpochTime
+	
+	while (i < length && std::isspace(data[i])) {
+		i += 1;
+	}
+	
+	int timelen = length - i;
+	
+	if (timelen > 15) {
+		log_error("'Timed' packet: time string too long\r\n");
+		return false;
+	}
+	
+	unsigned int k;
+	for (k = 0; i < length && k < 15; k++, i++) {
+		if (std::isspace(data[i])) {
+			break;
+		}
+		
+		buffer[k] = data[i];
+	}
+	
+	buffer[k] = 0;
+	
+	const char*  readend;
+	uint64_t     time = readull(buffer, &readend);
+	
+	if (*readend != 0) {
+		log_error("'Timed' packet: can't read timestamp\r\n");
+		return false;
+	}
+	
+	if (time < scheduleepoch || time - scheduleepoch > UINT32_MAX) {
+		log_error("'Timed' packet: timestamp out of range\r\n");
+		return false;
+	}
+	
+	if (i >= length || !std::isspace(data[i])) {
+		log_error("'Timed' packet: Incorrect format at %d: expected whitespace, found %c\r\n", i, charat(data, length, i));
+		return false;
+	}
+	
+	while (i < length && std::isspace(data[i])) {
+		i += 1;
+	}
+	
+	int remaining = length - i;
+	
+	if (remaining == 2 && strncmp("on", &data[i], 2) == 0) {
+		newcmd.command = '1';
+	}
+	else if (remaining == 3 && strncmp("off", &data[i], 3) == 0) {
+		newcmd.command = '0';
+	}
+	else {
+		log_error("'Timed' packet: Incorrect format at %d: expected [(on)(off)], found '%.*s'\r\n", i, remaining, &data[i]);
+		return false;
+	}
+	
+	newcmd.fuzzy     = fuzzy;
+	newcmd.recurrent = false;
+	newcmd.firedate  = time - scheduleepoch;
+	
+	return true;
+}
+
+bool parserecurrent(const char* data, unsigned int length, ScheduledCmd& newcmd, bool& add)
+{
+	// format: recurrent (-|+)(x|z)(0-9)+ Hours.Minutes Command
+	// the first char (-|+) indicates if the timer must be added (+) or removed (-)
+	// the second char (x|z) indicates exact timer or fuzzy match (adds 16-minutes uniform noise)
+	// the following digits indicate the days: a single one means a day of the week Mon-Sun (1-7),
+	// every day (0), every weekday Mon-Fri (8) or weekends Sat-Sun (9); several ones (1-7 only)
+	// mean every one of those days of the week, e.g. 135 for Mon, Wed and Fri
+	// Hour indicates the hour in 24-hour format using a leading zero if necessary
+	// Minutes indicates the minutes using a leading zero if necessary
+	// The last argument indicates turning off or on (using the same semantics as the on and off commands)
+	// e.g. '+x6 16.51 off' means 'turn the switch off every Saturday at 16:51'
+	
+	bool          fuzzy   = false;
+	byte          days    = 0;
+	byte          hours   = 0;
+	byte          minutes = 0;
+	unsigned int  i       = 9;
+	
+	log_debug("Recurrent event\r\n");
+	
+	if (i >= length || !std::isspace(data[i])) {
+		log_error("'Recurrent' packet: Incorrect format at %d: expected whitespace, found %c\r\n", i, charat(data, length, i));
+		return false;
+	}
+	
+	while (i < length && std::isspace(data[i])) {
+		i += 1;
+	}
+	
+	if (i >= length || !readbool(data[i], '+', '-', add)) {
+		log_error("'Recurrent' packet: Incorrect format at %d: expected [-+], found %c\r\n", i, charat(data, length, i));
+		return false;
+	}
+	
+	i += 1;
+	
+	if (i >= length || !readbool(data[i], 'z', 'x', fuzzy)) {
+		log_error("'Recurrent' packet: Incorrect format at %d: expected [zx], found %c\r\n", i, charat(data, length, i));
+		return false;
+	}
+	
+	i += 1;
+	
+	if (i < length && '0' <= data[i] && data[i] <= '9' && (i + 1 >= length || !std::isdigit(data[i + 1]))) {
+		days = daycodemask(data[i] - '0');
+		i += 1;
+	}
+	else {
+		for (; i < length && std::isdigit(data[i]); i++) {
+			if (data[i] < '1' || '7' < data[i]) {
+				log_error("'Recurrent' packet: Incorrect format at %d: expected day [1-7], found %c\r\n", i, charat(data, length, i));
+				return false;
+			}
+			
+			days |= 1 << (data[i] - '1');
+		}
+		
+		if (days == 0) {
+			log_error("'Recurrent' packet: Incorrect format at %d: expected digit, found %c\r\n", i, charat(data, length, i));
+			return false;
+		}
+	}
+	
+	if (i >= length || !std::isspace(data[i])) {
+		log_error("'Recurrent' packet: Incorrect format at %d: expected whitespace, found %c\r\n", i, charat(data, length, i));
+		return false;
+	}
+	
+	while (i < length && std::isspace(data[i])) {
+		i += 1;
+	}
+	
+	if (i + 1 < length &&
+	    '0' <= data[i]     && data[i]     <= '9' &&
+	    '0' <= data[i + 1] && data[i + 1] <= '9') {
+		
+		hours = 10 * (data[i] - '0') + (data[i + 1] - '0');
+		i += 2;
+	}
+	else {
+		log_error("'Recurrent' packet: Incorrect format at %d: expected hours, found %c%c\r\n", i, charat(data, length, i), charat(data, length, i + 1));
+		return false;
+	}
+	
+	if (hours > 23) {
+		log_error("'Recurrent' packet: hours out of range\r\n");
+		return false;
+	}
+	
+	if (i >= length || data[i] != '.') {
+		log_error("'Recurrent' packet: Incorrect format at %d: expected '.', found %c\r\n", i, charat(data, length, i));
+		return false;
+	}
+	
+	i += 1;
+	
+	if (i + 1 < length &&
+	    '0' <= data[i]     && data[i]     <= '9' &&
+	    '0' <= data[i + 1] && data[i + 1] <= '9') {
+		
+		minutes = 10 * (data[i] - '0') + (data[i + 1] - '0');
+		i += 2;
+	}
+	else {
+		log_error("'Recurrent' packet: Incorrect format at %d: expected minutes, found %c%c\r\n", i, charat(data, length, i), charat(data, length, i + 1));
+		return false;
+	}
+	
+	if (minutes > 59) {
+		log_error("'Recurrent' packet: minutes out of range\r\n");
+		return false;
+	}
+	
+	if (i >= length || !std::isspace(data[i])) {
+		log_error("'Recurrent' packet: Incorrect format at %d: expected whitespace, found %c\r\n", i, charat(data, length, i));
+		return false;
+	}
+	
+	while (i < length && std::isspace(data[i])) {
+		i += 1;
+	}
+	
+	int remaining = length - i;
+	
+	if (remaining == 2 && strncmp("on", &data[i], 2) == 0) {
+		newcmd.command = '1';
+	}
+	else if (remaining == 3 && strncmp("off", &data[i], 3) == 0) {
+		newcmd.command = '0';
+	}
+	else {
+		log_error("'Recurrent' packet: Incorrect format at %d: expected [(on)(off)], found '%.*s'\r\n", i, remaining, &data[i]);
+		return false;
+	}
+	
+	newcmd.fuzzy     = fuzzy;
+	newcmd.recurrent = true;
+	newcmd.days      = days;
+	newcmd.hours     = hours;
+	newcmd.minutes   = minutes;
+	
+	return true;
+}
+
+bool parsescommand(const char* data, unsigned int length, ScheduledCmd& newcmd, bool& add)
+{
+	if (length > 5 && strncmp("timed", data, 5) == 0) {
+		return parsetimed(data, length, newcmd, add);
+	}
+	else if (length > 9 && strncmp("recurrent", data, 9) == 0) {
+		return parserecurrent(data, length, newcmd, add);
+	}
+	
+	log_error("Unknown schedule event\r\n");
+	return false;
+}
+
+int formatscommand(char* dst, const ScheduledCmd& event)
+{
+	char        fuzzy   = (event.fuzzy) ? 'z' : 'x';
+	const char* command = (event.command == '1') ? "on" :
+	                      (event.command == 't') ? "toggle" :
+	                                               "off";
+	int         count;
+	
+	if (event.recurrent) {
+		char days[8];
+		
+		days[writedays(days, event.days)] = 0;
+		
+		count = snprintf(dst, schedlinesize, "recurrent %c%s %02d.%02d %s\n",
+		                 fuzzy, days, event.hours, event.minutes, command);
+	}
+	else {
+		char date[21];
+		
+		date[writeull(date, scheduleepoch + event.firedate)] = 0;
+		
+		count = snprintf(dst, schedlinesize, "timed %c %s %s\n", fuzzy, date, command);
+	}
+	
+	return (count < schedlinesize - 1) ? count : schedlinesize - 1;
+}
@@ -0,0 +1,59 @@
+// textprotocol.h
+// Text control protocol schedule lines
+// Part of AutoHome
+//
+// Copyright (c) 2017, Diego Guerrero
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * The names of its contributors may not be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef TEXTPROTOCOL_H
+#define TEXTPROTOCOL_H
+
+#include <Arduino.h>
+
+#include "schedule.h"
+
+const int schedlinesize = 34;  // longest schedule reply line and \0, "timed x 18446744073709551615 toggle\n"
+
+// read one char and compare to two acceptable options (mapped to true and false)
+// set an output argument to the appropriate value
+// if the char does not correspond to neither option, return false
+bool readbool(char c, char truevalue, char falsevalue, bool& output);
+
+// parse a one-off event line ("timed ...") into a scheduled command and whether it must be added or removed
+// return false if the line is malformed
+bool parsetimed(const char* data, unsigned int length, ScheduledCmd& newcmd, bool& add);
+
+// parse a recurrent event line ("recurrent ...") into a scheduled command and whether it must be added or removed
+// return false if the line is malformed
+bool parserecurrent(const char* data, unsigned int length, ScheduledCmd& newcmd, bool& add);
+
+// parse a schedule event line (either "timed ..." or "recurrent ...")
+// return false if the line is malformed
+bool parsescommand(const char* data, unsigned int length, ScheduledCmd& newcmd, bool& add);
+
+// write the schedule reply line of a scheduled command, \n included, to dst (schedlinesize bytes)
+// return its length
+int formatscommand(char* dst, const ScheduledCmd& event);
+
+#endif  // #ifndef TEXTPROTOCOL_H